@@ -79,17 +79,12 @@ PyObject* put(PyObject* data) {
 
       const size_t count = PyList_Size(data);
 
-      auto promise_array_builder =
-          kj::heapArrayBuilder<kj::Promise<std::string>>(count);
-
-      for (size_t i = 0; i < count; ++i) {
-        const auto item = PyList_GetItem(data, i);
-        promise_array_builder.add(
-            state.cas_client.PutAsync(AsStringView(item)));
-      }
+      std::vector<std::string_view> objects;
+      for (size_t i = 0; i < count; ++i)
+        objects.emplace_back(AsStringView(PyList_GetItem(data, i)));
 
-      auto keys = kj::joinPromises(promise_array_builder.finish())
-                      .wait(state.aio_context.waitScope);
+      auto keys = state.cas_client.PutManyAsync(objects).wait(
+          state.aio_context.waitScope);
 
       auto result = PyList_New(count);
 
@@ -19,12 +19,12 @@
 #endif
 
 #include <mutex>
+#include <vector>
 
 #include <fcntl.h>
 #include <syslog.h>
 #include <unistd.h>
 
-#include <capnp/rpc-twoparty.h>
 #include <kj/debug.h>
 
 #include "src/async-io.h"
@@ -34,6 +34,9 @@ namespace cas_internal {
 
 namespace {
 
+// Number of operations the io_uring submission queue has room for.
+const unsigned kRingEntries = 256;
+
 // TODO(mortehu): Verify that this never leaks.
 struct SignalArgument {
   AsyncIOServer* aio_server;
@@ -69,7 +72,18 @@ static void CloseOnExec(int fd) {
 #endif
 
 AsyncIOServer::AsyncIOServer(kj::AsyncIoContext& async_io)
-    : event_promise_(nullptr) {
+    : ring_(IOUring::Create(kRingEntries)),
+      ring_submit_promise_(nullptr),
+      event_promise_(nullptr) {
+  if (ring_) {
+    event_reader_ = async_io.lowLevelProvider->wrapInputFd(ring_->EventFd());
+    event_promise_ = HandleRingEvents().eagerlyEvaluate([](kj::Exception&& e) {
+      syslog(LOG_ERR, "io_uring event handling failed: %s:%d: %s",
+             e.getFile(), e.getLine(), e.getDescription().cStr());
+    });
+    return;
+  }
+
   int pipe[2];
 #if HAVE_PIPE2
   KJ_SYSCALL(::pipe2(pipe, O_CLOEXEC));
@@ -93,50 +107,76 @@ AsyncIOServer::AsyncIOServer(kj::AsyncIoContext& async_io)
           });
 }
 
-std::pair<kj::Own<RPCClient>, kj::Own<RPCServer<AsyncIO>>>
-AsyncIOServer::Create(kj::AsyncIoContext& async_io) {
-  auto pipe = async_io.provider->newTwoWayPipe();
+kj::Promise<void> AsyncIOServer::Pread(int fd, void* buffer, size_t offset,
+                                        size_t length) {
+  if (!length) return kj::READY_NOW;
+
+  if (ring_) {
+    return kj::newAdaptedPromise<void, RingRequest>(
+        IORequest::kOperationRead, this, fd, buffer, offset, length);
+  }
+
+  return kj::newAdaptedPromise<void, IORequest>(IORequest::kOperationRead, this,
+                                                fd, buffer, offset, length);
+}
+
+kj::Promise<void> AsyncIOServer::Pwrite(int fd, const void* buffer,
+                                         size_t offset, size_t length) {
+  if (!length) return kj::READY_NOW;
+
+  if (ring_) {
+    return kj::newAdaptedPromise<void, RingRequest>(
+        IORequest::kOperationWrite, this, fd, const_cast<void*>(buffer),
+        offset, length);
+  }
+
+  return kj::newAdaptedPromise<void, IORequest>(
+      IORequest::kOperationWrite, this, fd, const_cast<void*>(buffer), offset,
+      length);
+}
+
+kj::Promise<void> AsyncIOServer::Fsync(int fd) {
+  if (ring_) {
+    return kj::newAdaptedPromise<void, RingRequest>(IORequest::kOperationFsync,
+                                                    this, fd);
+  }
+
+  return kj::newAdaptedPromise<void, IORequest>(IORequest::kOperationFsync,
+                                                this, fd);
+}
 
-  return std::make_pair(
-      kj::heap<RPCClient>(std::move(pipe.ends[0])),
-      kj::heap<RPCServer<AsyncIO>>(kj::heap<AsyncIOServer>(async_io),
-                                   std::move(pipe.ends[1])));
+void AsyncIOServer::RegisterFiles(kj::ArrayPtr<const int> fds) {
+  if (ring_) ring_->RegisterFiles(fds);
 }
 
 kj::Promise<void> AsyncIOServer::pread(PreadContext context) {
   auto params = context.getParams();
-  auto fd = params.getFd();
   static_assert(sizeof(char*) == sizeof(params.getBuffer()),
                 "expected 64-bit pointers");
-  auto buf = reinterpret_cast<char*>(params.getBuffer());
-  auto start = params.getStart();
-  auto length = params.getLength();
-
-  if (!length) return kj::READY_NOW;
-
-  return kj::newAdaptedPromise<void, IORequest>(IORequest::kOperationRead, this,
-                                                fd, buf, start, length);
+  return Pread(params.getFd(), reinterpret_cast<char*>(params.getBuffer()),
+               params.getStart(), params.getLength());
 }
 
 kj::Promise<void> AsyncIOServer::pwrite(PwriteContext context) {
   auto params = context.getParams();
-  auto fd = params.getFd();
   static_assert(sizeof(const char*) == sizeof(params.getBuffer()),
                 "expected 64-bit pointers");
-  auto buf = reinterpret_cast<const char*>(params.getBuffer());
-  auto start = params.getStart();
-  auto length = params.getLength();
-
-  if (!length) return kj::READY_NOW;
-
-  return kj::newAdaptedPromise<void, IORequest>(
-      IORequest::kOperationWrite, this, fd, const_cast<char*>(buf), start,
-      length);
+  return Pwrite(params.getFd(),
+                reinterpret_cast<const char*>(params.getBuffer()),
+                params.getStart(), params.getLength());
 }
 
 kj::Promise<void> AsyncIOServer::fsync(FsyncContext context) {
-  return kj::newAdaptedPromise<void, IORequest>(
-      IORequest::kOperationFsync, this, context.getParams().getFd());
+  return Fsync(context.getParams().getFd());
+}
+
+kj::Promise<void> AsyncIOServer::registerFiles(RegisterFilesContext context) {
+  std::vector<int> fds;
+  for (auto fd : context.getParams().getFds()) fds.emplace_back(fd);
+
+  RegisterFiles(kj::arrayPtr(fds.data(), fds.size()));
+
+  return kj::READY_NOW;
 }
 
 AsyncIOServer::IORequest::IORequest(kj::PromiseFulfiller<void>& fulfiller,
@@ -226,6 +266,127 @@ void AsyncIOServer::IORequest::HandleCompletion() {
   });
 }
 
+AsyncIOServer::RingRequest::RingRequest(kj::PromiseFulfiller<void>& fulfiller,
+                                        IORequest::Operation operation,
+                                        AsyncIOServer* aio_server, int fd,
+                                        void* buffer, size_t offset,
+                                        size_t length)
+    : fulfiller_(fulfiller),
+      operation_(operation),
+      aio_server_(aio_server),
+      fd_(fd),
+      buffer_(reinterpret_cast<char*>(buffer)),
+      offset_(offset),
+      length_(length) {
+  Queue();
+}
+
+AsyncIOServer::RingRequest::~RingRequest() {
+  if (!in_flight_) return;
+
+  cancelled_ = true;
+
+  // The kernel may still be accessing the buffer, so we have to wait for the
+  // operation to either complete or be canceled.
+  auto& ring = *aio_server_->ring_;
+  ring.Cancel(reinterpret_cast<uint64_t>(this), 0);
+
+  while (in_flight_) {
+    ring.Submit();
+    if (!aio_server_->ReapRing()) ring.Wait();
+  }
+}
+
+void AsyncIOServer::RingRequest::Queue() {
+  auto& ring = *aio_server_->ring_;
+  const auto user_data = reinterpret_cast<uint64_t>(this);
+
+  switch (operation_) {
+    case IORequest::kOperationFsync:
+      ring.Fsync(fd_, user_data);
+      break;
+
+    case IORequest::kOperationRead:
+      ring.Read(fd_, buffer_, length_, offset_, user_data);
+      break;
+
+    case IORequest::kOperationWrite:
+      ring.Write(fd_, buffer_, length_, offset_, user_data);
+      break;
+
+    default:
+      KJ_FAIL_REQUIRE("Unknown I/O operation", operation_);
+  }
+
+  in_flight_ = true;
+  aio_server_->ScheduleRingSubmit();
+}
+
+void AsyncIOServer::RingRequest::HandleCompletion(int32_t result) {
+  in_flight_ = false;
+
+  if (cancelled_) return;
+
+  fulfiller_.rejectIfThrows([this, result]() mutable {
+    if (result < 0) {
+      KJ_FAIL_SYSCALL("io_uring", -result, operation_, fd_, offset_, length_);
+    }
+
+    if (operation_ != IORequest::kOperationFsync) {
+      const auto amount = static_cast<size_t>(result);
+      KJ_REQUIRE(amount > 0, "unexpected end of file", operation_, fd_,
+                 offset_, length_);
+      KJ_REQUIRE(amount <= length_, amount, length_);
+
+      if (amount < length_) {
+        buffer_ += amount;
+        offset_ += amount;
+        length_ -= amount;
+        Queue();
+        return;
+      }
+    }
+
+    fulfiller_.fulfill();
+  });
+}
+
+void AsyncIOServer::ScheduleRingSubmit() {
+  if (ring_submit_scheduled_) return;
+  ring_submit_scheduled_ = true;
+
+  ring_submit_promise_ = kj::evalLater([this] {
+                           ring_submit_scheduled_ = false;
+                           ring_->Submit();
+                         }).eagerlyEvaluate([](kj::Exception&& e) {
+    syslog(LOG_ERR, "io_uring submission failed: %s:%d: %s", e.getFile(),
+           e.getLine(), e.getDescription().cStr());
+  });
+}
+
+size_t AsyncIOServer::ReapRing() {
+  return ring_->Reap([](uint64_t user_data, int32_t result) {
+    // Cancellation requests have no user data.
+    if (!user_data) return;
+    reinterpret_cast<RingRequest*>(user_data)->HandleCompletion(result);
+  });
+}
+
+kj::Promise<void> AsyncIOServer::HandleRingEvents() {
+  return event_reader_
+      ->read(&ring_event_count_, sizeof(ring_event_count_),
+             sizeof(ring_event_count_))
+      .then([this](auto size) mutable {
+        ReapRing();
+
+        // Operations left queued by a submission that failed for lack of
+        // resources may fit now that completions have been reaped.
+        if (ring_->Queued()) ScheduleRingSubmit();
+
+        return this->HandleRingEvents();
+      });
+}
+
 void AsyncIOServer::PostEvent(size_t id) {
   kj::FdOutputStream event_output(event_writer_.get());
   event_output.write(&id, sizeof(id));
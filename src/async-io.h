@@ -9,8 +9,8 @@
 #include <kj/async-io.h>
 #include <kj/io.h>
 
+#include "io-uring.h"
 #include "proto/async-io.capnp.h"
-#include "rpc.h"
 
 namespace cantera {
 namespace cas_internal {
@@ -48,22 +48,90 @@ class AsyncIOServer : public AsyncIO::Server {
     size_t id_;
   };
 
-  static std::pair<kj::Own<RPCClient>, kj::Own<RPCServer<AsyncIO>>> Create(
-      kj::AsyncIoContext& async_io);
+  // An operation submitted through io_uring.  Short reads and writes are
+  // resubmitted for the remainder.
+  class RingRequest {
+   public:
+    RingRequest(kj::PromiseFulfiller<void>& fulfiller,
+                IORequest::Operation operation, AsyncIOServer* aio_server,
+                int fd, void* buffer = nullptr, size_t offset = 0,
+                size_t length = 0);
+
+    ~RingRequest();
+
+    void HandleCompletion(int32_t result);
+
+   private:
+    void Queue();
+
+    kj::PromiseFulfiller<void>& fulfiller_;
+
+    IORequest::Operation operation_;
+
+    AsyncIOServer* aio_server_;
+
+    int fd_;
+    char* buffer_;
+    size_t offset_;
+    size_t length_;
+
+    // True while the kernel may access `buffer_`.
+    bool in_flight_ = false;
+
+    // True if the promise was destroyed while the operation was in flight.
+    bool cancelled_ = false;
+  };
 
   AsyncIOServer(kj::AsyncIoContext& async_io);
 
+  // Reads `length` bytes at `offset` in `fd` into `buffer`, which must stay
+  // valid until the returned promise completes or is destroyed.  Fails on end
+  // of file.
+  kj::Promise<void> Pread(int fd, void* buffer, size_t offset, size_t length);
+
+  // Writes `length` bytes from `buffer` at `offset` in `fd`.
+  kj::Promise<void> Pwrite(int fd, const void* buffer, size_t offset,
+                           size_t length);
+
+  kj::Promise<void> Fsync(int fd);
+
+  // Hints that the given descriptors will be used frequently, and stay open
+  // for the lifetime of the server.
+  void RegisterFiles(kj::ArrayPtr<const int> fds);
+
+  // Cap'n Proto interface, for clients in the same address space that only
+  // hold an `AsyncIO::Client`.  Local users should call the methods above
+  // directly, which avoids encoding every operation as a message.
   kj::Promise<void> pread(PreadContext context) override;
 
   kj::Promise<void> pwrite(PwriteContext context) override;
 
   kj::Promise<void> fsync(FsyncContext context) override;
 
+  kj::Promise<void> registerFiles(RegisterFilesContext context) override;
+
   void PostEvent(size_t id);
 
  private:
   kj::Promise<void> HandleEvent(size_t id);
 
+  // Passes queued io_uring operations to the kernel once the current event
+  // loop turn is done, so that operations started in the same turn share a
+  // system call.
+  void ScheduleRingSubmit();
+
+  // Dispatches available io_uring completions.  Returns the number of
+  // completions.
+  size_t ReapRing();
+
+  kj::Promise<void> HandleRingEvents();
+
+  // Null if io_uring is not available, in which case POSIX AIO is used.
+  std::unique_ptr<IOUring> ring_;
+  bool ring_submit_scheduled_ = false;
+  kj::Promise<void> ring_submit_promise_;
+  uint64_t ring_event_count_;
+
   kj::Own<kj::AsyncInputStream> event_reader_;
   kj::AutoCloseFd event_writer_;
   size_t id_buffer_;
@@ -0,0 +1,104 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/background.h"
+
+#include <cerrno>
+#include <exception>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+struct ThreadTask {
+  ~ThreadTask() {
+    if (!thread.joinable()) return;
+    if (cancel) cancel();
+    thread.join();
+  }
+
+  std::function<void()> cancel;
+
+  kj::AutoCloseFd done_reader;
+  kj::AutoCloseFd done_writer;
+
+  // Becomes readable once the thread has finished.
+  kj::Own<kj::AsyncInputStream> done_stream;
+  char done_byte;
+
+  std::exception_ptr exception;
+
+  std::thread thread;
+};
+
+}  // namespace
+
+kj::Promise<void> RunInThread(kj::LowLevelAsyncIoProvider& provider,
+                              std::function<void()> function,
+                              std::function<void()> cancel) {
+  auto task = kj::heap<ThreadTask>();
+  task->cancel = std::move(cancel);
+
+  int pipe[2];
+#if HAVE_PIPE2
+  KJ_SYSCALL(::pipe2(pipe, O_CLOEXEC));
+#else
+  KJ_SYSCALL(::pipe(pipe));
+#endif
+  task->done_reader = kj::AutoCloseFd(pipe[0]);
+  task->done_writer = kj::AutoCloseFd(pipe[1]);
+#if !HAVE_PIPE2
+  KJ_SYSCALL(fcntl(pipe[0], F_SETFD, FD_CLOEXEC));
+  KJ_SYSCALL(fcntl(pipe[1], F_SETFD, FD_CLOEXEC));
+#endif
+
+  task->done_stream = provider.wrapInputFd(task->done_reader.get());
+
+  auto& task_ref = *task;
+
+  task->thread = std::thread([&task_ref, function = std::move(function)] {
+    try {
+      function();
+    } catch (...) {
+      task_ref.exception = std::current_exception();
+    }
+
+    const char byte = 0;
+    while (write(task_ref.done_writer.get(), &byte, 1) == -1 && errno == EINTR)
+      ;
+  });
+
+  auto done = task->done_stream->read(&task->done_byte, 1);
+
+  return done.then([task = kj::mv(task)](size_t) {
+    task->thread.join();
+    if (task->exception) std::rethrow_exception(task->exception);
+  });
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
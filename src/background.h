@@ -0,0 +1,26 @@
+#ifndef CANTERA_BACKGROUND_H_
+#define CANTERA_BACKGROUND_H_ 1
+
+#include <functional>
+
+#include <kj/async-io.h>
+
+namespace cantera {
+namespace cas_internal {
+
+// Runs `function` on a new thread, and returns a promise that is fulfilled on
+// the calling thread's event loop once it has returned, or rejected with the
+// exception it threw.  If the promise is destroyed first, the destructor calls
+// `cancel`, if given, to make `function` return early, and then waits for the
+// thread to exit.
+//
+// `function` must not touch anything the event loop might modify while it is
+// running.
+kj::Promise<void> RunInThread(kj::LowLevelAsyncIoProvider& provider,
+                              std::function<void()> function,
+                              std::function<void()> cancel = nullptr);
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_BACKGROUND_H_
@@ -29,11 +29,12 @@
 
 #include <capnp/ez-rpc.h>
 #include <capnp/message.h>
-#include <kj/arena.h>
 #include <kj/debug.h>
 
 #include "balancer.h"
 #include "client.h"
+#include "mark-router.h"
+#include "object-list.h"
 #include "proto/ca-cas.capnp.h"
 #include "util.h"
 
@@ -89,60 +90,69 @@ class CASObjectStreamMultiplexer : public ByteStream::Server {
   std::vector<ByteStream::Client> output_;
 };
 
-class ObjectListImpl : public CAS::ObjectList::Server {
- public:
-  ObjectListImpl(std::deque<CAS::ObjectList::Client>&& lists)
-      : lists_(std::move(lists)) {}
+}  // namespace
 
-  kj::Promise<void> read(ReadContext context) override;
+struct BalancerServer::ForwardedGet {
+  ForwardedGet(ByteStream::Client stream) : stream(std::move(stream)) {}
 
- private:
-  kj::Promise<void> Read(size_t limit);
+  ByteStream::Client stream;
 
-  std::deque<CAS::ObjectList::Client> lists_;
-  std::deque<CASKey> keys_;
-};
+  // Number of bytes forwarded to the client so far.
+  uint64_t received = 0;
 
-kj::Promise<void> ObjectListImpl::read(ReadContext context) {
-  return Read(context.getParams().getCount()).then([this, context]() mutable {
-    size_t count = std::min(
-        keys_.size(), static_cast<size_t>(context.getParams().getCount()));
-    auto objects = context.getResults().initObjects(count);
+  bool size_sent = false;
 
-    auto orphanage = context.getResultsOrphanage();
+  // Set if writing to the client failed, in which case there is no point in
+  // asking other backends.
+  bool client_failed = false;
 
-    for (size_t i = 0; i < count; ++i) {
-      auto key_buffer = orphanage.newOrphan<capnp::Data>(20);
-      std::copy(keys_.front().begin(), keys_.front().end(),
-                key_buffer.get().begin());
-      keys_.pop_front();
-      objects.adopt(i, std::move(key_buffer));
-    }
-  });
-}
+  // Incremented whenever a backend fails, so that any late writes from it
+  // are rejected instead of being mixed with the retried range.
+  unsigned int attempt = 0;
+};
 
-kj::Promise<void> ObjectListImpl::Read(size_t amount) {
-  if (keys_.size() >= amount || lists_.empty()) return kj::READY_NOW;
+class BalancerServer::AttemptStream : public ByteStream::Server {
+ public:
+  AttemptStream(std::shared_ptr<ForwardedGet> get)
+      : get_(std::move(get)), attempt_(get_->attempt) {}
 
-  auto read_request = lists_.front().readRequest();
-  read_request.setCount(amount - keys_.size());
+  kj::Promise<void> write(WriteContext context) override {
+    KJ_REQUIRE(attempt_ == get_->attempt, "Get was retried on another backend");
 
-  return read_request.send().then(
-      [this, amount](auto response) -> kj::Promise<void> {
-        auto objects = response.getObjects();
+    auto data = context.getParams().getData();
+    get_->received += data.size();
 
-        if (objects.size() == 0) lists_.pop_front();
+    auto request = get_->stream.writeRequest();
+    request.setData(data);
 
-        for (const auto& object : objects) {
-          KJ_REQUIRE(object.size() == 20);
-          keys_.emplace_back(object.begin());
-        }
+    return request.send().ignoreResult().catch_([get = get_](
+        kj::Exception&& e) {
+      get->client_failed = true;
+      kj::throwRecoverableException(std::move(e));
+    });
+  }
 
-        return this->Read(amount);
-      });
-}
+  kj::Promise<void> done(DoneContext context) override {
+    // The client's stream is closed once the get has succeeded.
+    return kj::READY_NOW;
+  }
 
-}  // namespace
+  kj::Promise<void> expectSize(ExpectSizeContext context) override {
+    // Only the first backend knows the size of the whole range.  Receivers
+    // such as `ByteStreamCollector` must not be told twice.
+    if (get_->size_sent || get_->received) return kj::READY_NOW;
+    get_->size_sent = true;
+
+    auto request = get_->stream.expectSizeRequest();
+    request.setSize(context.getParams().getSize());
+    return request.send().ignoreResult();
+  }
+
+ private:
+  std::shared_ptr<ForwardedGet> get_;
+
+  const unsigned int attempt_;
+};
 
 kj::Promise<void> BalancerServer::beginGC(BeginGCContext context) {
   const auto& backends = sharding_info_.Backends();
@@ -161,39 +171,124 @@ kj::Promise<void> BalancerServer::beginGC(BeginGCContext context) {
     backend_gc_ids_.insert(backend_gc_ids_.begin(), ids.begin(), ids.end());
 
     context.getResults().setId(gc_id_);
+
+    // Placements are read after the cycle has begun, since objects written
+    // out of place from then on are kept by this cycle anyway.
+    route_marks_ = false;
+
+    const auto& backends = sharding_info_.Backends();
+    auto placements =
+        kj::heapArrayBuilder<kj::Promise<uint64_t>>(backends.size());
+    for (auto& backend : backends) {
+      // Servers that fail to report a placement get every mark.
+      placements.add(
+          backend.client->RawClient().getPlacementRequest().send().then(
+              [](auto response) { return response.getRing(); },
+              [](kj::Exception&&) -> uint64_t { return 0; }));
+    }
+
+    return kj::joinPromises(placements.finish())
+        .then([ this, gc_id = gc_id_ ](kj::Array<uint64_t> && rings) {
+          if (gc_id != gc_id_) return;
+
+          const auto ring = sharding_info_.RingFingerprint();
+          route_marks_ = std::all_of(rings.begin(), rings.end(),
+                                     [ring](auto r) { return r == ring; });
+        });
   });
 }
 
 kj::Promise<void> BalancerServer::markGC(MarkGCContext context) {
-  auto request_keys = context.getParams().getKeys();
+  auto keys = context.getParams().getKeys();
+
+  const auto& backends = sharding_info_.Backends();
+
+  // Which backends may hold a key depends on which are connected, so all of
+  // them must be for the marks to reach every copy.
+  for (auto& backend : backends) KJ_REQUIRE(backend.client->Connected());
+
+  if (!route_marks_) {
+    // The keys are copied straight from the incoming message into each
+    // request.
+    auto promise_builder =
+        kj::heapArrayBuilder<kj::Promise<void>>(backends.size());
+
+    for (auto& backend : backends) {
+      auto request = backend.client->RawClient().markGCRequest();
+      request.setKeys(keys);
+      promise_builder.add(request.send().ignoreResult());
+    }
+
+    return kj::joinPromises(promise_builder.finish());
+  }
+
+  // Positions in `keys` of the keys to send to each backend.
+  std::vector<std::vector<unsigned int>> backend_keys(backends.size());
+  std::vector<size_t> targets;
+
+  for (unsigned int i = 0; i < keys.size(); ++i) {
+    targets.clear();
+    sharding_info_.GetMarkBackendsForKey(
+        ObjectKey::FromWire(keys[i]).StorageKey(), targets);
+
+    for (const auto idx : targets) backend_keys[idx].emplace_back(i);
+  }
 
-  auto arena = kj::heap<kj::Arena>(4096);
+  const auto count =
+      std::count_if(backend_keys.begin(), backend_keys.end(),
+                    [](const auto& indexes) { return !indexes.empty(); });
+  auto promise_builder = kj::heapArrayBuilder<kj::Promise<void>>(count);
 
-  auto key_builder =
-      kj::heapArrayBuilder<capnp::Data::Reader>(request_keys.size());
+  for (size_t idx = 0; idx < backends.size(); ++idx) {
+    const auto& indexes = backend_keys[idx];
+    if (indexes.empty()) continue;
 
-  for (const auto& key : request_keys) {
-    auto key_copy = arena->allocateArray<capnp::byte>(key.size());
-    std::copy(key.begin(), key.end(), key_copy.begin());
-    key_builder.add(std::move(key_copy));
+    auto request = backends[idx].client->RawClient().markGCRequest();
+    auto request_keys = request.initKeys(indexes.size());
+    for (size_t i = 0; i < indexes.size(); ++i)
+      request_keys.set(i, keys[indexes[i]]);
+
+    promise_builder.add(request.send().ignoreResult());
+  }
+
+  return kj::joinPromises(promise_builder.finish());
+}
+
+kj::Promise<void> BalancerServer::markGCStream(MarkGCStreamContext context) {
+  std::vector<CAS::MarkSink::Client> sinks;
+
+  for (auto& backend : sharding_info_.Backends()) {
+    KJ_REQUIRE(backend.client->Connected());
+    sinks.emplace_back(backend.client->RawClient()
+                           .markGCStreamRequest()
+                           .send()
+                           .getSink());
   }
 
-  auto keys = key_builder.finish();
+  context.getResults().setSink(kj::heap<MarkRouter>(
+      std::move(sinks),
+      [this](const CASKey& key, std::vector<size_t>& result) {
+        MarkBackendsForKey(key, result);
+      }));
 
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> BalancerServer::markGCFilter(MarkGCFilterContext context) {
+  // Which backends hold the keys in the filter is unknown, so every backend
+  // gets the whole filter.
   const auto& backends = sharding_info_.Backends();
-  auto promise_builder =
-      kj::heapArrayBuilder<kj::Promise<void>>(backends.size());
+
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(backends.size());
 
   for (auto& backend : backends) {
     KJ_REQUIRE(backend.client->Connected());
-    auto request = backend.client->RawClient().markGCRequest();
-    request.setKeys(keys);
-    promise_builder.add(request.send().ignoreResult());
+    auto request = backend.client->RawClient().markGCFilterRequest();
+    request.setFilter(context.getParams().getFilter());
+    builder.add(request.send().ignoreResult());
   }
 
-  return kj::joinPromises(promise_builder.finish())
-      .attach(std::move(keys))
-      .attach(std::move(arena));
+  return kj::joinPromises(builder.finish());
 }
 
 kj::Promise<void> BalancerServer::endGC(EndGCContext context) {
@@ -218,33 +313,65 @@ kj::Promise<void> BalancerServer::endGC(EndGCContext context) {
 }
 
 kj::Promise<void> BalancerServer::get(GetContext context) {
-  auto key_reader = context.getParams().getKey();
-  KJ_REQUIRE(key_reader.size() == 20, "CASKey size must be exactly 20 bytes");
-
-  auto key = std::make_unique<CASKey>(key_reader.begin());
+  // Storage servers find objects by their storage key alone, so there is no
+  // need to forward the algorithm.
+  auto key = std::make_unique<CASKey>(
+      ObjectKey::FromWire(context.getParams().getKey()).StorageKey());
   const auto offset = context.getParams().getOffset();
   const auto size = context.getParams().getSize();
 
   std::unordered_set<CASClient*> done;
 
-  return GetObjectFromBackends(offset, size, std::move(key),
-                               context.getParams().getStream(),
-                               std::move(done));
+  auto get = std::make_shared<ForwardedGet>(context.getParams().getStream());
+
+  return GetObjectFromBackends(offset, size, std::move(key), get,
+                               std::move(done))
+      .then([get] { return get->stream.doneRequest().send().ignoreResult(); });
 }
 
 kj::Promise<void> BalancerServer::put(PutContext context) {
   auto key_data = context.getParams().getKey();
-  KJ_REQUIRE(key_data.size() == 20 || key_data.size() == 0, key_data.size());
-
-  const auto sync = context.getParams().getSync();
 
-  CASKey key(key_data);
+  // Objects are placed on the hash ring by their storage key, regardless of
+  // the key algorithm.
+  const auto key = ObjectKey::FromWire(key_data).StorageKey();
 
   std::vector<CASClient*> backends;
-  sharding_info_.GetWriteBackendsForKey(key, backends);
+  const auto in_place = sharding_info_.GetWriteBackendsForKey(key, backends);
 
   KJ_REQUIRE(!backends.empty());
 
+  if (in_place) return ForwardPut(context, std::move(backends));
+
+  // Garbage collection will not find the object where it looks once every
+  // backend is back, so the backends receiving it must get marks for every
+  // key until `ca-cas balance` has moved it into place.
+  route_marks_ = false;
+
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(backends.size());
+  for (auto backend : backends) {
+    auto request = backend->RawClient().setPlacementRequest();
+    request.setRing(0);
+
+    // Servers without `setPlacement` never report a placement either.
+    builder.add(request.send().ignoreResult().catch_([](kj::Exception&& e) {
+      if (e.getType() != kj::Exception::Type::UNIMPLEMENTED)
+        kj::throwRecoverableException(std::move(e));
+    }));
+  }
+
+  return kj::joinPromises(builder.finish())
+      .then([ this, context, backends = std::move(backends) ]() mutable {
+        return ForwardPut(context, std::move(backends));
+      });
+}
+
+kj::Promise<void> BalancerServer::ForwardPut(PutContext context,
+                                             std::vector<CASClient*> backends) {
+  auto key_data = context.getParams().getKey();
+
+  const auto sync = context.getParams().getSync();
+
   if (backends.size() == 1) {
     auto backend = backends.front();
 
@@ -272,8 +399,8 @@ kj::Promise<void> BalancerServer::put(PutContext context) {
 }
 
 kj::Promise<void> BalancerServer::remove(RemoveContext context) {
-  auto key = context.getParams().getKey();
-  KJ_REQUIRE(key.size() == 20, "CASKey size must be exactly 20 bytes");
+  const auto key =
+      ObjectKey::FromWire(context.getParams().getKey()).StorageKey();
 
   const auto& backends = sharding_info_.Backends();
 
@@ -281,7 +408,7 @@ kj::Promise<void> BalancerServer::remove(RemoveContext context) {
   for (auto& backend : backends) {
     KJ_REQUIRE(backend.client->Connected(),
                "cannot give remove object unless all backends are connected");
-    builder.add(backend.client->RemoveAsync(key.begin()));
+    builder.add(backend.client->RemoveAsync(key));
   }
 
   return kj::joinPromises(builder.finish());
@@ -328,7 +455,8 @@ kj::Promise<void> BalancerServer::list(ListContext context) {
     lists.emplace_back(request.send().getList());
   }
 
-  context.getResults().setList(kj::heap<ObjectListImpl>(std::move(lists)));
+  context.getResults().setList(
+      kj::heap<ConcatenatedObjectList>(std::move(lists)));
 
   return kj::READY_NOW;
 }
@@ -380,9 +508,20 @@ kj::Promise<void> BalancerServer::getConfig(GetConfigContext context) {
   return kj::READY_NOW;
 }
 
+void BalancerServer::MarkBackendsForKey(const CASKey& key,
+                                        std::vector<size_t>& result) const {
+  if (route_marks_) {
+    sharding_info_.GetMarkBackendsForKey(key, result);
+    return;
+  }
+
+  for (size_t idx = 0; idx < sharding_info_.Backends().size(); ++idx)
+    result.emplace_back(idx);
+}
+
 kj::Promise<void> BalancerServer::GetObjectFromBackends(
     uint64_t offset, uint64_t size, std::unique_ptr<CASKey> key,
-    ByteStream::Client stream, std::unordered_set<CASClient*> done) {
+    std::shared_ptr<ForwardedGet> get, std::unordered_set<CASClient*> done) {
   auto backend = sharding_info_.NextShardForKey(*key, done);
   done.emplace(backend);
 
@@ -390,19 +529,25 @@ kj::Promise<void> BalancerServer::GetObjectFromBackends(
 
   auto get_request = backend->RawClient().getRequest();
 
-  get_request.setOffset(offset);
-  get_request.setSize(size);
+  // Storage servers seek straight to the requested offset, so resuming a
+  // large object costs no more than starting it.
+  get_request.setOffset(offset + get->received);
+  get_request.setSize(size - std::min(size, get->received));
   get_request.setKey(kj::arrayPtr(key->begin(), key->end()));
-  get_request.setStream(stream);
+  get_request.setStream(kj::heap<AttemptStream>(get));
 
   return get_request.send().then(
       [](auto get_results) mutable -> kj::Promise<void> {
         return kj::READY_NOW;
       },
       [
-        offset, size, key = std::move(key), stream, done = std::move(done), this
+        offset, size, key = std::move(key), get, done = std::move(done), this
       ](kj::Exception && e) mutable {
-        return GetObjectFromBackends(offset, size, std::move(key), stream,
+        if (get->client_failed) kj::throwRecoverableException(std::move(e));
+
+        ++get->attempt;
+
+        return GetObjectFromBackends(offset, size, std::move(key), get,
                                      std::move(done));
       });
 }
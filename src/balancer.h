@@ -26,16 +26,27 @@ class BalancerServer : public CAS::Server {
   BalancerServer(BalancerServer&&) = default;
   BalancerServer& operator=(BalancerServer&&) = default;
 
-  void AddBackend(std::shared_ptr<CASClient> client, uint8_t failure_domain) {
-    sharding_info_.AddBackend(std::move(client), failure_domain);
+  // If `out_of_balance` is true, the backend receives garbage collection
+  // marks for every key, even when the others only receive marks for the keys
+  // they would store.
+  void AddBackend(std::shared_ptr<CASClient> client, uint8_t failure_domain,
+                  bool out_of_balance = false) {
+    sharding_info_.AddBackend(std::move(client), failure_domain,
+                              out_of_balance);
   }
 
   void SetReplicas(size_t n) { sharding_info_.SetFullReplicas(n); }
 
+  uint64_t RingFingerprint() const { return sharding_info_.RingFingerprint(); }
+
   kj::Promise<void> beginGC(BeginGCContext context) override;
 
   kj::Promise<void> markGC(MarkGCContext context) override;
 
+  kj::Promise<void> markGCStream(MarkGCStreamContext context) override;
+
+  kj::Promise<void> markGCFilter(MarkGCFilterContext context) override;
+
   kj::Promise<void> endGC(EndGCContext context) override;
 
   kj::Promise<void> get(GetContext context) override;
@@ -53,15 +64,38 @@ class BalancerServer : public CAS::Server {
   kj::Promise<void> getConfig(GetConfigContext context) override;
 
  private:
+  // Progress of a get forwarded to the client, shared by the attempts on
+  // different backends.
+  struct ForwardedGet;
+
+  // Receives the data sent by one backend for a `ForwardedGet`.
+  class AttemptStream;
+
+  // Requests the part of the range starting at `offset` that has not yet
+  // been received from the next backend holding `key`, and moves on to the
+  // next backend if that fails.
+  // Determines which backends receive the garbage collection mark for `key`.
+  // Unless every backend reported being balanced for the current hash ring
+  // when the cycle began, this is all of them.
+  void MarkBackendsForKey(const CASKey& key, std::vector<size_t>& result) const;
+
+  // Forwards a put to the given backends.
+  kj::Promise<void> ForwardPut(PutContext context,
+                               std::vector<CASClient*> backends);
+
   kj::Promise<void> GetObjectFromBackends(uint64_t offset, uint64_t size,
                                           std::unique_ptr<CASKey> key,
-                                          ByteStream::Client stream,
+                                          std::shared_ptr<ForwardedGet> get,
                                           std::unordered_set<CASClient*> done);
 
   ShardingInfo sharding_info_;
 
   std::vector<uint64_t> backend_gc_ids_;
   uint64_t gc_id_ = 0;
+
+  // True if garbage collection marks are only sent to the backends that may
+  // hold each key in the current cycle.
+  bool route_marks_ = false;
 };
 
 }  // namespace cas_internal
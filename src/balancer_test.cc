@@ -28,15 +28,173 @@
 using namespace cantera;
 using namespace cantera::cas_internal;
 
+namespace {
+
+// Forwards data to `output` until `limit` bytes have been written, and then
+// fails.
+class TruncatingStream : public ByteStream::Server {
+ public:
+  TruncatingStream(ByteStream::Client output, size_t limit)
+      : output_(std::move(output)), limit_(limit) {}
+
+  kj::Promise<void> write(WriteContext context) override {
+    auto data = context.getParams().getData();
+    const auto amount = std::min(data.size(), limit_ - written_);
+
+    auto request = output_.writeRequest();
+    request.setData(kj::arrayPtr(data.begin(), amount));
+    written_ += amount;
+
+    return request.send().ignoreResult().then([this] {
+      KJ_REQUIRE(written_ < limit_, "Simulated connection failure");
+    });
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    return output_.doneRequest().send().ignoreResult();
+  }
+
+  kj::Promise<void> expectSize(ExpectSizeContext context) override {
+    auto request = output_.expectSizeRequest();
+    request.setSize(context.getParams().getSize());
+    return request.send().ignoreResult();
+  }
+
+ private:
+  ByteStream::Client output_;
+
+  const size_t limit_;
+  size_t written_ = 0;
+};
+
+// Storage backend whose next get fails part way through the object whenever
+// `*fail_get` is set.
+class FlakyServer : public CAS::Server {
+ public:
+  static const size_t kFailAfter = 200;
+
+  FlakyServer(CAS::Client backend, bool* fail_get)
+      : backend_(std::move(backend)), fail_get_(fail_get) {}
+
+  kj::Promise<void> get(GetContext context) override {
+    auto params = context.getParams();
+
+    auto request = backend_.getRequest();
+    request.setKey(params.getKey());
+    request.setOffset(params.getOffset());
+    request.setSize(params.getSize());
+
+    if (*fail_get_) {
+      *fail_get_ = false;
+      request.setStream(
+          kj::heap<TruncatingStream>(params.getStream(), kFailAfter));
+    } else {
+      request.setStream(params.getStream());
+    }
+
+    return context.tailCall(std::move(request));
+  }
+
+  kj::Promise<void> put(PutContext context) override {
+    auto request = backend_.putRequest();
+    request.setKey(context.getParams().getKey());
+    request.setSync(context.getParams().getSync());
+    return context.tailCall(std::move(request));
+  }
+
+  kj::Promise<void> getConfig(GetConfigContext context) override {
+    return context.tailCall(backend_.getConfigRequest());
+  }
+
+ private:
+  CAS::Client backend_;
+
+  bool* fail_get_;
+};
+
+}  // namespace
+
 struct RpcBalancerTest : testing::Test {
  public:
   RpcBalancerTest() : async_io_{kj::setupAsyncIo()} {}
 
   ~RpcBalancerTest() noexcept {}
 
-  // Starts several storage backends using temporary directories, and then
-  // starts a balancer server working across them.
-  void SetUp() override {
+  // Starts a balancer server, to which storage backends are then added.
+  void SetUp() override { StartBalancer(); }
+
+  void TearDown() override {
+    kj::Promise<void>(kj::READY_NOW).wait(async_io_.waitScope);
+
+    storage_servers_.clear();
+
+    cas_.reset();
+    client_.reset();
+    balancer_.reset();
+  }
+
+  // Starts a storage backend using a temporary directory, and adds it to the
+  // balancer.  If `fail_get` is not null, the backend fails part way through
+  // its next get whenever `*fail_get` is set.
+  void AddBackend(kj::WaitScope& wait_scope, uint8_t failure_domain = 0,
+                  bool* fail_get = nullptr, bool out_of_balance = false) {
+    backends_.push_back(
+        {TemporaryDirectory(), failure_domain, fail_get, out_of_balance});
+    StartBackend(backends_.back());
+  }
+
+  // Stops every server, and starts them again on the same directories, with
+  // a new balancer server.
+  void Restart() {
+    TearDown();
+    StartBalancer();
+    for (const auto& backend : backends_) StartBackend(backend);
+  }
+
+  // Stops the storage backend with the given index.  The balancer sees it as
+  // disconnected once this returns.
+  void StopBackend(size_t idx) {
+    storage_servers_[idx].reset();
+
+    for (size_t i = 0; backend_clients_[idx]->Connected(); ++i) {
+      ASSERT_LT(i, 1000U);
+      async_io_.provider->getTimer()
+          .afterDelay(1 * kj::MILLISECONDS)
+          .wait(async_io_.waitScope);
+    }
+  }
+
+  // Records `ring` as the placement of every storage backend, as
+  // `ca-cas balance` would.
+  void SetPlacements(uint64_t ring) {
+    for (auto& client : backend_clients_) {
+      auto request = client->RawClient().setPlacementRequest();
+      request.setRing(ring);
+      request.send().wait(async_io_.waitScope);
+    }
+  }
+
+  std::vector<uint64_t> GetPlacements() {
+    std::vector<uint64_t> result;
+    for (auto& client : backend_clients_) {
+      result.emplace_back(client->RawClient()
+                              .getPlacementRequest()
+                              .send()
+                              .wait(async_io_.waitScope)
+                              .getRing());
+    }
+    return result;
+  }
+
+ protected:
+  struct Backend {
+    std::string repo_root;
+    uint8_t failure_domain;
+    bool* fail_get;
+    bool out_of_balance;
+  };
+
+  void StartBalancer() {
     auto balancer_channel = async_io_.provider->newTwoWayPipe();
 
     auto balancer_server = kj::heap<BalancerServer>(async_io_);
@@ -48,34 +206,31 @@ struct RpcBalancerTest : testing::Test {
     client_ = std::make_unique<RPCClient>(std::move(balancer_channel.ends[1]));
 
     cas_ = std::make_unique<CAS::Client>(client_->GetMain<CAS>());
-  }
 
-  void TearDown() override {
-    kj::Promise<void>(kj::READY_NOW).wait(async_io_.waitScope);
-
-    storage_servers_.clear();
-
-    cas_.reset();
-    client_.reset();
-    balancer_.reset();
+    backend_clients_.clear();
   }
 
-  void AddBackend(kj::WaitScope& wait_scope, uint8_t failure_domain = 0) {
+  void StartBackend(const Backend& backend) {
     auto backend_channel = async_io_.provider->newTwoWayPipe();
 
-    auto repo_root = TemporaryDirectory();
+    kj::Own<CAS::Server> storage_server =
+        kj::heap<StorageServer>(backend.repo_root.c_str(), 0, async_io_);
+    if (backend.fail_get) {
+      storage_server = kj::heap<FlakyServer>(
+          CAS::Client(std::move(storage_server)), backend.fail_get);
+    }
 
     storage_servers_.emplace_back(std::make_unique<RPCServer<CAS>>(
-        kj::heap<StorageServer>(repo_root.c_str(), 0, async_io_),
-        std::move(backend_channel.ends[0])));
+        std::move(storage_server), std::move(backend_channel.ends[0])));
 
     auto client = std::make_shared<CASClient>(
         std::move(backend_channel.ends[1]), async_io_);
+    backend_clients_.emplace_back(client);
 
-    balancer_server_->AddBackend(std::move(client), failure_domain);
+    balancer_server_->AddBackend(std::move(client), backend.failure_domain,
+                                 backend.out_of_balance);
   }
 
- protected:
   std::string TemporaryDirectory() {
     const char* tmpdir = getenv("TMPDIR");
     if (!tmpdir) tmpdir = "/tmp";
@@ -120,7 +275,9 @@ struct RpcBalancerTest : testing::Test {
 
   kj::AsyncIoContext async_io_;
 
+  std::vector<Backend> backends_;
   std::vector<std::unique_ptr<RPCServer<CAS>>> storage_servers_;
+  std::vector<std::shared_ptr<CASClient>> backend_clients_;
 
   BalancerServer* balancer_server_ = nullptr;
   std::unique_ptr<RPCServer<CAS>> balancer_;
@@ -230,6 +387,40 @@ TEST_F(RpcBalancerTest, SimplePutAndGet) {
                          }));
 }
 
+// Verifies that a get that fails part way through is resumed on another
+// replica, without sending the client any data twice.
+TEST_F(RpcBalancerTest, GetResumesOnAnotherReplica) {
+  bool fail_get = false;
+
+  AddBackend(async_io_.waitScope, 0, &fail_get);
+  AddBackend(async_io_.waitScope, 1, &fail_get);
+  balancer_server_->SetReplicas(2);
+
+  auto data = RandomData();
+  const auto key = PutObject(kj::heapArray<capnp::byte>(data.asPtr()));
+
+  for (const uint64_t offset : {0, 100, 300}) {
+    fail_get = true;
+
+    // The collector requires exactly the announced number of bytes.
+    auto result = std::make_shared<kj::Array<char>>();
+
+    auto get_request = cas_->getRequest();
+    get_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+    get_request.setOffset(offset);
+    get_request.setStream(kj::heap<ByteStreamCollector>(result));
+    get_request.send().wait(async_io_.waitScope);
+
+    EXPECT_FALSE(fail_get);
+    ASSERT_EQ(data.size() - offset, result->size());
+    EXPECT_TRUE(std::equal(data.begin() + offset, data.end(),
+                           result->begin(), [](const auto lhs, const auto rhs) {
+                             return static_cast<uint8_t>(lhs) ==
+                                    static_cast<uint8_t>(rhs);
+                           }));
+  }
+}
+
 // Verifies that the server will refuse to accept objects whose SHA-1 digest
 // does not match the key set by the client.
 TEST_F(RpcBalancerTest, PutWithWrongKeyThrows) {
@@ -401,3 +592,82 @@ TEST_F(RpcBalancerTest, GarbageCollector) {
     EXPECT_EQ(*all_keys.begin(), data0_key);
   }
 }
+
+// Verifies that objects stored before backends were added survive garbage
+// collection, as long as their backend is flagged as out of balance.
+TEST_F(RpcBalancerTest, MarkGCReachesOutOfBalanceBackends) {
+  static const size_t kObjectCount = 20;
+
+  AddBackend(async_io_.waitScope, 0, nullptr, true);
+
+  std::vector<CASKey> keys;
+  for (size_t i = 0; i < kObjectCount; ++i)
+    keys.emplace_back(PutObject(RandomData()));
+
+  // The new backends take over most of the hash ring, but the objects stay
+  // where they are.
+  AddBackend(async_io_.waitScope, 1);
+  AddBackend(async_io_.waitScope, 2);
+
+  // Marks are routed, except to the backend configured as out of balance.
+  SetPlacements(balancer_server_->RingFingerprint());
+
+  const auto gc_id = CASClient::BeginGC(*cas_).wait(async_io_.waitScope);
+  CASClient::MarkGC(*cas_, keys).wait(async_io_.waitScope);
+  CASClient::EndGC(*cas_, gc_id).wait(async_io_.waitScope);
+
+  std::vector<CASKey> list_keys;
+  CASClient::ListAsync(*cas_, [&list_keys](const CASKey& key) {
+    list_keys.emplace_back(key);
+  }).wait(async_io_.waitScope);
+
+  std::sort(keys.begin(), keys.end());
+  std::sort(list_keys.begin(), list_keys.end());
+  EXPECT_EQ(keys, list_keys);
+}
+
+// Verifies that objects written elsewhere while a backend is disconnected
+// survive garbage collection through a new balancer server, once the backend
+// is back.
+TEST_F(RpcBalancerTest, MarkGCAfterWriteSkippedBackend) {
+  static const size_t kObjectCount = 20;
+
+  AddBackend(async_io_.waitScope, 0);
+  AddBackend(async_io_.waitScope, 1);
+  AddBackend(async_io_.waitScope, 2);
+
+  const auto ring = balancer_server_->RingFingerprint();
+  SetPlacements(ring);
+
+  std::vector<CASKey> keys;
+  for (size_t i = 0; i < kObjectCount; ++i)
+    keys.emplace_back(PutObject(RandomData()));
+
+  StopBackend(0);
+
+  // Objects belonging on the stopped backend are written to the next one on
+  // the hash ring instead.
+  for (size_t i = 0; i < kObjectCount; ++i)
+    keys.emplace_back(PutObject(RandomData()));
+
+  Restart();
+
+  ASSERT_EQ(ring, balancer_server_->RingFingerprint());
+
+  const auto placements = GetPlacements();
+  EXPECT_NE(placements.end(),
+            std::find(placements.begin(), placements.end(), 0));
+
+  const auto gc_id = CASClient::BeginGC(*cas_).wait(async_io_.waitScope);
+  CASClient::MarkGC(*cas_, keys).wait(async_io_.waitScope);
+  CASClient::EndGC(*cas_, gc_id).wait(async_io_.waitScope);
+
+  std::vector<CASKey> list_keys;
+  CASClient::ListAsync(*cas_, [&list_keys](const CASKey& key) {
+    list_keys.emplace_back(key);
+  }).wait(async_io_.waitScope);
+
+  std::sort(keys.begin(), keys.end());
+  std::sort(list_keys.begin(), list_keys.end());
+  EXPECT_EQ(keys, list_keys);
+}
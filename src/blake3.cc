@@ -0,0 +1,219 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/blake3.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+const uint32_t kIV[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// Order in which each round reads the message words, obtained by applying the
+// BLAKE3 message permutation once per round.
+const uint8_t kMessageSchedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+enum Flags : uint32_t {
+  kChunkStart = 1,
+  kChunkEnd = 2,
+  kParent = 4,
+  kRoot = 8,
+};
+
+inline uint32_t RotateRight(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+inline uint32_t LoadWord(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+         static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+inline void G(uint32_t* state, size_t a, size_t b, size_t c, size_t d,
+              uint32_t mx, uint32_t my) {
+  state[a] = state[a] + state[b] + mx;
+  state[d] = RotateRight(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = RotateRight(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + my;
+  state[d] = RotateRight(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = RotateRight(state[b] ^ state[c], 7);
+}
+
+// Runs the compression function, leaving the full 16 word output in
+// `output`.  The first 8 words are the new chaining value.
+void Compress(const uint32_t* cv, const uint8_t* block, uint64_t counter,
+              uint32_t block_size, uint32_t flags, uint32_t* output) {
+  uint32_t m[16];
+  for (size_t i = 0; i < 16; ++i) m[i] = LoadWord(block + i * 4);
+
+  uint32_t* state = output;
+  std::copy(cv, cv + 8, state);
+  std::copy(kIV, kIV + 4, state + 8);
+  state[12] = static_cast<uint32_t>(counter);
+  state[13] = static_cast<uint32_t>(counter >> 32);
+  state[14] = block_size;
+  state[15] = flags;
+
+#pragma GCC unroll 7
+  for (const auto& s : kMessageSchedule) {
+    G(state, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+    G(state, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+    G(state, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+    G(state, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+    G(state, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+    G(state, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    G(state, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+    G(state, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+  }
+
+  for (size_t i = 0; i < 8; ++i) {
+    state[i] ^= state[i + 8];
+    state[i + 8] ^= cv[i];
+  }
+}
+
+// Computes the chaining value of a parent node.
+void ParentChainingValue(const uint32_t* left, const uint32_t* right,
+                         uint32_t flags, uint32_t* cv) {
+  uint8_t block[64];
+  for (size_t i = 0; i < 8; ++i) {
+    for (size_t j = 0; j < 4; ++j) {
+      block[i * 4 + j] = left[i] >> (j * 8);
+      block[32 + i * 4 + j] = right[i] >> (j * 8);
+    }
+  }
+
+  uint32_t output[16];
+  Compress(kIV, block, 0, 64, kParent | flags, output);
+  std::copy(output, output + 8, cv);
+}
+
+}  // namespace
+
+BLAKE3::BLAKE3() { std::copy(kIV, kIV + 8, chunk_cv_); }
+
+void BLAKE3::Add(const void* data, size_t size) {
+  auto input = reinterpret_cast<const uint8_t*>(data);
+
+  while (size > 0) {
+    // A full block is only compressed once more input arrives, since the last
+    // block of a chunk needs the `kChunkEnd` flag.
+    if (block_size_ == kBlockSize) {
+      if (blocks_compressed_ + 1 == kChunkSize / kBlockSize) {
+        uint32_t cv[8];
+        ChunkChainingValue(cv);
+        PushChunk(cv);
+
+        std::copy(kIV, kIV + 8, chunk_cv_);
+        ++chunk_counter_;
+        blocks_compressed_ = 0;
+      } else {
+        uint32_t output[16];
+        Compress(chunk_cv_, block_, chunk_counter_, kBlockSize,
+                 blocks_compressed_ ? 0 : kChunkStart, output);
+        std::copy(output, output + 8, chunk_cv_);
+        ++blocks_compressed_;
+      }
+      block_size_ = 0;
+    }
+
+    const auto amount = std::min(kBlockSize - block_size_, size);
+    memcpy(block_ + block_size_, input, amount);
+    block_size_ += amount;
+    input += amount;
+    size -= amount;
+  }
+}
+
+void BLAKE3::Finish(uint8_t* digest) {
+  memset(block_ + block_size_, 0, kBlockSize - block_size_);
+
+  const uint32_t chunk_flags =
+      (blocks_compressed_ ? 0 : kChunkStart) | kChunkEnd;
+
+  uint32_t output[16];
+
+  if (!cv_stack_size_) {
+    Compress(chunk_cv_, block_, chunk_counter_, block_size_,
+             chunk_flags | kRoot, output);
+  } else {
+    uint32_t cv[8];
+    Compress(chunk_cv_, block_, chunk_counter_, block_size_, chunk_flags,
+             output);
+    std::copy(output, output + 8, cv);
+
+    // Merge the remaining subtrees from right to left.  The last merge
+    // produces the root node.
+    for (size_t i = cv_stack_size_; i-- > 1;)
+      ParentChainingValue(cv_stack_[i], cv, 0, cv);
+
+    uint8_t block[64];
+    for (size_t i = 0; i < 8; ++i) {
+      for (size_t j = 0; j < 4; ++j) {
+        block[i * 4 + j] = cv_stack_[0][i] >> (j * 8);
+        block[32 + i * 4 + j] = cv[i] >> (j * 8);
+      }
+    }
+    Compress(kIV, block, 0, 64, kParent | kRoot, output);
+  }
+
+  for (size_t i = 0; i < 8; ++i) {
+    for (size_t j = 0; j < 4; ++j) digest[i * 4 + j] = output[i] >> (j * 8);
+  }
+}
+
+void BLAKE3::ChunkChainingValue(uint32_t* cv) const {
+  uint32_t output[16];
+  Compress(chunk_cv_, block_, chunk_counter_, block_size_,
+           (blocks_compressed_ ? 0 : kChunkStart) | kChunkEnd, output);
+  std::copy(output, output + 8, cv);
+}
+
+void BLAKE3::PushChunk(const uint32_t* chunk_cv) {
+  uint32_t cv[8];
+  std::copy(chunk_cv, chunk_cv + 8, cv);
+
+  // Each trailing zero bit in the number of chunks completed so far marks a
+  // subtree that is now complete.
+  for (auto total_chunks = chunk_counter_ + 1; !(total_chunks & 1);
+       total_chunks >>= 1)
+    ParentChainingValue(cv_stack_[--cv_stack_size_], cv, 0, cv);
+
+  std::copy(cv, cv + 8, cv_stack_[cv_stack_size_++]);
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,56 @@
+#ifndef CANTERA_BLAKE3_H_
+#define CANTERA_BLAKE3_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cantera {
+namespace cas_internal {
+
+// Computes 256-bit BLAKE3 digests.  This is a portable implementation, which
+// hashes one 1 KiB chunk at a time.
+class BLAKE3 {
+ public:
+  static const size_t kDigestSize = 32;
+
+  static void Digest(const void* data, size_t size, uint8_t* digest) {
+    BLAKE3 blake3;
+    blake3.Add(data, size);
+    blake3.Finish(digest);
+  }
+
+  BLAKE3();
+
+  void Add(const void* data, size_t size);
+
+  // Writes the `kDigestSize` byte digest to `digest`.
+  void Finish(uint8_t* digest);
+
+ private:
+  static const size_t kBlockSize = 64;
+  static const size_t kChunkSize = 1024;
+
+  // Returns the chaining value of the current chunk, which must be complete.
+  void ChunkChainingValue(uint32_t* cv) const;
+
+  // Adds the chaining value of a completed chunk to the stack, merging
+  // subtrees that are complete.
+  void PushChunk(const uint32_t* cv);
+
+  // State of the chunk being hashed.
+  uint32_t chunk_cv_[8];
+  uint64_t chunk_counter_ = 0;
+  uint8_t block_[kBlockSize];
+  size_t block_size_ = 0;
+  size_t blocks_compressed_ = 0;
+
+  // Chaining values of complete subtrees, one for each bit set in
+  // `chunk_counter_`.
+  uint32_t cv_stack_[54][8];
+  size_t cv_stack_size_ = 0;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_BLAKE3_H_
@@ -0,0 +1,131 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/bloom-filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+#include <endian.h>
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+const unsigned int kMaxHashCount = 32;
+
+// Returns the first probe and the distance between probes for `key`.
+std::pair<uint64_t, uint64_t> Hashes(const CASKey& key) {
+  uint64_t h1, h2;
+  memcpy(&h1, key.data() + 4, sizeof(h1));
+  memcpy(&h2, key.data() + 12, sizeof(h2));
+  return std::make_pair(le64toh(h1), le64toh(h2) | 1);
+}
+
+uint64_t Reduce(uint64_t hash, uint64_t range) {
+  return (static_cast<unsigned __int128>(hash) * range) >> 64;
+}
+
+}  // namespace
+
+BloomFilter::BloomFilter(size_t key_count, double false_positive_rate) {
+  KJ_REQUIRE(false_positive_rate > 0.0 && false_positive_rate < 1.0,
+             false_positive_rate);
+
+  const auto bits_per_key = BytesPerKey(false_positive_rate) * 8.0;
+
+  // Whole 64-bit words, so that the filter is never empty.
+  const auto words =
+      std::ceil(std::max<size_t>(key_count, 1) * bits_per_key / 64.0);
+  bit_count_ = static_cast<uint64_t>(words) * 64;
+  bits_.resize(bit_count_ / 8);
+
+  hash_count_ = std::clamp<unsigned int>(std::lround(bits_per_key * M_LN2), 1,
+                                         kMaxHashCount);
+}
+
+BloomFilter::BloomFilter(kj::ArrayPtr<const uint8_t> bits,
+                         unsigned int hash_count)
+    : bits_(bits.begin(), bits.end()),
+      bit_count_(bits.size() * UINT64_C(8)),
+      hash_count_(hash_count) {
+  KJ_REQUIRE(!bits_.empty());
+  KJ_REQUIRE(hash_count_ >= 1 && hash_count_ <= kMaxHashCount, hash_count_);
+}
+
+void BloomFilter::Insert(const CASKey& key) {
+  auto [hash, step] = Hashes(key);
+
+  for (unsigned int i = 0; i < hash_count_; ++i, hash += step) {
+    const auto bit = Reduce(hash, bit_count_);
+    bits_[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+bool BloomFilter::Contains(const CASKey& key) const {
+  auto [hash, step] = Hashes(key);
+
+  for (unsigned int i = 0; i < hash_count_; ++i, hash += step) {
+    const auto bit = Reduce(hash, bit_count_);
+    if (!(bits_[bit / 8] & (1 << (bit % 8)))) return false;
+  }
+
+  return true;
+}
+
+double BloomFilter::BytesPerKey(double false_positive_rate) {
+  return -std::log(false_positive_rate) / (M_LN2 * M_LN2) / 8.0;
+}
+
+uint32_t KeyPrefix(const CASKey& key, unsigned int bits) {
+  KJ_REQUIRE(bits <= 32, bits);
+  if (!bits) return 0;
+
+  uint32_t result;
+  memcpy(&result, key.data(), sizeof(result));
+
+  return be32toh(result) >> (32 - bits);
+}
+
+std::pair<CASKey, CASKey> PrefixRange(unsigned int bits, uint32_t prefix) {
+  KJ_REQUIRE(bits <= 32, bits);
+
+  const uint64_t span = UINT64_C(1) << (32 - bits);
+  KJ_REQUIRE(prefix < (UINT64_C(1) << bits), prefix, bits);
+
+  const uint32_t first_prefix = htobe32(prefix * span);
+  const uint32_t last_prefix = htobe32(prefix * span + span - 1);
+
+  std::pair<CASKey, CASKey> result;
+  result.first.fill(0);
+  result.second.fill(0xff);
+  memcpy(result.first.data(), &first_prefix, sizeof(first_prefix));
+  memcpy(result.second.data(), &last_prefix, sizeof(last_prefix));
+
+  return result;
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
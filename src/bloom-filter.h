@@ -0,0 +1,64 @@
+#ifndef CANTERA_BLOOM_FILTER_H_
+#define CANTERA_BLOOM_FILTER_H_ 1
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <kj/array.h>
+
+#include "key.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Bloom filter of object keys, used to mark live objects in garbage
+// collection by sending a few bits per object instead of their keys.
+//
+// Keys are digests, so their bytes are used as hashes directly: with `h1` and
+// `h2` being the little endian 64-bit integers at offsets 4 and 12 of the
+// key, `h2` with its lowest bit set, and `m` the number of bits, probe `i` is
+// bit `((h1 + i * h2) * m) >> 64` in 128-bit arithmetic.  Bit `b` is bit
+// `b % 8` of byte `b / 8`.  The first four bytes are left out, since callers
+// often split keys into filters by their leading bits.
+class BloomFilter {
+ public:
+  // Sizes the filter to hold `key_count` keys with the given false positive
+  // rate.
+  BloomFilter(size_t key_count, double false_positive_rate);
+
+  // Uses the bits of a filter built elsewhere.
+  BloomFilter(kj::ArrayPtr<const uint8_t> bits, unsigned int hash_count);
+
+  void Insert(const CASKey& key);
+
+  // Returns true if `key` may have been inserted, and false if it definitely
+  // has not.
+  bool Contains(const CASKey& key) const;
+
+  const std::vector<uint8_t>& Bits() const { return bits_; }
+
+  unsigned int HashCount() const { return hash_count_; }
+
+  // Returns the number of bytes needed per key for the given false positive
+  // rate.
+  static double BytesPerKey(double false_positive_rate);
+
+ private:
+  std::vector<uint8_t> bits_;
+  uint64_t bit_count_;
+
+  unsigned int hash_count_;
+};
+
+// Returns the leading `bits` bits of `key`, by which keys are split over
+// several filters.  `bits` must be at most 32.
+uint32_t KeyPrefix(const CASKey& key, unsigned int bits);
+
+// Returns the first and last key whose leading `bits` bits equal `prefix`.
+std::pair<CASKey, CASKey> PrefixRange(unsigned int bits, uint32_t prefix);
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_BLOOM_FILTER_H_
@@ -0,0 +1,97 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <random>
+#include <vector>
+
+#include "bloom-filter.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+namespace {
+
+CASKey RandomKey(std::mt19937_64& rng) {
+  CASKey key;
+  for (auto& b : key) b = rng();
+  return key;
+}
+
+}  // namespace
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  static const size_t kKeyCount = 10000;
+
+  std::mt19937_64 rng;
+  BloomFilter filter(kKeyCount, 0.01);
+
+  std::vector<CASKey> keys;
+  for (size_t i = 0; i < kKeyCount; ++i) {
+    keys.emplace_back(RandomKey(rng));
+    filter.Insert(keys.back());
+  }
+
+  for (const auto& key : keys) EXPECT_TRUE(filter.Contains(key));
+
+  // A copy made from the bits gives the same answers.
+  const BloomFilter copy(
+      kj::arrayPtr(filter.Bits().data(), filter.Bits().size()),
+      filter.HashCount());
+  for (const auto& key : keys) EXPECT_TRUE(copy.Contains(key));
+}
+
+TEST(BloomFilterTest, FalsePositiveRate) {
+  static const size_t kKeyCount = 100000;
+
+  std::mt19937_64 rng;
+
+  for (const auto rate : {0.1, 0.01, 0.001}) {
+    BloomFilter filter(kKeyCount, rate);
+
+    for (size_t i = 0; i < kKeyCount; ++i) filter.Insert(RandomKey(rng));
+
+    size_t false_positives = 0;
+    for (size_t i = 0; i < kKeyCount; ++i)
+      false_positives += filter.Contains(RandomKey(rng));
+
+    EXPECT_LT(false_positives, kKeyCount * rate * 1.5) << rate;
+    EXPECT_NEAR(BloomFilter::BytesPerKey(rate) * kKeyCount,
+                filter.Bits().size(), 8)
+        << rate;
+  }
+
+  // Much smaller than the 20 bytes of a key.
+  EXPECT_LT(BloomFilter::BytesPerKey(0.01), 1.25);
+}
+
+TEST(BloomFilterTest, PrefixRange) {
+  std::mt19937_64 rng;
+
+  for (const auto bits : {0U, 1U, 7U, 12U, 32U}) {
+    for (size_t i = 0; i < 100; ++i) {
+      const auto key = RandomKey(rng);
+      const auto prefix = KeyPrefix(key, bits);
+
+      const auto range = PrefixRange(bits, prefix);
+      EXPECT_FALSE(key < range.first) << bits;
+      EXPECT_FALSE(range.second < key) << bits;
+
+      EXPECT_EQ(prefix, KeyPrefix(range.first, bits));
+      EXPECT_EQ(prefix, KeyPrefix(range.second, bits));
+    }
+  }
+}
@@ -0,0 +1,226 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/bulk-channel.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+// How long to wait for a client to make room for more data, in milliseconds.
+const int kSendTimeoutMsec = 60'000;
+
+// Largest amount of data passed to a single `sendfile(2)` call.
+const size_t kMaxSendfileSize = 64 << 20;
+
+// Waits until `socket` has room for more data.
+void WaitWritable(int socket) {
+  pollfd pfd;
+  pfd.fd = socket;
+  pfd.events = POLLOUT;
+
+  int ret;
+  KJ_SYSCALL(ret = poll(&pfd, 1, kSendTimeoutMsec));
+  KJ_REQUIRE(ret > 0, "Timed out writing to bulk transfer channel");
+}
+
+}  // namespace
+
+uint64_t BulkChannelRegistry::Add(int fd) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  uint64_t id;
+  do {
+    id = static_cast<uint64_t>(random_()) << 32 | random_();
+  } while (!id || channels_.count(id));
+
+  channels_.emplace(id, fd);
+
+  return id;
+}
+
+kj::AutoCloseFd BulkChannelRegistry::Open(uint64_t id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  auto i = channels_.find(id);
+  if (i == channels_.end()) return kj::AutoCloseFd();
+
+  int fd;
+  KJ_SYSCALL(fd = fcntl(i->second, F_DUPFD_CLOEXEC, 0));
+
+  return kj::AutoCloseFd(fd);
+}
+
+void BulkChannelRegistry::Remove(uint64_t id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  channels_.erase(id);
+}
+
+struct BulkChannelListener::Channel {
+  Channel(BulkChannelRegistry& registry, kj::AutoCloseFd fd)
+      : registry(registry),
+        fd(std::move(fd)),
+        id(registry.Add(this->fd.get())) {}
+
+  // Removes the channel before its descriptor is closed, so that no more
+  // copies of it are handed out.
+  ~Channel() { registry.Remove(id); }
+
+  BulkChannelRegistry& registry;
+
+  kj::AutoCloseFd fd;
+
+  const uint64_t id;
+
+  kj::Own<kj::AsyncIoStream> stream;
+  char byte;
+};
+
+BulkChannelListener::BulkChannelListener(kj::AsyncIoContext& aio_context,
+                                         BulkChannelRegistry& registry,
+                                         kj::AutoCloseFd listen_fd)
+    : provider_(*aio_context.lowLevelProvider),
+      registry_(registry),
+      listen_fd_(std::move(listen_fd)),
+      listen_observer_(aio_context.unixEventPort, listen_fd_.get(),
+                       kj::UnixEventPort::FdObserver::OBSERVE_READ),
+      tasks_(*this) {
+  int flags;
+  KJ_SYSCALL(flags = fcntl(listen_fd_.get(), F_GETFL));
+  KJ_SYSCALL(fcntl(listen_fd_.get(), F_SETFL, flags | O_NONBLOCK));
+}
+
+kj::Promise<void> BulkChannelListener::AcceptLoop() {
+  return listen_observer_.whenBecomesReadable().then([this] {
+    // The observer is edge triggered, so accept everything that is waiting.
+    for (;;) {
+      const auto fd = accept4(listen_fd_.get(), nullptr, nullptr,
+                              SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+      if (fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+
+        if (errno == EMFILE || errno == ENFILE) {
+          syslog(LOG_WARNING, "Unable to accept bulk transfer channel: %s",
+                 strerror(errno));
+          break;
+        }
+
+        KJ_FAIL_SYSCALL("accept4", errno);
+      }
+
+      tasks_.add(ServeChannel(kj::AutoCloseFd(fd)));
+    }
+
+    return AcceptLoop();
+  });
+}
+
+void BulkChannelListener::taskFailed(kj::Exception&& e) {
+  syslog(LOG_WARNING, "Bulk transfer channel failed: %s:%d: %s", e.getFile(),
+         e.getLine(), e.getDescription().cStr());
+}
+
+kj::Promise<void> BulkChannelListener::ServeChannel(kj::AutoCloseFd fd) {
+  auto channel = kj::heap<Channel>(registry_, std::move(fd));
+
+  const uint64_t id = htole64(channel->id);
+
+  // A new connection always has room for this much data.
+  ssize_t ret;
+  KJ_SYSCALL(ret = send(channel->fd.get(), &id, sizeof(id), MSG_NOSIGNAL));
+  KJ_REQUIRE(ret == sizeof(id), ret);
+
+  channel->stream = provider_.wrapSocketFd(
+      channel->fd.get(), kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+                       kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+
+  // Clients never send anything, so any input means they are done with the
+  // channel.
+  auto& channel_ref = *channel;
+  return channel_ref.stream->tryRead(&channel_ref.byte, 1, 1)
+      .then([](size_t) {}, [](kj::Exception&&) {})
+      .attach(std::move(channel));
+}
+
+void SendBulk(int socket, int fd, uint64_t offset, uint64_t size) {
+  try {
+    const uint64_t header = htole64(size);
+    size_t header_offset = 0;
+
+    while (header_offset < sizeof(header)) {
+      const auto ret =
+          send(socket, reinterpret_cast<const char*>(&header) + header_offset,
+               sizeof(header) - header_offset, MSG_NOSIGNAL);
+
+      if (ret == -1) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          KJ_FAIL_SYSCALL("send", errno);
+        WaitWritable(socket);
+        continue;
+      }
+
+      header_offset += ret;
+    }
+
+    auto file_offset = static_cast<off_t>(offset);
+
+    while (size > 0) {
+      const auto ret =
+          sendfile(socket, fd, &file_offset,
+                   std::min(size, static_cast<uint64_t>(kMaxSendfileSize)));
+
+      if (ret == -1) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          KJ_FAIL_SYSCALL("sendfile", errno);
+        WaitWritable(socket);
+        continue;
+      }
+
+      KJ_REQUIRE(ret > 0, "Unexpected end of data file", file_offset, size);
+
+      size -= ret;
+    }
+  } catch (...) {
+    shutdown(socket, SHUT_RDWR);
+    throw;
+  }
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,95 @@
+#ifndef CANTERA_BULK_CHANNEL_H_
+#define CANTERA_BULK_CHANNEL_H_ 1
+
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+
+#include <kj/async-io.h>
+#include <kj/async-unix.h>
+#include <kj/io.h>
+
+namespace cantera {
+namespace cas_internal {
+
+// Bulk transfer channels are plain TCP connections on which a storage server
+// sends object data straight from its data files with `sendfile(2)`, instead
+// of copying it through Cap'n Proto messages.
+//
+// A client opens a channel by connecting to the port returned by
+// `getBulkPort`.  The server replies with a 64-bit little endian channel ID,
+// which the client passes to `get`.  If the server decides to use the
+// channel, it writes the object size as a 64-bit little endian integer,
+// followed by the data.  Clients send nothing, and must not pass the same
+// channel to more than one `get` at a time.
+
+// Keeps track of the open channels of a process.  Channels are accepted by
+// one thread, but may be used by the storage server of any shard.
+class BulkChannelRegistry {
+ public:
+  BulkChannelRegistry() = default;
+
+  KJ_DISALLOW_COPY(BulkChannelRegistry);
+
+  // Registers the channel with socket `fd`, and returns its ID.  The caller
+  // keeps ownership of `fd`, and must call `Remove()` before closing it.
+  uint64_t Add(int fd);
+
+  // Returns a new descriptor for the socket of channel `id`, or an invalid
+  // descriptor if there is no such channel.
+  kj::AutoCloseFd Open(uint64_t id);
+
+  void Remove(uint64_t id);
+
+ private:
+  std::mutex mutex_;
+
+  std::unordered_map<uint64_t, int> channels_;
+
+  // Channel IDs are hard to guess, so that clients can't send data to each
+  // other's channels.
+  std::random_device random_;
+};
+
+// Accepts channels on a listening socket, and removes them from the registry
+// once the client disconnects.
+class BulkChannelListener : private kj::TaskSet::ErrorHandler {
+ public:
+  BulkChannelListener(kj::AsyncIoContext& aio_context,
+                      BulkChannelRegistry& registry,
+                      kj::AutoCloseFd listen_fd);
+
+  KJ_DISALLOW_COPY(BulkChannelListener);
+
+  kj::Promise<void> AcceptLoop();
+
+ private:
+  struct Channel;
+
+  void taskFailed(kj::Exception&& e) override;
+
+  // Sends the channel ID to a newly accepted client, and waits for it to
+  // disconnect.
+  kj::Promise<void> ServeChannel(kj::AutoCloseFd fd);
+
+  kj::LowLevelAsyncIoProvider& provider_;
+
+  BulkChannelRegistry& registry_;
+
+  kj::AutoCloseFd listen_fd_;
+  kj::UnixEventPort::FdObserver listen_observer_;
+
+  kj::TaskSet tasks_;
+};
+
+// Writes `size` as a 64-bit little endian integer to the socket `socket`,
+// followed by `size` bytes from `fd` starting at `offset`, blocking until
+// done.  On failure, the socket is shut down, so that the receiver does not
+// mistake what follows for another object.
+void SendBulk(int socket, int fd, uint64_t offset, uint64_t size);
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_BULK_CHANNEL_H_
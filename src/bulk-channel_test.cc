@@ -0,0 +1,113 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <random>
+#include <string>
+#include <thread>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <kj/debug.h>
+
+#include "bulk-channel.h"
+#include "io.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+TEST(BulkChannelTest, Registry) {
+  BulkChannelRegistry registry;
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  kj::AutoCloseFd local(fds[0]), remote(fds[1]);
+
+  const auto id = registry.Add(local.get());
+  EXPECT_NE(0U, id);
+
+  // The descriptor handed out refers to the same socket.
+  auto channel = registry.Open(id);
+  ASSERT_NE(-1, channel.get());
+  EXPECT_NE(local.get(), channel.get());
+  ASSERT_EQ(1, write(channel.get(), "x", 1));
+  char byte;
+  ASSERT_EQ(1, read(remote.get(), &byte, 1));
+  EXPECT_EQ('x', byte);
+
+  EXPECT_EQ(-1, registry.Open(id + 1).get());
+
+  registry.Remove(id);
+  EXPECT_EQ(-1, registry.Open(id).get());
+}
+
+// Sends a range of a file through a socket that fills up, to make sure
+// sending resumes once the receiver catches up.
+TEST(BulkChannelTest, SendBulk) {
+  std::mt19937 rng;
+
+  std::string data(3 << 20, 0);
+  for (auto& ch : data) ch = rng();
+
+  auto file = AnonTemporaryFile(nullptr);
+  WriteWithOffset(file.get(), data.data(), data.size(), 0);
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  kj::AutoCloseFd sender(fds[0]), receiver(fds[1]);
+  ASSERT_EQ(0, fcntl(sender.get(), F_SETFL, O_NONBLOCK));
+
+  const size_t offset = 12345, size = data.size() - 2 * offset;
+
+  std::string received;
+  std::thread reader([&received, &receiver] {
+    char buffer[65536];
+    ssize_t ret;
+    while (0 < (ret = read(receiver.get(), buffer, sizeof(buffer))))
+      received.append(buffer, ret);
+  });
+
+  SendBulk(sender.get(), file.get(), offset, size);
+  sender = kj::AutoCloseFd();
+  reader.join();
+
+  ASSERT_EQ(8 + size, received.size());
+
+  uint64_t header;
+  memcpy(&header, received.data(), sizeof(header));
+  EXPECT_EQ(size, le64toh(header));
+  EXPECT_TRUE(received.compare(8, size, data, offset, size) == 0);
+}
+
+// Verifies that the channel is shut down if the data is not available, so that
+// the receiver doesn't wait for it forever.
+TEST(BulkChannelTest, SendBulkPastEnd) {
+  auto file = AnonTemporaryFile(nullptr);
+  WriteWithOffset(file.get(), "abc", 3, 0);
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  kj::AutoCloseFd sender(fds[0]), receiver(fds[1]);
+
+  EXPECT_ANY_THROW(SendBulk(sender.get(), file.get(), 0, 10));
+
+  char buffer[16];
+  EXPECT_EQ(8 + 3, read(receiver.get(), buffer, sizeof(buffer)));
+  EXPECT_EQ(0, read(receiver.get(), buffer, sizeof(buffer)));
+}
@@ -42,7 +42,11 @@
 
 #include <kj/debug.h>
 
+#include "src/hasher.h"
+#include "src/index-log.h"
 #include "src/io.h"
+#include "src/object-index.h"
+#include "src/pack-block.h"
 #include "src/sha1.h"
 #include "src/storage-server.h"
 #include "src/util.h"
@@ -76,16 +80,21 @@ OutputIterator RandomSample(ForwardIterator first, ForwardIterator last,
   return out;
 }
 
-const auto kBucketMask = UINT64_C(0x3f00000000000000);
-const auto kDeletedMask = UINT64_C(0x8000000000000000);
-const auto kOffsetMask = UINT64_C(0x00ffffffffffffff);
-
 // Number of objects to verify in each CAS repository.  The objects are
 // randomly selected, so that repeated runs improve the coverage.  By making
 // this an absolute number rather than a fraction, the running time of a check
 // remains predictable.
 size_t num_sha1_verify = 10000;
 
+// Number of pack blocks whose directories are compared with the index in each
+// CAS repository, also randomly selected.
+const size_t kNumPackBlockVerify = 1000;
+
+// Maximum number of objects, and total size of objects, whose digests are
+// verified together.
+const size_t kVerifyBatchSize = 64;
+const size_t kVerifyBatchBytes = 16 << 20;
+
 int print_version;
 int print_help;
 
@@ -97,17 +106,128 @@ struct option long_options[] = {{"version", no_argument, &print_version, 1},
                                 {"help", no_argument, &print_help, 1},
                                 {0, 0, 0, 0}};
 
+// Objects in `index` lying within the same pack block.
+struct PackBlockEntries {
+  uint64_t offset;
+  std::vector<IndexEntry>::const_iterator begin, end;
+};
+
+// Finds the ranges of `index`, which must be sorted by offset, that may be
+// stored in pack blocks: objects small enough to be packed, within an aligned
+// block that no other object overlaps the start of.
+std::vector<PackBlockEntries> FindPackBlocks(
+    const std::vector<IndexEntry>& index) {
+  std::vector<PackBlockEntries> result;
+
+  // End of the furthest reaching object seen so far.  The data file number in
+  // the upper bits keeps objects in different files apart.
+  uint64_t covered_end = 0;
+
+  for (auto i = index.begin(); i != index.end();) {
+    const auto block = i->offset / kPackBlockSize * kPackBlockSize;
+
+    bool packable = i->offset != block && covered_end <= block;
+
+    auto j = i;
+    for (; j != index.end() && j->offset < block + kPackBlockSize; ++j) {
+      if (j->size > kMaxPackedObjectSize ||
+          j->offset + j->size > block + kPackBlockSize)
+        packable = false;
+      covered_end = std::max(covered_end, j->offset + j->size);
+    }
+
+    if (packable) result.push_back({block, i, j});
+
+    i = j;
+  }
+
+  return result;
+}
+
+// Verifies that every index entry within the block is listed in its
+// directory.  The directory may also list objects that have since been
+// removed or moved by compaction.
+void CheckPackBlock(const std::vector<kj::AutoCloseFd>& data_fds,
+                    const PackBlockEntries& block) {
+  const auto data_file_idx = (block.offset & kBucketMask) >> 56;
+  const auto offset = block.offset & kOffsetMask;
+  const auto fd = data_fds[data_file_idx].get();
+
+  // Objects that were never packed may also share a block.
+  if (!IsPackBlock(fd, offset)) return;
+
+  KJ_CONTEXT(data_file_idx, offset);
+
+  auto directory = ReadPackBlock(fd, offset);
+  std::sort(directory.begin(), directory.end(),
+            [](const auto& lhs, const auto& rhs) { return lhs.key < rhs.key; });
+
+  for (auto i = block.begin; i != block.end; ++i) {
+    auto entry = std::lower_bound(
+        directory.begin(), directory.end(), i->key,
+        [](const auto& lhs, const CASKey& rhs) { return lhs.key < rhs; });
+
+    KJ_REQUIRE(entry != directory.end() && entry->key == i->key,
+               "object missing from pack block directory", i->key.ToString());
+    KJ_REQUIRE(entry->offset == (i->offset & kOffsetMask) &&
+                   entry->size == i->size,
+               "pack block directory disagrees with index", i->key.ToString(),
+               entry->offset, entry->size, i->offset & kOffsetMask, i->size);
+  }
+}
+
 std::exception_ptr CheckRepository(std::string path) {
   try {
     KJ_CONTEXT(path);
 
     auto dir_fd = cas_internal::OpenFile(path.c_str(), O_RDONLY | O_DIRECTORY);
-    auto index_fd = cas_internal::OpenFile(dir_fd.get(), "index", O_RDONLY);
 
-    off_t index_size;
-    KJ_SYSCALL(index_size = lseek(index_fd.get(), 0, SEEK_END));
+    std::unique_lock<std::mutex> memory_lock(big_memory);
 
-    if (!index_size) return nullptr;
+    std::vector<IndexEntry> index;
+
+    // Shards own disjoint sets of keys, so their indexes can simply be
+    // concatenated.
+    const auto shard_count = StorageServer::ShardCount(dir_fd.get());
+
+    for (size_t shard = 0; shard < shard_count; ++shard) {
+      const auto log_name = StorageServer::IndexLogName(shard, shard_count);
+      const auto base_name = StorageServer::IndexBaseName(shard, shard_count);
+
+      IndexSegment base;
+      const auto base_fd = openat(dir_fd.get(), base_name.c_str(), O_RDONLY);
+      if (base_fd != -1) {
+        kj::AutoCloseFd base_fd_closer(base_fd);
+        base = IndexSegment(base_fd);
+        base.Verify();
+      } else if (errno != ENOENT) {
+        KJ_FAIL_SYSCALL("openat", errno, base_name);
+      }
+
+      ObjectIndex object_index;
+      object_index.SetBase(std::move(base));
+
+      const auto index_fd = openat(dir_fd.get(), log_name.c_str(), O_RDONLY);
+      if (index_fd != -1) {
+        kj::AutoCloseFd index_fd_closer(index_fd);
+
+        cas_internal::ReadIndexLog(
+            index_fd, [&object_index](const IndexEntry& item) {
+              if (item.offset & kDeletedMask)
+                object_index.Erase(item.key);
+              else
+                object_index.Insert(item);
+            });
+      } else if (errno != ENOENT) {
+        KJ_FAIL_SYSCALL("openat", errno, log_name);
+      }
+
+      index.reserve(index.size() + object_index.size());
+      object_index.ForEach(
+          [&index](const IndexEntry& entry) { index.emplace_back(entry); });
+    }
+
+    if (index.empty()) return nullptr;
 
     std::vector<kj::AutoCloseFd> data_fds;
     std::vector<uint64_t> data_sizes;
@@ -123,33 +243,27 @@ std::exception_ptr CheckRepository(std::string path) {
       data_sizes.emplace_back(data_size);
     }
 
-    std::unique_lock<std::mutex> memory_lock(big_memory);
-
-    std::vector<StorageServer::IndexEntry> index;
-    index.resize(index_size / sizeof(StorageServer::IndexEntry));
+    // Order index entries by offset in order to minimize seeks.  Sampling
+    // preserves the order.
+    std::sort(index.begin(), index.end(), [](const auto& lhs, const auto& rhs) {
+      return lhs.offset < rhs.offset;
+    });
 
-    cas_internal::ReadWithOffset(
-        index_fd.get(), index.data(),
-        index.size() * sizeof(StorageServer::IndexEntry), 0);
+    std::mt19937_64 strong_rng{std::random_device{}()};
 
-    // Remove duplicate entries in index, keeping the last instance.
-    std::stable_sort(
-        index.begin(), index.end(),
-        [](const auto& lhs, const auto& rhs) { return lhs.key < rhs.key; });
-    auto new_begin = std::unique(
-        index.rbegin(), index.rend(),
-        [](const auto& lhs, const auto& rhs) { return lhs.key == rhs.key; });
-    index.erase(index.begin(), new_begin.base());
+    // Finding pack blocks takes the whole index, since objects outside the
+    // sample may overlap them.
+    {
+      auto pack_blocks = FindPackBlocks(index);
+      pack_blocks.erase(
+          RandomSample(pack_blocks.begin(), pack_blocks.end(),
+                       pack_blocks.begin(), kNumPackBlockVerify, strong_rng),
+          pack_blocks.end());
 
-    // Remove deleted objects.
-    index.erase(
-        std::remove_if(index.begin(), index.end(),
-                       [](const auto& v) { return (v.offset & kDeletedMask); }),
-        index.end());
+      for (const auto& block : pack_blocks) CheckPackBlock(data_fds, block);
+    }
 
     if (index.size() > num_sha1_verify) {
-      std::mt19937_64 strong_rng{std::random_device{}()};
-
       index.erase(RandomSample(index.begin(), index.end(), index.begin(),
                                num_sha1_verify, strong_rng),
                   index.end());
@@ -158,13 +272,54 @@ std::exception_ptr CheckRepository(std::string path) {
     index.shrink_to_fit();
     memory_lock.unlock();
 
-    // Order index entries by offset in order to minimize seeks.
-    std::sort(index.begin(), index.end(), [](const auto& lhs, const auto& rhs) {
-      return lhs.offset < rhs.offset;
-    });
-
+    // Objects are read in batches, whose digests are computed together.
+    std::vector<const IndexEntry*> batch;
     std::vector<char> buffer;
 
+    const auto verify_batch = [&batch, &buffer] {
+      std::vector<const void*> data;
+      std::vector<size_t> sizes;
+      for (size_t i = 0, offset = 0; i < batch.size(); ++i) {
+        data.emplace_back(buffer.data() + offset);
+        sizes.emplace_back(batch[i]->size);
+        offset += batch[i]->size;
+      }
+
+      // SHA-1 digests are computed together, and others one at a time.  Keys
+      // of other algorithms are the first 20 bytes of the digest.
+      std::vector<std::array<uint8_t, 20>> digests(batch.size());
+      std::vector<const void*> sha1_data;
+      std::vector<size_t> sha1_sizes;
+      std::vector<uint8_t*> sha1_digests;
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        const auto algorithm = EntryAlgorithm(*batch[i]);
+
+        if (algorithm == KeyAlgorithm::kSHA1) {
+          sha1_data.emplace_back(data[i]);
+          sha1_sizes.emplace_back(sizes[i]);
+          sha1_digests.emplace_back(digests[i].begin());
+          continue;
+        }
+
+        const auto key =
+            cas_internal::Hasher::Digest(algorithm, data[i], sizes[i]);
+        std::copy(key.digest.begin(), key.digest.begin() + digests[i].size(),
+                  digests[i].begin());
+      }
+
+      cas_internal::SHA1::DigestBatch(sha1_data.size(), sha1_data.data(),
+                                      sha1_sizes.data(), sha1_digests.data());
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        KJ_REQUIRE(std::equal(digests[i].begin(), digests[i].end(),
+                              batch[i]->key.begin(), batch[i]->key.end()));
+      }
+
+      batch.clear();
+      buffer.clear();
+    };
+
     for (auto i = index.begin(); i != index.end(); ++i) {
       if (i->offset & kDeletedMask) continue;
 
@@ -173,17 +328,21 @@ std::exception_ptr CheckRepository(std::string path) {
 
       KJ_REQUIRE(offset + i->size <= data_sizes[data_file_idx]);
 
-      buffer.resize(i->size);
+      if (!batch.empty() && (batch.size() == kVerifyBatchSize ||
+                             buffer.size() + i->size > kVerifyBatchBytes))
+        verify_batch();
 
-      cas_internal::ReadWithOffset(data_fds[data_file_idx].get(), buffer.data(),
-                                   i->size, offset);
+      const auto buffer_offset = buffer.size();
+      buffer.resize(buffer_offset + i->size);
 
-      std::array<uint8_t, 20> digest;
-      cas_internal::SHA1::Digest(buffer, digest.begin());
+      cas_internal::ReadWithOffset(data_fds[data_file_idx].get(),
+                                   buffer.data() + buffer_offset, i->size,
+                                   offset);
 
-      KJ_REQUIRE(std::equal(digest.begin(), digest.end(), i->key.begin(),
-                            i->key.end()));
+      batch.emplace_back(&*i);
     }
+
+    if (!batch.empty()) verify_batch();
   } catch (...) {
     return std::current_exception();
   }
@@ -75,13 +75,20 @@ uint64_t max_size = std::numeric_limits<uint64_t>::max();
 cantera::ColumnFileCompression compression =
     cantera::kColumnFileCompressionDefault;
 std::vector<std::string> exclude_paths;
+KeyAlgorithm key_algorithm = KeyAlgorithm::kSHA1;
+
+// If non-zero, `mark-gc` sends Bloom filters with this false positive rate
+// instead of keys.
+double mark_filter_rate = 0.0;
 
 std::unique_ptr<kj::AsyncIoContext> aio_context;
 
 enum Option : int {
   kOptionCompression = 'c',
   kOptionExclude = 'e',
+  kOptionKeyAlgorithm = 'k',
   kOptionListMode = 'L',
+  kOptionMarkFilter = 'F',
   kOptionMaxSize = 'M',
   kOptionMinSize = 'm',
   kOptionServerAddress = 's',
@@ -90,7 +97,9 @@ enum Option : int {
 struct option kLongOptions[] = {
     {"compression", required_argument, nullptr, kOptionCompression},
     {"exclude", required_argument, nullptr, kOptionExclude},
+    {"key-algorithm", required_argument, nullptr, kOptionKeyAlgorithm},
     {"list-mode", required_argument, nullptr, kOptionListMode},
+    {"mark-filter", required_argument, nullptr, kOptionMarkFilter},
     {"keys-only", no_argument, &keys_only, 1},
     {"max-size", required_argument, nullptr, kOptionMaxSize},
     {"min-size", required_argument, nullptr, kOptionMinSize},
@@ -324,11 +333,42 @@ bool BeginGC(CASClient* client, char** argv, int argc) {
 bool MarkGC(CASClient* client, char** argv, int argc) {
   client->OnConnect().wait(aio_context->waitScope);
 
-  std::vector<CASKey> keys;
+  if (mark_filter_rate > 0.0) {
+    std::vector<CASKey> keys;
+
+    if (argc == 0) {
+      ReadLines<std::string_view>(STDIN_FILENO, [&keys](auto&& line) {
+        keys.emplace_back(CASKey::FromString(line));
+      });
+    } else {
+      for (int i = 0; i < argc; ++i)
+        keys.emplace_back(CASKey::FromString(argv[i]));
+    }
+
+    CASClient::MarkGCFilter(client->RawClient(), keys, mark_filter_rate)
+        .wait(aio_context->waitScope);
+
+    return true;
+  }
+
+  CASClient::MarkWriter writer(client->RawClient());
+
+  if (argc == 0) {
+    ReadLines<std::string_view>(STDIN_FILENO, [&writer](auto&& line) {
+      const auto key = CASKey::FromString(line);
+      writer.Write(kj::arrayPtr(&key, 1)).wait(aio_context->waitScope);
+    });
+  } else {
+    std::vector<CASKey> keys;
+
+    for (int i = 0; i < argc; ++i)
+      keys.emplace_back(CASKey::FromString(argv[i]));
 
-  for (int i = 0; i < argc; ++i) keys.emplace_back(CASKey::FromString(argv[i]));
+    writer.Write(kj::arrayPtr(keys.data(), keys.size()))
+        .wait(aio_context->waitScope);
+  }
 
-  client->MarkGC(keys).wait(aio_context->waitScope);
+  writer.Finish().wait(aio_context->waitScope);
 
   return true;
 }
@@ -433,6 +473,82 @@ bool Compact(CASClient* client, char** argv, int argc) {
   return true;
 }
 
+bool CompactionStatus(CASClient* client, char** argv, int argc) {
+  if (argc != 0) {
+    errx(EX_USAGE,
+         "The 'compaction-status' command takes exactly 0 arguments, %d given",
+         argc);
+  }
+
+  auto request = client->RawClient().getCompactionStatusRequest();
+  auto response = request.send().wait(client->WaitScope());
+  auto status = response.getStatus();
+
+  if (status.getActive()) {
+    printf("data-file   %" PRIu32
+           "\n"
+           "to-move     %" PRIu64
+           "\n"
+           "moved       %" PRIu64 "\n",
+           status.getDataFile(), status.getBytesToMove(),
+           status.getBytesMoved());
+  }
+
+  printf("reclaimed   %" PRIu64 "\n", status.getBytesReclaimed());
+
+  return true;
+}
+
+bool CacheStats(CASClient* client, char** argv, int argc) {
+  if (argc != 0) {
+    errx(EX_USAGE,
+         "The 'cache-stats' command takes exactly 0 arguments, %d given",
+         argc);
+  }
+
+  auto request = client->RawClient().getCacheStatsRequest();
+  auto response = request.send().wait(client->WaitScope());
+  auto stats = response.getStats();
+
+  printf("hits        %" PRIu64
+         "\n"
+         "misses      %" PRIu64
+         "\n"
+         "rejections  %" PRIu64
+         "\n"
+         "objects     %" PRIu64
+         "\n"
+         "size        %" PRIu64
+         "\n"
+         "capacity    %" PRIu64 "\n",
+         stats.getHits(), stats.getMisses(), stats.getRejections(),
+         stats.getObjects(), stats.getSize(), stats.getCapacity());
+
+  return true;
+}
+
+// Records `ring` as the placement of every backend, or if `conditional` is
+// set, of those still recording `expected`.  Returns the number of backends
+// recording `ring` afterwards.
+size_t SetPlacements(const std::vector<ShardingInfo::Backend>& backends,
+                     uint64_t ring, uint64_t expected, bool conditional) {
+  auto promises = kj::heapArrayBuilder<kj::Promise<bool>>(backends.size());
+
+  for (const auto& backend : backends) {
+    auto request = backend.client->RawClient().setPlacementRequest();
+    request.setRing(ring);
+    request.setExpected(expected);
+    request.setConditional(conditional);
+    promises.add(request.send().then(
+        [ring](auto response) { return response.getRing() == ring; }));
+  }
+
+  auto results =
+      kj::joinPromises(promises.finish()).wait(aio_context->waitScope);
+
+  return std::count(results.begin(), results.end(), true);
+}
+
 void Balance(char** argv, int argc) {
   if (argc != 1) {
     err(EX_USAGE, "The 'balance' command takes at exactly 1 argument, %d given",
@@ -446,6 +562,17 @@ void Balance(char** argv, int argc) {
   fprintf(stderr, "Got %zu buckets in %zu backends\n",
           sharding_info.BucketCount(), backends.size());
 
+  // Balancing servers record a placement of 0 on backends before writing
+  // objects to them out of place, so the fingerprint of the hash ring is
+  // only recorded where this token survives until every object is in place.
+  const auto ring = sharding_info.RingFingerprint();
+  uint64_t token = 0;
+  {
+    std::mt19937_64 rng{std::random_device{}()};
+    while (!token || token == ring) token = rng();
+  }
+  SetPlacements(backends, token, 0, false);
+
   std::vector<std::pair<CASKey, CASClient*>> object_presence;
 
   {
@@ -474,6 +601,10 @@ void Balance(char** argv, int argc) {
   std::vector<CASClient*> key_backends;
   size_t unique_objects = 0;
 
+  // Set to false if objects had to be placed elsewhere for a backend being
+  // disconnected.
+  bool in_place = true;
+
   RemovalQueue removals;
 
   {
@@ -489,7 +620,8 @@ void Balance(char** argv, int argc) {
       while (j != object_presence.end() && j->first == i->first) ++j;
 
       key_backends.clear();
-      sharding_info.GetWriteBackendsForKey(i->first, key_backends);
+      if (!sharding_info.GetWriteBackendsForKey(i->first, key_backends))
+        in_place = false;
       std::sort(key_backends.begin(), key_backends.end());
 
       auto a = key_backends.begin();
@@ -530,6 +662,17 @@ void Balance(char** argv, int argc) {
 
   moves.RunQueue(backends.size() * 2);
   removals.RunQueue(backends.size() * 10);
+
+  if (!in_place) {
+    fprintf(stderr, "Some objects could not be placed on disconnected "
+                    "backends; run again to finish balancing\n");
+    return;
+  }
+
+  const auto balanced = SetPlacements(backends, ring, token, true);
+
+  fprintf(stderr, "Recorded placement %016" PRIx64 " on %zu of %zu backends\n",
+          ring, balanced, backends.size());
 }
 
 bool Export(CASClient* client, char** argv, int argc) {
@@ -628,13 +771,14 @@ bool Import(CASClient* client, char** argv, int argc) {
   for (auto& reader : inputs) {
     reader.SetColumnFilter({1});
 
-    auto batch = kj::Vector<kj::Promise<void>>(100);
+    std::vector<std::string> batch;
 
     for (;;) {
       const bool at_end = reader.End();
 
       if (batch.size() == 100 || at_end) {
-        kj::joinPromises(batch.releaseAsArray()).wait(aio_context->waitScope);
+        std::vector<std::string_view> objects(batch.begin(), batch.end());
+        client->PutManyAsync(objects, false).wait(aio_context->waitScope);
 
         if (at_end) break;
 
@@ -647,7 +791,7 @@ bool Import(CASClient* client, char** argv, int argc) {
       KJ_REQUIRE(row[0].first == 1, row[0].first);
       KJ_REQUIRE(static_cast<bool>(row[0].second));
 
-      batch.add(client->PutAsync(*row[0].second, false).ignoreResult());
+      batch.emplace_back(*row[0].second);
     }
   }
 
@@ -686,6 +830,17 @@ int main(int argc, char** argv) try {
         }
       } break;
 
+      case kOptionKeyAlgorithm:
+        if (!strcmp(optarg, "sha1"))
+          key_algorithm = KeyAlgorithm::kSHA1;
+        else if (!strcmp(optarg, "sha256"))
+          key_algorithm = KeyAlgorithm::kSHA256;
+        else if (!strcmp(optarg, "blake3"))
+          key_algorithm = KeyAlgorithm::kBLAKE3;
+        else
+          errx(EX_USAGE, "Unknown key algorithm '%s'", optarg);
+        break;
+
       case kOptionListMode:
         if (!strcmp(optarg, "default"))
           list_mode = CAS::ListMode::DEFAULT;
@@ -695,6 +850,13 @@ int main(int argc, char** argv) try {
           errx(EX_USAGE, "Unknown list mode '%s'", optarg);
         break;
 
+      case kOptionMarkFilter: {
+        char* end;
+        mark_filter_rate = strtod(optarg, &end);
+        if (*end || !(mark_filter_rate > 0.0 && mark_filter_rate < 1.0))
+          errx(EX_USAGE, "Invalid false positive rate '%s'", optarg);
+      } break;
+
       case kOptionMaxSize:
         max_size = StringToUInt64(optarg);
         break;
@@ -714,6 +876,9 @@ int main(int argc, char** argv) try {
         "Usage: %s [OPTION]... COMMAND [ARGUMENT]...\n"
         "\n"
         "      --server=SERVER:PORT   connect to SERVER:PORT\n"
+        "      --key-algorithm=ALGO   hash function for the keys of new "
+        "objects:\n"
+        "                               sha1 (default), sha256 or blake3\n"
         "      --help     display this help and exit\n"
         "      --version  display version information and exit\n"
         "\n"
@@ -729,10 +894,18 @@ int main(int argc, char** argv) try {
         "Export options:\n"
         "      --keys-only            dump keys only (no data)\n"
         "\n"
+        "Garbage collection options:\n"
+        "      --mark-filter=RATE     mark objects with Bloom filters instead "
+        "of keys,\n"
+        "                               keeping a fraction RATE of the "
+        "garbage\n"
+        "\n"
         "Garbage collection commands:\n"
         "  begin-gc                   starts a garbage colleciton cycle\n"
         "                             and prints the ID required to end it\n"
-        "  mark-gc KEY...             marks objects as NOT garbage\n"
+        "  mark-gc [KEY]...           marks objects as NOT garbage; reads\n"
+        "                             keys from standard input if none are\n"
+        "                             given\n"
         "  end-gc ID                  removes all non-marked objects from the "
         "given\n"
         "                             cycle.  Reports a failure if another "
@@ -742,8 +915,10 @@ int main(int argc, char** argv) try {
         "Other commands:\n"
         "  balance CONFIG             ensures proper object placement after "
         "outage\n"
+        "  cache-stats                prints object cache statistics\n"
         "  capacity                   prints capacity figures\n"
         "  compact                    free disk space used by deleted objects\n"
+        "  compaction-status          prints the progress of compaction\n"
         "  export [PATH]...           export objects listed on standard input, "
         "or in\n"
         "                                the given files (subject to filters)\n"
@@ -783,10 +958,14 @@ int main(int argc, char** argv) try {
   if (command_name == "balance") {
     Balance(argv + optind, argc - optind);
     return EXIT_SUCCESS;
+  } else if (command_name == "cache-stats") {
+    command = CacheStats;
   } else if (command_name == "capacity") {
     command = Capacity;
   } else if (command_name == "compact") {
     command = Compact;
+  } else if (command_name == "compaction-status") {
+    command = CompactionStatus;
   } else if (command_name == "export") {
     command = Export;
   } else if (command_name == "import") {
@@ -813,6 +992,7 @@ int main(int argc, char** argv) try {
   }
 
   auto client = std::make_unique<CASClient>(server_addr, *aio_context);
+  client->SetKeyAlgorithm(key_algorithm);
 
   const auto status = command(client.get(), argv + optind, argc - optind);
 
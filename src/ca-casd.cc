@@ -21,9 +21,15 @@
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include <err.h>
 #include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sysexits.h>
@@ -34,6 +40,8 @@
 #include <kj/async-io.h>
 #include <kj/debug.h>
 
+#include "src/rpc.h"
+#include "src/shard-router.h"
 #include "src/storage-server.h"
 #include "src/util.h"
 
@@ -48,11 +56,32 @@ int no_detach;
 int disable_read;
 const char* address = "127.0.0.1";
 const char* service = "6001";
+size_t read_ahead = 4;
+size_t pack_threshold = 0;
+size_t compaction_rate = 0;
+size_t thread_count = 1;
+size_t hash_threads = 2;
+const char* bulk_service = nullptr;
+size_t bulk_threshold = 1 << 20;
+size_t cache_size = 64 << 20;
+size_t cache_object_size = 64 << 10;
+
+// Bulk transfer channels accepted by any thread, if enabled.
+std::unique_ptr<BulkChannelRegistry> bulk_channels;
 
 enum Option {
   kOptionAddress = 'a',
   kOptionNoDetach = 'n',
   kOptionPort = 'p',
+  kOptionReadAhead = 'r',
+  kOptionThreads = 't',
+  kOptionPackThreshold = 256,
+  kOptionCompactionRate,
+  kOptionHashThreads,
+  kOptionBulkPort,
+  kOptionBulkThreshold,
+  kOptionCacheSize,
+  kOptionCacheObjectSize,
 };
 
 struct option kLongOptions[] = {
@@ -61,15 +90,184 @@ struct option kLongOptions[] = {
     {"no-detach", no_argument, &no_detach, 1},
     {"address", required_argument, nullptr, kOptionAddress},
     {"port", required_argument, nullptr, kOptionPort},
+    {"read-ahead", required_argument, nullptr, kOptionReadAhead},
+    {"pack-threshold", required_argument, nullptr, kOptionPackThreshold},
+    {"compaction-rate", required_argument, nullptr, kOptionCompactionRate},
+    {"threads", required_argument, nullptr, kOptionThreads},
+    {"hash-threads", required_argument, nullptr, kOptionHashThreads},
+    {"bulk-port", required_argument, nullptr, kOptionBulkPort},
+    {"bulk-threshold", required_argument, nullptr, kOptionBulkThreshold},
+    {"cache-size", required_argument, nullptr, kOptionCacheSize},
+    {"cache-object-size", required_argument, nullptr, kOptionCacheObjectSize},
     {"disable-read", no_detach, &disable_read, 1},
     {nullptr, 0, nullptr, 0}};
 
+unsigned int StorageServerFlags() {
+  unsigned int flags = 0;
+  if (disable_read) flags |= StorageServer::kDisableRead;
+  return flags;
+}
+
+void ConfigureStorageServer(StorageServer& storage_server) {
+  storage_server.SetReadAhead(read_ahead);
+  storage_server.SetPackThreshold(pack_threshold);
+  storage_server.SetCompactionRate(compaction_rate);
+  storage_server.SetHashThreads(hash_threads);
+
+  // Each shard caches its own objects.
+  storage_server.SetCacheSize(cache_size / thread_count, cache_object_size);
+
+  if (bulk_channels) {
+    storage_server.SetBulkChannels(bulk_channels.get(),
+                                   StringToUInt64(bulk_service),
+                                   bulk_threshold);
+  }
+}
+
+// Creates a listening socket with SO_REUSEPORT set, so that several threads
+// can each accept connections on their own socket bound to the same address.
+kj::AutoCloseFd ListenReusePort(const char* service) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  addrinfo* addrs;
+  const auto ret = getaddrinfo(address, service, &hints, &addrs);
+  KJ_REQUIRE(ret == 0, "getaddrinfo failed", address, service,
+             gai_strerror(ret));
+  std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> addrs_deleter(
+      addrs, freeaddrinfo);
+
+  int fd;
+  KJ_SYSCALL(fd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_CLOEXEC,
+                         addrs->ai_protocol));
+  kj::AutoCloseFd result(fd);
+
+  const int one = 1;
+  KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+  KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+  KJ_SYSCALL(bind(fd, addrs->ai_addr, addrs->ai_addrlen), address, service);
+  KJ_SYSCALL(listen(fd, SOMAXCONN));
+
+  return result;
+}
+
+// Descriptors used by one shard thread.
+struct ShardThreadFds {
+  kj::AutoCloseFd listen_fd;
+
+  // Listening socket for bulk transfer channels, if enabled.
+  kj::AutoCloseFd bulk_listen_fd;
+
+  // Connections to the other shards, indexed by shard.  Requests for keys
+  // owned by shard `i` are sent on `client_fds[i]`, and requests from the
+  // router in thread `i` arrive on `server_fds[i]`.
+  std::vector<kj::AutoCloseFd> client_fds;
+  std::vector<kj::AutoCloseFd> server_fds;
+};
+
+// Runs the event loop for one shard.  Each thread serves its shard to the
+// other threads, and accepts client connections, routing requests to the
+// shard owning the key.
+void RunShard(const std::string& path, size_t shard, ShardThreadFds fds) try {
+  auto aio_context = kj::setupAsyncIo();
+  auto& provider = *aio_context.lowLevelProvider;
+
+  auto storage_server = kj::heap<StorageServer>(
+      path.c_str(), StorageServerFlags(), aio_context, shard, thread_count);
+  ConfigureStorageServer(*storage_server);
+
+  CAS::Client local_shard(std::move(storage_server));
+
+  std::vector<std::unique_ptr<RPCServer<CAS>>> peer_servers;
+  std::vector<std::unique_ptr<RPCClient>> peer_clients;
+  std::vector<CAS::Client> shards;
+
+  for (size_t i = 0; i < thread_count; ++i) {
+    if (i == shard) {
+      shards.emplace_back(local_shard);
+      continue;
+    }
+
+    peer_servers.emplace_back(std::make_unique<RPCServer<CAS>>(
+        local_shard, provider.wrapSocketFd(fds.server_fds[i].get())));
+
+    peer_clients.emplace_back(std::make_unique<RPCClient>(
+        provider.wrapSocketFd(fds.client_fds[i].get())));
+    shards.emplace_back(peer_clients.back()->GetMain<CAS>());
+  }
+
+  RPCListeningServer<CAS> server(
+      aio_context, kj::heap<ShardRouter>(std::move(shards)),
+      provider.wrapListenSocketFd(fds.listen_fd.get()));
+
+  auto accept_loop = server.AcceptLoop();
+
+  std::unique_ptr<BulkChannelListener> bulk_listener;
+  if (bulk_channels) {
+    bulk_listener = std::make_unique<BulkChannelListener>(
+        aio_context, *bulk_channels, std::move(fds.bulk_listen_fd));
+    accept_loop = accept_loop.exclusiveJoin(bulk_listener->AcceptLoop());
+  }
+
+  accept_loop.wait(aio_context.waitScope);
+} catch (kj::Exception& e) {
+  syslog(LOG_ERR, "Error in shard %zu: %s:%d: %s", shard, e.getFile(),
+         e.getLine(), e.getDescription().cStr());
+  _Exit(EXIT_FAILURE);
+}
+
+// Splits the repository into `thread_count` shards, each served by its own
+// thread.
+void RunShards() {
+  std::unique_ptr<char, decltype(&free)> cwd(getcwd(nullptr, 0), free);
+  if (!cwd) KJ_FAIL_SYSCALL("getcwd", errno);
+  const std::string path(cwd.get());
+
+  std::vector<ShardThreadFds> thread_fds(thread_count);
+
+  for (size_t i = 0; i < thread_count; ++i) {
+    thread_fds[i].listen_fd = ListenReusePort(service);
+    if (bulk_channels)
+      thread_fds[i].bulk_listen_fd = ListenReusePort(bulk_service);
+    thread_fds[i].client_fds.resize(thread_count);
+    thread_fds[i].server_fds.resize(thread_count);
+  }
+
+  for (size_t i = 0; i < thread_count; ++i) {
+    for (size_t j = 0; j < thread_count; ++j) {
+      if (i == j) continue;
+
+      int fds[2];
+      KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+      thread_fds[i].client_fds[j] = kj::AutoCloseFd(fds[0]);
+      thread_fds[j].server_fds[i] = kj::AutoCloseFd(fds[1]);
+    }
+  }
+
+  // Threads don't survive fork(), so detach first.  Temporary files are
+  // created in the working directory, so it's kept.
+  if (!no_detach) {
+    KJ_SYSCALL(daemon(1 /* nochdir */, 0 /* noclose */));
+  }
+
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back(RunShard, path, i, std::move(thread_fds[i]));
+  }
+
+  for (auto& thread : threads) thread.join();
+}
+
 }  // namespace
 
 int main(int argc, char** argv) try {
   int i;
 
-  while ((i = getopt_long(argc, argv, "na:p:", kLongOptions, 0)) != -1) {
+  while ((i = getopt_long(argc, argv, "na:p:r:t:", kLongOptions, 0)) != -1) {
     if (!i) continue;
     if (i == '?')
       errx(EX_USAGE, "Try '%s --help' for more information.", argv[0]);
@@ -86,6 +284,49 @@ int main(int argc, char** argv) try {
       case kOptionPort:
         service = optarg;
         break;
+
+      case kOptionReadAhead:
+        read_ahead = StringToUInt64(optarg);
+        if (!read_ahead) errx(EX_USAGE, "--read-ahead must be positive");
+        break;
+
+      case kOptionPackThreshold:
+        pack_threshold = StringToUInt64(optarg);
+        if (pack_threshold > kMaxPackedObjectSize) {
+          errx(EX_USAGE, "--pack-threshold must be at most %zu",
+               kMaxPackedObjectSize);
+        }
+        break;
+
+      case kOptionCompactionRate:
+        compaction_rate = StringToUInt64(optarg);
+        break;
+
+      case kOptionThreads:
+        thread_count = StringToUInt64(optarg);
+        if (!thread_count || thread_count > 50)
+          errx(EX_USAGE, "--threads must be between 1 and 50");
+        break;
+
+      case kOptionHashThreads:
+        hash_threads = StringToUInt64(optarg);
+        break;
+
+      case kOptionBulkPort:
+        bulk_service = optarg;
+        break;
+
+      case kOptionBulkThreshold:
+        bulk_threshold = StringToUInt64(optarg);
+        break;
+
+      case kOptionCacheSize:
+        cache_size = StringToUInt64(optarg);
+        break;
+
+      case kOptionCacheObjectSize:
+        cache_object_size = StringToUInt64(optarg);
+        break;
     }
   }
 
@@ -97,11 +338,37 @@ int main(int argc, char** argv) try {
         "  -n, --no-detach            don't detach from the tty\n"
         "  -a, --address=ADDRESS      IP address to bind to [%s]\n"
         "  -p, --port=PORT            select TCP port [%s]\n"
+        "  -r, --read-ahead=N         reads in flight per streamed object "
+        "[%zu]\n"
+        "      --pack-threshold=SIZE  pack objects of at most SIZE bytes into "
+        "shared\n"
+        "                             blocks; 0 disables packing [%zu]\n"
+        "      --compaction-rate=N    limit compaction to reading N bytes per "
+        "second;\n"
+        "                             0 means no limit [%zu]\n"
+        "  -t, --threads=N            split the repository into N shards, "
+        "each served\n"
+        "                             by its own thread [%zu]\n"
+        "      --hash-threads=N       verify uploads on N threads per shard; "
+        "0 verifies\n"
+        "                             them on the event loop [%zu]\n"
+        "      --bulk-port=PORT       send large objects to clients on "
+        "separate\n"
+        "                             connections to PORT, using "
+        "sendfile(2)\n"
+        "      --bulk-threshold=SIZE  smallest object sent on such connections "
+        "[%zu]\n"
+        "      --cache-size=SIZE      keep up to SIZE bytes of frequently read "
+        "objects\n"
+        "                             in memory; 0 disables caching [%zu]\n"
+        "      --cache-object-size=SIZE  largest object to cache [%zu]\n"
         "      --help     display this help and exit\n"
         "      --version  display version information and exit\n"
         "\n"
         "Report bugs to <morten.hustveit@gmail.com>\n",
-        argv[0], address, service);
+        argv[0], address, service, read_ahead, pack_threshold,
+        compaction_rate, thread_count, hash_threads, bulk_threshold,
+        cache_size, cache_object_size);
 
     return EXIT_SUCCESS;
   }
@@ -127,24 +394,50 @@ int main(int argc, char** argv) try {
     errx(EX_USAGE, "Usage: %s [OPTION]... [PATH]", argv[0]);
   }
 
+  StorageServer::SetShardCount(".", thread_count);
+
+  if (bulk_service) bulk_channels = std::make_unique<BulkChannelRegistry>();
+
+  if (thread_count > 1) {
+    RunShards();
+    return EXIT_SUCCESS;
+  }
+
   auto aio_context = kj::setupAsyncIo();
   auto listen_address = aio_context.provider->getNetwork()
                             .parseAddress(address, StringToUInt64(service))
                             .wait(aio_context.waitScope);
 
-  unsigned int flags = 0;
-  if (disable_read) flags |= StorageServer::kDisableRead;
+  auto listener = listen_address->listen();
+
+  kj::AutoCloseFd bulk_listen_fd;
+  if (bulk_channels) bulk_listen_fd = ListenReusePort(bulk_service);
 
-  auto storage_server = kj::heap<StorageServer>(".", flags, aio_context);
+  // Threads don't survive fork(), and the storage server starts its hashing
+  // threads right away, so detach first.  The working directory is the
+  // repository, so it's kept.
+  if (!no_detach) {
+    KJ_SYSCALL(daemon(1 /* nochdir */, 0 /* noclose */));
+  }
+
+  auto storage_server =
+      kj::heap<StorageServer>(".", StorageServerFlags(), aio_context);
+  ConfigureStorageServer(*storage_server);
 
   RPCListeningServer<CAS> server(aio_context, std::move(storage_server),
-                                 listen_address->listen());
+                                 std::move(listener));
 
-  if (!no_detach) {
-    KJ_SYSCALL(daemon(0 /* nochdir */, 0 /* noclose */));
+  std::unique_ptr<BulkChannelListener> bulk_listener;
+  if (bulk_channels) {
+    bulk_listener = std::make_unique<BulkChannelListener>(
+        aio_context, *bulk_channels, std::move(bulk_listen_fd));
   }
 
-  server.AcceptLoop().wait(aio_context.waitScope);
+  auto accept_loop = server.AcceptLoop();
+  if (bulk_listener)
+    accept_loop = accept_loop.exclusiveJoin(bulk_listener->AcceptLoop());
+
+  accept_loop.wait(aio_context.waitScope);
 } catch (kj::Exception& e) {
   syslog(LOG_ERR, "Error: %s:%d: %s", e.getFile(), e.getLine(),
          e.getDescription().cStr());
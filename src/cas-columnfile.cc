@@ -39,28 +39,19 @@ void CASColumnFileOutput::Flush(
     const cantera::ColumnFileCompression compression) {
   KJ_REQUIRE(key_.empty());
 
-  auto key_promises =
-      kj::heapArrayBuilder<kj::Promise<std::pair<uint32_t, std::string>>>(
-          chunks.size());
-
-  for (const auto& chunk : chunks) {
-    key_promises.add(
-        cas_client_->PutAsync(chunk.second.data(), chunk.second.size())
-            .then([column = chunk.first](auto key) {
-              return std::make_pair(column, std::move(key));
-            }));
-  }
+  std::vector<std::string_view> objects;
+  for (const auto& chunk : chunks) objects.emplace_back(chunk.second);
 
   // TODO(mortehu): We don't actually need to block until `Finalize()` is
   // called.
-  auto keys =
-      kj::joinPromises(key_promises.finish()).wait(cas_client_->WaitScope());
+  auto keys = cas_client_->PutManyAsync(objects).wait(cas_client_->WaitScope());
 
   segments_.emplace_back();
 
   Segment& new_segment = segments_.back();
 
-  for (auto& key : keys) new_segment.chunks.emplace_back(std::move(key));
+  for (size_t i = 0; i < chunks.size(); ++i)
+    new_segment.chunks.emplace_back(chunks[i].first, std::move(keys[i]));
   new_segment.compression = static_cast<uint32_t>(compression);
 }
 
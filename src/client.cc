@@ -16,14 +16,19 @@
 
 #include "client.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cstring>
 #include <memory>
 
+#include <endian.h>
 #include <syslog.h>
 
 #include <kj/debug.h>
 
+#include "bloom-filter.h"
 #include "bytestream.h"
+#include "hasher.h"
 #include "rpc.h"
 #include "sha1.h"
 #include "util.h"
@@ -49,6 +54,25 @@ class CASClient::Impl {
 
   void HandleError(kj::Exception e);
 
+  // Asks the server for a bulk transfer channel.
+  void OpenBulkChannel();
+
+  // Returns a promise that completes once any attempt to open a bulk transfer
+  // channel has succeeded or failed.
+  kj::Promise<void> OnBulkChannel();
+
+  // Returns the bulk transfer channel for use by a get, or null if there is
+  // none, or it is in use.
+  kj::Own<kj::AsyncIoStream> TakeBulkChannel();
+
+  // Makes the bulk transfer channel taken for a get available again, unless
+  // the get failed, in which case `stream` is null.
+  void ReturnBulkChannel(uint64_t generation,
+                         kj::Own<kj::AsyncIoStream> stream);
+
+  // Forgets the bulk transfer channel of a lost connection.
+  void ResetBulkChannel();
+
   kj::AsyncIoContext& aio_context;
 
   std::string addr;
@@ -64,11 +88,35 @@ class CASClient::Impl {
   uint64_t reconnection_delay_usec = 0;
 
   size_t max_object_in_key_size = 128;
+
+  KeyAlgorithm key_algorithm = KeyAlgorithm::kSHA1;
+
+  bool bulk_transfers = true;
+
+  // Set once a bulk transfer channel has been requested on the current
+  // connection.
+  bool bulk_requested = false;
+  kj::ForkedPromise<void> bulk_setup = nullptr;
+
+  kj::Own<kj::AsyncIoStream> bulk_stream;
+  uint64_t bulk_channel = 0;
+
+  // Incremented whenever the connection is lost, so that channels belonging
+  // to the old connection are not reused.
+  uint64_t connection_generation = 0;
 };
 
 const uint64_t kDefaultReconnectionDelayUSec = 500;
+
+// Largest amount of data read from a bulk transfer channel at a time.
+const size_t kBulkReadSize = 1 << 20;
 const uint64_t kMaxReconnectionDelayUSec = 1'000'000;
 
+// Largest size of a single garbage collection filter, well below Cap'n
+// Proto's default message size limit.
+const size_t kMaxFilterSize = 16 << 20;
+const unsigned int kMaxFilterPrefixBits = 16;
+
 CASClient::CASClient(kj::AsyncIoContext& aio_context)
     : pimpl_{std::make_unique<Impl>(aio_context)} {
   const auto addr = getenv("CA_CAS_SERVER");
@@ -80,6 +128,17 @@ CASClient::CASClient(kj::Own<kj::AsyncIoStream> stream,
     : pimpl_{std::make_unique<Impl>(aio_context)} {
   pimpl_->client = std::make_unique<RPCClient>(std::move(stream));
   pimpl_->cas_client = pimpl_->client->GetMain<CAS::Client>();
+
+  // There is no address to reconnect to, but `Connected()` must still report
+  // the loss of the connection, so that writes skip this server.
+  pimpl_->on_disconnect =
+      pimpl_->client->OnDisconnect()
+          .then([impl = pimpl_.get()] {
+            impl->ResetBulkChannel();
+            impl->cas_client = nullptr;
+            impl->client.reset();
+          })
+          .eagerlyEvaluate(nullptr);
 }
 
 CASClient::CASClient(std::string addr, kj::AsyncIoContext& aio_context)
@@ -96,10 +155,20 @@ std::string CASClient::Put(const void* data, size_t size, bool sync) {
   return PutAsync(data, size, sync).wait(pimpl_->aio_context.waitScope);
 }
 
+void CASClient::SetKeyAlgorithm(KeyAlgorithm algorithm) {
+  pimpl_->key_algorithm = algorithm;
+}
+
 ByteStream::Client CASClient::PutStream(const CASKey& key, bool sync) {
+  return PutStream(ObjectKey(key), sync);
+}
+
+ByteStream::Client CASClient::PutStream(const ObjectKey& key, bool sync) {
   auto stream = OnConnect().then([this, key, sync]() {
     auto put_request = pimpl_->cas_client.putRequest();
-    put_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+    auto wire_key = key.ToWire();
+    put_request.setKey(
+        kj::ArrayPtr<const capnp::byte>(wire_key.begin(), wire_key.end()));
     put_request.setSync(sync);
     return put_request.send().getStream();
   });
@@ -107,6 +176,60 @@ ByteStream::Client CASClient::PutStream(const CASKey& key, bool sync) {
   return std::move(stream);
 }
 
+namespace {
+
+// Writes `size` bytes read from a bulk transfer channel to `stream`.
+kj::Promise<void> ForwardBulk(kj::AsyncInputStream& input,
+                              ByteStream::Client stream, uint64_t size) {
+  if (!size) return stream.doneRequest().send().ignoreResult();
+
+  // Read straight into the message, rather than into a separate buffer.
+  auto request = stream.writeRequest();
+  const auto amount = std::min<uint64_t>(size, kBulkReadSize);
+  auto data = request.initData(amount);
+
+  auto read = input.read(data.begin(), amount);
+
+  return read.then([
+    &input, stream = std::move(stream), request = std::move(request),
+    remaining = size - amount
+  ]() mutable {
+    return request.send().then(
+        [&input, stream = std::move(stream), remaining](auto) mutable {
+          return ForwardBulk(input, std::move(stream), remaining);
+        });
+  });
+}
+
+// Receives an object sent on a bulk transfer channel, preceded by its size.
+kj::Promise<void> ReceiveBulk(kj::AsyncInputStream& input,
+                              ByteStream::Client stream) {
+  auto header = kj::heap<uint64_t>(0);
+
+  auto read = input.read(header.get(), sizeof(uint64_t));
+
+  return read.then([
+    &input, stream = std::move(stream), header = std::move(header)
+  ]() mutable {
+    const auto size = le64toh(*header);
+
+    auto expect_size_request = stream.expectSizeRequest();
+    expect_size_request.setSize(size);
+    expect_size_request.send().detach([](auto e) {});
+
+    return ForwardBulk(input, std::move(stream), size);
+  });
+}
+
+// Returns the host name part of a "host:port" address.
+std::string HostName(const std::string& addr) {
+  const auto colon = addr.rfind(':');
+  if (colon == std::string::npos || addr.back() == ']') return addr;
+  return addr.substr(0, colon);
+}
+
+}  // namespace
+
 kj::Promise<void> CASClient::GetStream(const std::string_view& key,
                                        ByteStream::Client stream) {
   KJ_REQUIRE(!key.empty());
@@ -130,18 +253,57 @@ kj::Promise<void> CASClient::GetStream(const std::string_view& key,
         });
   }
 
-  auto sha1 = CASKey::FromString(key);
+  auto object_key = ObjectKey::FromString(key);
 
-  return OnConnect().then([ this, sha1, stream = std::move(stream) ]() mutable {
+  return OnConnect().then([this] { return pimpl_->OnBulkChannel(); }).then([
+    this, object_key, stream = std::move(stream)
+  ]() mutable -> kj::Promise<void> {
     auto request = pimpl_->cas_client.getRequest();
-    request.setKey(kj::ArrayPtr<const capnp::byte>(sha1.begin(), sha1.end()));
-    request.setStream(std::move(stream));
-    return request.send().ignoreResult();
+    auto wire_key = object_key.ToWire();
+    request.setKey(
+        kj::ArrayPtr<const capnp::byte>(wire_key.begin(), wire_key.end()));
+    request.setStream(stream);
+
+    auto bulk_stream = pimpl_->TakeBulkChannel();
+    if (!bulk_stream) return request.send().ignoreResult();
+
+    request.setBulkChannel(pimpl_->bulk_channel);
+
+    // The server sends the data before replying, so reading has to start
+    // right away.
+    auto receive =
+        ReceiveBulk(*bulk_stream, std::move(stream)).eagerlyEvaluate(nullptr);
+
+    return request.send()
+        .then([receive = std::move(receive)](auto response) mutable {
+          // If the server chose not to use the channel, nothing was sent on
+          // it, and the read can be abandoned.
+          if (!response.getBulk()) return kj::Promise<void>(kj::READY_NOW);
+          return std::move(receive);
+        })
+        .then(
+            [
+              this, generation = pimpl_->connection_generation,
+              bulk_stream = std::move(bulk_stream)
+            ]() mutable {
+              pimpl_->ReturnBulkChannel(generation, std::move(bulk_stream));
+            },
+            [ this, generation = pimpl_->connection_generation ](
+                kj::Exception && e) {
+              // The channel may hold the remains of the object.
+              pimpl_->ReturnBulkChannel(generation, nullptr);
+              kj::throwRecoverableException(std::move(e));
+            });
   });
 }
 
 kj::Promise<void> CASClient::PutAsync(const CASKey& key, const void* data,
                                       size_t size, bool sync) {
+  return PutAsync(ObjectKey(key), data, size, sync);
+}
+
+kj::Promise<void> CASClient::PutAsync(const ObjectKey& key, const void* data,
+                                      size_t size, bool sync) {
   static const size_t kWriteSize = UINT64_C(1) << 20;
 
   auto stream = kj::heap<ByteStreamProducer>(PutStream(key, sync));
@@ -165,11 +327,64 @@ kj::Promise<std::string> CASClient::PutAsync(const void* data, size_t size,
     return std::move(key);
   }
 
-  CASKey sha1;
-  SHA1::Digest(data, size, sha1.begin());
+  auto key = Hasher::Digest(pimpl_->key_algorithm, data, size);
+
+  return PutAsync(key, data, size, sync).then([key] {
+    return key.ToString();
+  });
+}
+
+kj::Promise<std::vector<std::string>> CASClient::PutManyAsync(
+    const std::vector<std::string_view>& objects, bool sync) {
+  auto keys = std::make_shared<std::vector<std::string>>(objects.size());
+
+  // Objects that are too large to be stored in their keys.
+  std::vector<size_t> hashed;
+  std::vector<const void*> data;
+  std::vector<size_t> sizes;
+
+  for (size_t i = 0; i < objects.size(); ++i) {
+    const auto& object = objects[i];
+
+    if (object.size() < pimpl_->max_object_in_key_size) {
+      auto& key = (*keys)[i];
+      key = "P";
+      ToBase64(object, key, kBase64WebSafeChars, false);
+      continue;
+    }
+
+    hashed.emplace_back(i);
+    data.emplace_back(object.data());
+    sizes.emplace_back(object.size());
+  }
+
+  std::vector<ObjectKey> object_keys;
+  object_keys.reserve(hashed.size());
+
+  if (pimpl_->key_algorithm == KeyAlgorithm::kSHA1) {
+    std::vector<CASKey> sha1s(hashed.size());
+    std::vector<uint8_t*> digests;
+    for (auto& sha1 : sha1s) digests.emplace_back(sha1.begin());
+
+    SHA1::DigestBatch(hashed.size(), data.data(), sizes.data(),
+                      digests.data());
+
+    for (const auto& sha1 : sha1s) object_keys.emplace_back(sha1);
+  } else {
+    for (size_t i = 0; i < hashed.size(); ++i) {
+      object_keys.emplace_back(
+          Hasher::Digest(pimpl_->key_algorithm, data[i], sizes[i]));
+    }
+  }
+
+  auto puts = kj::heapArrayBuilder<kj::Promise<void>>(hashed.size());
+  for (size_t i = 0; i < hashed.size(); ++i) {
+    (*keys)[hashed[i]] = object_keys[i].ToString();
+    puts.add(PutAsync(object_keys[i], data[i], sizes[i], sync));
+  }
 
-  return PutAsync(sha1, data, size, sync).then([sha1] {
-    return sha1.ToString();
+  return kj::joinPromises(puts.finish()).then([keys = std::move(keys)] {
+    return std::move(*keys);
   });
 }
 
@@ -236,6 +451,13 @@ kj::Promise<void> CASClient::MarkGC(const std::vector<CASKey>& keys) {
   return MarkGC(pimpl_->cas_client, keys);
 }
 
+kj::Promise<void> CASClient::MarkGCFilter(const std::vector<CASKey>& keys,
+                                          double false_positive_rate) {
+  // The filters are built before returning, so `keys` is not needed for
+  // long.
+  return MarkGCFilter(pimpl_->cas_client, keys, false_positive_rate);
+}
+
 kj::Promise<void> CASClient::EndGC(uint64_t id) {
   return OnConnect().then(
       [this, id]() mutable { return EndGC(pimpl_->cas_client, id); });
@@ -250,15 +472,163 @@ kj::Promise<void> CASClient::MarkGC(CAS::Client& client,
                                     const std::vector<CASKey>& keys) {
   if (keys.empty()) return kj::READY_NOW;
 
-  auto request = client.markGCRequest();
-  auto request_keys = request.initKeys(keys.size());
+  auto writer = kj::heap<MarkWriter>(client);
+  auto write = writer->Write(kj::arrayPtr(keys.data(), keys.size()));
+
+  // The keys have been copied, so the caller's vector is no longer needed.
+  // Another copy is kept for servers without `markGCStream`, which get all
+  // of them in a single `markGC` call instead.
+  return write.then([writer = writer.get()] { return writer->Finish(); })
+      .attach(std::move(writer))
+      .catch_([ client, keys = std::vector<CASKey>(keys) ](
+          kj::Exception && e) mutable {
+        if (e.getType() != kj::Exception::Type::UNIMPLEMENTED)
+          kj::throwRecoverableException(std::move(e));
+
+        auto request = client.markGCRequest();
+        auto request_keys = request.initKeys(keys.size());
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+          const auto& key = keys[i];
+          request_keys.set(
+              i, kj::heapArray<capnp::byte>(key.begin(), key.size()));
+        }
+
+        return request.send().ignoreResult();
+      });
+}
+
+kj::Promise<void> CASClient::MarkGCFilter(CAS::Client& client,
+                                          const std::vector<CASKey>& keys,
+                                          double false_positive_rate) {
+  if (keys.empty()) return kj::READY_NOW;
+
+  // Split the keys by prefix, so that no filter makes for an unwieldy
+  // message.
+  const auto total_size =
+      BloomFilter::BytesPerKey(false_positive_rate) * keys.size();
+
+  unsigned int prefix_bits = 0;
+  while (prefix_bits < kMaxFilterPrefixBits &&
+         total_size / (UINT64_C(1) << prefix_bits) > kMaxFilterSize)
+    ++prefix_bits;
+
+  std::vector<size_t> counts(UINT64_C(1) << prefix_bits);
+  for (const auto& key : keys) ++counts[KeyPrefix(key, prefix_bits)];
+
+  auto filters = std::make_shared<std::vector<BloomFilter>>();
+  for (const auto count : counts)
+    filters->emplace_back(count, false_positive_rate);
+
+  for (const auto& key : keys)
+    (*filters)[KeyPrefix(key, prefix_bits)].Insert(key);
+
+  // One filter is sent at a time, to avoid queueing them all in the RPC
+  // system.
+  kj::Promise<void> promise = kj::READY_NOW;
+
+  for (uint32_t prefix = 0; prefix < filters->size(); ++prefix) {
+    // Nothing is marked in the ranges of empty filters anyway.
+    if (!counts[prefix]) continue;
 
-  for (size_t i = 0; i < keys.size(); ++i) {
-    const auto& key = keys[i];
-    request_keys.set(i, kj::heapArray<capnp::byte>(key.begin(), key.size()));
+    promise = promise.then([client, filters, prefix_bits, prefix]() mutable {
+      const auto& filter = (*filters)[prefix];
+
+      auto request = client.markGCFilterRequest();
+      auto params = request.initFilter();
+      params.setBits(kj::arrayPtr(filter.Bits().data(), filter.Bits().size()));
+      params.setHashCount(filter.HashCount());
+      params.setPrefixBits(prefix_bits);
+      params.setPrefix(prefix);
+
+      return request.send().ignoreResult();
+    });
   }
 
-  return request.send().ignoreResult();
+  return promise;
+}
+
+CASClient::MarkWriter::MarkWriter(CAS::Client& client)
+    : sink_(client.markGCStreamRequest().send().getSink()), tasks_(*this) {}
+
+kj::Promise<void> CASClient::MarkWriter::Write(
+    kj::ArrayPtr<const CASKey> keys) {
+  for (const auto& key : keys) {
+    block_.insert(block_.end(), key.begin(), key.end());
+    if (block_.size() == kBlockKeys * key.size()) Flush();
+  }
+
+  SendBlocks();
+
+  if (exception_) throw *exception_;
+  if (queue_.empty()) return kj::READY_NOW;
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  drained_ = std::move(paf.fulfiller);
+  return std::move(paf.promise);
+}
+
+kj::Promise<void> CASClient::MarkWriter::Finish() {
+  Flush();
+  SendBlocks();
+
+  if (exception_) throw *exception_;
+
+  kj::Promise<void> promise = kj::READY_NOW;
+
+  if (in_flight_) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    idle_ = std::move(paf.fulfiller);
+    promise = std::move(paf.promise);
+  }
+
+  return promise.then(
+      [this] { return sink_.doneRequest().send().ignoreResult(); });
+}
+
+void CASClient::MarkWriter::taskFailed(kj::Exception&& e) {
+  if (!exception_) exception_ = std::make_unique<kj::Exception>(std::move(e));
+
+  if (drained_) {
+    drained_->reject(kj::cp(*exception_));
+    drained_ = nullptr;
+  }
+
+  if (idle_) {
+    idle_->reject(kj::cp(*exception_));
+    idle_ = nullptr;
+  }
+}
+
+void CASClient::MarkWriter::Flush() {
+  if (block_.empty()) return;
+
+  queue_.emplace_back(kj::heapArray<capnp::byte>(block_.data(), block_.size()));
+  block_.clear();
+}
+
+void CASClient::MarkWriter::SendBlocks() {
+  while (in_flight_ < kMaxBlocksInFlight && !queue_.empty()) {
+    auto request = sink_.writeRequest();
+    request.setKeys(queue_.front());
+    queue_.pop_front();
+
+    ++in_flight_;
+    tasks_.add(request.send().then([this](auto) {
+      --in_flight_;
+      SendBlocks();
+    }));
+  }
+
+  if (queue_.empty() && drained_) {
+    drained_->fulfill();
+    drained_ = nullptr;
+  }
+
+  if (!in_flight_ && queue_.empty() && idle_) {
+    idle_->fulfill();
+    idle_ = nullptr;
+  }
 }
 
 kj::Promise<void> CASClient::EndGC(CAS::Client& client, uint64_t id) {
@@ -354,6 +724,75 @@ void CASClient::SetMaxObjectInKeySize(size_t limit) {
   pimpl_->max_object_in_key_size = limit;
 }
 
+void CASClient::SetBulkTransfers(bool enable) {
+  pimpl_->bulk_transfers = enable;
+}
+
+void CASClient::Impl::OpenBulkChannel() {
+  // Clients created from an existing stream don't know where to connect.
+  if (!bulk_transfers || addr.empty()) return;
+
+  bulk_requested = true;
+
+  bulk_setup =
+      cas_client.getBulkPortRequest()
+          .send()
+          .then([this](auto response) -> kj::Promise<void> {
+            const auto port = response.getPort();
+            if (!port) return kj::READY_NOW;
+
+            return aio_context.provider->getNetwork()
+                .parseAddress(HostName(addr), port)
+                .then([](kj::Own<kj::NetworkAddress> address) {
+                  return address->connect().attach(std::move(address));
+                })
+                .then([this](kj::Own<kj::AsyncIoStream> stream) {
+                  auto id = kj::heap<uint64_t>(0);
+                  auto read = stream->read(id.get(), sizeof(uint64_t));
+
+                  return read.then([
+                    this, stream = std::move(stream), id = std::move(id)
+                  ]() mutable {
+                    bulk_channel = le64toh(*id);
+                    bulk_stream = std::move(stream);
+                  });
+                });
+          })
+          .eagerlyEvaluate([this](kj::Exception e) {
+            // Older servers, and balancers, don't support bulk transfers.
+            syslog(LOG_DEBUG, "No bulk transfers from \"%s\": %s",
+                   addr.c_str(), e.getDescription().cStr());
+          })
+          .fork();
+}
+
+kj::Promise<void> CASClient::Impl::OnBulkChannel() {
+  if (!bulk_requested) return kj::READY_NOW;
+  return bulk_setup.addBranch();
+}
+
+kj::Own<kj::AsyncIoStream> CASClient::Impl::TakeBulkChannel() {
+  if (!bulk_transfers) return nullptr;
+  return std::move(bulk_stream);
+}
+
+void CASClient::Impl::ReturnBulkChannel(uint64_t generation,
+                                        kj::Own<kj::AsyncIoStream> stream) {
+  if (generation != connection_generation) return;
+
+  if (stream)
+    bulk_stream = std::move(stream);
+  else
+    OpenBulkChannel();
+}
+
+void CASClient::Impl::ResetBulkChannel() {
+  ++connection_generation;
+  bulk_requested = false;
+  bulk_setup = nullptr;
+  bulk_stream = nullptr;
+}
+
 kj::Promise<void> CASClient::Impl::Connect() {
   if (client) return kj::READY_NOW;
 
@@ -373,6 +812,7 @@ kj::Promise<void> CASClient::Impl::Connect() {
             on_disconnect =
                 client->OnDisconnect()
                     .then([this]() -> kj::Promise<void> {
+                      ResetBulkChannel();
                       cas_client = nullptr;
                       client.reset();
                       syslog(LOG_INFO, "Lost connection to backend \"%s\"",
@@ -385,6 +825,10 @@ kj::Promise<void> CASClient::Impl::Connect() {
             // Now that we're connected, we can set the reconnection
             // delay to its minimum value.
             reconnection_delay_usec = kDefaultReconnectionDelayUSec;
+
+            // Large gets wait for this, so that even the first one can use
+            // the channel.
+            OpenBulkChannel();
           })
           .fork();
 
@@ -397,6 +841,7 @@ void CASClient::Impl::HandleError(kj::Exception e) {
   syslog(LOG_ERR, "Error connecting to \"%s\": %s:%d: %s", addr.c_str(),
          e.getFile(), e.getLine(), e.getDescription().cStr());
 
+  ResetBulkChannel();
   cas_client = nullptr;
   client.reset();
 
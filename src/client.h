@@ -3,6 +3,7 @@
 
 #include <array>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <string_view>
 #include <memory>
@@ -34,9 +35,18 @@ class CASClient {
       CAS::ListMode mode = CAS::ListMode::DEFAULT, uint64_t min_size = 0,
       uint64_t max_size = UINT64_C(0xffffffffffffffff));
 
+  class MarkWriter;
+
   static kj::Promise<uint64_t> BeginGC(CAS::Client& client);
   static kj::Promise<void> MarkGC(CAS::Client& client,
                                   const std::vector<CASKey>& keys);
+
+  // Like `MarkGC()`, but sends Bloom filters of `keys` instead of the keys
+  // themselves, which takes about a tenth of the space at a false positive
+  // rate of 1%.  That fraction of the garbage is kept until a later cycle.
+  static kj::Promise<void> MarkGCFilter(CAS::Client& client,
+                                        const std::vector<CASKey>& keys,
+                                        double false_positive_rate);
   static kj::Promise<void> EndGC(CAS::Client& client, uint64_t id);
 
   static kj::Promise<void> RemoveAsync(CAS::Client& client, const CASKey& key);
@@ -62,10 +72,16 @@ class CASClient {
 
   KJ_DISALLOW_COPY(CASClient);
 
+  // Selects the hash function used for the keys of objects stored by `Put()`
+  // and friends.  The default is SHA-1.
+  void SetKeyAlgorithm(KeyAlgorithm algorithm);
+
   // Returns a stream for writing to CAS with the given key.  Throws an
   // exception on failure.  Failures can happen for any and no reason, so it's
   // important that the caller has retry logic.
   cantera::ByteStream::Client PutStream(const CASKey& key, bool sync = true);
+  cantera::ByteStream::Client PutStream(const ObjectKey& key,
+                                        bool sync = true);
 
   // Reads the given object from CAS into the given stream.  Throws an
   // exception on failure.  Failures can happen for any and no reason, so it's
@@ -89,6 +105,8 @@ class CASClient {
 
   kj::Promise<void> PutAsync(const CASKey& key, const void* data, size_t size,
                              bool sync = true);
+  kj::Promise<void> PutAsync(const ObjectKey& key, const void* data,
+                             size_t size, bool sync = true);
 
   kj::Promise<std::string> PutAsync(const void* data, size_t size,
                                     bool sync = true);
@@ -97,6 +115,12 @@ class CASClient {
     return PutAsync(data.data(), data.size(), sync);
   }
 
+  // Puts several objects at once, returning their keys in the same order.
+  // The digests are computed together, which is faster than calling
+  // `PutAsync()` for each object when there are many small ones.
+  kj::Promise<std::vector<std::string>> PutManyAsync(
+      const std::vector<std::string_view>& objects, bool sync = true);
+
   // Reads data from CAS.  All of these functions are convenience wrappers for
   // `GetStream`.
   kj::Array<const char> Get(const std::string_view& key);
@@ -110,6 +134,8 @@ class CASClient {
 
   kj::Promise<uint64_t> BeginGC();
   kj::Promise<void> MarkGC(const std::vector<CASKey>& keys);
+  kj::Promise<void> MarkGCFilter(const std::vector<CASKey>& keys,
+                                 double false_positive_rate);
   kj::Promise<void> EndGC(uint64_t id);
 
   void Remove(const CASKey& key);
@@ -135,11 +161,64 @@ class CASClient {
   // itself.
   void SetMaxObjectInKeySize(size_t limit);
 
+  // Enables or disables receiving large objects on a separate bulk transfer
+  // connection, when the server supports it.  Enabled by default.
+  void SetBulkTransfers(bool enable);
+
  private:
   class Impl;
   std::unique_ptr<Impl> pimpl_;
 };
 
+// Marks objects as live in the current garbage collection cycle through a
+// `MarkSink`.  Keys are packed into blocks, of which only a few are sent at a
+// time, so that any number of keys can be marked without building large
+// messages.
+class CASClient::MarkWriter : private kj::TaskSet::ErrorHandler {
+ public:
+  explicit MarkWriter(CAS::Client& client);
+
+  KJ_DISALLOW_COPY(MarkWriter);
+
+  // Queues `keys`, which are copied right away.  The returned promise
+  // completes once few enough keys are waiting to be sent that the caller
+  // should write more, and must be waited for before the next call.
+  kj::Promise<void> Write(kj::ArrayPtr<const CASKey> keys);
+
+  // Sends any remaining keys, and completes once the server has processed all
+  // of them.
+  kj::Promise<void> Finish();
+
+ private:
+  // Number of keys in each `MarkSink::write` call.
+  static const size_t kBlockKeys = 16384;
+
+  static const size_t kMaxBlocksInFlight = 4;
+
+  void taskFailed(kj::Exception&& e) override;
+
+  // Queues the block being built, if any.
+  void Flush();
+
+  // Sends queued blocks while there is room, and wakes up callers waiting
+  // for the queue to drain.
+  void SendBlocks();
+
+  CAS::MarkSink::Client sink_;
+
+  std::vector<capnp::byte> block_;
+  std::deque<kj::Array<capnp::byte>> queue_;
+  size_t in_flight_ = 0;
+
+  // Fulfilled when `queue_` is empty, and when nothing is in flight.
+  kj::Own<kj::PromiseFulfiller<void>> drained_;
+  kj::Own<kj::PromiseFulfiller<void>> idle_;
+
+  std::unique_ptr<kj::Exception> exception_;
+
+  kj::TaskSet tasks_;
+};
+
 }  // namespace cantera
 
 #endif  // !STORAGE_CA_CAS_CLIENT_H_
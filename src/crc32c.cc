@@ -0,0 +1,51 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include "src/crc32c.h"
+
+#include <array>
+
+namespace cantera {
+namespace cas_internal {
+
+uint32_t CRC32C(const void* data, size_t size, uint32_t crc) {
+  static const auto kTable = [] {
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (size_t j = 0; j < 8; ++j)
+        crc = (crc >> 1) ^ ((crc & 1) ? UINT32_C(0x82f63b78) : 0);
+      table[i] = crc;
+    }
+    return table;
+  }();
+
+  const auto input = reinterpret_cast<const uint8_t*>(data);
+
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i)
+    crc = kTable[(crc ^ input[i]) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,18 @@
+#ifndef CANTERA_CRC32C_H_
+#define CANTERA_CRC32C_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cantera {
+namespace cas_internal {
+
+// Returns the CRC-32C (Castagnoli) of `size` bytes at `data`.  To compute the
+// checksum of data arriving in pieces, pass the result for the preceding
+// pieces as `crc`.
+uint32_t CRC32C(const void* data, size_t size, uint32_t crc = 0);
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_CRC32C_H_
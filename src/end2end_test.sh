@@ -5,16 +5,37 @@ set -o pipefail
 
 #LAUNCHER="valgrind -q"
 
-repo=`mktemp -d`
+repo=
+SERVER_PID=
 
-trap 'rm -rf "$repo"' EXIT INT
+trap 'rm -rf "$repo"; [ -z "$SERVER_PID" ] || kill $SERVER_PID' EXIT INT
 
-$LAUNCHER ./ca-casd --address=127.0.0.1 --port=5923 -n "$repo" &
-SERVER_PID=$!
+# Starts a server on a new repository, passing any arguments to ca-casd.
+start_server() {
+  repo=`mktemp -d`
+  $LAUNCHER ./ca-casd --address=127.0.0.1 --port=5923 "$@" -n "$repo" &
+  SERVER_PID=$!
+}
 
-export CA_CAS_SERVER=127.0.0.1:5923
+# Like start_server, but lets ca-casd detach itself from the terminal.
+start_detached_server() {
+  repo=`mktemp -d`
+  $LAUNCHER ./ca-casd --address=127.0.0.1 --port=5923 "$@" "$repo"
+  SERVER_PID=`pgrep -n -f "ca-casd .*$repo"`
+}
+
+stop_server() {
+  kill $SERVER_PID
+  wait $SERVER_PID 2>/dev/null || true
+
+  # A detached server is not our child, so `wait` doesn't wait for it.
+  while kill -0 $SERVER_PID 2>/dev/null; do sleep 0.1; done
 
-trap 'rm -rf "$repo" && kill $SERVER_PID' EXIT INT
+  SERVER_PID=
+  rm -rf "$repo"
+}
+
+export CA_CAS_SERVER=127.0.0.1:5923
 
 fatal_error() {
   echo "$@" >&2
@@ -63,61 +84,101 @@ expect_n_objects() {
   fi
 }
 
-if [ 0 != `$LAUNCHER ./ca-cas list | wc -l` ]; then
-  fatal_error "Unexpected LIST output on empty repository"
-fi
-
-# Short objects aren't actually stored, so we need this padding to make "large" objects.
-PADDING="zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz"
-PADDING="${PADDING}${PADDING}"
-PADDING="${PADDING}${PADDING}"
-
-test_404 "data000000"
-put "data000000"
-test_200 "data000000"
+run_tests() {
+  KEYS=()
 
-test_404 "missing"
-
-test_200 "data000000"
-test_404 "missing"
-
-put "data000001"
-put "data000001$PADDING"
-put "data000002$PADDING"
-expect_n_objects 2
-
-put "data000002"
-put "data000003$PADDING"
-expect_n_objects 3
-
-test_200 "data000001$PADDING"
-test_200 "data000002$PADDING"
-test_200 "data000003$PADDING"
-
-test_200 "data000000"
-test_200 "data000001"
-test_200 "data000002"
-
-put "data000000"
-put "novel_object"
-
-for x in `seq 3 30`
-do
-  put "data$x"
-done
+  if [ 0 != `$LAUNCHER ./ca-cas list | wc -l` ]; then
+    fatal_error "Unexpected LIST output on empty repository"
+  fi
 
-for x in `seq 3 30`
-do
-  test_200 "data$x"
-done
+  # Short objects aren't actually stored, so we need this padding to make "large" objects.
+  PADDING="zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz"
+  PADDING="${PADDING}${PADDING}"
+  PADDING="${PADDING}${PADDING}"
+
+  test_404 "data000000"
+  put "data000000"
+  test_200 "data000000"
+
+  test_404 "missing"
+
+  test_200 "data000000"
+  test_404 "missing"
+
+  put "data000001"
+  put "data000001$PADDING"
+  put "data000002$PADDING"
+  expect_n_objects 2
+
+  put "data000002"
+  put "data000003$PADDING"
+  expect_n_objects 3
+
+  test_200 "data000001$PADDING"
+  test_200 "data000002$PADDING"
+  test_200 "data000003$PADDING"
+
+  test_200 "data000000"
+  test_200 "data000001"
+  test_200 "data000002"
+
+  put "data000000"
+  put "novel_object"
+
+  for x in `seq 3 30`
+  do
+    put "data$x"
+  done
+
+  for x in `seq 3 30`
+  do
+    test_200 "data$x"
+  done
+
+  for x in `seq 3 30`
+  do
+    test_200 "data$x"
+  done
+
+  test_200 "data000000"
+  test_200 "data000001"
+  test_200 "data000002"
+
+  # Large enough to be hashed on the server's hash threads.  A server that
+  # lost them would never respond, hence the timeout.
+  LARGE=`mktemp`
+  head -c 4194304 /dev/urandom > "$LARGE"
+  KEY=`timeout 60 $LAUNCHER ./ca-cas put < "$LARGE"` ||
+    fatal_error "Inserting large object failed"
+  if ! $LAUNCHER ./ca-cas get "$KEY" | cmp "$LARGE"; then
+    rm -f "$LARGE"
+    fatal_error "Retrieving large object failed"
+  fi
+  rm -f "$LARGE"
+
+  # ca-cas-fsck checks these with the hash functions they were stored with.
+  for ALGORITHM in sha256 blake3
+  do
+    KEY=`echo "$ALGORITHM$PADDING" |
+      $LAUNCHER ./ca-cas --key-algorithm=$ALGORITHM put` ||
+      fatal_error "Inserting $ALGORITHM object failed"
+    KEYS["$ALGORITHM$PADDING"]="$KEY"
+    test_200 "$ALGORITHM$PADDING"
+  done
+
+  $LAUNCHER ./ca-cas-fsck "$repo"
+}
 
-for x in `seq 3 30`
-do
-  test_200 "data$x"
-done
+start_server
+run_tests
+stop_server
 
-test_200 "data000000"
-test_200 "data000001"
-test_200 "data000002"
+# Objects are sent on bulk transfer channels regardless of size.
+start_server --bulk-port=5924 --bulk-threshold=0
+run_tests
+stop_server
 
-$LAUNCHER ./ca-cas-fsck "$repo"
+# Threads started before detaching would be lost in the fork.
+start_detached_server
+run_tests
+stop_server
@@ -0,0 +1,162 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/gc-marks.h"
+
+#include <algorithm>
+
+namespace cantera {
+namespace cas_internal {
+
+uint64_t GCMarks::MarkAll() {
+  Clear();
+
+  const auto& base = index_.Base();
+  bits_.assign((base.size() + 63) / 64, 0);
+
+  uint64_t total_size = 0;
+
+  index_.ForEach([this, &base, &total_size](const IndexEntry& entry) {
+    if (base.Contains(&entry)) {
+      const size_t position = &entry - base.begin();
+      bits_[position / 64] |= UINT64_C(1) << (position % 64);
+    } else {
+      keys_.emplace(entry.key);
+    }
+
+    ++count_;
+    total_size += entry.size;
+  });
+
+  return total_size;
+}
+
+void GCMarks::Clear() {
+  bits_ = std::vector<uint64_t>();
+  keys_ = std::unordered_set<CASKey>();
+  count_ = 0;
+}
+
+bool GCMarks::Unmark(const CASKey& key) {
+  if (!count_) return false;
+
+  const auto position = Position(key);
+  if (position >= 0) {
+    auto& word = bits_[position / 64];
+    const auto mask = UINT64_C(1) << (position % 64);
+
+    if (word & mask) {
+      word &= ~mask;
+      --count_;
+      return true;
+    }
+  }
+
+  if (!keys_.erase(key)) return false;
+
+  --count_;
+
+  return true;
+}
+
+bool GCMarks::IsMarked(const CASKey& key) const {
+  if (!count_) return false;
+
+  const auto position = Position(key);
+  if (position >= 0 &&
+      (bits_[position / 64] & (UINT64_C(1) << (position % 64))))
+    return true;
+
+  return keys_.count(key);
+}
+
+void GCMarks::Rebase(const IndexSegment& new_base) {
+  if (!count_) {
+    Clear();
+    return;
+  }
+
+  std::vector<uint64_t> new_bits((new_base.size() + 63) / 64, 0);
+
+  const auto set_bit = [&new_bits, &new_base](const IndexEntry* entry) {
+    const size_t position = entry - new_base.begin();
+    new_bits[position / 64] |= UINT64_C(1) << (position % 64);
+  };
+
+  // Both segments are sorted by key, so the marked entries of the old one
+  // are found in the new one by a single merge pass.
+  auto j = new_base.begin();
+
+  ForEachBit([this, &new_base, &j, &set_bit](const IndexEntry& entry) {
+    while (j != new_base.end() && j->key < entry.key) ++j;
+
+    if (j != new_base.end() && j->key == entry.key)
+      set_bit(j);
+    else
+      keys_.emplace(entry.key);
+  });
+
+  for (auto i = keys_.begin(); i != keys_.end();) {
+    if (auto entry = new_base.Find(*i)) {
+      set_bit(entry);
+      i = keys_.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  bits_ = std::move(new_bits);
+}
+
+ssize_t GCMarks::Position(const CASKey& key) const {
+  const auto& base = index_.Base();
+
+  auto entry = base.Find(key);
+  if (!entry) return -1;
+
+  const size_t position = entry - base.begin();
+  if (position / 64 >= bits_.size()) return -1;
+
+  return position;
+}
+
+std::pair<size_t, size_t> GCMarks::BitRange(const CASKey& first,
+                                            const CASKey& last) const {
+  const auto& base = index_.Base();
+
+  // Keys past the end of the bitmap are not marked.
+  const auto end = base.begin() + std::min(base.size(), bits_.size() * 64);
+
+  const auto lower =
+      std::lower_bound(base.begin(), end, first,
+                       [](const IndexEntry& entry, const CASKey& key) {
+                         return entry.key < key;
+                       });
+  const auto upper =
+      std::upper_bound(lower, end, last,
+                       [](const CASKey& key, const IndexEntry& entry) {
+                         return key < entry.key;
+                       });
+
+  return std::make_pair(lower - base.begin(), upper - base.begin());
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
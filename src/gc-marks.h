@@ -0,0 +1,119 @@
+#ifndef CANTERA_GC_MARKS_H_
+#define CANTERA_GC_MARKS_H_ 1
+
+#include <cstdint>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <kj/common.h>
+
+#include "key.h"
+#include "object-index.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Objects marked for removal by mark and sweep garbage collection.
+//
+// Objects in the base segment of the index are marked with one bit each, at
+// their position in the segment, so marking every object costs an eighth of
+// a byte per object instead of a copy of its key.  Only objects held in the
+// in-memory overlay when collection starts, of which there are few between
+// checkpoints, are marked by key.
+class GCMarks {
+ public:
+  explicit GCMarks(const ObjectIndex& index) : index_(index) {}
+
+  KJ_DISALLOW_COPY(GCMarks);
+
+  // Marks every object in the index, replacing any previous marks.  Returns
+  // the total size of the objects.
+  uint64_t MarkAll();
+
+  // Removes all marks, and releases the memory used.
+  void Clear();
+
+  // Unmarks the object `key`.  Returns true if it was marked.
+  bool Unmark(const CASKey& key);
+
+  bool IsMarked(const CASKey& key) const;
+
+  // Returns the number of marked objects.
+  size_t size() const { return count_; }
+
+  // Carries the marks over to `new_base`, which is about to replace the base
+  // segment of the index.  Must be called while the old base segment is still
+  // in use.
+  void Rebase(const IndexSegment& new_base);
+
+  // Invokes `function` with the key of every marked object, scanning the
+  // bitmap in order.  The base segment of the index must not be replaced
+  // while this is running, but objects may be removed.
+  template <typename Function>
+  void ForEach(Function&& function) const {
+    ForEachBit([&function](const IndexEntry& entry) { function(entry.key); });
+
+    for (const auto& key : keys_) function(key);
+  }
+
+  // Like `ForEach()`, but only for keys from `first` to `last`, inclusive.
+  // Only the part of the bitmap covering the range is scanned.
+  template <typename Function>
+  void ForEachInRange(const CASKey& first, const CASKey& last,
+                      Function&& function) const {
+    const auto base = index_.Base().begin();
+    const auto [begin, end] = BitRange(first, last);
+
+    for (size_t i = begin / 64; i * 64 < end; ++i) {
+      auto word = bits_[i];
+      if (i == begin / 64) word &= ~UINT64_C(0) << (begin % 64);
+      if ((i + 1) * 64 > end) word &= ~UINT64_C(0) >> ((i + 1) * 64 - end);
+
+      for (; word; word &= word - 1)
+        function(base[i * 64 + __builtin_ctzll(word)].key);
+    }
+
+    for (const auto& key : keys_) {
+      if (!(key < first) && !(last < key)) function(key);
+    }
+  }
+
+ private:
+  // Invokes `function` with the base segment entry of every object marked in
+  // the bitmap, in key order.
+  template <typename Function>
+  void ForEachBit(Function&& function) const {
+    const auto base = index_.Base().begin();
+
+    for (size_t i = 0; i < bits_.size(); ++i) {
+      for (auto word = bits_[i]; word; word &= word - 1)
+        function(base[i * 64 + __builtin_ctzll(word)]);
+    }
+  }
+
+  // Returns the bitmap position of `key`, or -1 if `key` is not in the base
+  // segment.
+  ssize_t Position(const CASKey& key) const;
+
+  // Returns the range of bitmap positions holding keys from `first` to
+  // `last`, inclusive.
+  std::pair<size_t, size_t> BitRange(const CASKey& first,
+                                     const CASKey& last) const;
+
+  const ObjectIndex& index_;
+
+  // One bit for every entry in the base segment.  Empty when no objects are
+  // marked.
+  std::vector<uint64_t> bits_;
+
+  // Marked objects that were not in the base segment.
+  std::unordered_set<CASKey> keys_;
+
+  size_t count_ = 0;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_GC_MARKS_H_
@@ -0,0 +1,198 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <random>
+#include <set>
+
+#include "gc-marks.h"
+#include "io.h"
+#include "object-index.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+struct GCMarksTest : testing::Test {
+ protected:
+  IndexEntry RandomEntry() {
+    std::uniform_int_distribution<uint8_t> byte_distribution;
+    std::uniform_int_distribution<uint64_t> size_distribution(0, 1 << 20);
+
+    IndexEntry result;
+    for (auto& b : result.key) b = byte_distribution(rng_);
+    result.offset = size_distribution(rng_);
+    result.size = size_distribution(rng_);
+
+    return result;
+  }
+
+  // Replaces the base segment of `index_` with one holding all its objects,
+  // carrying the marks over.
+  void Checkpoint() {
+    auto segment_file = AnonTemporaryFile(nullptr);
+    index_.WriteSegment(segment_file.get());
+
+    IndexSegment segment(segment_file.get());
+    marks_.Rebase(segment);
+    index_.SetBase(std::move(segment));
+  }
+
+  // Verifies that exactly the objects in `expected` are marked.
+  void ExpectMarks(const std::set<CASKey>& expected) {
+    EXPECT_EQ(expected.size(), marks_.size());
+
+    std::set<CASKey> marked;
+    marks_.ForEach([&marked](const CASKey& key) {
+      EXPECT_TRUE(marked.emplace(key).second);
+    });
+    EXPECT_EQ(expected, marked);
+
+    index_.ForEach([this, &expected](const IndexEntry& entry) {
+      EXPECT_EQ(expected.count(entry.key) > 0, marks_.IsMarked(entry.key));
+    });
+  }
+
+  std::mt19937_64 rng_;
+
+  ObjectIndex index_;
+  GCMarks marks_{index_};
+};
+
+// Verifies that objects in both the base segment and the overlay are marked,
+// and can be unmarked.
+TEST_F(GCMarksTest, MarkAndUnmark) {
+  static const size_t kObjectCount = 10000;
+
+  std::vector<CASKey> keys;
+  uint64_t total_size = 0;
+
+  for (size_t i = 0; i < kObjectCount; ++i) {
+    auto entry = RandomEntry();
+    index_.Insert(entry);
+    keys.emplace_back(entry.key);
+    total_size += entry.size;
+
+    // Put a quarter of the objects in the overlay.
+    if (i == kObjectCount * 3 / 4) Checkpoint();
+  }
+
+  // Replace an object in the base segment with an overlay entry.
+  auto moved = *index_.Find(keys[0]);
+  moved.offset += 1;
+  index_.Insert(moved);
+
+  EXPECT_EQ(total_size, marks_.MarkAll());
+
+  std::set<CASKey> expected(keys.begin(), keys.end());
+  ExpectMarks(expected);
+
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    EXPECT_TRUE(marks_.Unmark(keys[i]));
+    EXPECT_FALSE(marks_.Unmark(keys[i]));
+    expected.erase(keys[i]);
+  }
+
+  ExpectMarks(expected);
+
+  marks_.Clear();
+  ExpectMarks({});
+}
+
+// Verifies that marks survive the base segment being replaced while
+// collection is in progress.
+TEST_F(GCMarksTest, Rebase) {
+  static const size_t kObjectCount = 10000;
+
+  std::vector<CASKey> keys;
+
+  for (size_t i = 0; i < kObjectCount; ++i) {
+    auto entry = RandomEntry();
+    index_.Insert(entry);
+    keys.emplace_back(entry.key);
+
+    if (i == kObjectCount / 2) Checkpoint();
+  }
+
+  marks_.MarkAll();
+
+  std::set<CASKey> expected(keys.begin(), keys.end());
+
+  // Objects are unmarked before being removed, as by the storage server.
+  for (size_t i = 0; i < keys.size(); i += 3) {
+    marks_.Unmark(keys[i]);
+    index_.Erase(keys[i]);
+    expected.erase(keys[i]);
+  }
+
+  // Objects added after marking are not marked.
+  for (size_t i = 0; i < kObjectCount / 10; ++i) index_.Insert(RandomEntry());
+
+  ExpectMarks(expected);
+
+  Checkpoint();
+  ExpectMarks(expected);
+
+  for (size_t i = 1; i < keys.size(); i += 3) {
+    marks_.Unmark(keys[i]);
+    expected.erase(keys[i]);
+  }
+
+  Checkpoint();
+  ExpectMarks(expected);
+}
+
+// Verifies that scanning a range of keys finds exactly the marked objects in
+// it, in both the base segment and the overlay.
+TEST_F(GCMarksTest, ForEachInRange) {
+  static const size_t kObjectCount = 10000;
+
+  std::vector<CASKey> keys;
+
+  for (size_t i = 0; i < kObjectCount; ++i) {
+    auto entry = RandomEntry();
+    index_.Insert(entry);
+    keys.emplace_back(entry.key);
+
+    if (i == kObjectCount * 3 / 4) Checkpoint();
+  }
+
+  marks_.MarkAll();
+
+  for (size_t i = 0; i < keys.size(); i += 2) marks_.Unmark(keys[i]);
+
+  std::sort(keys.begin(), keys.end());
+
+  for (const auto& [first_idx, last_idx] :
+       {std::make_pair<size_t, size_t>(0, kObjectCount - 1),
+        std::make_pair<size_t, size_t>(1000, 1000),
+        std::make_pair<size_t, size_t>(1234, 5678)}) {
+    const auto& first = keys[first_idx];
+    const auto& last = keys[last_idx];
+
+    std::set<CASKey> expected;
+    marks_.ForEach([&expected, &first, &last](const CASKey& key) {
+      if (!(key < first) && !(last < key)) expected.emplace(key);
+    });
+
+    std::set<CASKey> found;
+    marks_.ForEachInRange(first, last, [&found](const CASKey& key) {
+      EXPECT_TRUE(found.emplace(key).second);
+    });
+
+    EXPECT_EQ(expected, found);
+  }
+}
@@ -0,0 +1,292 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/hash-pool.h"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <kj/debug.h>
+
+#include "src/hasher.h"
+
+namespace cantera {
+namespace cas_internal {
+
+struct HashPool::StreamState {
+  explicit StreamState(KeyAlgorithm algorithm)
+      : hasher(Hasher::Create(algorithm)) {}
+
+  std::unique_ptr<Hasher> hasher;
+  ObjectKey key;
+
+  // Jobs waiting for a worker.  Guarded by `HashPool::mutex_`.
+  std::deque<Job> jobs;
+
+  // Set while the stream is in `HashPool::ready_` or being processed by a
+  // worker.  Guarded by `HashPool::mutex_`.
+  bool scheduled = false;
+
+  // Set once the stream is abandoned, so that remaining jobs can be skipped.
+  // Guarded by `HashPool::mutex_`.
+  bool canceled = false;
+
+  // Number of jobs submitted, but not yet completed, and number of jobs in
+  // `HashPool::pending_`.  While both are zero, no worker touches `hasher`, and
+  // it may be used directly on the event loop.  Only accessed on the event
+  // loop.
+  size_t outstanding = 0;
+  size_t pending = 0;
+};
+
+HashPool::HashPool(kj::LowLevelAsyncIoProvider& provider, size_t thread_count,
+                   size_t max_queued_bytes)
+    : max_queued_bytes_(max_queued_bytes) {
+  if (!thread_count) return;
+
+  int pipe[2];
+#if HAVE_PIPE2
+  KJ_SYSCALL(::pipe2(pipe, O_CLOEXEC));
+#else
+  KJ_SYSCALL(::pipe(pipe));
+#endif
+  completion_reader_ = kj::AutoCloseFd(pipe[0]);
+  completion_writer_ = kj::AutoCloseFd(pipe[1]);
+#if !HAVE_PIPE2
+  KJ_SYSCALL(fcntl(pipe[0], F_SETFD, FD_CLOEXEC));
+  KJ_SYSCALL(fcntl(pipe[1], F_SETFD, FD_CLOEXEC));
+#endif
+
+  completion_stream_ = provider.wrapInputFd(completion_reader_.get());
+  completion_task_ = ReceiveCompletions().eagerlyEvaluate([](
+      kj::Exception&& e) {
+    syslog(LOG_ERR, "Hash completion handling failed: %s:%d: %s", e.getFile(),
+           e.getLine(), e.getDescription().cStr());
+  });
+
+  for (size_t i = 0; i < thread_count; ++i)
+    threads_.emplace_back([this] { WorkerLoop(); });
+}
+
+HashPool::~HashPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  ready_cv_.notify_all();
+
+  for (auto& thread : threads_) thread.join();
+}
+
+kj::Own<HashPool::Stream> HashPool::NewStream(KeyAlgorithm algorithm) {
+  return kj::heap<Stream>(*this, std::make_shared<StreamState>(algorithm));
+}
+
+void HashPool::Submit(Job job) {
+  auto& stream = *job.stream;
+
+  queued_bytes_ += job.size;
+  ++stream.outstanding;
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stream.jobs.emplace_back(std::move(job));
+    if (stream.scheduled) return;
+    stream.scheduled = true;
+    ready_.emplace_back(stream.jobs.back().stream);
+  }
+
+  ready_cv_.notify_one();
+}
+
+void HashPool::SubmitPending() {
+  while (!pending_.empty()) {
+    auto& pending = pending_.front();
+
+    // A job whose promise has been dropped may refer to data that no longer
+    // exists.
+    if (!pending.fulfiller->isWaiting()) {
+      --pending.stream->pending;
+      pending_.pop_front();
+      continue;
+    }
+
+    if (queued_bytes_ > 0 &&
+        queued_bytes_ + pending.data.size() > max_queued_bytes_)
+      break;
+
+    Job job;
+    job.stream = pending.stream;
+    job.size = pending.data.size();
+    job.finish = pending.finish;
+    if (pending.finish) {
+      job.fulfiller = std::move(pending.fulfiller);
+    } else {
+      job.data = kj::heapArray<uint8_t>(pending.data);
+      pending.fulfiller->fulfill();
+    }
+
+    --pending.stream->pending;
+    pending_.pop_front();
+
+    Submit(std::move(job));
+  }
+}
+
+kj::Promise<void> HashPool::ReceiveCompletions() {
+  return completion_stream_
+      ->read(completion_buffer_, 1, sizeof(completion_buffer_))
+      .then([this](size_t) {
+        std::vector<Job> jobs;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          jobs.swap(completed_);
+        }
+
+        for (auto& job : jobs) {
+          queued_bytes_ -= job.size;
+          --job.stream->outstanding;
+          if (job.fulfiller) job.fulfiller->fulfill();
+        }
+
+        SubmitPending();
+
+        return ReceiveCompletions();
+      });
+}
+
+void HashPool::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  for (;;) {
+    ready_cv_.wait(lock, [this] { return stopping_ || !ready_.empty(); });
+    if (stopping_) return;
+
+    auto stream = std::move(ready_.front());
+    ready_.pop_front();
+
+    auto job = std::move(stream->jobs.front());
+    stream->jobs.pop_front();
+
+    const auto canceled = stream->canceled;
+
+    lock.unlock();
+
+    if (!canceled) {
+      if (job.finish)
+        stream->key = stream->hasher->Finish();
+      else
+        stream->hasher->Add(job.data.begin(), job.data.size());
+    }
+    job.data = nullptr;
+
+    lock.lock();
+
+    // Put the stream at the back of the queue rather than continuing with it,
+    // so that one large object does not starve the others.
+    if (stream->jobs.empty())
+      stream->scheduled = false;
+    else
+      ready_.emplace_back(std::move(stream));
+
+    if (completed_.empty()) {
+      const char byte = 0;
+      while (write(completion_writer_.get(), &byte, 1) == -1 && errno == EINTR)
+        ;
+    }
+
+    completed_.emplace_back(std::move(job));
+  }
+}
+
+HashPool::Stream::Stream(HashPool& pool, std::shared_ptr<StreamState> state)
+    : pool_(pool), state_(std::move(state)) {}
+
+HashPool::Stream::~Stream() {
+  std::unique_lock<std::mutex> lock(pool_.mutex_);
+  state_->canceled = true;
+}
+
+kj::Promise<void> HashPool::Stream::Add(kj::ArrayPtr<const uint8_t> data) {
+  auto& state = *state_;
+
+  if (pool_.threads_.empty() ||
+      (data.size() < kInlineHashSize && !state.outstanding && !state.pending)) {
+    state.hasher->Add(data.begin(), data.size());
+    return kj::READY_NOW;
+  }
+
+  if (pool_.pending_.empty() &&
+      (!pool_.queued_bytes_ ||
+       pool_.queued_bytes_ + data.size() <= pool_.max_queued_bytes_)) {
+    Job job;
+    job.stream = state_;
+    job.data = kj::heapArray<uint8_t>(data);
+    job.size = data.size();
+    pool_.Submit(std::move(job));
+    return kj::READY_NOW;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+
+  PendingJob pending;
+  pending.stream = state_;
+  pending.data = data;
+  pending.fulfiller = std::move(paf.fulfiller);
+  pool_.pending_.emplace_back(std::move(pending));
+  ++state.pending;
+
+  return std::move(paf.promise);
+}
+
+kj::Promise<ObjectKey> HashPool::Stream::Finish() {
+  auto& state = *state_;
+
+  if (pool_.threads_.empty() || (!state.outstanding && !state.pending)) {
+    state.key = state.hasher->Finish();
+    return state.key;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+
+  if (pool_.pending_.empty()) {
+    Job job;
+    job.stream = state_;
+    job.finish = true;
+    job.fulfiller = std::move(paf.fulfiller);
+    pool_.Submit(std::move(job));
+  } else {
+    PendingJob pending;
+    pending.stream = state_;
+    pending.finish = true;
+    pending.fulfiller = std::move(paf.fulfiller);
+    pool_.pending_.emplace_back(std::move(pending));
+    ++state.pending;
+  }
+
+  return paf.promise.then([state = state_] { return state->key; });
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
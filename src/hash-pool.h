@@ -0,0 +1,144 @@
+#ifndef CANTERA_HASH_POOL_H_
+#define CANTERA_HASH_POOL_H_ 1
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <kj/array.h>
+#include <kj/async-io.h>
+
+#include "key.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Computes the keys of objects on a set of worker threads, so that
+// hashing large objects does not stall the event loop.  Each stream is hashed
+// in order on one worker at a time, while different streams are hashed in
+// parallel.
+//
+// At most `max_queued_bytes` of data may be waiting to be hashed at any time.
+// Once that limit is reached, `Stream::Add()` returns promises that are not
+// fulfilled until enough queued data has been hashed.
+class HashPool {
+ public:
+  class Stream;
+
+  // Chunks smaller than this are hashed directly on the event loop when their
+  // stream has no other work queued, since handing them to a worker would
+  // cost more than it saves.
+  static const size_t kInlineHashSize = 64 * 1024;
+
+  // Starts `thread_count` worker threads.  If `thread_count` is zero, all
+  // hashing is done on the event loop.
+  HashPool(kj::LowLevelAsyncIoProvider& provider, size_t thread_count,
+           size_t max_queued_bytes = 64 << 20);
+
+  KJ_DISALLOW_COPY(HashPool);
+  ~HashPool();
+
+  // Starts hashing a new object with `algorithm`.  The pool must outlive the
+  // returned stream.
+  kj::Own<Stream> NewStream(KeyAlgorithm algorithm);
+
+ private:
+  struct StreamState;
+
+  struct Job {
+    std::shared_ptr<StreamState> stream;
+
+    // Copy of the data to hash.  Released by the worker once hashed.
+    kj::Array<uint8_t> data;
+    size_t size = 0;
+
+    // If true, the key is computed instead.
+    bool finish = false;
+
+    // Fulfilled on the event loop once the job has completed, if set.
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+
+  struct PendingJob {
+    std::shared_ptr<StreamState> stream;
+
+    // Data owned by the caller of `Stream::Add()`.
+    kj::ArrayPtr<const uint8_t> data;
+
+    bool finish = false;
+
+    // For data, fulfilled once `data` has been copied.  For the key, passed
+    // on to the `Job`.
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+
+  // Hands a job to the workers.
+  void Submit(Job job);
+
+  // Submits waiting jobs, in order, for as long as the queue has room.
+  void SubmitPending();
+
+  // Processes jobs completed by the workers, and waits for more.
+  kj::Promise<void> ReceiveCompletions();
+
+  void WorkerLoop();
+
+  // Number of bytes submitted to the workers, but not yet completed.  Only
+  // accessed on the event loop.
+  size_t queued_bytes_ = 0;
+  size_t max_queued_bytes_;
+
+  // Jobs waiting for room in the queue.  Only accessed on the event loop.
+  std::deque<PendingJob> pending_;
+
+  kj::AutoCloseFd completion_reader_;
+  kj::AutoCloseFd completion_writer_;
+  kj::Own<kj::AsyncInputStream> completion_stream_;
+  char completion_buffer_[64];
+  kj::Promise<void> completion_task_ = nullptr;
+
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+
+  // Streams with jobs waiting for a worker.  Guarded by `mutex_`.
+  std::deque<std::shared_ptr<StreamState>> ready_;
+
+  // Jobs finished by the workers, waiting to be processed on the event loop.
+  // Guarded by `mutex_`.
+  std::vector<Job> completed_;
+
+  // Set to true to make the workers exit.  Guarded by `mutex_`.
+  bool stopping_ = false;
+
+  std::vector<std::thread> threads_;
+};
+
+class HashPool::Stream {
+ public:
+  Stream(HashPool& pool, std::shared_ptr<StreamState> state);
+
+  KJ_DISALLOW_COPY(Stream);
+  ~Stream();
+
+  // Adds `data` to the object being hashed.  The data is copied before the
+  // returned promise is fulfilled, and must remain valid until then.
+  kj::Promise<void> Add(kj::ArrayPtr<const uint8_t> data);
+
+  // Returns a promise for the key of all the data added.  `Add()` must not be
+  // called afterwards.
+  kj::Promise<ObjectKey> Finish();
+
+ private:
+  HashPool& pool_;
+
+  std::shared_ptr<StreamState> state_;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_HASH_POOL_H_
@@ -0,0 +1,106 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <kj/async-io.h>
+
+#include "hash-pool.h"
+#include "hasher.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+struct HashPoolTest : testing::Test {
+ public:
+  HashPoolTest() : async_io_{kj::setupAsyncIo()} {}
+
+ protected:
+  // Hashes several objects concurrently, in chunks of random size, and
+  // verifies that the keys match those computed directly.
+  void HashObjects(HashPool& pool,
+                   KeyAlgorithm algorithm = KeyAlgorithm::kSHA1) {
+    std::uniform_int_distribution<uint8_t> byte_distribution;
+    std::uniform_int_distribution<size_t> chunk_size_distribution(
+        1, 4 * HashPool::kInlineHashSize);
+
+    std::vector<std::vector<uint8_t>> objects(8);
+    for (auto& object : objects) {
+      object.resize(1 << 20);
+      for (auto& b : object) b = byte_distribution(rng_);
+    }
+
+    std::vector<kj::Own<HashPool::Stream>> streams;
+    for (size_t i = 0; i < objects.size(); ++i)
+      streams.emplace_back(pool.NewStream(algorithm));
+
+    // Interleave chunks of the different objects.
+    std::vector<size_t> offsets(objects.size(), 0);
+    std::vector<kj::Promise<void>> add_promises;
+    for (bool more = true; more;) {
+      more = false;
+      for (size_t i = 0; i < objects.size(); ++i) {
+        auto& offset = offsets[i];
+        if (offset == objects[i].size()) continue;
+        const auto size = std::min(chunk_size_distribution(rng_),
+                                   objects[i].size() - offset);
+        add_promises.emplace_back(
+            streams[i]->Add(kj::arrayPtr(objects[i].data() + offset, size)));
+        offset += size;
+        more = true;
+      }
+    }
+
+    for (size_t i = 0; i < objects.size(); ++i) {
+      auto key = streams[i]->Finish().wait(async_io_.waitScope);
+
+      const auto expected =
+          Hasher::Digest(algorithm, objects[i].data(), objects[i].size());
+      EXPECT_EQ(expected.ToString(), key.ToString());
+    }
+
+    for (auto& promise : add_promises) promise.wait(async_io_.waitScope);
+  }
+
+  kj::AsyncIoContext async_io_;
+
+  std::mt19937_64 rng_;
+};
+
+TEST_F(HashPoolTest, Inline) {
+  HashPool pool(*async_io_.lowLevelProvider, 0);
+  HashObjects(pool);
+}
+
+TEST_F(HashPoolTest, Threads) {
+  HashPool pool(*async_io_.lowLevelProvider, 3);
+  HashObjects(pool);
+}
+
+// Verifies that data waiting for room in the queue is hashed in order.
+TEST_F(HashPoolTest, FullQueue) {
+  HashPool pool(*async_io_.lowLevelProvider, 2, 2 * HashPool::kInlineHashSize);
+  HashObjects(pool);
+}
+
+TEST_F(HashPoolTest, BLAKE3) {
+  HashPool pool(*async_io_.lowLevelProvider, 3);
+  HashObjects(pool, KeyAlgorithm::kBLAKE3);
+}
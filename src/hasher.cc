@@ -0,0 +1,119 @@
+// Copyright 2016 Morten Hustveit <morten.hustveit@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations
+// including the two.
+//
+// You must obey the GNU General Public License in all respects
+// for all of the code used other than OpenSSL.  If you modify
+// file(s) with this exception, you may extend this exception to your
+// version of the file(s), but you are not obligated to do so.  If you
+// do not wish to do so, delete this exception statement from your
+// version.  If you delete this exception statement from all source
+// files in the program, then also delete it here.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/hasher.h"
+
+#include <openssl/sha.h>
+
+#include <kj/debug.h>
+
+#include "src/blake3.h"
+#include "src/sha1.h"
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+class SHA1Hasher : public Hasher {
+ public:
+  void Add(const void* data, size_t size) override { sha1_.Add(data, size); }
+
+  ObjectKey Finish() override {
+    CASKey digest;
+    sha1_.Finish(digest.begin());
+    return ObjectKey(digest);
+  }
+
+ private:
+  SHA1 sha1_;
+};
+
+class SHA256Hasher : public Hasher {
+ public:
+  SHA256Hasher() { SHA256_Init(&sha_ctx_); }
+
+  void Add(const void* data, size_t size) override {
+    SHA256_Update(&sha_ctx_, data, size);
+  }
+
+  ObjectKey Finish() override {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &sha_ctx_);
+    return ObjectKey(KeyAlgorithm::kSHA256, digest);
+  }
+
+ private:
+  SHA256_CTX sha_ctx_;
+};
+
+class BLAKE3Hasher : public Hasher {
+ public:
+  void Add(const void* data, size_t size) override { blake3_.Add(data, size); }
+
+  ObjectKey Finish() override {
+    uint8_t digest[BLAKE3::kDigestSize];
+    blake3_.Finish(digest);
+    return ObjectKey(KeyAlgorithm::kBLAKE3, digest);
+  }
+
+ private:
+  BLAKE3 blake3_;
+};
+
+}  // namespace
+
+std::unique_ptr<Hasher> Hasher::Create(KeyAlgorithm algorithm) {
+  switch (algorithm) {
+    case KeyAlgorithm::kSHA1:
+      return std::make_unique<SHA1Hasher>();
+
+    case KeyAlgorithm::kSHA256:
+      return std::make_unique<SHA256Hasher>();
+
+    case KeyAlgorithm::kBLAKE3:
+      return std::make_unique<BLAKE3Hasher>();
+  }
+
+  KJ_FAIL_REQUIRE("Unknown key algorithm", static_cast<int>(algorithm));
+}
+
+ObjectKey Hasher::Digest(KeyAlgorithm algorithm, const void* data,
+                         size_t size) {
+  auto hasher = Create(algorithm);
+  hasher->Add(data, size);
+  return hasher->Finish();
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
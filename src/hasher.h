@@ -0,0 +1,35 @@
+#ifndef CANTERA_HASHER_H_
+#define CANTERA_HASHER_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "key.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Computes object keys incrementally, using any of the supported key
+// algorithms.
+class Hasher {
+ public:
+  static std::unique_ptr<Hasher> Create(KeyAlgorithm algorithm);
+
+  // Returns the key of the `size` bytes at `data`.
+  static ObjectKey Digest(KeyAlgorithm algorithm, const void* data,
+                          size_t size);
+
+  virtual ~Hasher() = default;
+
+  virtual void Add(const void* data, size_t size) = 0;
+
+  // Returns the key of all the data added.  No more data may be added
+  // afterwards.
+  virtual ObjectKey Finish() = 0;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_HASHER_H_
@@ -0,0 +1,86 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "blake3.h"
+#include "hasher.h"
+#include "key.h"
+#include "util.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+namespace {
+
+std::string HexDigest(const ObjectKey& key) {
+  std::string result;
+  BinaryToHex(key.digest.data(), key.DigestSize(), &result);
+  return result;
+}
+
+}  // namespace
+
+TEST(HasherTest, BLAKE3) {
+  EXPECT_EQ("af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+            HexDigest(Hasher::Digest(KeyAlgorithm::kBLAKE3, "", 0)));
+  EXPECT_EQ("6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85",
+            HexDigest(Hasher::Digest(KeyAlgorithm::kBLAKE3, "abc", 3)));
+
+  // Spans several chunks, and is added in pieces not aligned to them.
+  std::vector<uint8_t> data(3000);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = i % 251;
+
+  auto hasher = Hasher::Create(KeyAlgorithm::kBLAKE3);
+  for (size_t offset = 0; offset < data.size(); offset += 333) {
+    hasher->Add(&data[offset], std::min<size_t>(333, data.size() - offset));
+  }
+  EXPECT_EQ("5fade288bf27444bee55ba2babb98c3c922c1e84c2e445e7d1f6da24756f5060",
+            HexDigest(hasher->Finish()));
+}
+
+TEST(HasherTest, SHA256) {
+  EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+            HexDigest(Hasher::Digest(KeyAlgorithm::kSHA256, "abc", 3)));
+}
+
+TEST(HasherTest, KeyEncoding) {
+  for (const auto algorithm : {KeyAlgorithm::kSHA1, KeyAlgorithm::kSHA256,
+                               KeyAlgorithm::kBLAKE3}) {
+    const auto key = Hasher::Digest(algorithm, "abc", 3);
+
+    auto wire = key.ToWire();
+    EXPECT_EQ(key.WireSize(), wire.size());
+    EXPECT_EQ(key, ObjectKey::FromWire(wire.asPtr()));
+    EXPECT_EQ(key, ObjectKey::FromString(key.ToString()));
+
+    // The storage key is a prefix of the digest.
+    const auto storage_key = key.StorageKey();
+    EXPECT_TRUE(std::equal(storage_key.begin(), storage_key.end(),
+                           key.digest.begin()));
+    EXPECT_EQ(storage_key, CASKey::FromString(key.ToString()));
+  }
+
+  // SHA-1 keys keep their untagged format.
+  const auto sha1 = Hasher::Digest(KeyAlgorithm::kSHA1, "abc", 3);
+  EXPECT_EQ(20U, sha1.ToWire().size());
+  EXPECT_EQ(sha1.StorageKey().ToString(), sha1.ToString());
+  EXPECT_EQ(sha1, ObjectKey::FromString(
+                      "A9993E364706816ABA3E25717850C26C9CD0D89D"));
+}
@@ -0,0 +1,51 @@
+#ifndef CANTERA_INDEX_ENTRY_H_
+#define CANTERA_INDEX_ENTRY_H_ 1
+
+#include <cstdint>
+
+#include "key.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Fields packed into `IndexEntry::offset`.  The algorithm is the
+// `KeyAlgorithm` used to compute the object's key, which is zero, meaning
+// SHA-1, in entries written before other algorithms were supported.
+const auto kBucketMask = UINT64_C(0x3f00000000000000);
+const auto kDeletedMask = UINT64_C(0x8000000000000000);
+const auto kAlgorithmMask = UINT64_C(0x0000c00000000000);
+const auto kOffsetMask = UINT64_C(0x00003fffffffffff);
+const int kAlgorithmShift = 46;
+
+// Upper bound on the number of data files addressable by `kBucketMask`.
+const size_t kMaxDataFiles = 64;
+
+struct IndexEntry {
+  IndexEntry() = default;
+
+  IndexEntry(const CASKey& key) : key(key) {}
+
+  uint64_t offset = 0;
+  uint32_t size = 0;
+  CASKey key;
+
+  bool operator==(const IndexEntry& rhs) const { return key == rhs.key; }
+};
+
+static_assert(sizeof(IndexEntry) == 32, "unexpected IndexEntry size");
+
+// Returns the bits of `IndexEntry::offset` recording `algorithm`.
+inline uint64_t AlgorithmBits(KeyAlgorithm algorithm) {
+  return static_cast<uint64_t>(algorithm) << kAlgorithmShift;
+}
+
+// Returns the algorithm used to compute the key of the object in `entry`.
+inline KeyAlgorithm EntryAlgorithm(const IndexEntry& entry) {
+  return static_cast<KeyAlgorithm>((entry.offset & kAlgorithmMask) >>
+                                   kAlgorithmShift);
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_INDEX_ENTRY_H_
@@ -0,0 +1,425 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/index-log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <kj/debug.h>
+
+#include "crc32c.h"
+#include "io.h"
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+const char kMagic[8] = {'C', 'A', 'S', 'I', 'D', 'X', 'L', 'G'};
+const uint32_t kVersion = 2;
+
+const size_t kBlockHeaderSize = 8;
+
+// Upper bound on the number of records in a block, to limit the amount of
+// data discarded if a block is damaged.
+const size_t kMaxBlockRecords = 4096;
+
+void EncodeUInt32(uint32_t value, uint8_t* output) {
+  for (size_t i = 0; i < 4; ++i) output[i] = value >> (i * 8);
+}
+
+uint32_t DecodeUInt32(const uint8_t* input) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < 4; ++i)
+    result |= static_cast<uint32_t>(input[i]) << (i * 8);
+  return result;
+}
+
+// Checks a block header that is invalid or describes a block running past the
+// end of the log.  Each append is a single write of whole blocks, so an
+// interrupted append leaves at most one partial block, at the very end, and
+// shorter than the largest possible block.  Anything else is damage that
+// truncating the log would silently turn into lost records.
+void CheckTail(const uint8_t* begin, const uint8_t* input,
+               const uint8_t* end) {
+  KJ_REQUIRE(end - input < static_cast<ptrdiff_t>(
+                               kBlockHeaderSize +
+                               kMaxBlockRecords * kIndexLogRecordSize),
+             "damaged index log block header before the end of the log",
+             input - begin, end - begin);
+}
+
+static_assert(((kAlgorithmMask | kOffsetMask) >> 48) == 0,
+              "offset and key algorithm must fit in 48 bits");
+
+void EncodeRecord(const IndexEntry& entry, uint8_t* output) {
+  const auto offset = entry.offset & (kAlgorithmMask | kOffsetMask);
+
+  std::copy(entry.key.begin(), entry.key.end(), output);
+  output += entry.key.size();
+
+  *output++ = entry.offset >> 56;
+  for (size_t i = 0; i < 6; ++i) *output++ = offset >> (i * 8);
+  EncodeUInt32(entry.size, output);
+}
+
+IndexEntry DecodeRecord(const uint8_t* input) {
+  IndexEntry result;
+
+  std::copy(input, input + result.key.size(), result.key.begin());
+  input += result.key.size();
+
+  result.offset = static_cast<uint64_t>(*input++) << 56;
+  for (size_t i = 0; i < 6; ++i)
+    result.offset |= static_cast<uint64_t>(*input++) << (i * 8);
+  result.size = DecodeUInt32(input);
+
+  return result;
+}
+
+}  // namespace
+
+IndexLogFormat GetIndexLogFormat(int fd) {
+  off_t size;
+  KJ_SYSCALL(size = lseek(fd, 0, SEEK_END));
+  if (!size) return IndexLogFormat::kEmpty;
+
+  // In the legacy format, the first 8 bytes are the offset of an object, with
+  // the data file index in the high byte.  The magic string corresponds to an
+  // index beyond the maximum number of data files, so it's not ambiguous.
+  char magic[sizeof(kMagic)];
+  if (size < static_cast<off_t>(sizeof(magic))) return IndexLogFormat::kLegacy;
+  ReadWithOffset(fd, magic, sizeof(magic), 0);
+  if (memcmp(magic, kMagic, sizeof(kMagic))) return IndexLogFormat::kLegacy;
+
+  return IndexLogFormat::kCurrent;
+}
+
+void InitIndexLog(int fd) {
+  uint8_t header[kIndexLogHeaderSize];
+  memcpy(header, kMagic, sizeof(kMagic));
+  EncodeUInt32(kVersion, header + 8);
+  EncodeUInt32(kIndexLogRecordSize, header + 12);
+
+  KJ_SYSCALL(ftruncate(fd, 0));
+  WriteWithOffset(fd, header, sizeof(header), 0);
+}
+
+void AppendIndexLog(int fd, kj::ArrayPtr<const IndexEntry> entries) {
+  if (!entries.size()) return;
+
+  const auto block_count =
+      (entries.size() + kMaxBlockRecords - 1) / kMaxBlockRecords;
+  std::vector<uint8_t> buffer(block_count * kBlockHeaderSize +
+                              entries.size() * kIndexLogRecordSize);
+
+  auto output = buffer.data();
+
+  for (size_t i = 0; i < entries.size(); i += kMaxBlockRecords) {
+    const auto count = std::min(kMaxBlockRecords, entries.size() - i);
+    const auto records = output + kBlockHeaderSize;
+
+    for (size_t j = 0; j < count; ++j)
+      EncodeRecord(entries[i + j], records + j * kIndexLogRecordSize);
+
+    EncodeUInt32(count, output);
+    EncodeUInt32(CRC32C(records, count * kIndexLogRecordSize), output + 4);
+
+    output = records + count * kIndexLogRecordSize;
+  }
+
+  KJ_ASSERT(output == buffer.data() + buffer.size());
+
+  kj::FdOutputStream(fd).write(buffer.data(), buffer.size());
+}
+
+off_t ReadIndexLog(int fd,
+                   const std::function<void(const IndexEntry&)>& function) {
+  const auto format = GetIndexLogFormat(fd);
+  if (format == IndexLogFormat::kEmpty) return 0;
+
+  const auto data = ReadFile(fd);
+  const auto begin = reinterpret_cast<const uint8_t*>(data.begin());
+  const auto end = begin + data.size();
+
+  if (format == IndexLogFormat::kLegacy) {
+    // Legacy records are the in-memory layout of `IndexEntry`.
+    static const size_t kLegacyRecordSize = 32;
+    const auto count = data.size() / kLegacyRecordSize;
+
+    for (size_t i = 0; i < count; ++i) {
+      const auto record = begin + i * kLegacyRecordSize;
+
+      IndexEntry entry;
+      memcpy(&entry.offset, record, sizeof(entry.offset));
+      memcpy(&entry.size, record + 8, sizeof(entry.size));
+      std::copy(record + 12, record + kLegacyRecordSize, entry.key.begin());
+      function(entry);
+    }
+
+    return count * kLegacyRecordSize;
+  }
+
+  KJ_REQUIRE(data.size() >= kIndexLogHeaderSize, "truncated index log header");
+  KJ_REQUIRE(DecodeUInt32(begin + 8) == kVersion,
+             "unsupported index log version", DecodeUInt32(begin + 8));
+  KJ_REQUIRE(DecodeUInt32(begin + 12) == kIndexLogRecordSize,
+             "unexpected index log record size", DecodeUInt32(begin + 12));
+
+  auto input = begin + kIndexLogHeaderSize;
+
+  while (end - input >= static_cast<ptrdiff_t>(kBlockHeaderSize)) {
+    const auto count = DecodeUInt32(input);
+    const auto records = input + kBlockHeaderSize;
+
+    if (!count || count > kMaxBlockRecords ||
+        count * kIndexLogRecordSize > static_cast<size_t>(end - records)) {
+      CheckTail(begin, input, end);
+      break;
+    }
+
+    const auto block_end = records + count * kIndexLogRecordSize;
+
+    if (CRC32C(records, count * kIndexLogRecordSize) !=
+        DecodeUInt32(input + 4)) {
+      // Only the last block may have been damaged by an interrupted write.
+      KJ_REQUIRE(block_end == end, "index log checksum mismatch",
+                 input - begin);
+      break;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+      function(DecodeRecord(records + i * kIndexLogRecordSize));
+
+    input = block_end;
+  }
+
+  return input - begin;
+}
+
+IndexLogReplay ReplayIndexLog(int fd, size_t thread_count) {
+  using Clock = std::chrono::steady_clock;
+
+  KJ_REQUIRE(thread_count > 0);
+
+  IndexLogReplay result;
+
+  const auto format = GetIndexLogFormat(fd);
+  if (format == IndexLogFormat::kEmpty) return result;
+  KJ_REQUIRE(format == IndexLogFormat::kCurrent,
+             "legacy index log must be migrated before replay");
+
+  auto phase_start = Clock::now();
+
+  const auto data = ReadFile(fd);
+  const auto begin = reinterpret_cast<const uint8_t*>(data.begin());
+  const auto end = begin + data.size();
+
+  KJ_REQUIRE(data.size() >= kIndexLogHeaderSize, "truncated index log header");
+  KJ_REQUIRE(DecodeUInt32(begin + 8) == kVersion,
+             "unsupported index log version", DecodeUInt32(begin + 8));
+  KJ_REQUIRE(DecodeUInt32(begin + 12) == kIndexLogRecordSize,
+             "unexpected index log record size", DecodeUInt32(begin + 12));
+
+  // Locate the blocks.  Only the headers are read here; checksums are
+  // verified by the worker threads.
+  std::vector<const uint8_t*> blocks;
+
+  auto input = begin + kIndexLogHeaderSize;
+
+  while (end - input >= static_cast<ptrdiff_t>(kBlockHeaderSize)) {
+    const auto count = DecodeUInt32(input);
+    const auto records = input + kBlockHeaderSize;
+
+    if (!count || count > kMaxBlockRecords ||
+        count * kIndexLogRecordSize > static_cast<size_t>(end - records)) {
+      CheckTail(begin, input, end);
+      break;
+    }
+
+    const auto block_end = records + count * kIndexLogRecordSize;
+
+    blocks.emplace_back(input);
+    result.record_count += count;
+    input = block_end;
+  }
+
+  blocks.emplace_back(input);
+
+  const auto now = Clock::now();
+  result.read_time = now - phase_start;
+  phase_start = now;
+
+  const auto block_count = blocks.size() - 1;
+
+  if (!block_count) {
+    result.valid_size = input - begin;
+    return result;
+  }
+
+  // Split the blocks into ranges holding roughly the same number of records.
+  // Each range is deduplicated separately, with the keys divided among
+  // `thread_count` partitions so that the partitions can be merged in
+  // parallel.
+  using Partition = std::unordered_map<CASKey, IndexEntry>;
+
+  thread_count = std::max<size_t>(1, std::min(thread_count, block_count));
+
+  std::vector<size_t> range_begin;
+  for (size_t i = 0, records = 0; i < block_count; ++i) {
+    const auto block_records = DecodeUInt32(blocks[i]);
+    if (records * thread_count >= range_begin.size() * result.record_count)
+      range_begin.emplace_back(i);
+    records += block_records;
+  }
+  range_begin.emplace_back(block_count);
+
+  const auto range_count = range_begin.size() - 1;
+
+  const auto partition_of = [thread_count](const CASKey& key) {
+    return (static_cast<size_t>(key[0]) << 8 | key[1]) % thread_count;
+  };
+
+  std::vector<std::vector<Partition>> ranges(range_count);
+
+  // Index of the first block failing its checksum in each range, or
+  // `block_count` if none.
+  std::vector<size_t> damaged_block(range_count, block_count);
+
+  std::vector<std::future<void>> tasks;
+
+  for (size_t r = 0; r < range_count; ++r) {
+    tasks.emplace_back(std::async(std::launch::async, [&, r] {
+      auto& partitions = ranges[r];
+      partitions.resize(thread_count);
+
+      for (auto i = range_begin[r]; i < range_begin[r + 1]; ++i) {
+        const auto count = DecodeUInt32(blocks[i]);
+        const auto records = blocks[i] + kBlockHeaderSize;
+
+        if (CRC32C(records, count * kIndexLogRecordSize) !=
+            DecodeUInt32(blocks[i] + 4)) {
+          damaged_block[r] = i;
+          break;
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+          const auto entry = DecodeRecord(records + j * kIndexLogRecordSize);
+          partitions[partition_of(entry.key)][entry.key] = entry;
+        }
+      }
+    }));
+  }
+
+  for (auto& task : tasks) task.get();
+  tasks.clear();
+
+  // Only the last block may have been damaged by an interrupted write.
+  auto valid_blocks = block_count;
+
+  for (size_t r = 0; r < range_count; ++r) {
+    if (damaged_block[r] == block_count) continue;
+
+    const auto block = damaged_block[r];
+    KJ_REQUIRE(block + 1 == block_count && blocks[block + 1] == end,
+               "index log checksum mismatch", blocks[block] - begin);
+
+    valid_blocks = block;
+    result.record_count -= DecodeUInt32(blocks[block]);
+  }
+
+  result.valid_size = blocks[valid_blocks] - begin;
+
+  const auto decoded = Clock::now();
+  result.decode_time = decoded - phase_start;
+  phase_start = decoded;
+
+  // Merge each partition across the ranges, in log order, so that later
+  // records replace earlier ones.
+  std::vector<std::vector<IndexEntry>> merged(thread_count);
+
+  for (size_t p = 0; p < thread_count; ++p) {
+    tasks.emplace_back(std::async(std::launch::async, [&, p] {
+      auto partition = std::move(ranges[0][p]);
+
+      for (size_t r = 1; r < range_count; ++r) {
+        for (const auto& key_entry : ranges[r][p])
+          partition[key_entry.first] = key_entry.second;
+        Partition().swap(ranges[r][p]);
+      }
+
+      merged[p].reserve(partition.size());
+      for (const auto& key_entry : partition)
+        merged[p].emplace_back(key_entry.second);
+    }));
+  }
+
+  for (auto& task : tasks) task.get();
+
+  size_t entry_count = 0;
+  for (const auto& partition : merged) entry_count += partition.size();
+
+  result.entries.reserve(entry_count);
+  for (const auto& partition : merged)
+    result.entries.insert(result.entries.end(), partition.begin(),
+                          partition.end());
+
+  result.merge_time = Clock::now() - phase_start;
+
+  return result;
+}
+
+kj::AutoCloseFd MigrateIndexLog(int dir_fd, const char* path, int fd) {
+  KJ_CONTEXT(path);
+
+  auto new_log = AnonTemporaryFile(".", 0666);
+  InitIndexLog(new_log.get());
+
+  KJ_SYSCALL(lseek(new_log.get(), 0, SEEK_END));
+
+  std::vector<IndexEntry> buffer;
+
+  const auto flush = [&new_log, &buffer] {
+    AppendIndexLog(new_log.get(), kj::arrayPtr(buffer.data(), buffer.size()));
+    buffer.clear();
+  };
+
+  ReadIndexLog(fd, [&buffer, &flush](const IndexEntry& entry) {
+    buffer.emplace_back(entry);
+    if (buffer.size() == 65536) flush();
+  });
+
+  flush();
+
+  KJ_SYSCALL(fsync(new_log.get()));
+
+  LinkAnonTemporaryFile(dir_fd, new_log.get(), path);
+
+  return OpenFile(dir_fd, path, O_RDWR | O_APPEND);
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,98 @@
+#ifndef CANTERA_INDEX_LOG_H_
+#define CANTERA_INDEX_LOG_H_ 1
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <kj/common.h>
+#include <kj/io.h>
+
+#include "index-entry.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// The index log holds every insertion and deletion made since the last index
+// checkpoint.
+//
+// File layout: a 16 byte header holding a magic string, the format version
+// and the record size, followed by blocks.  Each block is a 32-bit record
+// count and the CRC-32C of its records, followed by the records themselves.
+// A record is the 20 byte key, followed by a byte holding the data file index
+// and deletion flag, 48 bits holding the offset and the key algorithm, as
+// packed into `IndexEntry::offset`, and the 32-bit size, all little endian.
+//
+// The first version of the format had no header, and consisted of raw
+// `IndexEntry` structures.
+
+const size_t kIndexLogHeaderSize = 16;
+const size_t kIndexLogRecordSize = 31;
+
+// Largest object offset that can be represented in the log.
+const uint64_t kIndexLogMaxOffset = kOffsetMask;
+
+enum class IndexLogFormat {
+  kEmpty,
+  kLegacy,
+  kCurrent,
+};
+
+// Determines the format of the index log stored in `fd`.
+IndexLogFormat GetIndexLogFormat(int fd);
+
+// Writes the header of an empty index log.
+void InitIndexLog(int fd);
+
+// Appends `entries` to the index log in `fd`, which must be opened with
+// O_APPEND.  All entries are written with a single system call.
+void AppendIndexLog(int fd, kj::ArrayPtr<const IndexEntry> entries);
+
+// Invokes `function` for every entry in the index log in `fd`, in order.
+// Both the current and the legacy format are supported.
+//
+// Returns the file offset following the last complete block.  Anything beyond
+// that is the remains of an interrupted write, and can be truncated.  Damage
+// that an interrupted write can not explain, such as an invalid block header
+// or checksum followed by more than a block's worth of data, throws instead.
+off_t ReadIndexLog(int fd,
+                   const std::function<void(const IndexEntry&)>& function);
+
+struct IndexLogReplay {
+  // The last record for every key in the log, in no particular order.
+  // Records with `kDeletedMask` set are included.
+  std::vector<IndexEntry> entries;
+
+  // Number of records in the log, including those superseded by later
+  // records.
+  size_t record_count = 0;
+
+  // File offset following the last complete block, as returned by
+  // `ReadIndexLog()`.
+  off_t valid_size = 0;
+
+  // Time spent reading the file and locating blocks, checking and decoding
+  // blocks, and merging the per-thread results.
+  std::chrono::steady_clock::duration read_time{};
+  std::chrono::steady_clock::duration decode_time{};
+  std::chrono::steady_clock::duration merge_time{};
+};
+
+// Reads the current format index log in `fd`, keeping only the last record
+// for each key.  The blocks are split into contiguous ranges that are checked,
+// decoded and deduplicated by up to `thread_count` threads, and the results
+// are then merged in parallel, partitioned by key.
+IndexLogReplay ReplayIndexLog(int fd, size_t thread_count);
+
+// Converts the legacy format index log `fd`, named `path` relative to
+// `dir_fd`, to the current format, atomically replacing the old file.
+// Returns a descriptor for the new file, opened for appending.
+kj::AutoCloseFd MigrateIndexLog(int dir_fd, const char* path, int fd);
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_INDEX_LOG_H_
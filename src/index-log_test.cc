@@ -0,0 +1,232 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "index-log.h"
+#include "io.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+struct IndexLogTest : testing::Test {
+ protected:
+  std::vector<IndexEntry> RandomEntries(size_t count) {
+    std::uniform_int_distribution<uint8_t> byte_distribution;
+    std::uniform_int_distribution<uint64_t> offset_distribution(
+        0, kIndexLogMaxOffset);
+    std::uniform_int_distribution<uint64_t> file_distribution(0, 49);
+    std::uniform_int_distribution<int> algorithm_distribution(0, 2);
+
+    std::vector<IndexEntry> result(count);
+
+    for (auto& entry : result) {
+      for (auto& b : entry.key) b = byte_distribution(rng_);
+      entry.offset = offset_distribution(rng_) | (file_distribution(rng_) << 56);
+      entry.offset |= AlgorithmBits(
+          static_cast<KeyAlgorithm>(algorithm_distribution(rng_)));
+      if (rng_() & 1) entry.offset |= kDeletedMask;
+      entry.size = rng_();
+    }
+
+    return result;
+  }
+
+  std::vector<IndexEntry> ReadAll(int fd, off_t* valid_size = nullptr) {
+    std::vector<IndexEntry> result;
+    const auto size = ReadIndexLog(
+        fd, [&result](const IndexEntry& entry) { result.emplace_back(entry); });
+    if (valid_size) *valid_size = size;
+    return result;
+  }
+
+  void ExpectEqual(const std::vector<IndexEntry>& expected,
+                   const std::vector<IndexEntry>& actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_EQ(expected[i].key, actual[i].key);
+      EXPECT_EQ(expected[i].offset, actual[i].offset);
+      EXPECT_EQ(expected[i].size, actual[i].size);
+    }
+  }
+
+  std::mt19937_64 rng_;
+};
+
+// Verifies that entries survive a round trip through the log, and that a
+// partially written block at the end is ignored.
+TEST_F(IndexLogTest, AppendAndRead) {
+  auto log = AnonTemporaryFile(nullptr);
+  EXPECT_EQ(IndexLogFormat::kEmpty, GetIndexLogFormat(log.get()));
+
+  InitIndexLog(log.get());
+  EXPECT_EQ(IndexLogFormat::kCurrent, GetIndexLogFormat(log.get()));
+  EXPECT_TRUE(ReadAll(log.get()).empty());
+
+  KJ_SYSCALL(fcntl(log.get(), F_SETFL, O_APPEND));
+
+  auto expected = RandomEntries(10000);
+  AppendIndexLog(log.get(), kj::arrayPtr(expected.data(), 1));
+  AppendIndexLog(log.get(),
+                 kj::arrayPtr(expected.data() + 1, expected.size() - 1));
+
+  off_t valid_size;
+  ExpectEqual(expected, ReadAll(log.get(), &valid_size));
+
+  off_t size;
+  KJ_SYSCALL(size = lseek(log.get(), 0, SEEK_END));
+  EXPECT_EQ(size, valid_size);
+
+  auto extra = RandomEntries(10);
+  AppendIndexLog(log.get(), kj::arrayPtr(extra.data(), extra.size()));
+  KJ_SYSCALL(ftruncate(log.get(), size + 100));
+
+  ExpectEqual(expected, ReadAll(log.get(), &valid_size));
+  EXPECT_EQ(size, valid_size);
+}
+
+// Verifies that a log in the unversioned format is converted to the current
+// format.
+TEST_F(IndexLogTest, MigrateLegacy) {
+  auto expected = RandomEntries(1000);
+
+  char path[] = "/tmp/index-log-test.XXXXXX";
+  ASSERT_TRUE(mkdtemp(path) != nullptr);
+
+  auto dir_fd = OpenFile(path, O_RDONLY | O_DIRECTORY);
+
+  {
+    auto legacy = OpenFile(dir_fd.get(), "index", O_WRONLY | O_CREAT);
+    WriteWithOffset(legacy.get(), expected.data(),
+                    expected.size() * sizeof(IndexEntry), 0);
+  }
+
+  auto legacy = OpenFile(dir_fd.get(), "index", O_RDONLY);
+  EXPECT_EQ(IndexLogFormat::kLegacy, GetIndexLogFormat(legacy.get()));
+  ExpectEqual(expected, ReadAll(legacy.get()));
+
+  auto migrated = MigrateIndexLog(dir_fd.get(), "index", legacy.get());
+  EXPECT_EQ(IndexLogFormat::kCurrent, GetIndexLogFormat(migrated.get()));
+  ExpectEqual(expected, ReadAll(migrated.get()));
+
+  KJ_SYSCALL(unlinkat(dir_fd.get(), "index", 0));
+  KJ_SYSCALL(rmdir(path));
+}
+
+// Verifies that replaying the log in parallel yields the last record for each
+// key, and ignores a damaged block at the end.
+TEST_F(IndexLogTest, ParallelReplay) {
+  auto log = AnonTemporaryFile(nullptr);
+  InitIndexLog(log.get());
+  KJ_SYSCALL(fcntl(log.get(), F_SETFL, O_APPEND));
+
+  // Reuse keys, so that most of them appear in several blocks.
+  auto entries = RandomEntries(50000);
+  for (size_t i = 1000; i < entries.size(); ++i)
+    entries[i].key = entries[rng_() % 1000].key;
+
+  for (size_t i = 0; i < entries.size(); i += 3000) {
+    const auto count = std::min<size_t>(3000, entries.size() - i);
+    AppendIndexLog(log.get(), kj::arrayPtr(entries.data() + i, count));
+  }
+
+  off_t size;
+  KJ_SYSCALL(size = lseek(log.get(), 0, SEEK_END));
+
+  auto extra = RandomEntries(10);
+  AppendIndexLog(log.get(), kj::arrayPtr(extra.data(), extra.size()));
+
+  // Corrupt the last record of the final block.  Positioned writes ignore
+  // the offset in append mode.
+  off_t damaged_size;
+  KJ_SYSCALL(damaged_size = lseek(log.get(), 0, SEEK_END));
+  KJ_SYSCALL(fcntl(log.get(), F_SETFL, 0));
+  const char garbage = 0x55;
+  WriteWithOffset(log.get(), &garbage, 1, damaged_size - 1);
+
+  std::map<CASKey, IndexEntry> expected;
+  for (const auto& entry : entries) expected[entry.key] = entry;
+
+  for (size_t thread_count : {1, 3, 8}) {
+    auto replay = ReplayIndexLog(log.get(), thread_count);
+    EXPECT_EQ(size, replay.valid_size);
+    EXPECT_EQ(entries.size(), replay.record_count);
+
+    std::sort(
+        replay.entries.begin(), replay.entries.end(),
+        [](const auto& lhs, const auto& rhs) { return lhs.key < rhs.key; });
+
+    std::vector<IndexEntry> expected_entries;
+    for (const auto& key_entry : expected)
+      expected_entries.emplace_back(key_entry.second);
+
+    ExpectEqual(expected_entries, replay.entries);
+  }
+}
+
+// Verifies that an invalid block header is only tolerated at the end of the
+// log, where an interrupted append can leave one.
+TEST_F(IndexLogTest, DamagedBlockHeader) {
+  auto log = AnonTemporaryFile(nullptr);
+  InitIndexLog(log.get());
+  KJ_SYSCALL(fcntl(log.get(), F_SETFL, O_APPEND));
+
+  auto entries = RandomEntries(20000);
+  for (size_t i = 0; i < entries.size(); i += 5000)
+    AppendIndexLog(log.get(), kj::arrayPtr(entries.data() + i, 5000));
+
+  off_t size;
+  KJ_SYSCALL(size = lseek(log.get(), 0, SEEK_END));
+
+  auto extra = RandomEntries(10);
+  AppendIndexLog(log.get(), kj::arrayPtr(extra.data(), extra.size()));
+  KJ_SYSCALL(fcntl(log.get(), F_SETFL, 0));
+
+  // Overwrites the record count of the block starting at `offset`.
+  const auto write_count = [&log](uint32_t count, off_t offset) {
+    const uint8_t header[4] = {
+        static_cast<uint8_t>(count), static_cast<uint8_t>(count >> 8),
+        static_cast<uint8_t>(count >> 16), static_cast<uint8_t>(count >> 24)};
+    WriteWithOffset(log.get(), header, sizeof(header), offset);
+  };
+
+  // Garbage in place of the final block's header is the remains of an
+  // interrupted append.
+  for (const uint32_t count : {0U, 4097U, 11U, 0xffffffffU}) {
+    write_count(count, size);
+
+    off_t valid_size;
+    ExpectEqual(entries, ReadAll(log.get(), &valid_size));
+    EXPECT_EQ(size, valid_size) << count;
+    EXPECT_EQ(size, ReplayIndexLog(log.get(), 3).valid_size) << count;
+  }
+
+  // The same damage to the first block must not discard everything after it.
+  for (const uint32_t count : {0U, 4097U, 0xffffffffU}) {
+    write_count(count, kIndexLogHeaderSize);
+
+    EXPECT_THROW(ReadAll(log.get()), kj::Exception) << count;
+    EXPECT_THROW(ReplayIndexLog(log.get(), 3), kj::Exception) << count;
+  }
+}
@@ -0,0 +1,218 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/index-table.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+const int8_t kEmpty = -128;
+const int8_t kDeleted = -2;
+
+uint64_t Hash(const CASKey& key) {
+  // Keys are normally uniformly distributed already, but the high bits of the
+  // product depend on every bit of the prefix, which protects against
+  // degenerate probe sequences for keys that are not.  The low bits only
+  // depend on the low bits of the prefix, and are not used.
+  return key.Prefix() * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+// Returns the first group probed for a key with the given hash, taken from
+// the `group_bits` highest bits.
+size_t HomeGroup(uint64_t hash, size_t group_bits) {
+  // Shifting by 64 is undefined, so an empty shift is split in two.
+  return hash >> 1 >> (63 - group_bits);
+}
+
+// Returns the control byte stored for a key with the given hash: the 7 bits
+// following those selecting the home group.
+int8_t Tag(uint64_t hash, size_t group_bits) {
+  return (hash << group_bits) >> 57;
+}
+
+// Returns a bit mask of the slots in `control` equal to `value`.
+uint32_t Match(const int8_t* control, int8_t value) {
+#ifdef __SSE2__
+  const auto group = _mm_load_si128(reinterpret_cast<const __m128i*>(control));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value)));
+#else
+  uint32_t result = 0;
+  for (size_t i = 0; i < 16; ++i) {
+    if (control[i] == value) result |= 1U << i;
+  }
+  return result;
+#endif
+}
+
+// Returns a bit mask of the slots in `control` that are empty or deleted.
+uint32_t MatchFree(const int8_t* control) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(control)));
+#else
+  uint32_t result = 0;
+  for (size_t i = 0; i < 16; ++i) {
+    if (control[i] < 0) result |= 1U << i;
+  }
+  return result;
+#endif
+}
+
+// Returns the number of slots that may be used before the table must grow.
+size_t MaxUsed(size_t slots) { return slots - slots / 8; }
+
+}  // namespace
+
+const IndexEntry* IndexTable::Find(const CASKey& key) const {
+  return FindSlot(key, Hash(key));
+}
+
+void IndexTable::Insert(const IndexEntry& entry) {
+  const auto hash = Hash(entry.key);
+
+  if (auto slot = FindSlot(entry.key, hash)) {
+    *slot = entry;
+    return;
+  }
+
+  if (used_ + 1 > MaxUsed(group_count_ * kGroupSize)) Rehash(size_ + 1);
+
+  InsertNew(entry, hash);
+}
+
+bool IndexTable::Erase(const CASKey& key) {
+  auto slot = FindSlot(key, Hash(key));
+  if (!slot) return false;
+
+  const auto offset = reinterpret_cast<char*>(slot) -
+                      reinterpret_cast<char*>(groups_.get());
+  auto& group = groups_[offset / sizeof(Group)];
+  const auto idx = slot - group.entries;
+
+  // Lookups stop at the first group having an empty slot, so if this group
+  // already has one, no probe sequence continues past it, and the slot can be
+  // made empty as well.
+  if (Match(group.control, kEmpty)) {
+    group.control[idx] = kEmpty;
+    --used_;
+  } else {
+    group.control[idx] = kDeleted;
+  }
+
+  --size_;
+
+  return true;
+}
+
+void IndexTable::Reserve(size_t n) {
+  if (n > MaxUsed(group_count_ * kGroupSize)) Rehash(n);
+}
+
+void IndexTable::Clear() {
+  groups_.reset();
+  group_count_ = 0;
+  group_bits_ = 0;
+  size_ = 0;
+  used_ = 0;
+}
+
+IndexEntry* IndexTable::FindSlot(const CASKey& key, uint64_t hash) const {
+  if (!group_count_) return nullptr;
+
+  const auto tag = Tag(hash, group_bits_);
+  const auto mask = group_count_ - 1;
+
+  // Triangular probing visits every group when the group count is a power of
+  // two.
+  for (size_t i = HomeGroup(hash, group_bits_), step = 1;;
+       i = (i + step++) & mask) {
+    auto& group = groups_[i];
+
+    for (auto matches = Match(group.control, tag); matches;
+         matches &= matches - 1) {
+      auto& entry = group.entries[__builtin_ctz(matches)];
+      if (entry.key == key) return &entry;
+    }
+
+    if (Match(group.control, kEmpty)) return nullptr;
+
+    KJ_ASSERT(step <= group_count_);
+  }
+}
+
+void IndexTable::Rehash(size_t n) {
+  size_t group_count = 1, group_bits = 0;
+  while (MaxUsed(group_count * kGroupSize) < n) {
+    group_count *= 2;
+    ++group_bits;
+  }
+
+  auto old_groups = std::move(groups_);
+  const auto old_group_count = group_count_;
+
+  groups_.reset(new Group[group_count]);
+  group_count_ = group_count;
+  group_bits_ = group_bits;
+  size_ = 0;
+  used_ = 0;
+
+  for (size_t i = 0; i < group_count; ++i)
+    memset(groups_[i].control, kEmpty, kGroupSize);
+
+  for (size_t i = 0; i < old_group_count; ++i) {
+    const auto& group = old_groups[i];
+    for (size_t j = 0; j < kGroupSize; ++j) {
+      if (group.control[j] >= 0)
+        InsertNew(group.entries[j], Hash(group.entries[j].key));
+    }
+  }
+}
+
+void IndexTable::InsertNew(const IndexEntry& entry, uint64_t hash) {
+  const auto mask = group_count_ - 1;
+
+  for (size_t i = HomeGroup(hash, group_bits_), step = 1;;
+       i = (i + step++) & mask) {
+    auto& group = groups_[i];
+
+    if (auto free = MatchFree(group.control)) {
+      const auto idx = __builtin_ctz(free);
+      if (group.control[idx] == kEmpty) ++used_;
+      group.control[idx] = Tag(hash, group_bits_);
+      group.entries[idx] = entry;
+      break;
+    }
+  }
+
+  ++size_;
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
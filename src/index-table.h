@@ -0,0 +1,105 @@
+#ifndef CANTERA_INDEX_TABLE_H_
+#define CANTERA_INDEX_TABLE_H_ 1
+
+#include <cstdint>
+#include <memory>
+
+#include <kj/common.h>
+
+#include "index-entry.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Open addressing hash table holding index entries, keyed on
+// `CASKey::Prefix()`.
+//
+// Slots are arranged in groups of 16, each group storing one control byte per
+// slot followed by the entries themselves.  A control byte is either empty,
+// deleted, or 7 bits of the key's hash, so candidate slots in a group are found
+// with a single SIMD comparison, and the entry is usually in the same or the
+// next cache line.  Compared to a node based hash set, there is no per entry
+// allocation and no pointer chasing.
+//
+// Each slot costs 33 bytes, and the table grows once 7/8 of them are in use.
+// `ObjectIndex` only keeps the changes made since the last checkpoint here;
+// the remaining objects cost 32 bytes each in the memory mapped base segment.
+class IndexTable {
+ public:
+  IndexTable() = default;
+
+  IndexTable(IndexTable&&) = default;
+  IndexTable& operator=(IndexTable&&) = default;
+
+  KJ_DISALLOW_COPY(IndexTable);
+
+  // Returns the entry for `key`, or nullptr if `key` is not present.
+  const IndexEntry* Find(const CASKey& key) const;
+
+  // Inserts `entry`, replacing any existing entry with the same key.
+  void Insert(const IndexEntry& entry);
+
+  // Removes the entry for `key`.  Returns false if `key` was not present.
+  bool Erase(const CASKey& key);
+
+  // Makes room for at least `n` entries without further allocation.
+  void Reserve(size_t n);
+
+  // Removes all entries, and releases the memory used.
+  void Clear();
+
+  size_t size() const { return size_; }
+
+  // Returns the number of bytes allocated for the table.
+  size_t MemoryUsage() const { return group_count_ * sizeof(Group); }
+
+  // Invokes `function` for every entry, in no particular order.  The table
+  // must not be modified while this is running.
+  template <typename Function>
+  void ForEach(Function&& function) const {
+    for (size_t i = 0; i < group_count_; ++i) {
+      const auto& group = groups_[i];
+      for (size_t j = 0; j < kGroupSize; ++j) {
+        if (group.control[j] >= 0) function(group.entries[j]);
+      }
+    }
+  }
+
+ private:
+  static const size_t kGroupSize = 16;
+
+  struct alignas(16) Group {
+    int8_t control[kGroupSize];
+    IndexEntry entries[kGroupSize];
+  };
+
+  // Returns the slot holding `key`, or nullptr if `key` is not present.
+  IndexEntry* FindSlot(const CASKey& key, uint64_t hash) const;
+
+  // Rebuilds the table with room for at least `n` entries, discarding deletion
+  // markers.
+  void Rehash(size_t n);
+
+  // Stores `entry` in the first free slot of its probe sequence.  The key
+  // must not already be present.
+  void InsertNew(const IndexEntry& entry, uint64_t hash);
+
+  std::unique_ptr<Group[]> groups_;
+
+  // Always zero or a power of two.
+  size_t group_count_ = 0;
+
+  // Base 2 logarithm of `group_count_`, or zero if there are no groups.
+  size_t group_bits_ = 0;
+
+  // Number of live entries.
+  size_t size_ = 0;
+
+  // Number of slots holding live entries or deletion markers.
+  size_t used_ = 0;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_INDEX_TABLE_H_
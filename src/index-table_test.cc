@@ -0,0 +1,138 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "index-table.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+// Verifies that a random sequence of inserts, replacements and removals yields
+// the same result as a standard hash map.
+TEST(IndexTableTest, RandomOperations) {
+  static const size_t kOperationCount = 200000;
+
+  std::mt19937_64 rng;
+  std::uniform_int_distribution<uint8_t> byte_distribution;
+  std::uniform_int_distribution<int> operation_distribution(0, 3);
+
+  IndexTable table;
+  std::unordered_map<CASKey, IndexEntry> expected;
+  std::vector<CASKey> keys;
+
+  for (size_t i = 0; i < kOperationCount; ++i) {
+    const auto operation = operation_distribution(rng);
+
+    if (operation == 0 && !keys.empty()) {
+      std::uniform_int_distribution<size_t> key_distribution(0,
+                                                             keys.size() - 1);
+      const auto key = keys[key_distribution(rng)];
+      EXPECT_EQ(expected.erase(key) > 0, table.Erase(key));
+    } else {
+      IndexEntry entry;
+      if (operation == 1 && !keys.empty()) {
+        entry.key = keys[i % keys.size()];
+      } else {
+        for (auto& b : entry.key) b = byte_distribution(rng);
+        keys.emplace_back(entry.key);
+      }
+      entry.offset = rng();
+      entry.size = i;
+
+      table.Insert(entry);
+      expected[entry.key] = entry;
+    }
+  }
+
+  ASSERT_EQ(expected.size(), table.size());
+
+  for (const auto& key : keys) {
+    auto entry = table.Find(key);
+    auto i = expected.find(key);
+
+    if (i == expected.end()) {
+      EXPECT_TRUE(entry == nullptr);
+    } else {
+      ASSERT_TRUE(entry != nullptr);
+      EXPECT_EQ(i->second.offset, entry->offset);
+      EXPECT_EQ(i->second.size, entry->size);
+    }
+  }
+
+  size_t count = 0;
+  table.ForEach([&expected, &count](const IndexEntry& entry) {
+    ++count;
+    EXPECT_EQ(1U, expected.count(entry.key));
+  });
+  EXPECT_EQ(expected.size(), count);
+}
+
+// Verifies that reserving space up front avoids over-allocation.
+TEST(IndexTableTest, Reserve) {
+  static const size_t kEntryCount = 100000;
+
+  IndexTable table;
+  table.Reserve(kEntryCount);
+
+  const auto memory_usage = table.MemoryUsage();
+
+  std::mt19937_64 rng;
+  std::uniform_int_distribution<uint8_t> byte_distribution;
+
+  for (size_t i = 0; i < kEntryCount; ++i) {
+    IndexEntry entry;
+    for (auto& b : entry.key) b = byte_distribution(rng);
+    table.Insert(entry);
+  }
+
+  EXPECT_EQ(kEntryCount, table.size());
+  EXPECT_EQ(memory_usage, table.MemoryUsage());
+  EXPECT_GT(2 * kEntryCount * sizeof(IndexEntry), table.MemoryUsage());
+}
+
+// Verifies that keys differing only in their first bytes, which only affect
+// the high bits of the hash, are spread over the table.
+TEST(IndexTableTest, KeysDifferingInFirstBytes) {
+  static const size_t kEntryCount = 65536;
+
+  IndexTable table;
+
+  for (size_t i = 0; i < kEntryCount; ++i) {
+    IndexEntry entry;
+    entry.key.fill(0);
+    entry.key[0] = i >> 8;
+    entry.key[1] = i;
+    entry.size = i;
+    table.Insert(entry);
+  }
+
+  ASSERT_EQ(kEntryCount, table.size());
+
+  for (size_t i = 0; i < kEntryCount; ++i) {
+    CASKey key;
+    key.fill(0);
+    key[0] = i >> 8;
+    key[1] = i;
+
+    auto entry = table.Find(key);
+    ASSERT_TRUE(entry != nullptr);
+    EXPECT_EQ(i, entry->size);
+  }
+}
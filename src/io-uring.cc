@@ -0,0 +1,339 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/io-uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+#if HAVE_LINUX_IO_URING_H
+
+namespace {
+
+int SysIOUringSetup(unsigned entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int SysIOUringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+int SysIOUringRegister(int fd, unsigned opcode, const void* arg,
+                       unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template <typename T>
+T* RingField(void* ring, uint32_t offset) {
+  return reinterpret_cast<T*>(reinterpret_cast<char*>(ring) + offset);
+}
+
+// Returns true if the kernel supports every operation queued by `IOUring`.
+bool SupportsOperations(int ring_fd) {
+  static const unsigned kMaxOps = 256;
+
+  // Zeroed, and aligned for `io_uring_probe`.
+  std::vector<uint64_t> buffer(
+      (sizeof(io_uring_probe) + kMaxOps * sizeof(io_uring_probe_op) + 7) / 8);
+  auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+
+  // Kernels that can't be probed also predate IORING_OP_READ and
+  // IORING_OP_WRITE.
+  if (-1 == SysIOUringRegister(ring_fd, IORING_REGISTER_PROBE, probe, kMaxOps))
+    return false;
+
+  for (const auto op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC,
+                        IORING_OP_ASYNC_CANCEL}) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+      return false;
+  }
+
+  return true;
+}
+
+}  // namespace
+
+std::unique_ptr<IOUring> IOUring::Create(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  const auto fd = SysIOUringSetup(entries, &params);
+  if (fd == -1) {
+    if (errno == ENOSYS || errno == EPERM || errno == EACCES) return nullptr;
+    KJ_FAIL_SYSCALL("io_uring_setup", errno, entries);
+  }
+
+  if (!SupportsOperations(fd)) {
+    close(fd);
+    return nullptr;
+  }
+
+  std::unique_ptr<IOUring> result(new IOUring(
+      fd, params.sq_entries, params.cq_entries, params.features));
+  result->MapRings(&params);
+
+  return result;
+}
+
+IOUring::IOUring(int ring_fd, unsigned sq_entries, unsigned cq_entries,
+                 unsigned features)
+    : ring_fd_(ring_fd), features_(features), sq_entries_(sq_entries) {
+  int event_fd;
+  KJ_SYSCALL(event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  event_fd_ = kj::AutoCloseFd(event_fd);
+
+  KJ_SYSCALL(SysIOUringRegister(ring_fd_.get(), IORING_REGISTER_EVENTFD,
+                                &event_fd, 1));
+}
+
+IOUring::~IOUring() {
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+}
+
+void IOUring::MapRings(const void* params_ptr) {
+  const auto& params = *reinterpret_cast<const io_uring_params*>(params_ptr);
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  if (features_ & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+  sq_ring_ =
+      mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd_.get(), IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    KJ_FAIL_SYSCALL("mmap", errno);
+  }
+
+  if (features_ & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ =
+        mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_.get(), IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+  }
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  auto sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_.get(), IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) KJ_FAIL_SYSCALL("mmap", errno);
+  sqes_ = reinterpret_cast<io_uring_sqe*>(sqes);
+
+  sq_head_ = RingField<unsigned>(sq_ring_, params.sq_off.head);
+  sq_tail_ptr_ = RingField<unsigned>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = *RingField<unsigned>(sq_ring_, params.sq_off.ring_mask);
+  sq_array_ = RingField<unsigned>(sq_ring_, params.sq_off.array);
+
+  cq_head_ = RingField<unsigned>(cq_ring_, params.cq_off.head);
+  cq_tail_ = RingField<unsigned>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = *RingField<unsigned>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = RingField<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+  sq_tail_ = submitted_tail_ = *sq_tail_ptr_;
+}
+
+void IOUring::RegisterFiles(kj::ArrayPtr<const int> fds) {
+  if (!registered_files_.empty()) {
+    KJ_SYSCALL(SysIOUringRegister(ring_fd_.get(), IORING_UNREGISTER_FILES,
+                                  nullptr, 0));
+    registered_files_.clear();
+  }
+
+  if (!fds.size()) return;
+
+  KJ_SYSCALL(SysIOUringRegister(ring_fd_.get(), IORING_REGISTER_FILES,
+                                fds.begin(), fds.size()));
+
+  for (size_t i = 0; i < fds.size(); ++i) registered_files_[fds[i]] = i;
+}
+
+void IOUring::Read(int fd, void* buffer, size_t length, off_t offset,
+                   uint64_t user_data) {
+  auto sqe = PrepareFileSqe(IORING_OP_READ, fd, user_data);
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = length;
+  sqe->off = offset;
+}
+
+void IOUring::Write(int fd, const void* buffer, size_t length, off_t offset,
+                    uint64_t user_data) {
+  auto sqe = PrepareFileSqe(IORING_OP_WRITE, fd, user_data);
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = length;
+  sqe->off = offset;
+}
+
+void IOUring::Fsync(int fd, uint64_t user_data) {
+  PrepareFileSqe(IORING_OP_FSYNC, fd, user_data);
+}
+
+void IOUring::Cancel(uint64_t target, uint64_t user_data) {
+  auto sqe = NextSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
+
+void IOUring::Submit() {
+  while (Queued()) {
+    const auto ret = SysIOUringEnter(ring_fd_.get(), Queued(), 0, 0);
+
+    if (ret == -1) {
+      if (errno == EINTR) continue;
+
+      // The kernel is short on resources, or the completion queue is
+      // overflowing.  The remaining operations stay queued, to be submitted
+      // again once completions have been reaped.
+      if (errno == EAGAIN || errno == EBUSY) return;
+
+      KJ_FAIL_SYSCALL("io_uring_enter", errno);
+    }
+
+    submitted_tail_ += ret;
+  }
+}
+
+void IOUring::Wait() {
+  for (;;) {
+    if (SysIOUringEnter(ring_fd_.get(), 0, 1, IORING_ENTER_GETEVENTS) != -1)
+      return;
+    if (errno != EINTR) KJ_FAIL_SYSCALL("io_uring_enter", errno);
+  }
+}
+
+io_uring_sqe* IOUring::NextSqe() {
+  while (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+         sq_entries_) {
+    const auto queued = Queued();
+    Submit();
+    if (Queued() == queued) Wait();
+  }
+
+  const auto idx = sq_tail_ & sq_mask_;
+  auto sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+
+  sq_array_[idx] = idx;
+  ++sq_tail_;
+  __atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+
+  return sqe;
+}
+
+io_uring_sqe* IOUring::PrepareFileSqe(int opcode, int fd, uint64_t user_data) {
+  // Look up the registered file before claiming the entry, since the entry
+  // is visible to the kernel as soon as it has been claimed.
+  auto i = registered_files_.find(fd);
+
+  auto sqe = NextSqe();
+  sqe->opcode = opcode;
+  sqe->user_data = user_data;
+
+  if (i != registered_files_.end()) {
+    sqe->fd = i->second;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = fd;
+  }
+
+  return sqe;
+}
+
+bool IOUring::PopCompletion(uint64_t* user_data, int32_t* result) {
+  const auto head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+
+  const auto& cqe = cqes_[head & cq_mask_];
+  *user_data = cqe.user_data;
+  *result = cqe.res;
+
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+#else  // !HAVE_LINUX_IO_URING_H
+
+std::unique_ptr<IOUring> IOUring::Create(unsigned entries) { return nullptr; }
+
+IOUring::~IOUring() {}
+
+void IOUring::RegisterFiles(kj::ArrayPtr<const int> fds) {
+  KJ_FAIL_REQUIRE("io_uring not supported");
+}
+
+void IOUring::Read(int fd, void* buffer, size_t length, off_t offset,
+                   uint64_t user_data) {
+  KJ_FAIL_REQUIRE("io_uring not supported");
+}
+
+void IOUring::Write(int fd, const void* buffer, size_t length, off_t offset,
+                    uint64_t user_data) {
+  KJ_FAIL_REQUIRE("io_uring not supported");
+}
+
+void IOUring::Fsync(int fd, uint64_t user_data) {
+  KJ_FAIL_REQUIRE("io_uring not supported");
+}
+
+void IOUring::Cancel(uint64_t target, uint64_t user_data) {
+  KJ_FAIL_REQUIRE("io_uring not supported");
+}
+
+void IOUring::Submit() { KJ_FAIL_REQUIRE("io_uring not supported"); }
+
+void IOUring::Wait() { KJ_FAIL_REQUIRE("io_uring not supported"); }
+
+bool IOUring::PopCompletion(uint64_t* user_data, int32_t* result) {
+  return false;
+}
+
+#endif  // !HAVE_LINUX_IO_URING_H
+
+}  // namespace cas_internal
+}  // namespace cantera
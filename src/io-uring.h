@@ -0,0 +1,131 @@
+#ifndef CANTERA_IO_URING_H_
+#define CANTERA_IO_URING_H_ 1
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include <sys/types.h>
+
+#include <kj/common.h>
+#include <kj/io.h>
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+namespace cantera {
+namespace cas_internal {
+
+// Minimal wrapper for a Linux io_uring instance, using the system calls
+// directly.  Operations are queued in user space, and passed to the kernel in
+// batches by `Submit()`.  Completions are signalled through an eventfd, so they
+// can be waited for in an event loop.  Not thread safe.
+class IOUring {
+ public:
+  // Creates a ring with room for `entries` queued operations.  Returns nullptr
+  // if io_uring is not supported by the kernel, not permitted, or lacks any of
+  // the operations used here.
+  static std::unique_ptr<IOUring> Create(unsigned entries);
+
+  ~IOUring();
+
+  KJ_DISALLOW_COPY(IOUring);
+
+  // Returns a descriptor that becomes readable when completions are available.
+  int EventFd() const { return event_fd_.get(); }
+
+  // Registers `fds` with the kernel, so that operations on them avoid the
+  // per-operation file table lookup.  Replaces any previously registered
+  // files.  The descriptors must stay open until the ring is destroyed, or the
+  // files are registered again.
+  void RegisterFiles(kj::ArrayPtr<const int> fds);
+
+  // Queue operations.  `user_data` is passed back to the function given to
+  // `Reap()` along with the result.
+  void Read(int fd, void* buffer, size_t length, off_t offset,
+            uint64_t user_data);
+  void Write(int fd, const void* buffer, size_t length, off_t offset,
+             uint64_t user_data);
+  void Fsync(int fd, uint64_t user_data);
+
+  // Queues a request to cancel the operation identified by `target`.
+  void Cancel(uint64_t target, uint64_t user_data);
+
+  // Returns the number of operations queued but not yet submitted.
+  size_t Queued() const { return sq_tail_ - submitted_tail_; }
+
+  // Passes all queued operations to the kernel.  If the kernel is short on
+  // resources, some may remain queued, as reported by `Queued()`.
+  void Submit();
+
+  // Blocks until at least one completion is available.
+  void Wait();
+
+  // Invokes `function(user_data, result)` for every available completion,
+  // where `result` is either a non-negative return value or a negated errno
+  // value.  Returns the number of completions.
+  template <typename Function>
+  size_t Reap(Function&& function) {
+    size_t count = 0;
+    for (;;) {
+      uint64_t user_data;
+      int32_t result;
+      if (!PopCompletion(&user_data, &result)) break;
+      function(user_data, result);
+      ++count;
+    }
+    return count;
+  }
+
+ private:
+  IOUring(int ring_fd, unsigned sq_entries, unsigned cq_entries,
+          unsigned features);
+
+  void MapRings(const void* params);
+
+  io_uring_sqe* NextSqe();
+
+  // Prepares the next submission queue entry for an operation on `fd`.
+  io_uring_sqe* PrepareFileSqe(int opcode, int fd, uint64_t user_data);
+
+  bool PopCompletion(uint64_t* user_data, int32_t* result);
+
+  kj::AutoCloseFd ring_fd_;
+  kj::AutoCloseFd event_fd_;
+
+  unsigned features_;
+
+  // Memory mapped rings.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  // Pointers into the submission queue ring.
+  unsigned* sq_head_;
+  unsigned* sq_tail_ptr_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned* sq_array_;
+
+  // Pointers into the completion queue ring.
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  // Local copy of the submission queue tail, and the tail at the time of the
+  // last submission.
+  unsigned sq_tail_ = 0;
+  unsigned submitted_tail_ = 0;
+
+  // Maps descriptors to their index among the registered files.
+  std::unordered_map<int, int> registered_files_;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_IO_URING_H_
@@ -0,0 +1,96 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "io-uring.h"
+#include "io.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+// Verifies that writes, reads and fsyncs complete with the expected results,
+// both with and without registered files.
+TEST(IOUringTest, ReadWrite) {
+  auto ring = IOUring::Create(8);
+  if (!ring) return;  // Not supported.
+
+  auto file = AnonTemporaryFile(nullptr);
+
+  for (const auto registered : {false, true}) {
+    if (registered) {
+      const int fds[] = {file.get()};
+      ring->RegisterFiles(kj::arrayPtr(fds, 1));
+    }
+
+    // More operations than the ring has room for.
+    std::string data(64 * 16, 'x');
+    for (size_t i = 0; i < data.size(); ++i)
+      data[i] = 'a' + (i * 7 + registered) % 26;
+
+    for (size_t i = 0; i < 16; ++i)
+      ring->Write(file.get(), data.data() + i * 64, 64, i * 64, i + 1);
+    ring->Fsync(file.get(), 100);
+
+    std::vector<int32_t> results(101, -1);
+    size_t done = 0;
+    while (done < 17) {
+      ring->Submit();
+      const auto count = ring->Reap([&results](uint64_t user_data,
+                                               int32_t result) {
+        ASSERT_LT(user_data, results.size());
+        results[user_data] = result;
+      });
+      if (!count) ring->Wait();
+      done += count;
+    }
+
+    for (size_t i = 0; i < 16; ++i) EXPECT_EQ(64, results[i + 1]);
+    EXPECT_EQ(0, results[100]);
+
+    std::string read_back(data.size(), 0);
+    ring->Read(file.get(), &read_back[0], read_back.size(), 0, 1);
+    ring->Submit();
+
+    int32_t result = -1;
+    while (!ring->Reap([&result](uint64_t, int32_t r) { result = r; }))
+      ring->Wait();
+
+    EXPECT_EQ(static_cast<int32_t>(data.size()), result);
+    EXPECT_EQ(data, read_back);
+  }
+}
+
+// Verifies that errors are reported as negated errno values.
+TEST(IOUringTest, Error) {
+  auto ring = IOUring::Create(8);
+  if (!ring) return;
+
+  char buffer[16];
+  ring->Read(-1, buffer, sizeof(buffer), 0, 1);
+  ring->Submit();
+
+  int32_t result = 0;
+  while (!ring->Reap([&result](uint64_t, int32_t r) { result = r; }))
+    ring->Wait();
+
+  EXPECT_EQ(-EBADF, result);
+}
@@ -160,6 +160,33 @@ size_t ReadWithOffset(int fd, void* dest, size_t size_min, size_t size_max,
   return result;
 }
 
+void WriteWithOffset(int fd, const void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t ret;
+    KJ_SYSCALL(ret = pwrite(fd, data, size, offset));
+    size -= ret;
+    offset += ret;
+    data = reinterpret_cast<const char*>(data) + ret;
+  }
+}
+
+BufferPool::Buffer BufferPool::Get() {
+  std::unique_ptr<kj::byte[]> data;
+
+  if (!idle_.empty()) {
+    data = std::move(idle_.back());
+    idle_.pop_back();
+  } else {
+    data.reset(new kj::byte[buffer_size_]);
+  }
+
+  return Buffer(shared_from_this(), std::move(data));
+}
+
+void BufferPool::Release(std::unique_ptr<kj::byte[]> data) {
+  if (idle_.size() < max_idle_) idle_.emplace_back(std::move(data));
+}
+
 kj::AutoCloseFd AnonTemporaryFile(const char* path, int mode) {
   if (!path) {
     path = getenv("TMPDIR");
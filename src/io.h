@@ -2,6 +2,7 @@
 #define CANTERA_IO_H_ 1
 
 #include <algorithm>
+#include <memory>
 #include <vector>
 
 #include <fcntl.h>
@@ -31,6 +32,57 @@ inline void ReadWithOffset(int fd, void* dest, size_t size, off_t offset) {
   ReadWithOffset(fd, dest, size, size, offset);
 }
 
+// Writes `size` bytes at the given offset, retrying on short writes.
+void WriteWithOffset(int fd, const void* data, size_t size, off_t offset);
+
+// Pool of equally sized buffers, for I/O paths that would otherwise allocate
+// a new buffer for every request.  Not thread safe.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+ public:
+  // Buffer borrowed from a pool, and returned to it on destruction.
+  class Buffer {
+   public:
+    Buffer(std::shared_ptr<BufferPool> pool, std::unique_ptr<kj::byte[]> data)
+        : pool_(std::move(pool)), data_(std::move(data)) {}
+
+    Buffer(Buffer&&) = default;
+    Buffer& operator=(Buffer&&) = default;
+
+    ~Buffer() {
+      if (data_) pool_->Release(std::move(data_));
+    }
+
+    kj::byte* begin() const { return data_.get(); }
+    size_t size() const { return pool_->buffer_size_; }
+
+   private:
+    std::shared_ptr<BufferPool> pool_;
+    std::unique_ptr<kj::byte[]> data_;
+  };
+
+  // Creates a pool of buffers of `buffer_size` bytes, keeping at most
+  // `max_idle` unused buffers around for reuse.
+  static std::shared_ptr<BufferPool> Create(size_t buffer_size,
+                                            size_t max_idle) {
+    return std::shared_ptr<BufferPool>(new BufferPool(buffer_size, max_idle));
+  }
+
+  KJ_DISALLOW_COPY(BufferPool);
+
+  Buffer Get();
+
+ private:
+  BufferPool(size_t buffer_size, size_t max_idle)
+      : buffer_size_(buffer_size), max_idle_(max_idle) {}
+
+  void Release(std::unique_ptr<kj::byte[]> data);
+
+  const size_t buffer_size_;
+  const size_t max_idle_;
+
+  std::vector<std::unique_ptr<kj::byte[]>> idle_;
+};
+
 kj::AutoCloseFd AnonTemporaryFile(const char* path, int mode = 0666);
 
 void LinkAnonTemporaryFile(int dir_fd, int fd, const char* path);
@@ -50,6 +50,10 @@ CASKey CASKey::FromString(const std::string_view& str) {
     case 'D':
     case 'E':
     case 'F':
+      // BLAKE3 keys share their prefix with upper case hexadecimal ones.
+      if (str[0] == 'B' && str.size() != 40)
+        return ObjectKey::FromString(str).StorageKey();
+
       KJ_REQUIRE(str.size() == 40, "Hexadecimal key must be 40 characters",
                  str.size());
       cas_internal::HexToBinary(str.begin(), str.end(), result.begin());
@@ -61,6 +65,9 @@ CASKey CASKey::FromString(const std::string_view& str) {
       cas_internal::Base64ToBinary(str.substr(1, 28), result.begin());
       return result;
 
+    case 'S':
+      return ObjectKey::FromString(str).StorageKey();
+
     case 'P':
       KJ_FAIL_REQUIRE("Can't use CASKey::FromString with in-key objects", std::string{str});
 
@@ -126,4 +133,113 @@ std::string CASKey::ToString() const {
   return result;
 }
 
+size_t ObjectKey::DigestSize(KeyAlgorithm algorithm) {
+  switch (algorithm) {
+    case KeyAlgorithm::kSHA1:
+      return 20;
+
+    case KeyAlgorithm::kSHA256:
+    case KeyAlgorithm::kBLAKE3:
+      return 32;
+  }
+
+  KJ_FAIL_REQUIRE("Unknown key algorithm", static_cast<int>(algorithm));
+}
+
+ObjectKey ObjectKey::FromWire(const kj::ArrayPtr<const capnp::byte>& data) {
+  if (data.size() == 20) return ObjectKey(CASKey(data.begin()));
+
+  KJ_REQUIRE(data.size() > 0, "Key must not be empty");
+
+  const auto algorithm = static_cast<KeyAlgorithm>(data[0]);
+  KJ_REQUIRE(algorithm == KeyAlgorithm::kSHA256 ||
+                 algorithm == KeyAlgorithm::kBLAKE3,
+             "Unknown key algorithm", data[0]);
+  KJ_REQUIRE(data.size() == 1 + DigestSize(algorithm),
+             "Key size does not match algorithm", data.size());
+
+  return ObjectKey(algorithm, data.begin() + 1);
+}
+
+ObjectKey ObjectKey::FromString(const std::string_view& str) {
+  KJ_REQUIRE(!str.empty());
+
+  KeyAlgorithm algorithm;
+
+  switch (str[0]) {
+    case 'S':
+      algorithm = KeyAlgorithm::kSHA256;
+      break;
+
+    case 'B':
+      if (str.size() == 40) return ObjectKey(CASKey::FromString(str));
+      algorithm = KeyAlgorithm::kBLAKE3;
+      break;
+
+    default:
+      return ObjectKey(CASKey::FromString(str));
+  }
+
+  // Unpadded base64 uses 4 characters for every 3 bytes, rounded up.
+  const auto encoded_size = (DigestSize(algorithm) * 4 + 2) / 3;
+  KJ_REQUIRE(str.size() == 1 + encoded_size, "Invalid key length",
+             std::string{str});
+
+  uint8_t digest[kMaxDigestSize];
+  cas_internal::Base64ToBinary(str.substr(1), digest);
+
+  return ObjectKey(algorithm, digest);
+}
+
+ObjectKey::ObjectKey(const CASKey& sha1) {
+  std::copy(sha1.begin(), sha1.end(), digest.begin());
+}
+
+ObjectKey::ObjectKey(KeyAlgorithm algorithm, const uint8_t* digest)
+    : algorithm(algorithm) {
+  std::copy(digest, digest + DigestSize(), this->digest.begin());
+}
+
+size_t ObjectKey::WireSize() const {
+  if (algorithm == KeyAlgorithm::kSHA1) return 20;
+  return 1 + DigestSize();
+}
+
+kj::Array<capnp::byte> ObjectKey::ToWire() const {
+  auto result = kj::heapArray<capnp::byte>(WireSize());
+  auto output = result.begin();
+  if (algorithm != KeyAlgorithm::kSHA1)
+    *output++ = static_cast<capnp::byte>(algorithm);
+  std::copy(digest.begin(), digest.begin() + DigestSize(), output);
+  return result;
+}
+
+std::string ObjectKey::ToString() const {
+  std::string result;
+
+  switch (algorithm) {
+    case KeyAlgorithm::kSHA1:
+      return StorageKey().ToString();
+
+    case KeyAlgorithm::kSHA256:
+      result = "S";
+      break;
+
+    case KeyAlgorithm::kBLAKE3:
+      result = "B";
+      break;
+  }
+
+  cas_internal::ToBase64(
+      std::string_view{reinterpret_cast<const char*>(digest.data()),
+                       DigestSize()},
+      result, cas_internal::kBase64WebSafeChars, false);
+
+  return result;
+}
+
+bool ObjectKey::operator==(const ObjectKey& rhs) const {
+  return algorithm == rhs.algorithm && digest == rhs.digest;
+}
+
 }  // namespace cantera
@@ -10,7 +10,8 @@
 namespace cantera {
 
 struct CASKey : public std::array<uint8_t, 20> {
-  // Converts a key string into its binary representation.
+  // Converts a key string into its binary representation.  For keys using
+  // other algorithms than SHA-1, this is the storage key described below.
   static CASKey FromString(const std::string_view& str);
 
   CASKey() noexcept;
@@ -40,6 +41,64 @@ struct CASKey : public std::array<uint8_t, 20> {
   std::string ToString() const;
 };
 
+// Hash functions used to compute object keys.  The values are used in the
+// wire format.
+enum class KeyAlgorithm : uint8_t {
+  kSHA1 = 0,
+  kSHA256 = 1,
+  kBLAKE3 = 2,
+};
+
+// Identifies an object by the digest of its contents, and the hash function
+// used to compute it.
+//
+// On the wire, SHA-1 keys are the bare 20 byte digest, as understood by older
+// clients and servers.  Other keys are a byte holding the algorithm, followed
+// by the 32 byte digest.
+//
+// Storage servers and the balancer's hash ring address objects by the
+// `CASKey` returned by `StorageKey()`, which holds the first 20 bytes of the
+// digest.  Keys listed by storage servers are in this form, and are accepted
+// by every call except `put`, which treats 20 byte keys as SHA-1 digests.
+struct ObjectKey {
+  static const size_t kMaxDigestSize = 32;
+
+  // Returns the digest size of the given algorithm.
+  static size_t DigestSize(KeyAlgorithm algorithm);
+
+  // Parses a key in the wire format.
+  static ObjectKey FromWire(const kj::ArrayPtr<const capnp::byte>& data);
+
+  // Parses a key string.  SHA-1 keys are either 40 hexadecimal digits, or
+  // 'G' followed by the base64 encoded digest.  SHA-256 and BLAKE3 keys are
+  // 'S' or 'B', respectively, followed by the base64 encoded digest.
+  static ObjectKey FromString(const std::string_view& str);
+
+  ObjectKey() = default;
+
+  // Creates a key from a SHA-1 digest.
+  explicit ObjectKey(const CASKey& sha1);
+
+  ObjectKey(KeyAlgorithm algorithm, const uint8_t* digest);
+
+  size_t DigestSize() const { return DigestSize(algorithm); }
+
+  size_t WireSize() const;
+
+  kj::Array<capnp::byte> ToWire() const;
+
+  CASKey StorageKey() const { return CASKey(digest.data()); }
+
+  // Converts the key into the string format accepted by `FromString()`.
+  std::string ToString() const;
+
+  bool operator==(const ObjectKey& rhs) const;
+  bool operator!=(const ObjectKey& rhs) const { return !(*this == rhs); }
+
+  KeyAlgorithm algorithm = KeyAlgorithm::kSHA1;
+  std::array<uint8_t, kMaxDigestSize> digest{};
+};
+
 }  // namespace cantera
 
 namespace std {
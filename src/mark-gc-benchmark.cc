@@ -0,0 +1,184 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Measures how fast the balancer marks objects during garbage collection, for
+// each of the given numbers of backends.  Every key is only forwarded to the
+// backends that may hold it, so throughput should grow as backends are
+// added, instead of every backend processing every key.
+//
+// Usage: mark-gc-benchmark [BACKENDS]...
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include "balancer.h"
+#include "client.h"
+#include "rpc.h"
+#include "storage-server.h"
+#include "util.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const size_t kKeyCount = 4 << 20;
+const size_t kReplicas = 2;
+
+std::string TemporaryDirectory() {
+  const char* tmpdir = getenv("TMPDIR");
+  if (!tmpdir) tmpdir = "/tmp";
+
+  char path[PATH_MAX];
+  strcpy(path, tmpdir);
+  strcat(path, "/mark-gc.XXXXXX");
+
+  KJ_SYSCALL(mkdtemp(path));
+
+  return path;
+}
+
+// Serves an empty repository on `socket_fd` until `stop_fd` is closed.
+void RunServer(int socket_fd, int stop_fd) {
+  auto aio = kj::setupAsyncIo();
+
+  const auto path = TemporaryDirectory();
+
+  RPCServer<CAS> server(
+      kj::heap<StorageServer>(path.c_str(), 0, aio),
+      aio.lowLevelProvider->wrapSocketFd(
+          socket_fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+
+  auto stop = aio.lowLevelProvider->wrapInputFd(stop_fd);
+  char byte;
+  stop->tryRead(&byte, 1, 1).wait(aio.waitScope);
+}
+
+void RunBenchmark(kj::AsyncIoContext& aio, size_t backend_count,
+                  const std::vector<CASKey>& keys) {
+  int stop_pipe[2];
+  KJ_SYSCALL(pipe(stop_pipe));
+  kj::AutoCloseFd stop_reader(stop_pipe[0]);
+  kj::AutoCloseFd stop_writer(stop_pipe[1]);
+
+  auto balancer_server = kj::heap<BalancerServer>(aio);
+  balancer_server->SetReplicas(kReplicas);
+
+  std::vector<std::thread> server_threads;
+  std::vector<std::shared_ptr<CASClient>> backends;
+
+  for (size_t i = 0; i < backend_count; ++i) {
+    int sockets[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+
+    server_threads.emplace_back(RunServer, sockets[0], stop_reader.get());
+
+    backends.emplace_back(std::make_shared<CASClient>(
+        aio.lowLevelProvider->wrapSocketFd(
+            sockets[1], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP),
+        aio));
+    balancer_server->AddBackend(backends.back(), i);
+  }
+
+  // Record the placement `ca-cas balance` would, so that marks are routed.
+  const auto ring = balancer_server->RingFingerprint();
+  for (auto& backend : backends) {
+    auto request = backend->RawClient().setPlacementRequest();
+    request.setRing(ring);
+    request.send().wait(aio.waitScope);
+  }
+
+  Clock::duration mark_time;
+
+  {
+    auto balancer_channel = aio.provider->newTwoWayPipe();
+
+    RPCServer<CAS> balancer(std::move(balancer_server),
+                            std::move(balancer_channel.ends[0]));
+
+    RPCClient client(std::move(balancer_channel.ends[1]));
+    auto cas = client.GetMain<CAS>();
+
+    const auto gc_id = CASClient::BeginGC(cas).wait(aio.waitScope);
+
+    const auto mark_start = Clock::now();
+    CASClient::MarkGC(cas, keys).wait(aio.waitScope);
+    mark_time = Clock::now() - mark_start;
+
+    CASClient::EndGC(cas, gc_id).wait(aio.waitScope);
+  }
+
+  stop_writer = nullptr;
+  for (auto& thread : server_threads) thread.join();
+
+  const auto seconds = std::chrono::duration<double>(mark_time).count();
+
+  printf(
+      "backends: %zu  keys: %zu  time: %.0f ms  keys/s: %.0f  "
+      "keys per backend: %zu\n",
+      backend_count, keys.size(), seconds * 1000.0, keys.size() / seconds,
+      keys.size() * kReplicas / backend_count);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) try {
+  std::vector<size_t> backend_counts;
+  for (int i = 1; i < argc; ++i)
+    backend_counts.emplace_back(StringToUInt64(argv[i]));
+  if (backend_counts.empty()) backend_counts = {2, 4, 8};
+
+  std::mt19937_64 rng(1234);
+  std::uniform_int_distribution<uint8_t> byte_distribution;
+
+  // The keys don't need to exist; storage servers look each of them up in
+  // their index either way.
+  std::vector<CASKey> keys(kKeyCount);
+  for (auto& key : keys) {
+    for (auto& b : key) b = byte_distribution(rng);
+  }
+
+  auto aio = kj::setupAsyncIo();
+
+  for (const auto backend_count : backend_counts) {
+    KJ_REQUIRE(backend_count >= kReplicas, backend_count);
+    RunBenchmark(aio, backend_count, keys);
+  }
+} catch (kj::Exception& e) {
+  KJ_LOG(FATAL, e);
+  return EXIT_FAILURE;
+}
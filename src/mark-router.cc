@@ -0,0 +1,75 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/mark-router.h"
+
+#include <algorithm>
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+MarkRouter::MarkRouter(std::vector<CAS::MarkSink::Client> sinks, Route route)
+    : sinks_(std::move(sinks)),
+      route_(std::move(route)),
+      blocks_(sinks_.size()) {}
+
+kj::Promise<void> MarkRouter::write(WriteContext context) {
+  auto keys = context.getParams().getKeys();
+  KJ_REQUIRE(keys.size() % sizeof(CASKey) == 0, keys.size());
+
+  for (auto key = keys.begin(); key != keys.end(); key += sizeof(CASKey)) {
+    targets_.clear();
+    route_(CASKey(key), targets_);
+
+    for (const auto target : targets_) {
+      auto& block = blocks_[target];
+      block.insert(block.end(), key, key + sizeof(CASKey));
+    }
+  }
+
+  const auto count = std::count_if(blocks_.begin(), blocks_.end(),
+                                   [](const auto& b) { return !b.empty(); });
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(count);
+
+  for (size_t i = 0; i < sinks_.size(); ++i) {
+    if (blocks_[i].empty()) continue;
+
+    auto request = sinks_[i].writeRequest();
+    request.setKeys(kj::arrayPtr(blocks_[i].data(), blocks_[i].size()));
+    blocks_[i].clear();
+
+    builder.add(request.send().ignoreResult());
+  }
+
+  return kj::joinPromises(builder.finish());
+}
+
+kj::Promise<void> MarkRouter::done(DoneContext context) {
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(sinks_.size());
+  for (auto& sink : sinks_)
+    builder.add(sink.doneRequest().send().ignoreResult());
+
+  return kj::joinPromises(builder.finish());
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
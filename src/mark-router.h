@@ -0,0 +1,43 @@
+#ifndef CANTERA_MARK_ROUTER_H_
+#define CANTERA_MARK_ROUTER_H_ 1
+
+#include <functional>
+#include <vector>
+
+#include "key.h"
+#include "proto/ca-cas.capnp.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Mark sink passing each key on to the mark sinks of the servers that may
+// hold it.  Every write is answered once all of its keys have been processed
+// downstream, which carries the client's flow control through to the
+// servers.
+class MarkRouter : public CAS::MarkSink::Server {
+ public:
+  // Appends the indexes of the sinks that should receive `key` to `result`.
+  using Route =
+      std::function<void(const CASKey& key, std::vector<size_t>& result)>;
+
+  MarkRouter(std::vector<CAS::MarkSink::Client> sinks, Route route);
+
+  kj::Promise<void> write(WriteContext context) override;
+
+  kj::Promise<void> done(DoneContext context) override;
+
+ private:
+  std::vector<CAS::MarkSink::Client> sinks_;
+
+  Route route_;
+
+  // Keys of the current write, by sink.
+  std::vector<std::vector<capnp::byte>> blocks_;
+
+  std::vector<size_t> targets_;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_MARK_ROUTER_H_
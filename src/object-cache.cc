@@ -0,0 +1,161 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/object-cache.h"
+
+#include <algorithm>
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+// Object size assumed when sizing the frequency sketch.
+const size_t kTypicalObjectSize = 4096;
+
+const size_t kMinSketchWidth = 1024;
+const size_t kMaxSketchWidth = 1 << 22;
+
+// Counters are halved after this many requests per counter in each row.
+const size_t kSamplesPerCounter = 10;
+
+const uint8_t kMaxCount = 15;
+
+}  // namespace
+
+ObjectCache::FrequencySketch::FrequencySketch(size_t width) {
+  width = std::min(std::max(width, kMinSketchWidth), kMaxSketchWidth);
+
+  size_t rounded_width = 1;
+  while (rounded_width < width) rounded_width <<= 1;
+
+  counters_.resize(kDepth * rounded_width);
+  mask_ = rounded_width - 1;
+  sample_size_ = kSamplesPerCounter * rounded_width;
+}
+
+void ObjectCache::FrequencySketch::Increment(const CASKey& key) {
+  for (size_t row = 0; row < kDepth; ++row) {
+    auto& counter = counters_[Index(key, row)];
+    if (counter < kMaxCount) ++counter;
+  }
+
+  if (++additions_ < sample_size_) return;
+
+  for (auto& counter : counters_) counter >>= 1;
+  additions_ /= 2;
+}
+
+unsigned int ObjectCache::FrequencySketch::Estimate(const CASKey& key) const {
+  unsigned int result = kMaxCount;
+  for (size_t row = 0; row < kDepth; ++row)
+    result = std::min<unsigned int>(result, counters_[Index(key, row)]);
+  return result;
+}
+
+size_t ObjectCache::FrequencySketch::Index(const CASKey& key,
+                                           size_t row) const {
+  // Keys are digests, so any of their bytes make a good hash.  The first
+  // bytes are skipped, since they select the shard and the hash ring bucket.
+  const auto bytes = key.begin() + 4 + row * 4;
+  const uint32_t hash = bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+                        static_cast<uint32_t>(bytes[3]) << 24;
+  return row * (mask_ + 1) + (hash & mask_);
+}
+
+ObjectCache::ObjectCache(size_t capacity)
+    : capacity_(capacity), sketch_(capacity / kTypicalObjectSize) {}
+
+const std::string* ObjectCache::Find(const CASKey& key) {
+  sketch_.Increment(key);
+
+  auto i = index_.find(key);
+  if (i == index_.end()) {
+    ++stats_.misses;
+    return nullptr;
+  }
+
+  ++stats_.hits;
+
+  // Move to the most recently used end.
+  entries_.splice(entries_.end(), entries_, i->second);
+
+  return &i->second->data;
+}
+
+bool ObjectCache::ShouldAdmit(const CASKey& key, size_t size) const {
+  return !index_.count(key) && VictimCount(key, size) >= 0;
+}
+
+void ObjectCache::Insert(const CASKey& key, std::string data) {
+  if (index_.count(key)) return;
+
+  const auto victims = VictimCount(key, data.size());
+  if (victims < 0) {
+    ++stats_.rejections;
+    return;
+  }
+
+  for (ssize_t i = 0; i < victims; ++i) {
+    const auto& victim = entries_.front();
+    stats_.size -= victim.data.size();
+    index_.erase(victim.key);
+    entries_.pop_front();
+  }
+
+  stats_.size += data.size();
+  entries_.emplace_back(Entry{key, std::move(data)});
+  index_.emplace(key, std::prev(entries_.end()));
+
+  stats_.objects = entries_.size();
+}
+
+void ObjectCache::Erase(const CASKey& key) {
+  auto i = index_.find(key);
+  if (i == index_.end()) return;
+
+  stats_.size -= i->second->data.size();
+  entries_.erase(i->second);
+  index_.erase(i);
+
+  stats_.objects = entries_.size();
+}
+
+ssize_t ObjectCache::VictimCount(const CASKey& key, size_t size) const {
+  if (size > capacity_) return -1;
+
+  const auto frequency = sketch_.Estimate(key);
+
+  size_t available = capacity_ - stats_.size;
+  ssize_t victims = 0;
+
+  for (auto i = entries_.begin(); available < size; ++i, ++victims) {
+    KJ_ASSERT(i != entries_.end());
+    if (sketch_.Estimate(i->key) >= frequency) return -1;
+    available += i->data.size();
+  }
+
+  return victims;
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,109 @@
+#ifndef CANTERA_OBJECT_CACHE_H_
+#define CANTERA_OBJECT_CACHE_H_ 1
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <kj/common.h>
+
+#include "key.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// In-memory cache of small objects, limited by their total size.
+//
+// Objects are evicted in LRU order, but a new object is only admitted if it
+// has been requested more often than every object it would evict, as
+// estimated by a TinyLFU frequency sketch.  This keeps large scans, such as
+// exports, from flushing out the objects that are read over and over.
+class ObjectCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    // Number of objects not admitted because they were requested less often
+    // than the objects they would evict.
+    uint64_t rejections = 0;
+
+    // Number and total size of cached objects.
+    size_t objects = 0;
+    size_t size = 0;
+  };
+
+  // `capacity` is the maximum total size of the cached objects, in bytes.
+  explicit ObjectCache(size_t capacity);
+
+  KJ_DISALLOW_COPY(ObjectCache);
+
+  // Returns the object `key`, or nullptr if it's not cached.  The pointer is
+  // valid until the cache is next modified.  Counts as a request for the
+  // object, whether or not it's found.
+  const std::string* Find(const CASKey& key);
+
+  // Returns true if `Insert()` would store an object of `size` bytes, so that
+  // callers can avoid reading objects that would not be cached anyway.
+  bool ShouldAdmit(const CASKey& key, size_t size) const;
+
+  // Stores `data` as the object `key`, if admitted.
+  void Insert(const CASKey& key, std::string data);
+
+  void Erase(const CASKey& key);
+
+  size_t Capacity() const { return capacity_; }
+
+  const Stats& GetStats() const { return stats_; }
+
+ private:
+  struct Entry {
+    CASKey key;
+    std::string data;
+  };
+
+  // Count-min sketch of how often each key has been requested recently.
+  // Counters saturate at 15, and are halved periodically, so that old
+  // requests are gradually forgotten.
+  class FrequencySketch {
+   public:
+    explicit FrequencySketch(size_t width);
+
+    void Increment(const CASKey& key);
+
+    unsigned int Estimate(const CASKey& key) const;
+
+   private:
+    static const size_t kDepth = 4;
+
+    size_t Index(const CASKey& key, size_t row) const;
+
+    std::vector<uint8_t> counters_;
+    size_t mask_;
+
+    size_t additions_ = 0;
+    size_t sample_size_;
+  };
+
+  // Returns the number of entries, from the least recently used end, that
+  // must be evicted to make room for `size` bytes, or -1 if the object should
+  // not be admitted.
+  ssize_t VictimCount(const CASKey& key, size_t size) const;
+
+  size_t capacity_;
+
+  // Least recently used objects first.
+  std::list<Entry> entries_;
+  std::unordered_map<CASKey, std::list<Entry>::iterator> index_;
+
+  FrequencySketch sketch_;
+
+  Stats stats_;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_OBJECT_CACHE_H_
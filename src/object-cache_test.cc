@@ -0,0 +1,127 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "object-cache.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+namespace {
+
+CASKey RandomKey(std::mt19937_64& rng) {
+  CASKey key;
+  for (auto& b : key) b = rng();
+  return key;
+}
+
+}  // namespace
+
+TEST(ObjectCacheTest, FindAndErase) {
+  std::mt19937_64 rng;
+  ObjectCache cache(1024);
+
+  const auto key = RandomKey(rng);
+
+  EXPECT_EQ(nullptr, cache.Find(key));
+  cache.Insert(key, "hello");
+
+  auto data = cache.Find(key);
+  ASSERT_NE(nullptr, data);
+  EXPECT_EQ("hello", *data);
+
+  EXPECT_EQ(1U, cache.GetStats().hits);
+  EXPECT_EQ(1U, cache.GetStats().misses);
+  EXPECT_EQ(1U, cache.GetStats().objects);
+  EXPECT_EQ(5U, cache.GetStats().size);
+
+  cache.Erase(key);
+  EXPECT_EQ(nullptr, cache.Find(key));
+  EXPECT_EQ(0U, cache.GetStats().objects);
+  EXPECT_EQ(0U, cache.GetStats().size);
+
+  // Objects larger than the whole cache are never admitted.
+  EXPECT_FALSE(cache.ShouldAdmit(key, 1025));
+}
+
+// Verifies that objects read repeatedly stay cached while a much larger set
+// of objects is read once in between.
+TEST(ObjectCacheTest, ScanResistance) {
+  std::mt19937_64 rng;
+  ObjectCache cache(100 * 100);
+
+  const std::string data(100, 'x');
+
+  std::vector<CASKey> hot_keys;
+  for (size_t i = 0; i < 50; ++i) hot_keys.emplace_back(RandomKey(rng));
+
+  for (size_t round = 0; round < 3; ++round) {
+    for (const auto& key : hot_keys) {
+      if (!cache.Find(key)) cache.Insert(key, data);
+    }
+  }
+
+  const auto hits_before_scan = cache.GetStats().hits;
+
+  for (size_t i = 0; i < 10000; ++i) {
+    const auto key = RandomKey(rng);
+    if (!cache.Find(key)) cache.Insert(key, data);
+    EXPECT_LE(cache.GetStats().size, cache.Capacity());
+
+    if (i % 20 == 0) {
+      const auto& hot_key = hot_keys[(i / 20) % hot_keys.size()];
+      if (!cache.Find(hot_key)) cache.Insert(hot_key, data);
+    }
+  }
+
+  EXPECT_LT(0U, cache.GetStats().rejections);
+
+  // Each hot object was read 10 times during the scan.
+  EXPECT_EQ(500U, cache.GetStats().hits - hits_before_scan);
+}
+
+// Verifies that objects read often enough eventually displace ones that are
+// no longer read.
+TEST(ObjectCacheTest, Adapts) {
+  std::mt19937_64 rng;
+  ObjectCache cache(100 * 10);
+
+  const std::string data(100, 'x');
+
+  std::vector<CASKey> old_keys, new_keys;
+  for (size_t i = 0; i < 10; ++i) {
+    old_keys.emplace_back(RandomKey(rng));
+    new_keys.emplace_back(RandomKey(rng));
+  }
+
+  for (size_t round = 0; round < 2; ++round) {
+    for (const auto& key : old_keys) {
+      if (!cache.Find(key)) cache.Insert(key, data);
+    }
+  }
+
+  for (size_t round = 0; round < 5; ++round) {
+    for (const auto& key : new_keys) {
+      if (!cache.Find(key)) cache.Insert(key, data);
+    }
+  }
+
+  for (const auto& key : new_keys) EXPECT_NE(nullptr, cache.Find(key));
+}
@@ -0,0 +1,355 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/object-index.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <kj/debug.h>
+
+#include "crc32c.h"
+#include "io.h"
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+const uint32_t kVersion = 1;
+
+const size_t kEntrySize = 32;
+
+// Header fields other than the magic string and the version.
+const size_t kEntrySizeOffset = 12;
+const size_t kEntryCountOffset = 16;
+const size_t kUtilizationOffset = 24;
+const size_t kHeaderChecksumOffset = kUtilizationOffset + kMaxDataFiles * 8;
+const size_t kHeaderSize = kHeaderChecksumOffset + 8;
+
+const size_t kFanoutOffset = kHeaderSize;
+const size_t kChecksumsOffset =
+    kFanoutOffset + IndexSegment::kFanoutSize * sizeof(uint64_t);
+const size_t kDataOffset =
+    kChecksumsOffset + (IndexSegment::kFanoutSize - 1) * sizeof(uint32_t);
+
+// Number of encoded entries buffered by `IndexSegmentWriter`.
+const size_t kWriteBufferEntries = 65536;
+
+static_assert(kHeaderSize == 544, "unexpected index segment header size");
+
+static_assert(kDataOffset % alignof(IndexEntry) == 0,
+              "index entries must be aligned");
+
+// Returns the slot in the prefix table for the given key.
+size_t FanoutSlot(const CASKey& key) { return (key[0] << 8) | key[1]; }
+
+void EncodeUInt32(uint32_t value, uint8_t* output) {
+  for (size_t i = 0; i < 4; ++i) output[i] = value >> (i * 8);
+}
+
+void EncodeUInt64(uint64_t value, uint8_t* output) {
+  for (size_t i = 0; i < 8; ++i) output[i] = value >> (i * 8);
+}
+
+uint32_t DecodeUInt32(const uint8_t* input) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < 4; ++i)
+    result |= static_cast<uint32_t>(input[i]) << (i * 8);
+  return result;
+}
+
+uint64_t DecodeUInt64(const uint8_t* input) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < 8; ++i)
+    result |= static_cast<uint64_t>(input[i]) << (i * 8);
+  return result;
+}
+
+// On little endian hosts, the encoding of an entry is its in-memory layout.
+void EncodeEntry(const IndexEntry& entry, uint8_t* output) {
+  EncodeUInt64(entry.offset, output);
+  EncodeUInt32(entry.size, output + 8);
+  std::copy(entry.key.begin(), entry.key.end(), output + 12);
+}
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+IndexEntry DecodeEntry(const uint8_t* input) {
+  IndexEntry result;
+  result.offset = DecodeUInt64(input);
+  result.size = DecodeUInt32(input + 8);
+  std::copy(input + 12, input + kEntrySize, result.key.begin());
+  return result;
+}
+#endif
+
+// Returns the checksum stored in the header, given the encoded header and
+// prefix table.
+uint32_t HeaderChecksum(const uint8_t* data) {
+  const auto crc = CRC32C(data, kHeaderChecksumOffset);
+  return CRC32C(data + kFanoutOffset, kChecksumsOffset - kFanoutOffset, crc);
+}
+
+}  // namespace
+
+const char IndexSegment::kMagic[8] = {'C', 'A', 'S', 'I', 'D', 'X', 'B', 'S'};
+
+IndexSegment::IndexSegment(int fd) : data_(ReadFile(fd)) {
+  KJ_REQUIRE(data_.size() >= kDataOffset, "truncated index segment",
+             data_.size());
+
+  const auto data = reinterpret_cast<const uint8_t*>(data_.begin());
+
+  KJ_REQUIRE(!memcmp(data, kMagic, sizeof(kMagic)), "bad index segment magic");
+  KJ_REQUIRE(DecodeUInt32(data + 8) == kVersion,
+             "unsupported index segment version", DecodeUInt32(data + 8));
+  KJ_REQUIRE(DecodeUInt32(data + kEntrySizeOffset) == kEntrySize,
+             "unexpected index segment entry size",
+             DecodeUInt32(data + kEntrySizeOffset));
+  KJ_REQUIRE(
+      DecodeUInt32(data + kHeaderChecksumOffset) == HeaderChecksum(data),
+      "index segment header checksum mismatch");
+
+  size_ = DecodeUInt64(data + kEntryCountOffset);
+  KJ_REQUIRE((data_.size() - kDataOffset) % kEntrySize == 0 &&
+                 (data_.size() - kDataOffset) / kEntrySize == size_,
+             "index segment size does not match header", data_.size(), size_);
+
+  for (size_t i = 0; i < kMaxDataFiles; ++i)
+    utilization_[i] = DecodeUInt64(data + kUtilizationOffset + i * 8);
+
+  fanout_.resize(kFanoutSize);
+  for (size_t i = 0; i < kFanoutSize; ++i)
+    fanout_[i] = DecodeUInt64(data + kFanoutOffset + i * 8);
+
+  KJ_REQUIRE(fanout_.front() == 0 && fanout_.back() == size_,
+             "bad index segment prefix table");
+  for (size_t slot = 0; slot + 1 < kFanoutSize; ++slot)
+    KJ_REQUIRE(fanout_[slot] <= fanout_[slot + 1],
+               "bad index segment prefix table", slot);
+
+  const auto entries = data + kDataOffset;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  entries_ = reinterpret_cast<const IndexEntry*>(entries);
+#else
+  decoded_entries_ = kj::heapArray<IndexEntry>(size_);
+  for (size_t i = 0; i < size_; ++i)
+    decoded_entries_[i] = DecodeEntry(entries + i * kEntrySize);
+  entries_ = decoded_entries_.begin();
+#endif
+}
+
+void IndexSegment::Verify() const {
+  if (!size_) return;
+
+  const auto data = reinterpret_cast<const uint8_t*>(data_.begin());
+  const auto entries = data + kDataOffset;
+
+  for (size_t slot = 0; slot + 1 < kFanoutSize; ++slot) {
+    const auto first = entries + fanout_[slot] * kEntrySize;
+    const auto last = entries + fanout_[slot + 1] * kEntrySize;
+    KJ_REQUIRE(CRC32C(first, last - first) ==
+                   DecodeUInt32(data + kChecksumsOffset + slot * 4),
+               "index segment checksum mismatch", slot);
+  }
+}
+
+const IndexEntry* IndexSegment::Find(const CASKey& key) const {
+  if (!size_) return nullptr;
+
+  const auto slot = FanoutSlot(key);
+
+  const auto first = entries_ + fanout_[slot];
+  const auto last = entries_ + fanout_[slot + 1];
+
+  auto i = std::lower_bound(
+      first, last, key,
+      [](const IndexEntry& lhs, const CASKey& rhs) { return lhs.key < rhs; });
+
+  if (i == last || i->key != key) return nullptr;
+
+  return i;
+}
+
+uint64_t IndexSegment::Utilization(size_t data_file_idx) const {
+  KJ_REQUIRE(data_file_idx < kMaxDataFiles, data_file_idx);
+  return utilization_[data_file_idx];
+}
+
+IndexSegmentWriter::IndexSegmentWriter(int fd)
+    : fd_(fd),
+      fanout_(IndexSegment::kFanoutSize),
+      checksums_(IndexSegment::kFanoutSize - 1),
+      offset_(kDataOffset) {
+  KJ_SYSCALL(ftruncate(fd_, 0));
+
+  buffer_.reserve(kWriteBufferEntries * kEntrySize);
+}
+
+void IndexSegmentWriter::Add(const IndexEntry& entry) {
+  KJ_REQUIRE(!(entry.offset & kDeletedMask));
+
+  const auto slot = FanoutSlot(entry.key);
+
+  // Every slot up to and including this entry's slot starts at or before this
+  // entry.
+  ++fanout_[slot + 1];
+
+  utilization_[(entry.offset & kBucketMask) >> 56] += entry.size;
+  ++entry_count_;
+
+  const auto record_offset = buffer_.size();
+  buffer_.resize(record_offset + kEntrySize);
+  const auto record = buffer_.data() + record_offset;
+  EncodeEntry(entry, record);
+
+  // Entries are added in key order, so each prefix's entries are contiguous.
+  checksums_[slot] = CRC32C(record, kEntrySize, checksums_[slot]);
+
+  if (buffer_.size() == buffer_.capacity()) Flush();
+}
+
+void IndexSegmentWriter::Finish() {
+  Flush();
+
+  // Convert per-slot counts to offsets.
+  for (size_t i = 1; i < fanout_.size(); ++i) fanout_[i] += fanout_[i - 1];
+
+  KJ_ASSERT(fanout_.back() == entry_count_);
+
+  std::vector<uint8_t> header(kDataOffset);
+  const auto data = header.data();
+
+  memcpy(data, IndexSegment::kMagic, sizeof(IndexSegment::kMagic));
+  EncodeUInt32(kVersion, data + 8);
+  EncodeUInt32(kEntrySize, data + kEntrySizeOffset);
+  EncodeUInt64(entry_count_, data + kEntryCountOffset);
+
+  for (size_t i = 0; i < kMaxDataFiles; ++i)
+    EncodeUInt64(utilization_[i], data + kUtilizationOffset + i * 8);
+
+  for (size_t i = 0; i < fanout_.size(); ++i)
+    EncodeUInt64(fanout_[i], data + kFanoutOffset + i * 8);
+
+  for (size_t i = 0; i < checksums_.size(); ++i)
+    EncodeUInt32(checksums_[i], data + kChecksumsOffset + i * 4);
+
+  EncodeUInt32(HeaderChecksum(data), data + kHeaderChecksumOffset);
+
+  WriteWithOffset(fd_, data, header.size(), 0);
+}
+
+void IndexSegmentWriter::Flush() {
+  if (buffer_.empty()) return;
+
+  WriteWithOffset(fd_, buffer_.data(), buffer_.size(), offset_);
+  offset_ += buffer_.size();
+
+  buffer_.clear();
+}
+
+void ObjectIndex::SetBase(IndexSegment base) {
+  base_ = std::move(base);
+  overlay_.Clear();
+  size_ = base_.size();
+  ++generation_;
+}
+
+const IndexEntry* ObjectIndex::Find(const CASKey& key) const {
+  if (auto entry = overlay_.Find(key)) {
+    if (entry->offset & kDeletedMask) return nullptr;
+    return entry;
+  }
+
+  return base_.Find(key);
+}
+
+void ObjectIndex::Insert(const IndexEntry& entry) {
+  KJ_REQUIRE(!(entry.offset & kDeletedMask));
+
+  if (!Find(entry.key)) ++size_;
+
+  overlay_.Insert(entry);
+}
+
+void ObjectIndex::Erase(const CASKey& key) {
+  if (!Find(key)) return;
+
+  --size_;
+
+  overlay_.Erase(key);
+
+  // Objects in the base segment need an explicit deletion marker to hide
+  // them.
+  if (auto base_entry = base_.Find(key)) {
+    IndexEntry tombstone = *base_entry;
+    tombstone.offset |= kDeletedMask;
+    overlay_.Insert(tombstone);
+  }
+}
+
+std::vector<IndexEntry> ObjectIndex::Changes() const {
+  std::vector<IndexEntry> result;
+  result.reserve(overlay_.size());
+
+  overlay_.ForEach(
+      [&result](const IndexEntry& entry) { result.emplace_back(entry); });
+
+  return result;
+}
+
+void ObjectIndex::WriteSegment(int fd) const {
+  WriteIndexSegment(fd, base_, Changes());
+}
+
+void WriteIndexSegment(int fd, const IndexSegment& base,
+                       std::vector<IndexEntry> changes) {
+  std::sort(changes.begin(), changes.end(),
+            [](const auto& lhs, const auto& rhs) { return lhs.key < rhs.key; });
+
+  IndexSegmentWriter writer(fd);
+
+  auto change = changes.begin();
+
+  const auto add_change = [&writer](const IndexEntry& entry) {
+    if (!(entry.offset & kDeletedMask)) writer.Add(entry);
+  };
+
+  for (const auto& entry : base) {
+    while (change != changes.end() && change->key < entry.key)
+      add_change(*change++);
+
+    // Entries present in both are replaced or deleted by the change.
+    if (change != changes.end() && change->key == entry.key) {
+      add_change(*change++);
+      continue;
+    }
+
+    writer.Add(entry);
+  }
+
+  while (change != changes.end()) add_change(*change++);
+
+  writer.Finish();
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
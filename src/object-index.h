@@ -0,0 +1,192 @@
+#ifndef CANTERA_OBJECT_INDEX_H_
+#define CANTERA_OBJECT_INDEX_H_ 1
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <kj/array.h>
+#include <kj/common.h>
+
+#include "index-entry.h"
+#include "index-table.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Sorted, memory mapped snapshot of the object index.  Lookups are served
+// straight from the mapped pages, so opening a segment only checks its header
+// and prefix table, and takes constant time regardless of how many objects it
+// holds.  The entries are checked separately by `Verify()`.
+//
+// File layout: a 544 byte header, followed by 65537 64-bit offsets into the
+// entry array, one for each 16-bit key prefix, followed by the CRC-32C of each
+// prefix's entries, followed by the entries themselves, sorted by key.  The
+// header holds a magic string, the format version, the entry size, the entry
+// count and the sum of object sizes in each data file, followed by the CRC-32C
+// of the preceding header fields and the prefix table.  An entry is the 64-bit
+// offset, the 32-bit size and the 20 byte key.  All integers are little
+// endian.
+class IndexSegment {
+ public:
+  static const char kMagic[8];
+
+  static const size_t kFanoutSize = 65537;
+
+  // Creates an empty segment.
+  IndexSegment() = default;
+
+  // Maps the segment stored in the file given by `fd`.  The descriptor may be
+  // closed afterwards.
+  explicit IndexSegment(int fd);
+
+  IndexSegment(IndexSegment&&) = default;
+  IndexSegment& operator=(IndexSegment&&) = default;
+
+  KJ_DISALLOW_COPY(IndexSegment);
+
+  // Throws an exception if the entries for any key prefix don't match their
+  // checksum.  This reads the entire segment.
+  void Verify() const;
+
+  // Returns the entry for `key`, or nullptr if `key` is not present.
+  const IndexEntry* Find(const CASKey& key) const;
+
+  const IndexEntry* begin() const { return entries_; }
+  const IndexEntry* end() const { return entries_ + size_; }
+
+  size_t size() const { return size_; }
+
+  // Returns true if `entry` points into this segment.
+  bool Contains(const IndexEntry* entry) const {
+    return entry >= begin() && entry < end();
+  }
+
+  // Returns the sum of object sizes in the given data file.
+  uint64_t Utilization(size_t data_file_idx) const;
+
+ private:
+  kj::Array<const char> data_;
+
+  // Entries decoded on hosts where the file encoding differs from the
+  // in-memory layout.  Unused on little endian hosts.
+  kj::Array<IndexEntry> decoded_entries_;
+
+  std::vector<uint64_t> fanout_;
+  std::array<uint64_t, kMaxDataFiles> utilization_{};
+  const IndexEntry* entries_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Writes an `IndexSegment` to a file in a single pass.
+class IndexSegmentWriter {
+ public:
+  explicit IndexSegmentWriter(int fd);
+
+  KJ_DISALLOW_COPY(IndexSegmentWriter);
+
+  // Appends an entry.  Entries must be added in strictly increasing key order,
+  // and must not be marked as deleted.
+  void Add(const IndexEntry& entry);
+
+  // Writes the header, prefix table and checksums.  Must be called exactly
+  // once, after the last entry has been added.
+  void Finish();
+
+ private:
+  void Flush();
+
+  int fd_;
+
+  uint64_t entry_count_ = 0;
+  std::array<uint64_t, kMaxDataFiles> utilization_{};
+  std::vector<uint64_t> fanout_;
+
+  // CRC-32C of the entries for each key prefix.
+  std::vector<uint32_t> checksums_;
+
+  // Encoded entries not yet written.
+  std::vector<uint8_t> buffer_;
+
+  off_t offset_;
+};
+
+// Writes the result of applying `changes`, which may include deletion
+// markers, to `base` as a new segment in `fd`.  Each key may appear at most
+// once in `changes`.
+void WriteIndexSegment(int fd, const IndexSegment& base,
+                       std::vector<IndexEntry> changes);
+
+// Object index made up of an immutable, sorted base segment, and a set of
+// changes applied on top of it.  Removal of objects present in the base
+// segment is represented by entries having `kDeletedMask` set.
+class ObjectIndex {
+ public:
+  ObjectIndex() = default;
+
+  KJ_DISALLOW_COPY(ObjectIndex);
+
+  // Replaces the base segment, and discards all changes made on top of the
+  // previous one.
+  void SetBase(IndexSegment base);
+
+  const IndexSegment& Base() const { return base_; }
+
+  // Returns a number that changes whenever the base segment is replaced, so
+  // that positions in it can be told apart from positions in a later one.
+  uint64_t Generation() const { return generation_; }
+
+  // Returns the entry for `key`, or nullptr if `key` is not present.
+  const IndexEntry* Find(const CASKey& key) const;
+
+  // Inserts `entry`, replacing any existing entry with the same key.
+  void Insert(const IndexEntry& entry);
+
+  // Removes the entry for `key`, if any.
+  void Erase(const CASKey& key);
+
+  // Returns the number of objects in the index.
+  size_t size() const { return size_; }
+
+  // Returns the number of entries held in memory on top of the base segment.
+  size_t OverlaySize() const { return overlay_.size(); }
+
+  void Reserve(size_t n) { overlay_.Reserve(n); }
+
+  // Invokes `function` for every object in the index, in no particular order.
+  // The index must not be modified while this is running.
+  template <typename Function>
+  void ForEach(Function&& function) const {
+    for (const auto& entry : base_) {
+      if (overlay_.Find(entry.key)) continue;
+      function(entry);
+    }
+
+    overlay_.ForEach([&function](const IndexEntry& entry) {
+      if (!(entry.offset & kDeletedMask)) function(entry);
+    });
+  }
+
+  // Returns the entries held on top of the base segment, including deletion
+  // markers, in no particular order.
+  std::vector<IndexEntry> Changes() const;
+
+  // Writes all objects in the index to `fd` as a new base segment.
+  void WriteSegment(int fd) const;
+
+ private:
+  IndexSegment base_;
+
+  IndexTable overlay_;
+
+  size_t size_ = 0;
+
+  uint64_t generation_ = 0;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_OBJECT_INDEX_H_
@@ -0,0 +1,186 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+
+#include <kj/debug.h>
+
+#include "io.h"
+#include "object-index.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+struct ObjectIndexTest : testing::Test {
+ protected:
+  IndexEntry RandomEntry() {
+    std::uniform_int_distribution<uint8_t> byte_distribution;
+    std::uniform_int_distribution<uint64_t> offset_distribution(0, 1 << 30);
+    std::uniform_int_distribution<uint64_t> file_distribution(0, 49);
+
+    IndexEntry result;
+    for (auto& b : result.key) b = byte_distribution(rng_);
+    result.offset = offset_distribution(rng_) | (file_distribution(rng_) << 56);
+    result.size = offset_distribution(rng_);
+
+    return result;
+  }
+
+  // Verifies that `index` contains exactly the entries in `expected`.
+  void ExpectContents(const ObjectIndex& index,
+                      const std::unordered_map<CASKey, IndexEntry>& expected) {
+    EXPECT_EQ(expected.size(), index.size());
+
+    for (const auto& e : expected) {
+      auto entry = index.Find(e.first);
+      ASSERT_TRUE(entry != nullptr);
+      EXPECT_EQ(e.second.offset, entry->offset);
+      EXPECT_EQ(e.second.size, entry->size);
+    }
+
+    size_t count = 0;
+    index.ForEach([&expected, &count](const IndexEntry& entry) {
+      ++count;
+      EXPECT_EQ(1U, expected.count(entry.key));
+    });
+    EXPECT_EQ(expected.size(), count);
+  }
+
+  std::mt19937_64 rng_;
+};
+
+// Verifies that inserts, replacements and removals are visible through lookups
+// before and after being merged into a base segment.
+TEST_F(ObjectIndexTest, InsertEraseAndCheckpoint) {
+  static const size_t kObjectCount = 20000;
+
+  ObjectIndex index;
+  std::unordered_map<CASKey, IndexEntry> expected;
+
+  for (size_t i = 0; i < kObjectCount; ++i) {
+    auto entry = RandomEntry();
+    index.Insert(entry);
+    expected[entry.key] = entry;
+  }
+
+  ExpectContents(index, expected);
+
+  auto segment_file = AnonTemporaryFile(nullptr);
+  index.WriteSegment(segment_file.get());
+  index.SetBase(IndexSegment(segment_file.get()));
+
+  EXPECT_EQ(0U, index.OverlaySize());
+  ExpectContents(index, expected);
+
+  uint64_t utilization = 0;
+  for (size_t i = 0; i < kMaxDataFiles; ++i)
+    utilization += index.Base().Utilization(i);
+  uint64_t expected_utilization = 0;
+  for (const auto& e : expected) expected_utilization += e.second.size;
+  EXPECT_EQ(expected_utilization, utilization);
+
+  // Remove and replace some of the objects in the base segment, and add some
+  // new ones.
+  std::vector<CASKey> keys;
+  for (const auto& e : expected) keys.emplace_back(e.first);
+  std::sort(keys.begin(), keys.end());
+
+  for (size_t i = 0; i < keys.size(); i += 3) {
+    index.Erase(keys[i]);
+    expected.erase(keys[i]);
+  }
+
+  for (size_t i = 1; i < keys.size(); i += 3) {
+    auto entry = RandomEntry();
+    entry.key = keys[i];
+    index.Insert(entry);
+    expected[entry.key] = entry;
+  }
+
+  for (size_t i = 0; i < kObjectCount / 10; ++i) {
+    auto entry = RandomEntry();
+    index.Insert(entry);
+    expected[entry.key] = entry;
+  }
+
+  for (size_t i = 0; i < keys.size(); i += 3)
+    EXPECT_TRUE(index.Find(keys[i]) == nullptr);
+
+  ExpectContents(index, expected);
+
+  auto second_segment_file = AnonTemporaryFile(nullptr);
+  index.WriteSegment(second_segment_file.get());
+  index.SetBase(IndexSegment(second_segment_file.get()));
+
+  ExpectContents(index, expected);
+}
+
+// Verifies that an empty index can be written and read back.
+TEST_F(ObjectIndexTest, EmptySegment) {
+  ObjectIndex index;
+
+  auto segment_file = AnonTemporaryFile(nullptr);
+  index.WriteSegment(segment_file.get());
+  index.SetBase(IndexSegment(segment_file.get()));
+
+  EXPECT_EQ(0U, index.size());
+  EXPECT_TRUE(index.Find(RandomEntry().key) == nullptr);
+}
+
+// Verifies that damage to the header or the prefix table is detected when the
+// segment is opened, and that damage to an entry is detected by `Verify()`.
+TEST_F(ObjectIndexTest, DamagedSegmentIsRejected) {
+  static const size_t kObjectCount = 1000;
+
+  ObjectIndex index;
+  for (size_t i = 0; i < kObjectCount; ++i) index.Insert(RandomEntry());
+
+  auto segment_file = AnonTemporaryFile(nullptr);
+  index.WriteSegment(segment_file.get());
+
+  const auto data = ReadFile(segment_file.get());
+
+  const auto damaged_copy = [&data](size_t offset) {
+    auto damaged = kj::heapArray<char>(data.begin(), data.size());
+    damaged[offset] ^= 1;
+
+    auto result = AnonTemporaryFile(nullptr);
+    WriteWithOffset(result.get(), damaged.begin(), damaged.size(), 0);
+    return result;
+  };
+
+  // Entry count, and an offset in the prefix table.
+  const size_t header_offsets[] = {16, 544 + 8 * 30000};
+
+  for (const auto offset : header_offsets) {
+    auto damaged_file = damaged_copy(offset);
+    EXPECT_THROW(IndexSegment(damaged_file.get()), kj::Exception) << offset;
+  }
+
+  // The last byte of the last entry's key.
+  {
+    auto damaged_file = damaged_copy(data.size() - 1);
+    IndexSegment segment(damaged_file.get());
+    EXPECT_THROW(segment.Verify(), kj::Exception);
+  }
+
+  IndexSegment segment(segment_file.get());
+  EXPECT_EQ(kObjectCount, segment.size());
+  segment.Verify();
+}
@@ -0,0 +1,70 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/object-list.h"
+
+#include <algorithm>
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+kj::Promise<void> ConcatenatedObjectList::read(ReadContext context) {
+  return Read(context.getParams().getCount()).then([this, context]() mutable {
+    size_t count = std::min(
+        keys_.size(), static_cast<size_t>(context.getParams().getCount()));
+    auto objects = context.getResults().initObjects(count);
+
+    auto orphanage = context.getResultsOrphanage();
+
+    for (size_t i = 0; i < count; ++i) {
+      auto key_buffer = orphanage.newOrphan<capnp::Data>(20);
+      std::copy(keys_.front().begin(), keys_.front().end(),
+                key_buffer.get().begin());
+      keys_.pop_front();
+      objects.adopt(i, std::move(key_buffer));
+    }
+  });
+}
+
+kj::Promise<void> ConcatenatedObjectList::Read(size_t amount) {
+  if (keys_.size() >= amount || lists_.empty()) return kj::READY_NOW;
+
+  auto read_request = lists_.front().readRequest();
+  read_request.setCount(amount - keys_.size());
+
+  return read_request.send().then(
+      [this, amount](auto response) -> kj::Promise<void> {
+        auto objects = response.getObjects();
+
+        if (objects.size() == 0) lists_.pop_front();
+
+        for (const auto& object : objects) {
+          KJ_REQUIRE(object.size() == 20);
+          keys_.emplace_back(object.begin());
+        }
+
+        return this->Read(amount);
+      });
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,31 @@
+#ifndef CANTERA_OBJECT_LIST_H_
+#define CANTERA_OBJECT_LIST_H_ 1
+
+#include <deque>
+
+#include "key.h"
+#include "proto/ca-cas.capnp.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Object list returning the contents of several other object lists, one after
+// the other.
+class ConcatenatedObjectList : public CAS::ObjectList::Server {
+ public:
+  ConcatenatedObjectList(std::deque<CAS::ObjectList::Client>&& lists)
+      : lists_(std::move(lists)) {}
+
+  kj::Promise<void> read(ReadContext context) override;
+
+ private:
+  kj::Promise<void> Read(size_t limit);
+
+  std::deque<CAS::ObjectList::Client> lists_;
+  std::deque<CASKey> keys_;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_OBJECT_LIST_H_
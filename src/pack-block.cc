@@ -0,0 +1,132 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/pack-block.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <kj/debug.h>
+
+#include "io.h"
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+const char kMagic[8] = {'C', 'A', 'S', 'P', 'A', 'C', 'K', 'B'};
+const uint32_t kVersion = 1;
+
+void EncodeUInt(uint32_t value, size_t size, uint8_t* output) {
+  for (size_t i = 0; i < size; ++i) output[i] = value >> (i * 8);
+}
+
+uint32_t DecodeUInt(const uint8_t* input, size_t size) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < size; ++i)
+    result |= static_cast<uint32_t>(input[i]) << (i * 8);
+  return result;
+}
+
+}  // namespace
+
+PackBlockWriter::PackBlockWriter(int fd, off_t offset)
+    : fd_(fd), offset_(offset) {
+  KJ_REQUIRE(offset % kPackBlockSize == 0, offset);
+
+  uint8_t header[kPackHeaderSize];
+  memcpy(header, kMagic, sizeof(kMagic));
+  EncodeUInt(kVersion, 4, header + 8);
+  EncodeUInt(kPackBlockSize, 4, header + 12);
+
+  WriteWithOffset(fd_, header, sizeof(header), offset_);
+}
+
+off_t PackBlockWriter::Add(const CASKey& key, const void* data, size_t size) {
+  KJ_REQUIRE(Fits(size), size, count_, data_begin_);
+
+  data_begin_ -= size;
+  WriteWithOffset(fd_, data, size, offset_ + data_begin_);
+
+  // The entry is written after the data, so that the directory never refers
+  // to data that has not been written.
+  uint8_t entry[kPackEntrySize];
+  std::copy(key.begin(), key.end(), entry);
+  EncodeUInt(data_begin_, 2, entry + 20);
+  EncodeUInt(size, 2, entry + 22);
+
+  WriteWithOffset(fd_, entry, sizeof(entry),
+                  offset_ + kPackHeaderSize + count_ * kPackEntrySize);
+  ++count_;
+
+  return offset_ + data_begin_;
+}
+
+bool IsPackBlock(int fd, off_t offset) {
+  char magic[sizeof(kMagic)];
+  return sizeof(magic) == ReadWithOffset(fd, magic, 0, sizeof(magic), offset) &&
+         !memcmp(magic, kMagic, sizeof(kMagic));
+}
+
+std::vector<IndexEntry> ReadPackBlock(int fd, off_t offset) {
+  std::vector<uint8_t> block(kPackBlockSize);
+  const auto size =
+      ReadWithOffset(fd, block.data(), kPackHeaderSize, block.size(), offset);
+  block.resize(size);
+
+  KJ_REQUIRE(!memcmp(block.data(), kMagic, sizeof(kMagic)),
+             "missing pack block header", offset);
+  KJ_REQUIRE(DecodeUInt(block.data() + 8, 4) == kVersion,
+             "unsupported pack block version", DecodeUInt(block.data() + 8, 4));
+  KJ_REQUIRE(DecodeUInt(block.data() + 12, 4) == kPackBlockSize,
+             "unexpected pack block size", DecodeUInt(block.data() + 12, 4));
+
+  std::vector<IndexEntry> result;
+
+  // The directory ends where the object data begins.
+  size_t data_begin = size;
+
+  for (size_t i = kPackHeaderSize; i + kPackEntrySize <= data_begin;
+       i += kPackEntrySize) {
+    const auto entry = block.data() + i;
+    const auto object_offset = DecodeUInt(entry + 20, 2);
+    const auto object_size = DecodeUInt(entry + 22, 2);
+
+    if (!object_offset) break;
+
+    KJ_REQUIRE(object_offset >= i + kPackEntrySize &&
+                   object_offset + object_size <= kPackBlockSize,
+               "corrupt pack block directory", offset, i);
+
+    data_begin = std::min<size_t>(data_begin, object_offset);
+
+    IndexEntry index_entry;
+    std::copy(entry, entry + 20, index_entry.key.begin());
+    index_entry.offset = offset + object_offset;
+    index_entry.size = object_size;
+    result.emplace_back(index_entry);
+  }
+
+  return result;
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
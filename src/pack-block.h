@@ -0,0 +1,79 @@
+#ifndef CANTERA_PACK_BLOCK_H_
+#define CANTERA_PACK_BLOCK_H_ 1
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "index-entry.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Small objects are packed into blocks of `kPackBlockSize` bytes, stored at
+// aligned offsets in the data files.
+//
+// Block layout: a 16 byte header holding a magic string, the format version
+// and the block size, followed by a directory of 24 byte entries.  Each entry
+// is a 20 byte key followed by the 16-bit offset of the object within the
+// block and its 16-bit size, little endian.  Object data is stored from the
+// end of the block towards the directory.  The directory ends at the first
+// entry with a zero offset.
+//
+// The index still holds an entry for every object, pointing directly at its
+// data, so a packed object is read like any other object.  The directory lets
+// `ca-cas-fsck` verify that the index agrees with the blocks.
+
+const size_t kPackBlockSize = 64 * 1024;
+const size_t kPackHeaderSize = 16;
+const size_t kPackEntrySize = 24;
+
+// Largest object that fits in an empty block.
+const size_t kMaxPackedObjectSize =
+    kPackBlockSize - kPackHeaderSize - kPackEntrySize;
+
+// Appends objects to a block, writing each object and its directory entry as
+// it is added.  Nothing else may write to the block's range of the file.
+class PackBlockWriter {
+ public:
+  // Starts a new block at `offset` in `fd`, which must be a multiple of
+  // `kPackBlockSize`.  `fd` must not be opened with O_APPEND.
+  PackBlockWriter(int fd, off_t offset);
+
+  // Returns true if an object of `size` bytes fits in the remaining space.
+  bool Fits(size_t size) const {
+    const auto directory_end = kPackHeaderSize + (count_ + 1) * kPackEntrySize;
+    return size > 0 && directory_end + size <= data_begin_;
+  }
+
+  // Writes an object to the block, and returns its offset in the file.  Empty
+  // objects can not be packed.
+  off_t Add(const CASKey& key, const void* data, size_t size);
+
+  off_t Offset() const { return offset_; }
+
+  // Number of objects in the block.
+  size_t size() const { return count_; }
+
+ private:
+  int fd_;
+  off_t offset_;
+
+  size_t count_ = 0;
+
+  // Offset of the first byte of object data, relative to the block.
+  size_t data_begin_ = kPackBlockSize;
+};
+
+// Returns true if a block header is stored at `offset` in `fd`.
+bool IsPackBlock(int fd, off_t offset);
+
+// Returns the directory of the block at `offset` in `fd`.  The offsets in the
+// returned entries are relative to the start of the file.
+std::vector<IndexEntry> ReadPackBlock(int fd, off_t offset);
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_PACK_BLOCK_H_
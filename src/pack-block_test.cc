@@ -0,0 +1,98 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "io.h"
+#include "pack-block.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+// Verifies that objects added to a block can be found through its directory,
+// and that the block fills up without overflowing.
+TEST(PackBlockTest, AddAndRead) {
+  std::mt19937_64 rng;
+  std::uniform_int_distribution<size_t> size_distribution(1, 4096);
+
+  auto file = AnonTemporaryFile(nullptr);
+
+  // Something that is not part of the block, to verify the block offset is
+  // respected.
+  const std::string junk(kPackBlockSize, 'x');
+  WriteWithOffset(file.get(), junk.data(), junk.size(), 0);
+
+  PackBlockWriter writer(file.get(), kPackBlockSize);
+
+  std::vector<std::pair<CASKey, std::string>> objects;
+
+  for (;;) {
+    std::string data(size_distribution(rng), 0);
+    for (auto& ch : data) ch = rng();
+
+    if (!writer.Fits(data.size())) break;
+
+    CASKey key;
+    for (auto& b : key) b = rng();
+
+    const auto offset = writer.Add(key, data.data(), data.size());
+    EXPECT_LE(kPackBlockSize, offset);
+    EXPECT_GE(2 * kPackBlockSize, offset + data.size());
+
+    objects.emplace_back(key, std::move(data));
+  }
+
+  EXPECT_EQ(objects.size(), writer.size());
+  EXPECT_FALSE(writer.Fits(0));
+  EXPECT_FALSE(writer.Fits(kMaxPackedObjectSize + 1));
+
+  EXPECT_TRUE(IsPackBlock(file.get(), kPackBlockSize));
+  EXPECT_FALSE(IsPackBlock(file.get(), 0));
+  EXPECT_FALSE(IsPackBlock(file.get(), 2 * kPackBlockSize));
+
+  const auto directory = ReadPackBlock(file.get(), kPackBlockSize);
+  ASSERT_EQ(objects.size(), directory.size());
+
+  for (size_t i = 0; i < objects.size(); ++i) {
+    EXPECT_EQ(objects[i].first, directory[i].key);
+    ASSERT_EQ(objects[i].second.size(), directory[i].size);
+
+    std::string data(directory[i].size, 0);
+    ReadWithOffset(file.get(), &data[0], data.size(), directory[i].offset);
+    EXPECT_EQ(objects[i].second, data);
+  }
+}
+
+// Verifies that the largest packable object fits in an empty block.
+TEST(PackBlockTest, MaxSize) {
+  auto file = AnonTemporaryFile(nullptr);
+
+  PackBlockWriter writer(file.get(), 0);
+  ASSERT_TRUE(writer.Fits(kMaxPackedObjectSize));
+
+  CASKey key;
+  const std::string data(kMaxPackedObjectSize, 'a');
+  EXPECT_EQ(kPackHeaderSize + kPackEntrySize,
+            writer.Add(key, data.data(), data.size()));
+  EXPECT_FALSE(writer.Fits(1));
+
+  const auto directory = ReadPackBlock(file.get(), 0);
+  ASSERT_EQ(1U, directory.size());
+  EXPECT_EQ(kMaxPackedObjectSize, directory[0].size);
+}
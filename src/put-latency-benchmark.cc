@@ -0,0 +1,235 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Measures how long small gets take while large objects are being uploaded to
+// the same storage server, for each of the given numbers of hash threads.
+// With hashing done on the event loop, every get queued behind a chunk of
+// upload data waits for that chunk to be hashed.
+//
+// Usage: put-latency-benchmark [HASH-THREADS]...
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include "bytestream.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "storage-server.h"
+#include "util.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const size_t kSmallObjectSize = 4096;
+const size_t kLargeObjectSize = 128 << 20;
+const size_t kLargeObjectCount = 4;
+const size_t kWriteSize = 1 << 20;
+
+std::string TemporaryDirectory() {
+  const char* tmpdir = getenv("TMPDIR");
+  if (!tmpdir) tmpdir = "/tmp";
+
+  char path[PATH_MAX];
+  strcpy(path, tmpdir);
+  strcat(path, "/put-latency.XXXXXX");
+
+  KJ_SYSCALL(mkdtemp(path));
+
+  return path;
+}
+
+std::vector<uint8_t> RandomData(std::mt19937_64& rng, size_t size) {
+  std::vector<uint8_t> result(size);
+  std::uniform_int_distribution<uint8_t> byte_distribution;
+  for (auto& b : result) b = byte_distribution(rng);
+  return result;
+}
+
+CASKey Digest(const std::vector<uint8_t>& data) {
+  CASKey key;
+  SHA1::Digest(data.data(), data.size(), key.begin());
+  return key;
+}
+
+// Serves the repository in `path` on `socket_fd` until `stop_fd` is closed.
+void RunServer(const std::string& path, size_t hash_threads, int socket_fd,
+               int stop_fd) {
+  auto aio = kj::setupAsyncIo();
+
+  auto storage_server = kj::heap<StorageServer>(path.c_str(), 0, aio);
+  storage_server->SetHashThreads(hash_threads);
+
+  RPCServer<CAS> server(
+      std::move(storage_server),
+      aio.lowLevelProvider->wrapSocketFd(
+          socket_fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+
+  auto stop = aio.lowLevelProvider->wrapInputFd(stop_fd);
+  char byte;
+  stop->tryRead(&byte, 1, 1).wait(aio.waitScope);
+}
+
+kj::Promise<void> Put(CAS::Client& cas, const CASKey& key,
+                      const std::vector<uint8_t>& data) {
+  auto put_request = cas.putRequest();
+  put_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+  put_request.setSync(false);
+
+  auto producer =
+      kj::heap<ByteStreamProducer>(put_request.send().getStream());
+  for (size_t offset = 0; offset < data.size(); offset += kWriteSize) {
+    producer->Write(data.data() + offset,
+                    std::min(kWriteSize, data.size() - offset));
+  }
+
+  return producer->Done().attach(std::move(producer));
+}
+
+// Gets `key` repeatedly until `done` is set, recording the latency of each
+// request.
+kj::Promise<void> GetLoop(CAS::Client& cas, const CASKey& key,
+                          const bool& done,
+                          std::vector<Clock::duration>& latencies) {
+  if (done) return kj::READY_NOW;
+
+  const auto start = Clock::now();
+
+  auto result = kj::heap<std::string>();
+  auto get_request = cas.getRequest();
+  get_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+  get_request.setStream(kj::heap<ByteStreamCollector>(*result));
+
+  return get_request.send()
+      .then([&cas, key, &done, &latencies, start](auto&&) {
+        latencies.emplace_back(Clock::now() - start);
+        return GetLoop(cas, key, done, latencies);
+      })
+      .attach(std::move(result));
+}
+
+double Microseconds(Clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+void RunBenchmark(kj::AsyncIoContext& aio, size_t hash_threads,
+                  const std::vector<uint8_t>& small_object,
+                  const std::vector<std::vector<uint8_t>>& large_objects) {
+  const auto path = TemporaryDirectory();
+
+  int sockets[2];
+  KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+
+  int stop_pipe[2];
+  KJ_SYSCALL(pipe(stop_pipe));
+  kj::AutoCloseFd stop_reader(stop_pipe[0]);
+  kj::AutoCloseFd stop_writer(stop_pipe[1]);
+
+  std::thread server_thread(RunServer, path, hash_threads, sockets[0],
+                            stop_reader.get());
+
+  std::vector<Clock::duration> latencies;
+  Clock::duration put_time;
+
+  {
+    RPCClient client(aio.lowLevelProvider->wrapSocketFd(
+        sockets[1], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+    auto cas = client.GetMain<CAS>();
+
+    const auto small_key = Digest(small_object);
+    Put(cas, small_key, small_object).wait(aio.waitScope);
+
+    std::vector<CASKey> large_keys;
+    for (const auto& data : large_objects)
+      large_keys.emplace_back(Digest(data));
+
+    const auto put_start = Clock::now();
+
+    auto puts = kj::heapArrayBuilder<kj::Promise<void>>(large_objects.size());
+    for (size_t i = 0; i < large_objects.size(); ++i)
+      puts.add(Put(cas, large_keys[i], large_objects[i]));
+
+    bool puts_done = false;
+    auto gets = GetLoop(cas, small_key, puts_done, latencies);
+
+    kj::joinPromises(puts.finish()).wait(aio.waitScope);
+    put_time = Clock::now() - put_start;
+    puts_done = true;
+
+    gets.wait(aio.waitScope);
+  }
+
+  stop_writer = nullptr;
+  server_thread.join();
+
+  KJ_REQUIRE(!latencies.empty());
+  std::sort(latencies.begin(), latencies.end());
+
+  printf(
+      "hash threads: %zu  put time: %.0f ms  gets: %zu  p50: %.0f us  "
+      "p99: %.0f us  max: %.0f us\n",
+      hash_threads, Microseconds(put_time) / 1000.0, latencies.size(),
+      Microseconds(latencies[latencies.size() / 2]),
+      Microseconds(latencies[latencies.size() * 99 / 100]),
+      Microseconds(latencies.back()));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) try {
+  std::vector<size_t> hash_thread_counts;
+  for (int i = 1; i < argc; ++i)
+    hash_thread_counts.emplace_back(StringToUInt64(argv[i]));
+  if (hash_thread_counts.empty()) hash_thread_counts = {0, 2};
+
+  std::mt19937_64 rng(1234);
+
+  const auto small_object = RandomData(rng, kSmallObjectSize);
+
+  std::vector<std::vector<uint8_t>> large_objects;
+  for (size_t i = 0; i < kLargeObjectCount; ++i)
+    large_objects.emplace_back(RandomData(rng, kLargeObjectSize));
+
+  auto aio = kj::setupAsyncIo();
+
+  for (const auto hash_threads : hash_thread_counts)
+    RunBenchmark(aio, hash_threads, small_object, large_objects);
+} catch (kj::Exception& e) {
+  KJ_LOG(FATAL, e);
+  return EXIT_FAILURE;
+}
@@ -27,6 +27,15 @@ class RPCServer {
         vat_network_(*async_io_stream_, capnp::rpc::twoparty::Side::SERVER),
         rpc_server_(capnp::makeRpcServer(vat_network_, std::move(server))) {}
 
+  // Serves an existing capability, which may be shared with other
+  // connections.
+  RPCServer(typename Capability::Client bootstrap,
+            kj::Own<kj::AsyncIoStream>&& async_io_stream)
+      : async_io_stream_(std::move(async_io_stream)),
+        vat_network_(*async_io_stream_, capnp::rpc::twoparty::Side::SERVER),
+        rpc_server_(capnp::makeRpcServer(vat_network_, std::move(bootstrap))) {
+  }
+
   KJ_DISALLOW_COPY(RPCServer);
   RPCServer(RPCServer&& rhs) = delete;
   RPCServer& operator=(RPCServer&& rhs) = delete;
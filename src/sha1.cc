@@ -0,0 +1,316 @@
+// Copyright 2016 Morten Hustveit <morten.hustveit@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations
+// including the two.
+//
+// You must obey the GNU General Public License in all respects
+// for all of the code used other than OpenSSL.  If you modify
+// file(s) with this exception, you may extend this exception to your
+// version of the file(s), but you are not obligated to do so.  If you
+// do not wish to do so, delete this exception statement from your
+// version.  If you delete this exception statement from all source
+// files in the program, then also delete it here.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/sha1.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CANTERA_SHA1_AVX2 1
+#endif
+
+#include <kj/debug.h>
+
+namespace cantera {
+namespace cas_internal {
+
+namespace {
+
+#if CANTERA_SHA1_AVX2
+
+const size_t kLanes = 8;
+
+// A buffer being hashed in one lane of the AVX2 implementation.  Full
+// blocks are read directly from the buffer, while the remaining bytes and the
+// padding are copied to `tail`.
+struct Lane {
+  void Init(const void* data, size_t size) {
+    this->data = reinterpret_cast<const uint8_t*>(data);
+    full_blocks = size / 64;
+
+    const auto remaining = size % 64;
+    const auto tail_blocks = (remaining + 9 <= 64) ? 1 : 2;
+    block_count = full_blocks + tail_blocks;
+
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, this->data + full_blocks * 64, remaining);
+    tail[remaining] = 0x80;
+
+    const uint64_t bit_count = static_cast<uint64_t>(size) * 8;
+    auto length = tail + tail_blocks * 64 - 8;
+    for (size_t i = 0; i < 8; ++i) length[i] = bit_count >> (56 - i * 8);
+  }
+
+  const uint8_t* Block(size_t idx) const {
+    if (idx < full_blocks) return data + idx * 64;
+    return tail + (idx - full_blocks) * 64;
+  }
+
+  const uint8_t* data = nullptr;
+  size_t full_blocks = 0;
+  size_t block_count = 0;
+  uint8_t tail[128];
+};
+
+__attribute__((target("avx2"))) inline __m256i Rotate(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+// Loads eight consecutive big endian words from each of eight blocks, and
+// transposes them so that `w[i]` holds word `i` of every block.
+__attribute__((target("avx2"))) void LoadWords(const uint8_t* const* blocks,
+                                               size_t offset, __m256i* w) {
+  const auto byte_swap = _mm256_set_epi8(
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+      9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+  __m256i r[8];
+  for (size_t i = 0; i < 8; ++i) {
+    r[i] = _mm256_shuffle_epi8(
+        _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(blocks[i] + offset)),
+        byte_swap);
+  }
+
+  __m256i t[8];
+  for (size_t i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+  }
+
+  __m256i u[8];
+  for (size_t i = 0; i < 8; i += 4) {
+    u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+    u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+    u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+    u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+  }
+
+  for (size_t i = 0; i < 4; ++i) {
+    w[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+    w[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+  }
+}
+
+// Applies the SHA-1 compression function to one block in each lane.  Lanes
+// not set in `active` keep their previous state.
+__attribute__((target("avx2"))) void Compress(__m256i* state,
+                                              const uint8_t* const* blocks,
+                                              __m256i active) {
+  __m256i w[16];
+  LoadWords(blocks, 0, w);
+  LoadWords(blocks, 32, w + 8);
+
+  auto a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+#pragma GCC unroll 80
+  for (size_t t = 0; t < 80; ++t) {
+    if (t >= 16) {
+      w[t % 16] = Rotate(
+          _mm256_xor_si256(
+              _mm256_xor_si256(w[(t - 3) % 16], w[(t - 8) % 16]),
+              _mm256_xor_si256(w[(t - 14) % 16], w[t % 16])),
+          1);
+    }
+
+    __m256i f, k;
+    if (t < 20) {
+      f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+      k = _mm256_set1_epi32(0x5a827999);
+    } else if (t < 40) {
+      f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+      k = _mm256_set1_epi32(0x6ed9eba1);
+    } else if (t < 60) {
+      f = _mm256_or_si256(_mm256_and_si256(b, c),
+                          _mm256_and_si256(d, _mm256_or_si256(b, c)));
+      k = _mm256_set1_epi32(0x8f1bbcdc);
+    } else {
+      f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+      k = _mm256_set1_epi32(0xca62c1d6);
+    }
+
+    const auto temp = _mm256_add_epi32(
+        _mm256_add_epi32(Rotate(a, 5), f),
+        _mm256_add_epi32(_mm256_add_epi32(e, k), w[t % 16]));
+    e = d;
+    d = c;
+    c = Rotate(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  const __m256i result[5] = {a, b, c, d, e};
+  for (size_t i = 0; i < 5; ++i) {
+    state[i] = _mm256_blendv_epi8(
+        state[i], _mm256_add_epi32(state[i], result[i]), active);
+  }
+}
+
+// Hashes up to eight buffers in parallel.
+__attribute__((target("avx2"))) void DigestLanes(Lane* lanes, size_t count,
+                                                 uint8_t* const* digests) {
+  static const uint8_t kZeroBlock[64] = {};
+
+  __m256i state[5] = {
+      _mm256_set1_epi32(0x67452301), _mm256_set1_epi32(0xefcdab89),
+      _mm256_set1_epi32(0x98badcfe), _mm256_set1_epi32(0x10325476),
+      _mm256_set1_epi32(0xc3d2e1f0)};
+
+  size_t max_blocks = 0;
+  for (size_t i = 0; i < count; ++i)
+    max_blocks = std::max(max_blocks, lanes[i].block_count);
+
+  for (size_t block = 0; block < max_blocks; ++block) {
+    const uint8_t* blocks[kLanes];
+    int32_t active[kLanes];
+    for (size_t i = 0; i < kLanes; ++i) {
+      if (i < count && block < lanes[i].block_count) {
+        blocks[i] = lanes[i].Block(block);
+        active[i] = -1;
+      } else {
+        blocks[i] = kZeroBlock;
+        active[i] = 0;
+      }
+    }
+
+    Compress(state, blocks,
+             _mm256_loadu_si256(reinterpret_cast<const __m256i*>(active)));
+  }
+
+  uint32_t words[5][kLanes];
+  for (size_t i = 0; i < 5; ++i)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+
+  for (size_t lane = 0; lane < count; ++lane) {
+    for (size_t i = 0; i < 5; ++i) {
+      const auto word = words[i][lane];
+      digests[lane][i * 4] = word >> 24;
+      digests[lane][i * 4 + 1] = word >> 16;
+      digests[lane][i * 4 + 2] = word >> 8;
+      digests[lane][i * 4 + 3] = word;
+    }
+  }
+}
+
+void DigestBatchAVX2(size_t count, const void* const* data,
+                     const size_t* sizes, uint8_t* const* digests) {
+  // Buffers of similar size are hashed together, so that few lanes sit idle
+  // while the longest buffer in a group is finishing.
+  std::vector<size_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [sizes](size_t lhs, size_t rhs) {
+    return sizes[lhs] < sizes[rhs];
+  });
+
+  Lane lanes[kLanes];
+  uint8_t* lane_digests[kLanes];
+
+  for (size_t i = 0; i < count; i += kLanes) {
+    const auto group_size = std::min(kLanes, count - i);
+
+    if (group_size == 1) {
+      const auto idx = order[i];
+      SHA1::Digest(data[idx], sizes[idx], digests[idx]);
+      break;
+    }
+
+    for (size_t j = 0; j < group_size; ++j) {
+      const auto idx = order[i + j];
+      lanes[j].Init(data[idx], sizes[idx]);
+      lane_digests[j] = digests[idx];
+    }
+
+    DigestLanes(lanes, group_size, lane_digests);
+  }
+}
+
+#endif  // CANTERA_SHA1_AVX2
+
+SHA1::Implementation BestImplementation() {
+  // Even where OpenSSL uses the SHA extensions, hashing eight buffers at once
+  // with AVX2 gives higher throughput.
+  if (SHA1::Supported(SHA1::Implementation::kAVX2))
+    return SHA1::Implementation::kAVX2;
+
+  return SHA1::Implementation::kSerial;
+}
+
+}  // namespace
+
+bool SHA1::Supported(Implementation implementation) {
+  switch (implementation) {
+    case Implementation::kSerial:
+      return true;
+
+    case Implementation::kAVX2:
+#if CANTERA_SHA1_AVX2
+      return __builtin_cpu_supports("avx2");
+#else
+      return false;
+#endif
+  }
+
+  return false;
+}
+
+void SHA1::DigestBatch(size_t count, const void* const* data,
+                       const size_t* sizes, uint8_t* const* digests) {
+  static const auto implementation = BestImplementation();
+
+  DigestBatch(implementation, count, data, sizes, digests);
+}
+
+void SHA1::DigestBatch(Implementation implementation, size_t count,
+                       const void* const* data, const size_t* sizes,
+                       uint8_t* const* digests) {
+  KJ_REQUIRE(Supported(implementation));
+
+  switch (implementation) {
+    case Implementation::kSerial:
+      for (size_t i = 0; i < count; ++i) Digest(data[i], sizes[i], digests[i]);
+      break;
+
+    case Implementation::kAVX2:
+#if CANTERA_SHA1_AVX2
+      DigestBatchAVX2(count, data, sizes, digests);
+#endif
+      break;
+  }
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -43,6 +43,29 @@ namespace cas_internal {
 
 class SHA1 {
  public:
+  enum class Implementation {
+    // One buffer at a time, using OpenSSL, which in turn uses the SHA
+    // extensions where available.
+    kSerial,
+
+    // Eight buffers at a time, using AVX2.
+    kAVX2,
+  };
+
+  // Returns true if `implementation` can be used on this CPU.
+  static bool Supported(Implementation implementation);
+
+  // Computes the digests of `count` buffers, storing the digest of the
+  // `sizes[i]` bytes at `data[i]` in `digests[i]`.  This is faster than
+  // calling `Digest()` for each buffer when there are many small ones.
+  static void DigestBatch(size_t count, const void* const* data,
+                          const size_t* sizes, uint8_t* const* digests);
+
+  // Like above, but using the given implementation, which must be supported.
+  static void DigestBatch(Implementation implementation, size_t count,
+                          const void* const* data, const size_t* sizes,
+                          uint8_t* const* digests);
+
   static void Digest(const void* data, size_t size, uint8_t* digest) {
     SHA1 sha1;
     sha1.Add(data, size);
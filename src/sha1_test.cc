@@ -0,0 +1,99 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <array>
+#include <random>
+#include <vector>
+
+#include "sha1.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+namespace {
+
+typedef std::array<uint8_t, 20> Digest;
+
+// Computes the digests of buffers of the given sizes with `implementation`,
+// and verifies that they match those computed one at a time.
+void VerifyBatch(SHA1::Implementation implementation,
+                 const std::vector<size_t>& sizes) {
+  std::mt19937_64 rng;
+  std::uniform_int_distribution<uint8_t> byte_distribution;
+
+  std::vector<std::vector<uint8_t>> buffers;
+  std::vector<const void*> data;
+  for (const auto size : sizes) {
+    buffers.emplace_back(size);
+    for (auto& b : buffers.back()) b = byte_distribution(rng);
+    data.emplace_back(buffers.back().data());
+  }
+
+  std::vector<Digest> digests(sizes.size());
+  std::vector<uint8_t*> digest_pointers;
+  for (auto& digest : digests) digest_pointers.emplace_back(digest.begin());
+
+  SHA1::DigestBatch(implementation, sizes.size(), data.data(), sizes.data(),
+                    digest_pointers.data());
+
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    Digest expected;
+    SHA1::Digest(buffers[i], expected.begin());
+    EXPECT_EQ(expected, digests[i]) << "size " << sizes[i];
+  }
+}
+
+void VerifyImplementation(SHA1::Implementation implementation) {
+  // Every size around the block boundaries, where the padding spills into an
+  // extra block.
+  std::vector<size_t> sizes;
+  for (size_t size = 0; size <= 200; ++size) sizes.emplace_back(size);
+  VerifyBatch(implementation, sizes);
+
+  // Buffers of very different sizes hashed together.
+  VerifyBatch(implementation, {0, 100000, 3, 65, 1 << 20, 119, 120, 8191, 2});
+
+  // A single buffer.
+  VerifyBatch(implementation, {1000});
+
+  VerifyBatch(implementation, {});
+}
+
+}  // namespace
+
+TEST(SHA1Test, KnownDigest) {
+  const char data[] = "abc";
+  const Digest expected = {0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81,
+                           0x6a, 0xba, 0x3e, 0x25, 0x71, 0x78, 0x50,
+                           0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d};
+
+  const void* data_pointer = data;
+  const size_t size = 3;
+  Digest digest;
+  auto digest_pointer = digest.begin();
+
+  SHA1::DigestBatch(1, &data_pointer, &size, &digest_pointer);
+  EXPECT_EQ(expected, digest);
+}
+
+TEST(SHA1Test, Serial) { VerifyImplementation(SHA1::Implementation::kSerial); }
+
+TEST(SHA1Test, AVX2) {
+  if (!SHA1::Supported(SHA1::Implementation::kAVX2)) return;
+  VerifyImplementation(SHA1::Implementation::kAVX2);
+}
@@ -0,0 +1,295 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/shard-router.h"
+
+#include <algorithm>
+#include <deque>
+
+#include <kj/debug.h>
+
+#include "client.h"
+#include "mark-router.h"
+#include "object-list.h"
+#include "util.h"
+
+namespace cantera {
+namespace cas_internal {
+
+ShardRouter::ShardRouter(std::vector<CAS::Client> shards)
+    : shards_(std::move(shards)) {
+  KJ_REQUIRE(!shards_.empty());
+}
+
+kj::Promise<void> ShardRouter::beginGC(BeginGCContext context) {
+  auto builder = kj::heapArrayBuilder<kj::Promise<uint64_t>>(shards_.size());
+  for (auto& shard : shards_) builder.add(CASClient::BeginGC(shard));
+
+  return kj::joinPromises(builder.finish())
+      .then([this, context](kj::Array<uint64_t>&& ids) mutable {
+        gc_id_ = std::max(gc_id_ + 1, cas_internal::CurrentTimeUSec());
+        shard_gc_ids_.assign(ids.begin(), ids.end());
+
+        context.getResults().setId(gc_id_);
+      });
+}
+
+kj::Promise<void> ShardRouter::markGC(MarkGCContext context) {
+  // Each shard only needs to hear about its own keys.
+  std::vector<std::vector<CASKey>> shard_keys(shards_.size());
+
+  for (const auto& key : context.getParams().getKeys()) {
+    const auto storage_key = ObjectKey::FromWire(key).StorageKey();
+    shard_keys[ShardForKey(storage_key, shards_.size())].emplace_back(
+        storage_key);
+  }
+
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(shards_.size());
+
+  for (size_t i = 0; i < shards_.size(); ++i)
+    builder.add(CASClient::MarkGC(shards_[i], shard_keys[i]));
+
+  return kj::joinPromises(builder.finish());
+}
+
+kj::Promise<void> ShardRouter::markGCStream(MarkGCStreamContext context) {
+  std::vector<CAS::MarkSink::Client> sinks;
+  for (auto& shard : shards_)
+    sinks.emplace_back(shard.markGCStreamRequest().send().getSink());
+
+  const auto shard_count = shards_.size();
+
+  context.getResults().setSink(kj::heap<MarkRouter>(
+      std::move(sinks),
+      [shard_count](const CASKey& key, std::vector<size_t>& result) {
+        result.emplace_back(ShardForKey(key, shard_count));
+      }));
+
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ShardRouter::markGCFilter(MarkGCFilterContext context) {
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(shards_.size());
+
+  for (auto& shard : shards_) {
+    auto request = shard.markGCFilterRequest();
+    request.setFilter(context.getParams().getFilter());
+    builder.add(request.send().ignoreResult());
+  }
+
+  return kj::joinPromises(builder.finish());
+}
+
+kj::Promise<void> ShardRouter::endGC(EndGCContext context) {
+  const auto gc_id = context.getParams().getId();
+  KJ_REQUIRE(gc_id == gc_id_, "Conflicting garbage collection detected", gc_id,
+             gc_id_);
+  KJ_REQUIRE(shards_.size() == shard_gc_ids_.size());
+
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(shards_.size());
+
+  for (size_t i = 0; i < shards_.size(); ++i)
+    builder.add(CASClient::EndGC(shards_[i], shard_gc_ids_[i]));
+
+  return kj::joinPromises(builder.finish());
+}
+
+kj::Promise<void> ShardRouter::get(GetContext context) {
+  auto params = context.getParams();
+
+  auto request = OwningShard(params.getKey()).getRequest();
+  request.setKey(params.getKey());
+  request.setOffset(params.getOffset());
+  request.setSize(params.getSize());
+  request.setStream(params.getStream());
+  request.setBulkChannel(params.getBulkChannel());
+
+  return context.tailCall(std::move(request));
+}
+
+kj::Promise<void> ShardRouter::put(PutContext context) {
+  auto params = context.getParams();
+
+  auto request = OwningShard(params.getKey()).putRequest();
+  request.setKey(params.getKey());
+  request.setSync(params.getSync());
+
+  return context.tailCall(std::move(request));
+}
+
+kj::Promise<void> ShardRouter::remove(RemoveContext context) {
+  auto request = OwningShard(context.getParams().getKey()).removeRequest();
+  request.setKey(context.getParams().getKey());
+
+  return context.tailCall(std::move(request));
+}
+
+kj::Promise<void> ShardRouter::capacity(CapacityContext context) {
+  auto builder = kj::heapArrayBuilder<kj::Promise<
+      capnp::Response<CAS::CapacityResults>>>(shards_.size());
+  for (auto& shard : shards_) builder.add(shard.capacityRequest().send());
+
+  return kj::joinPromises(builder.finish())
+      .then([context](auto responses) mutable {
+        auto results = context.getResults();
+
+        // The shards share a file system.
+        results.setTotal(responses[0].getTotal());
+        results.setAvailable(responses[0].getAvailable());
+
+        uint64_t unreclaimed = 0, garbage = 0;
+        for (auto& response : responses) {
+          unreclaimed += response.getUnreclaimed();
+          garbage += response.getGarbage();
+        }
+
+        results.setUnreclaimed(unreclaimed);
+        results.setGarbage(garbage);
+      });
+}
+
+kj::Promise<void> ShardRouter::list(ListContext context) {
+  const auto mode = context.getParams().getMode();
+  const auto min_size = context.getParams().getMinSize();
+  const auto max_size = context.getParams().getMaxSize();
+
+  std::deque<CAS::ObjectList::Client> lists;
+
+  for (auto& shard : shards_) {
+    auto request = shard.listRequest();
+    request.setMode(mode);
+    request.setMinSize(min_size);
+    request.setMaxSize(max_size);
+    lists.emplace_back(request.send().getList());
+  }
+
+  context.getResults().setList(
+      kj::heap<ConcatenatedObjectList>(std::move(lists)));
+
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ShardRouter::compact(CompactContext context) {
+  const auto sync = context.getParams().getSync();
+
+  // The shards share the same disks, so compact them one at a time.
+  kj::Promise<void> promise = kj::READY_NOW;
+
+  for (auto& shard : shards_) {
+    promise = promise.then(
+        [&shard, sync] { return CASClient::CompactAsync(shard, sync); });
+  }
+
+  return promise;
+}
+
+kj::Promise<void> ShardRouter::getCompactionStatus(
+    GetCompactionStatusContext context) {
+  auto builder = kj::heapArrayBuilder<kj::Promise<
+      capnp::Response<CAS::GetCompactionStatusResults>>>(shards_.size());
+  for (auto& shard : shards_)
+    builder.add(shard.getCompactionStatusRequest().send());
+
+  return kj::joinPromises(builder.finish())
+      .then([context](auto responses) mutable {
+        auto status = context.getResults().initStatus();
+
+        uint64_t bytes_to_move = 0, bytes_moved = 0, bytes_reclaimed = 0;
+
+        for (auto& response : responses) {
+          auto shard_status = response.getStatus();
+
+          if (shard_status.getActive()) {
+            status.setActive(true);
+            status.setDataFile(shard_status.getDataFile());
+          }
+
+          bytes_to_move += shard_status.getBytesToMove();
+          bytes_moved += shard_status.getBytesMoved();
+          bytes_reclaimed += shard_status.getBytesReclaimed();
+        }
+
+        status.setBytesToMove(bytes_to_move);
+        status.setBytesMoved(bytes_moved);
+        status.setBytesReclaimed(bytes_reclaimed);
+      });
+}
+
+kj::Promise<void> ShardRouter::getConfig(GetConfigContext context) {
+  // The shards share a configuration file.
+  return context.tailCall(shards_[0].getConfigRequest());
+}
+
+kj::Promise<void> ShardRouter::getPlacement(GetPlacementContext context) {
+  // Like the configuration, the placement is shared by the shards.
+  return context.tailCall(shards_[0].getPlacementRequest());
+}
+
+kj::Promise<void> ShardRouter::setPlacement(SetPlacementContext context) {
+  auto request = shards_[0].setPlacementRequest();
+  request.setRing(context.getParams().getRing());
+  request.setExpected(context.getParams().getExpected());
+  request.setConditional(context.getParams().getConditional());
+  return context.tailCall(std::move(request));
+}
+
+kj::Promise<void> ShardRouter::getBulkPort(GetBulkPortContext context) {
+  // Bulk transfer channels are shared by all the shards in a process.
+  return context.tailCall(shards_[0].getBulkPortRequest());
+}
+
+kj::Promise<void> ShardRouter::getCacheStats(GetCacheStatsContext context) {
+  auto builder = kj::heapArrayBuilder<
+      kj::Promise<capnp::Response<CAS::GetCacheStatsResults>>>(shards_.size());
+  for (auto& shard : shards_) builder.add(shard.getCacheStatsRequest().send());
+
+  return kj::joinPromises(builder.finish())
+      .then([context](auto responses) mutable {
+        auto stats = context.getResults().initStats();
+
+        uint64_t hits = 0, misses = 0, rejections = 0, objects = 0, size = 0,
+                 capacity = 0;
+
+        for (auto& response : responses) {
+          auto shard_stats = response.getStats();
+          hits += shard_stats.getHits();
+          misses += shard_stats.getMisses();
+          rejections += shard_stats.getRejections();
+          objects += shard_stats.getObjects();
+          size += shard_stats.getSize();
+          capacity += shard_stats.getCapacity();
+        }
+
+        stats.setHits(hits);
+        stats.setMisses(misses);
+        stats.setRejections(rejections);
+        stats.setObjects(objects);
+        stats.setSize(size);
+        stats.setCapacity(capacity);
+      });
+}
+
+CAS::Client& ShardRouter::OwningShard(capnp::Data::Reader key) {
+  return shards_[ShardForKey(ObjectKey::FromWire(key).StorageKey(),
+                            shards_.size())];
+}
+
+}  // namespace cas_internal
+}  // namespace cantera
@@ -0,0 +1,76 @@
+#ifndef CANTERA_SHARD_ROUTER_H_
+#define CANTERA_SHARD_ROUTER_H_ 1
+
+#include <cstdint>
+#include <vector>
+
+#include "key.h"
+#include "proto/ca-cas.capnp.h"
+
+namespace cantera {
+namespace cas_internal {
+
+// Front end for a storage server split into shards that each own a disjoint
+// range of the key space, such as one `StorageServer` per thread in a single
+// process.  Requests for a single object are forwarded to the shard owning
+// the key, and all other requests are sent to every shard.
+class ShardRouter : public CAS::Server {
+ public:
+  // `shards[i]` must hold the objects for which `ShardForKey()` returns `i`.
+  explicit ShardRouter(std::vector<CAS::Client> shards);
+
+  KJ_DISALLOW_COPY(ShardRouter);
+
+  // Returns the shard owning `key`, out of `shard_count` shards.
+  static size_t ShardForKey(const CASKey& key, size_t shard_count) {
+    return ((static_cast<size_t>(key[0]) << 8 | key[1]) * shard_count) >> 16;
+  }
+
+  kj::Promise<void> beginGC(BeginGCContext context) override;
+
+  kj::Promise<void> markGC(MarkGCContext context) override;
+
+  kj::Promise<void> markGCStream(MarkGCStreamContext context) override;
+
+  kj::Promise<void> markGCFilter(MarkGCFilterContext context) override;
+
+  kj::Promise<void> endGC(EndGCContext context) override;
+
+  kj::Promise<void> get(GetContext context) override;
+
+  kj::Promise<void> put(PutContext context) override;
+
+  kj::Promise<void> remove(RemoveContext context) override;
+
+  kj::Promise<void> capacity(CapacityContext context) override;
+
+  kj::Promise<void> list(ListContext context) override;
+
+  kj::Promise<void> compact(CompactContext context) override;
+
+  kj::Promise<void> getCompactionStatus(
+      GetCompactionStatusContext context) override;
+
+  kj::Promise<void> getConfig(GetConfigContext context) override;
+
+  kj::Promise<void> getBulkPort(GetBulkPortContext context) override;
+
+  kj::Promise<void> getCacheStats(GetCacheStatsContext context) override;
+
+  kj::Promise<void> getPlacement(GetPlacementContext context) override;
+
+  kj::Promise<void> setPlacement(SetPlacementContext context) override;
+
+ private:
+  CAS::Client& OwningShard(capnp::Data::Reader key);
+
+  std::vector<CAS::Client> shards_;
+
+  std::vector<uint64_t> shard_gc_ids_;
+  uint64_t gc_id_ = 0;
+};
+
+}  // namespace cas_internal
+}  // namespace cantera
+
+#endif  // !CANTERA_SHARD_ROUTER_H_
@@ -0,0 +1,197 @@
+// Copyright 2013, 2014, 2015, 2016 Morten Hustveit <morten.hustveit@gmail.com>
+// Copyright 2013, 2014, 2015, 2016 eVenture Capital Partners
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <climits>
+#include <map>
+#include <random>
+#include <set>
+
+#include "bytestream.h"
+#include "client.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "shard-router.h"
+#include "storage-server.h"
+#include "third_party/gtest/gtest.h"
+
+using namespace cantera;
+using namespace cantera::cas_internal;
+
+struct ShardRouterTest : testing::Test {
+ public:
+  static const size_t kShardCount = 3;
+
+  ShardRouterTest() : async_io_{kj::setupAsyncIo()} {}
+
+  ~ShardRouterTest() noexcept {}
+
+  void SetUp() override {
+    const char* tmpdir = getenv("TMPDIR");
+    if (!tmpdir) tmpdir = "/tmp";
+
+    char path[PATH_MAX];
+    strcpy(path, tmpdir);
+    strcat(path, "/test.XXXXXX");
+
+    KJ_SYSCALL(mkdtemp(path));
+
+    temp_directory_ = path;
+
+    StorageServer::SetShardCount(path, kShardCount);
+
+    Connect();
+  }
+
+  void TearDown() override {
+    kj::Promise<void>(kj::READY_NOW).wait(async_io_.waitScope);
+
+    cas_.reset();
+    client_.reset();
+    server_.reset();
+    shards_.clear();
+  }
+
+ protected:
+  // Opens all shards in the same event loop, and connects to a router in
+  // front of them.
+  void Connect() {
+    cas_.reset();
+    client_.reset();
+    server_.reset();
+    shards_.clear();
+
+    for (size_t i = 0; i < kShardCount; ++i) {
+      shards_.emplace_back(kj::heap<StorageServer>(
+          temp_directory_.c_str(), 0, async_io_, i, kShardCount));
+    }
+
+    auto channel = async_io_.provider->newTwoWayPipe();
+
+    server_ = std::make_unique<RPCServer<CAS>>(
+        kj::heap<ShardRouter>(shards_), std::move(channel.ends[0]));
+
+    client_ = std::make_unique<RPCClient>(std::move(channel.ends[1]));
+
+    cas_ = std::make_unique<CAS::Client>(client_->GetMain<CAS>());
+  }
+
+  std::string RandomData() {
+    std::uniform_int_distribution<int> byte_distribution(0, 255);
+    std::uniform_int_distribution<size_t> size_distribution(1, 10000);
+
+    std::string result(size_distribution(rng_), 0);
+    for (auto& b : result) b = byte_distribution(rng_);
+
+    return result;
+  }
+
+  CASKey PutObject(const std::string& data) {
+    CASKey key;
+    SHA1::Digest(data.data(), data.size(), key.begin());
+
+    auto put_request = cas_->putRequest();
+    put_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+    put_request.setSync(false);
+    auto stream = put_request.send().getStream();
+
+    auto write_request = stream.writeRequest();
+    write_request.setData(kj::arrayPtr(
+        reinterpret_cast<const capnp::byte*>(data.data()), data.size()));
+    write_request.send().wait(async_io_.waitScope);
+
+    stream.doneRequest().send().wait(async_io_.waitScope);
+
+    return key;
+  }
+
+  std::string GetObject(const CASKey& key) {
+    std::string result;
+
+    auto get_request = cas_->getRequest();
+    get_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+    get_request.setStream(kj::heap<ByteStreamCollector>(result));
+    get_request.send().wait(async_io_.waitScope);
+
+    return result;
+  }
+
+  std::set<CASKey> List(CAS::Client& cas) {
+    std::set<CASKey> result;
+    CASClient::ListAsync(cas, [&result](const CASKey& key) {
+      result.emplace(key);
+    }).wait(async_io_.waitScope);
+    return result;
+  }
+
+  kj::AsyncIoContext async_io_;
+
+  std::default_random_engine rng_;
+
+  std::string temp_directory_;
+
+  std::vector<CAS::Client> shards_;
+
+  std::unique_ptr<RPCServer<CAS>> server_;
+  std::unique_ptr<RPCClient> client_;
+  std::unique_ptr<CAS::Client> cas_;
+};
+
+// Verifies that objects are stored in the shard owning their key, and can be
+// read back through the router after a restart.
+TEST_F(ShardRouterTest, PutAndGet) {
+  std::map<CASKey, std::string> objects;
+
+  for (size_t i = 0; i < 200; ++i) {
+    auto data = RandomData();
+    objects.emplace(PutObject(data), std::move(data));
+  }
+
+  for (size_t restart = 0; restart < 2; ++restart) {
+    for (const auto& object : objects)
+      EXPECT_EQ(object.second, GetObject(object.first));
+
+    EXPECT_EQ(objects.size(), List(*cas_).size());
+
+    size_t shard_object_count = 0;
+
+    for (size_t i = 0; i < kShardCount; ++i) {
+      for (const auto& key : List(shards_[i])) {
+        EXPECT_EQ(i, ShardRouter::ShardForKey(key, kShardCount));
+        ++shard_object_count;
+      }
+    }
+
+    EXPECT_EQ(objects.size(), shard_object_count);
+
+    Connect();
+  }
+}
+
+// Verifies that garbage collection through the router keeps marked objects
+// in every shard, and removes the rest.
+TEST_F(ShardRouterTest, GarbageCollector) {
+  std::vector<CASKey> keys;
+  for (size_t i = 0; i < 50; ++i) keys.emplace_back(PutObject(RandomData()));
+
+  const auto gc_id = CASClient::BeginGC(*cas_).wait(async_io_.waitScope);
+
+  std::vector<CASKey> keep(keys.begin(), keys.begin() + keys.size() / 2);
+  CASClient::MarkGC(*cas_, keep).wait(async_io_.waitScope);
+
+  CASClient::EndGC(*cas_, gc_id).wait(async_io_.waitScope);
+
+  EXPECT_EQ(std::set<CASKey>(keep.begin(), keep.end()), List(*cas_));
+}
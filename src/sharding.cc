@@ -23,6 +23,7 @@
 #include <kj/debug.h>
 #include <yaml-cpp/yaml.h>
 
+#include "src/sha1.h"
 #include "src/sharding.h"
 #include "src/util.h"
 
@@ -59,6 +60,12 @@ ShardingInfo::ShardingInfo(const std::string& filename,
       backend.failure_domain = failure_domain.as<int>();
     }
 
+    auto out_of_balance = config_backend["out-of-balance"];
+    if (out_of_balance.IsDefined()) {
+      KJ_REQUIRE(out_of_balance.IsScalar());
+      backend.out_of_balance = out_of_balance.as<bool>();
+    }
+
     KJ_CONTEXT(backend.addr, backend.failure_domain);
 
     backend.client = std::make_unique<CASClient>(backend.addr, aio_context);
@@ -69,42 +76,37 @@ ShardingInfo::ShardingInfo(const std::string& filename,
 }
 
 void ShardingInfo::AddBackend(std::shared_ptr<CASClient> client,
-                              uint8_t failure_domain) {
+                              uint8_t failure_domain, bool out_of_balance) {
   Backend backend;
   backend.client = std::move(client);
   backend.failure_domain = failure_domain;
+  backend.out_of_balance = out_of_balance;
 
   InitializeBackend(backend);
 }
 
-void ShardingInfo::GetWriteBackendsForKey(const CASKey& key,
-                                          std::vector<CASClient*>& result) {
-  KJ_REQUIRE(backends_.size() >= full_replicas_);
+bool ShardingInfo::GetWriteBackendsForKey(
+    const CASKey& key, std::vector<CASClient*>& result) const {
+  std::vector<size_t> indexes;
 
-  uint64_t failure_domain_mask = ~static_cast<uint64_t>(0);
-  std::unordered_set<CASClient*> done;
+  const auto all_connected = WriteBackendsForKey(key, indexes);
 
-  const auto first = FirstBackendForKey(key);
+  for (const auto idx : indexes)
+    result.emplace_back(backends_[idx].client.get());
 
-  auto i = first;
-
-  while (result.size() < full_replicas_) {
-    const auto& backend = backends_[i->second];
-    const auto shard_mask = UINT64_C(1) << backend.failure_domain;
-
-    if ((shard_mask & failure_domain_mask) != 0 &&
-        backend.client->Connected() && !done.count(backend.client.get())) {
-      result.emplace_back(backend.client.get());
-      done.emplace(backend.client.get());
+  return all_connected;
+}
 
-      failure_domain_mask &= ~shard_mask;
-    }
+void ShardingInfo::GetMarkBackendsForKey(const CASKey& key,
+                                         std::vector<size_t>& result) const {
+  const auto begin = result.size();
 
-    if (result.size() == full_replicas_) break;
+  WriteBackendsForKey(key, result);
 
-    if (++i == hash_ring_.end()) i = hash_ring_.begin();
-    KJ_REQUIRE(i != first, "Not enough online backends", result.size(),
-               full_replicas_, backends_.size());
+  for (size_t idx = 0; idx < backends_.size(); ++idx) {
+    if (backends_[idx].out_of_balance &&
+        std::find(result.begin() + begin, result.end(), idx) == result.end())
+      result.emplace_back(idx);
   }
 }
 
@@ -125,6 +127,71 @@ CASClient* ShardingInfo::NextShardForKey(
   KJ_FAIL_REQUIRE("Missing backend for key");
 }
 
+uint64_t ShardingInfo::RingFingerprint() const {
+  SHA1 sha1;
+
+  const uint64_t replicas = full_replicas_;
+  sha1.Add(&replicas, sizeof(replicas));
+
+  // Buckets identify their backends, so only the failure domains, which also
+  // decide where objects are written, need to be added.  Backend indexes
+  // depend on the order of the configuration file.
+  for (const auto& bucket : hash_ring_) {
+    sha1.Add(bucket.first.data(), bucket.first.size());
+    sha1.Add(&backends_[bucket.second].failure_domain,
+             sizeof(backends_[bucket.second].failure_domain));
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  sha1.Finish(digest);
+
+  uint64_t result = 0;
+  for (size_t i = 0; i < sizeof(result); ++i)
+    result |= static_cast<uint64_t>(digest[i]) << (i * 8);
+
+  // Zero means no placement is recorded.
+  return result ? result : 1;
+}
+
+bool ShardingInfo::WriteBackendsForKey(const CASKey& key,
+                                       std::vector<size_t>& result) const {
+  KJ_REQUIRE(backends_.size() >= full_replicas_);
+
+  uint64_t failure_domain_mask = ~static_cast<uint64_t>(0);
+  bool all_connected = true;
+
+  const auto begin = result.size();
+  const auto first = FirstBackendForKey(key);
+
+  auto i = first;
+
+  // Every backend owns many buckets, so the same backend is usually seen
+  // several times before enough replicas are found.
+  while (result.size() - begin < full_replicas_) {
+    const auto idx = i->second;
+    const auto& backend = backends_[idx];
+    const auto shard_mask = UINT64_C(1) << backend.failure_domain;
+
+    if ((shard_mask & failure_domain_mask) != 0 &&
+        std::find(result.begin() + begin, result.end(), idx) == result.end()) {
+      if (backend.client->Connected()) {
+        result.emplace_back(idx);
+        failure_domain_mask &= ~shard_mask;
+      } else {
+        all_connected = false;
+      }
+    }
+
+    if (result.size() - begin == full_replicas_) break;
+
+    if (++i == hash_ring_.end()) i = hash_ring_.begin();
+    KJ_REQUIRE(i != first, "Not enough online backends", result.size() - begin,
+               full_replicas_, backends_.size());
+  }
+
+  return all_connected;
+}
+
 void ShardingInfo::InitializeBackend(Backend backend) {
   const auto idx = backends_.size();
   auto config = backend.client->RawClient().getConfigRequest().send().wait(
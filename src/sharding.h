@@ -19,6 +19,10 @@ class ShardingInfo {
     std::shared_ptr<CASClient> client;
 
     std::vector<CASKey> buckets;
+
+    // Set for backends configured as holding objects outside their positions
+    // on the hash ring.  These receive garbage collection marks for every key.
+    bool out_of_balance = false;
   };
 
   ShardingInfo(kj::AsyncIoContext& aio_context);
@@ -33,14 +37,23 @@ class ShardingInfo {
 
   size_t FullReplicas() const { return full_replicas_; }
 
-  void AddBackend(std::shared_ptr<CASClient> client, uint8_t failure_domain);
+  void AddBackend(std::shared_ptr<CASClient> client, uint8_t failure_domain,
+                  bool out_of_balance = false);
 
   void SetFullReplicas(size_t n) { full_replicas_ = n; }
 
   // Determines to which backends an object should be written.  The results are
-  // written to the `result` vector.
-  void GetWriteBackendsForKey(const CASKey& key,
-                              std::vector<CASClient*>& result);
+  // written to the `result` vector.  Returns false if a backend had to be
+  // skipped for being disconnected, in which case the object will be stored
+  // outside its position on the hash ring.
+  bool GetWriteBackendsForKey(const CASKey& key,
+                              std::vector<CASClient*>& result) const;
+
+  // Determines which backends may hold a previously stored object: those it
+  // would be written to now, and those that are out of balance.  The indexes
+  // of the backends are appended to the `result` vector.
+  void GetMarkBackendsForKey(const CASKey& key,
+                             std::vector<size_t>& result) const;
 
   // Determines the next candidate for reading a previously stored object.  The
   // `done` parameter should indicate which backends have already been
@@ -50,11 +63,21 @@ class ShardingInfo {
 
   size_t BucketCount() const { return hash_ring_.size(); }
 
+  // Returns a nonzero fingerprint of the hash ring and replica count, which
+  // changes whenever objects could have different write backends.
+  uint64_t RingFingerprint() const;
+
  private:
   typedef std::vector<std::pair<CASKey, size_t>> HashRing;
 
   void InitializeBackend(Backend backend);
 
+  // Appends the indexes of the backends `key` should be written to to
+  // `result`.  Returns false if any backend had to be skipped for being
+  // disconnected.
+  bool WriteBackendsForKey(const CASKey& key,
+                           std::vector<size_t>& result) const;
+
   HashRing::const_iterator FirstBackendForKey(const CASKey& key) const;
 
   kj::AsyncIoContext& aio_context_;
@@ -21,9 +21,11 @@
 #include "src/storage-server.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cerrno>
 #include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <deque>
 #include <memory>
 #include <random>
@@ -31,6 +33,7 @@
 #include <utility>
 
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #if HAVE_SYS_VFS_H
@@ -48,7 +51,10 @@
 #include <kj/debug.h>
 
 #include "async-io.h"
+#include "background.h"
+#include "bloom-filter.h"
 #include "client.h"
+#include "index-log.h"
 #include "io.h"
 #include "proto/ca-cas.capnp.h"
 #include "sha1.h"
@@ -58,12 +64,108 @@ namespace cas_internal {
 
 namespace {
 
-const auto kBucketMask = UINT64_C(0x3f00000000000000);
-const auto kDeletedMask = UINT64_C(0x8000000000000000);
-const auto kOffsetMask = UINT64_C(0x00ffffffffffffff);
-
 const size_t kHashBucketSize = 128 * 1024 * 1024;
 
+// Size of the buffers used when streaming objects to clients.
+const size_t kReadBufferSize = 1024 * 1024;
+
+// Maximum number of unused read buffers kept for reuse.
+const size_t kMaxIdleReadBuffers = 64;
+
+// Objects larger than this are staged in a temporary file while being
+// uploaded, rather than being held in memory.
+const size_t kMaxPutBufferSize = 1024 * 1024;
+
+// Space is reserved at the end of data files in steps of this size, so that
+// appended objects are laid out contiguously on disk.
+const size_t kPreallocationStep = 64 * 1024 * 1024;
+
+// Default number of threads verifying the SHA-1 digests of uploaded objects.
+const size_t kDefaultHashThreads = 2;
+
+// Objects at least this large are dropped from the page cache once they have
+// been sent, so that large sequential reads, such as exports, don't evict more
+// frequently read data.
+const size_t kDropCacheReadSize = 16 * 1024 * 1024;
+
+// Default size of the object cache, and of the largest object kept in it.
+const size_t kDefaultCacheSize = 64 * 1024 * 1024;
+const size_t kDefaultMaxCachedObjectSize = 64 * 1024;
+
+// Maximum number of gets served on bulk transfer channels at the same time,
+// each of which occupies a thread.  Further gets use the Cap'n Proto stream.
+const size_t kMaxBulkTransfers = 16;
+
+// Synchronous puts arriving within this long of each other share a single
+// round of `fdatasync(2)` calls.
+const auto kGroupSyncDelay = 250 * kj::MICROSECONDS;
+
+// Maximum number of synchronous puts sharing a round of `fdatasync(2)` calls.
+const size_t kGroupSyncMaxBatch = 256;
+
+// Upper bound on the amount of object data moved by each step of a
+// compaction.
+const size_t kCompactionStepSize = 4 * 1024 * 1024;
+
+// Objects to be moved by compaction that are separated by no more than this
+// much unused space are fetched with a single read.
+const size_t kCompactionMaxGap = 64 * 1024;
+
+// Number of data files in a repository.  When the repository is split into
+// shards, each shard appends to the data files whose index modulo the shard
+// count equals the shard number.
+const size_t kDataFileCount = 50;
+
+// Name of the file recording the number of shards, for repositories having
+// more than one.
+const char kShardCountName[] = "shards";
+
+// If more than this many index log entries are replayed on startup, a new
+// base segment is written, so that subsequent startups are fast.  While
+// running, a background checkpoint is started when the log reaches this
+// length.
+const size_t kMaxStartupLogEntries = 1 << 20;
+
+// A background index checkpoint is also started when the index log holds at
+// least this many deletion records, and they make up more than
+// `kCheckpointDeletionRatio` of the number of objects.
+const size_t kCheckpointMinDeletions = 1 << 16;
+const double kCheckpointDeletionRatio = 0.1;
+
+std::string DataFileName(size_t idx) {
+  std::string result("data");
+  if (idx > 0) {
+    result.push_back('.');
+    if (idx < 10) result.push_back('0');
+    result += std::to_string(idx);
+  }
+  return result;
+}
+
+// Copies `size` bytes from the start of `from` to `offset` in `to`, through
+// `buffer`.
+kj::Promise<void> CopyFile(cas_internal::AsyncIOServer& aio, int from, int to,
+                           size_t offset, size_t size, kj::Array<char> buffer,
+                           size_t copied = 0) {
+  if (copied == size) return kj::READY_NOW;
+
+  const auto amount = std::min(buffer.size(), size - copied);
+  auto read = aio.Pread(from, buffer.begin(), copied, amount);
+
+  // Moving `buffer` into the continuation below leaves its data in place.
+  return read
+      .then([&aio, to, offset, copied, amount, data = buffer.begin()] {
+        return aio.Pwrite(to, data, offset + copied, amount);
+      })
+      .then([
+        &aio, from, to, offset, size, buffer = std::move(buffer), copied,
+        amount
+      ]() mutable {
+        return CopyFile(aio, from, to, offset, size, std::move(buffer),
+                        copied + amount);
+      });
+}
+
 bool HeapComparator(const std::pair<size_t, size_t>& lhs,
                     const std::pair<size_t, size_t>& rhs) {
   return lhs.first > rhs.first;
@@ -90,7 +192,7 @@ class NullStream : public ByteStream::Server {
 
 class PutStream : public ByteStream::Server {
  public:
-  PutStream(StorageServer& storage_server, CASKey key, bool sync);
+  PutStream(StorageServer& storage_server, ObjectKey key, bool sync);
 
   kj::Promise<void> write(WriteContext context) override;
 
@@ -101,171 +203,554 @@ class PutStream : public ByteStream::Server {
  private:
   StorageServer& storage_server_;
 
-  CASKey sha1_digest_;
+  ObjectKey key_;
+
+  // Key of the data received so far, computed by the hash pool.
+  kj::Own<HashPool::Stream> hash_;
 
   bool sync_;
 
+  // Data received so far, unless it has been moved to `staging_fd_`.
   std::string buffer_;
 
-  cas_internal::SHA1 sha1_;
+  // Temporary file holding the data received so far, once it grows beyond
+  // `kMaxPutBufferSize`.
+  kj::AutoCloseFd staging_fd_;
+
+  size_t size_ = 0;
 };
 
+class MarkSinkImpl : public CAS::MarkSink::Server {
+ public:
+  MarkSinkImpl(StorageServer& storage_server)
+      : storage_server_(storage_server) {}
+
+  kj::Promise<void> write(WriteContext context) override {
+    auto keys = context.getParams().getKeys();
+    KJ_REQUIRE(keys.size() % sizeof(CASKey) == 0, keys.size());
+
+    for (size_t i = 0; i < keys.size(); i += sizeof(CASKey))
+      storage_server_.MarkGC(CASKey(keys.begin() + i));
+
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    return kj::READY_NOW;
+  }
+
+ private:
+  StorageServer& storage_server_;
+};
+
+// Lists objects in key order by walking the base segment of the index, a
+// batch at a time, merged with the objects held on top of it when the list
+// was opened.  Only those are copied, so memory use is bounded by the size of
+// the index overlay.  If a checkpoint replaces the base segment, the walk
+// continues after the last key returned.
+//
+// This gives up the data file order lists used to have, which would take a
+// copy of the whole index to produce.  The keys returned by each read are
+// still sorted by data file and offset, so that a client fetching a batch in
+// order reads the disks in one ascending sweep.
+//
+// Every object present during the whole listing is returned exactly once.
+// Objects added or removed in the meantime may or may not be.
 class ObjectListImpl : public CAS::ObjectList::Server {
  public:
-  ObjectListImpl(const StorageServer* server, CAS::ListMode mode,
+  ObjectListImpl(const StorageServer& server, CAS::ListMode mode,
                  uint64_t min_size, uint64_t max_size);
 
   kj::Promise<void> read(ReadContext context) override;
 
  private:
-  std::deque<StorageServer::IndexEntry> buffer_;
+  // Largest number of keys returned by one read.
+  static const size_t kMaxReadCount = 65536;
+
+  // Largest number of index entries examined per turn of the event loop.
+  static const size_t kScanBatch = 65536;
+
+  // Scans up to `kScanBatch` entries, until `found_` holds `count` entries.
+  // Returns false once every object has been examined.
+  bool Scan(size_t count);
+
+  // Scans until `count` keys have been found or the end is reached, yielding
+  // to the event loop after each batch, and returns what was found.
+  kj::Promise<void> Read(ReadContext context, size_t count);
+
+  const StorageServer& server_;
+
+  const CAS::ListMode mode_;
+  const uint64_t min_size_;
+  const uint64_t max_size_;
+
+  // Generation of the base segment `position_` refers to.
+  uint64_t generation_;
+  size_t position_ = 0;
+
+  // Sorted keys of the objects that were not in the base segment when the
+  // list was opened, and the next one to merge.
+  std::vector<CASKey> added_;
+  size_t added_position_ = 0;
+
+  // Last key examined, valid once `started_` is set.
+  CASKey last_key_;
+  bool started_ = false;
+
+  bool done_ = false;
+
+  std::vector<IndexEntry> found_;
 };
 
-PutStream::PutStream(StorageServer& storage_server, CASKey key, bool sync)
-    : storage_server_(storage_server), sha1_digest_(key), sync_(sync) {}
+PutStream::PutStream(StorageServer& storage_server, ObjectKey key, bool sync)
+    : storage_server_(storage_server),
+      key_(key),
+      hash_(storage_server.HashStream(key.algorithm)),
+      sync_(sync) {}
 
 kj::Promise<void> PutStream::write(WriteContext context) {
   auto data = context.getParams().getData();
 
-  sha1_.Add(data.begin(), data.size());
-  buffer_.append(data.begin(), data.end());
+  size_ += data.size();
 
-  return kj::READY_NOW;
+  if (staging_fd_.get() == -1 && size_ > kMaxPutBufferSize) {
+    // NOTE(mortehu): When using dir_fd_ instead of ".", glibc or Linux seems
+    // to clear all the permission bits.
+    staging_fd_ = cas_internal::AnonTemporaryFile(".", 0600);
+
+    kj::FdOutputStream(staging_fd_.get()).write(buffer_.data(), buffer_.size());
+    buffer_ = std::string();
+  }
+
+  if (staging_fd_.get() != -1)
+    kj::FdOutputStream(staging_fd_.get()).write(data.begin(), data.size());
+  else
+    buffer_.append(data.begin(), data.end());
+
+  // Once the hash pool is saturated, this holds back the reply, so that
+  // clients pushing data faster than it can be hashed are slowed down.
+  return hash_->Add(data);
 }
 
 kj::Promise<void> PutStream::done(DoneContext context) {
-  CASKey calc_sha1_digest;
-  sha1_.Finish(calc_sha1_digest.begin());
-
-  KJ_REQUIRE(std::equal(calc_sha1_digest.begin(), calc_sha1_digest.end(),
-                        sha1_digest_.begin()),
-             "calculated SHA-1 digest does not match key suggested by client");
+  return hash_->Finish().then([this](ObjectKey calculated_key) {
+    KJ_REQUIRE(calculated_key == key_,
+               "calculated digest does not match key suggested by client");
+
+    if (staging_fd_.get() != -1) {
+      const auto staging_fd = staging_fd_.get();
+      return storage_server_.Put(key_, staging_fd, size_, sync_)
+          .attach(std::move(staging_fd_));
+    }
 
-  return storage_server_.Put(sha1_digest_, std::move(buffer_), sync_);
+    return storage_server_.Put(key_, std::move(buffer_), sync_);
+  });
 }
 
 kj::Promise<void> PutStream::expectSize(ExpectSizeContext context) {
-  buffer_.reserve(buffer_.size() + context.getParams().getSize());
+  const auto size = buffer_.size() + context.getParams().getSize();
+  if (size <= kMaxPutBufferSize) buffer_.reserve(size);
+
   return kj::READY_NOW;
 }
 
-ObjectListImpl::ObjectListImpl(const StorageServer* server, CAS::ListMode mode,
-                               uint64_t min_size, uint64_t max_size) {
-  const auto& index = server->Index();
-  buffer_.assign(index.begin(), index.end());
-
-  buffer_.erase(std::remove_if(buffer_.begin(), buffer_.end(),
-                               [min_size, max_size](const auto& ie) {
-                                 return ie.size < min_size ||
-                                        ie.size >= max_size;
-                               }),
-                buffer_.end());
-
-  if (mode == CAS::ListMode::GARBAGE) {
-    const auto& marks = server->Marks();
-    buffer_.erase(std::remove_if(buffer_.begin(), buffer_.end(),
-                                 [&marks](const auto& ie) {
-                                   return !marks.count(ie.key);
-                                 }),
-                  buffer_.end());
+ObjectListImpl::ObjectListImpl(const StorageServer& server, CAS::ListMode mode,
+                               uint64_t min_size, uint64_t max_size)
+    : server_(server),
+      mode_(mode),
+      min_size_(min_size),
+      max_size_(max_size),
+      generation_(server.Index().Generation()) {
+  const auto& index = server.Index();
+
+  // Objects replaced or removed since the last checkpoint are found in the
+  // base segment, and looked up again when reached.
+  for (const auto& entry : index.Changes()) {
+    if (entry.offset & kDeletedMask) continue;
+    if (!index.Base().Find(entry.key)) added_.emplace_back(entry.key);
   }
 
-  std::sort(
-      buffer_.begin(), buffer_.end(),
-      [](const auto& lhs, const auto& rhs) { return lhs.offset < rhs.offset; });
+  std::sort(added_.begin(), added_.end());
 }
 
 kj::Promise<void> ObjectListImpl::read(ReadContext context) {
-  auto count = context.getParams().getCount();
+  const auto count =
+      std::min<uint64_t>(context.getParams().getCount(), kMaxReadCount);
+
+  found_.clear();
 
-  if (buffer_.size() < count) count = buffer_.size();
+  if (!count) return kj::READY_NOW;
 
-  auto objects = context.getResults().initObjects(count);
+  return Read(context, count);
+}
 
-  auto bi = buffer_.begin();
+kj::Promise<void> ObjectListImpl::Read(ReadContext context, size_t count) {
+  const auto more = Scan(count);
+
+  // An empty reply ends the list, so keep going until something is found.
+  if (more && found_.empty()) {
+    return kj::evalLater(
+        [this, context, count]() mutable { return Read(context, count); });
+  }
+
+  std::sort(found_.begin(), found_.end(),
+            [](const auto& lhs, const auto& rhs) {
+              return (lhs.offset & (kBucketMask | kOffsetMask)) <
+                     (rhs.offset & (kBucketMask | kOffsetMask));
+            });
+
+  auto objects = context.getResults().initObjects(found_.size());
 
   auto orphanage = context.getResultsOrphanage();
 
-  for (size_t i = 0; i < count; ++i, ++bi) {
+  for (size_t i = 0; i < found_.size(); ++i) {
     auto key_buffer = orphanage.newOrphan<capnp::Data>(20);
-    memcpy(key_buffer.get().begin(), bi->key.begin(), 20);
+    memcpy(key_buffer.get().begin(), found_[i].key.begin(), 20);
     objects.adopt(i, std::move(key_buffer));
   }
 
-  buffer_.erase(buffer_.begin(), bi);
+  found_.clear();
 
   return kj::READY_NOW;
 }
 
-kj::Promise<void> WriteStream(ByteStream::Client&& stream,
-                              AsyncIO::Client& aio_client, int fd,
-                              size_t offset, size_t size) {
-  // TODO(mortehu): Implement double-buffering.
+bool ObjectListImpl::Scan(size_t count) {
+  if (done_) return false;
 
-  KJ_ASSERT(offset <= size, offset, size);
+  const auto& index = server_.Index();
+  const auto& base = index.Base();
 
-  static const size_t kBufferSize = 8 * 1024 * 1024;
+  if (index.Generation() != generation_) {
+    generation_ = index.Generation();
+    position_ = 0;
 
-  if (offset == size) return stream.doneRequest().send().ignoreResult();
+    if (started_) {
+      position_ = std::upper_bound(base.begin(), base.end(), last_key_,
+                                   [](const CASKey& key,
+                                      const IndexEntry& entry) {
+                                     return key < entry.key;
+                                   }) -
+                  base.begin();
+    }
+  }
+
+  for (size_t i = 0; i < kScanBatch && found_.size() < count; ++i) {
+    const auto base_entry =
+        (position_ < base.size()) ? base.begin() + position_ : nullptr;
+    const auto added_key = (added_position_ < added_.size())
+                               ? &added_[added_position_]
+                               : nullptr;
 
-  const auto read_amount = std::min(size - offset, kBufferSize);
+    if (!base_entry && !added_key) {
+      done_ = true;
+      return false;
+    }
 
-  auto data = kj::heapArray<capnp::byte>(read_amount);
+    // Merge the two sorted sequences.  An added object may have reached the
+    // base segment through a checkpoint, so equal keys are taken once.
+    if (base_entry && (!added_key || !(*added_key < base_entry->key))) {
+      last_key_ = base_entry->key;
+      ++position_;
+      if (added_key && *added_key == last_key_) ++added_position_;
+    } else {
+      last_key_ = *added_key;
+      ++added_position_;
+    }
 
-  auto pread_request = aio_client.preadRequest();
-  pread_request.setFd(fd);
-  pread_request.setBuffer(reinterpret_cast<uint64_t>(data.begin()));
-  pread_request.setStart(offset);
-  pread_request.setLength(read_amount);
+    started_ = true;
 
-  offset += read_amount;
+    const auto entry = index.Find(last_key_);
+    if (!entry) continue;
+    if (entry->size < min_size_ || entry->size >= max_size_) continue;
+    if (mode_ == CAS::ListMode::GARBAGE &&
+        !server_.Marks().IsMarked(last_key_))
+      continue;
 
-  return pread_request.send().then([
-    stream = std::move(stream), aio_client, fd, offset, size,
-    data = std::move(data)
-  ](auto read_response) mutable {
+    found_.emplace_back(*entry);
+  }
+
+  return true;
+}
+
+// Copies a range of a file to a byte stream.  Up to `depth` reads are kept in
+// flight while waiting for the stream to accept data, so that disk reads
+// overlap with network transfers.
+class ReadAheadStream {
+ public:
+  ReadAheadStream(ByteStream::Client&& stream,
+                  cas_internal::AsyncIOServer& aio,
+                  std::shared_ptr<cas_internal::BufferPool> buffers,
+                  size_t depth, int fd, size_t offset, size_t end)
+      : stream_(std::move(stream)),
+        aio_(aio),
+        buffers_(std::move(buffers)),
+        depth_(depth),
+        fd_(fd),
+        offset_(offset),
+        end_(end),
+        drop_cache_(end - offset >= kDropCacheReadSize) {
+    KJ_ASSERT(offset <= end, offset, end);
+    KJ_REQUIRE(depth > 0);
+  }
+
+  KJ_DISALLOW_COPY(ReadAheadStream);
+
+  kj::Promise<void> Pump();
+
+ private:
+  struct Chunk {
+    cas_internal::BufferPool::Buffer buffer;
+    size_t size;
+  };
+
+  ByteStream::Client stream_;
+  cas_internal::AsyncIOServer& aio_;
+  std::shared_ptr<cas_internal::BufferPool> buffers_;
+
+  const size_t depth_;
+  const int fd_;
+
+  // Offset of the next read to issue.
+  size_t offset_;
+  const size_t end_;
+
+  // If true, data is dropped from the page cache once it has been read.
+  const bool drop_cache_;
+
+  // Reads issued, but not yet written to `stream_`, in file order.
+  std::deque<kj::Promise<Chunk>> reads_;
+};
+
+kj::Promise<void> ReadAheadStream::Pump() {
+  while (reads_.size() < depth_ && offset_ < end_) {
+    auto buffer = buffers_->Get();
+    const auto read_amount = std::min(end_ - offset_, buffer.size());
+
+    auto read = aio_.Pread(fd_, buffer.begin(), offset_, read_amount);
+
+    reads_.emplace_back(read.then([
+      this, buffer = std::move(buffer), offset = offset_, read_amount
+    ]() mutable {
+      if (drop_cache_)
+        posix_fadvise(fd_, offset, read_amount, POSIX_FADV_DONTNEED);
+      return Chunk{std::move(buffer), read_amount};
+    }));
+
+    offset_ += read_amount;
+  }
+
+  if (reads_.empty()) return stream_.doneRequest().send().ignoreResult();
+
+  auto read = std::move(reads_.front());
+  reads_.pop_front();
+
+  return read
+      .then([this](Chunk chunk) {
+        // The data is copied into the request, so the buffer can be reused
+        // right away.
+        auto write_request = stream_.writeRequest();
+        write_request.setData(kj::arrayPtr(chunk.buffer.begin(), chunk.size));
+
+        return write_request.send().ignoreResult();
+      })
+      .then([this] { return Pump(); });
+}
+
+// Writes `data` to `stream`, which is then closed.
+kj::Promise<void> WriteData(ByteStream::Client stream,
+                            kj::ArrayPtr<const char> data) {
+  auto expect_size_request = stream.expectSizeRequest();
+  expect_size_request.setSize(data.size());
+  expect_size_request.send().detach([](auto e) {});
+
+  auto writes = kj::heapArrayBuilder<kj::Promise<void>>(
+      (data.size() + kReadBufferSize - 1) / kReadBufferSize);
+
+  // The data is copied into the requests, so it need not outlive them.
+  for (size_t offset = 0; offset < data.size(); offset += kReadBufferSize) {
     auto write_request = stream.writeRequest();
-    write_request.setData(data);
+    write_request.setData(kj::arrayPtr(
+        reinterpret_cast<const capnp::byte*>(data.begin()) + offset,
+        std::min(kReadBufferSize, data.size() - offset)));
+    writes.add(write_request.send().ignoreResult());
+  }
 
-    return write_request.send().attach(std::move(data)).then([
-      stream = std::move(stream), aio_client, fd, offset, size
-    ](auto write_response) mutable {
-      return WriteStream(std::move(stream), aio_client, fd, offset, size);
-    });
+  return kj::joinPromises(writes.finish()).then([stream]() mutable {
+    return stream.doneRequest().send().ignoreResult();
   });
 }
 
+kj::Promise<void> WriteStream(ByteStream::Client&& stream,
+                              cas_internal::AsyncIOServer& aio,
+                              std::shared_ptr<cas_internal::BufferPool> buffers,
+                              size_t depth, int fd, size_t offset, size_t end) {
+  auto read_ahead_stream =
+      kj::heap<ReadAheadStream>(std::move(stream), aio, std::move(buffers),
+                                depth, fd, offset, end);
+
+  auto promise = read_ahead_stream->Pump();
+
+  return promise.attach(std::move(read_ahead_stream));
+}
+
 }  // namespace
 
+struct StorageServer::Compaction {
+  Compaction(size_t data_file_idx, size_t file_size, bool sync,
+             kj::PromiseFulfillerPair<void> paf)
+      : data_file_idx(data_file_idx),
+        file_size(file_size),
+        sync(sync),
+        fulfiller(std::move(paf.fulfiller)),
+        done(paf.promise.fork()) {}
+
+  const size_t data_file_idx;
+
+  // Size of the data file when compaction started.
+  const size_t file_size;
+
+  const bool sync;
+
+  // Length of the prefix of the data file that is kept as is.
+  size_t keep_prefix = 0;
+
+  // Objects to move, ordered by offset, and the index of the next one.
+  std::vector<IndexEntry> objects;
+  size_t next = 0;
+
+  uint64_t bytes_to_move = 0;
+  uint64_t bytes_moved = 0;
+
+  // Number of reads in progress from beyond `keep_prefix`, and the fulfiller
+  // to notify once they are done.
+  size_t readers = 0;
+  kj::Own<kj::PromiseFulfiller<void>> readers_done;
+
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  kj::ForkedPromise<void> done;
+};
+
+struct StorageServer::IndexCheckpoint {
+  IndexCheckpoint(kj::PromiseFulfillerPair<void> paf)
+      : fulfiller(std::move(paf.fulfiller)), done(paf.promise.fork()) {}
+
+  // Index log records appended after the snapshot was taken.
+  std::vector<IndexEntry> tail;
+
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  kj::ForkedPromise<void> done;
+};
+
+std::string StorageServer::IndexLogName(size_t shard, size_t shard_count) {
+  if (shard_count == 1) return "index";
+  return "index." + std::to_string(shard);
+}
+
+std::string StorageServer::IndexBaseName(size_t shard, size_t shard_count) {
+  if (shard_count == 1) return "index.base";
+  return "index.base." + std::to_string(shard);
+}
+
+size_t StorageServer::ShardCount(int dir_fd) {
+  const auto fd = openat(dir_fd, kShardCountName, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) return 1;
+    KJ_FAIL_SYSCALL("openat", errno, kShardCountName);
+  }
+
+  kj::AutoCloseFd fd_closer(fd);
+  auto data = cas_internal::ReadFile(fd);
+
+  std::string value(data.begin(), data.end());
+  while (!value.empty() && value.back() == '\n') value.pop_back();
+
+  const auto shard_count = cas_internal::StringToUInt64(value.c_str());
+  KJ_REQUIRE(shard_count > 0 && shard_count <= kDataFileCount, shard_count);
+
+  return shard_count;
+}
+
+void StorageServer::SetShardCount(const char* path, size_t shard_count) {
+  KJ_REQUIRE(shard_count > 0 && shard_count <= kDataFileCount, shard_count);
+
+  auto dir_fd = cas_internal::OpenFile(path, O_RDONLY | O_DIRECTORY);
+
+  const auto current_shard_count = ShardCount(dir_fd.get());
+  if (current_shard_count == shard_count) return;
+
+  KJ_REQUIRE(current_shard_count == 1,
+             "repository is split into a different number of shards",
+             current_shard_count, shard_count);
+
+  // An unsharded index can't be used by the shards, so only allow this for
+  // empty repositories.
+  struct stat index_stat;
+  if (0 == fstatat(dir_fd.get(), "index", &index_stat, 0)) {
+    KJ_REQUIRE(static_cast<size_t>(index_stat.st_size) <=
+                   cas_internal::kIndexLogHeaderSize,
+               "repository has an unsharded index");
+  } else if (errno != ENOENT) {
+    KJ_FAIL_SYSCALL("fstatat", errno, "index");
+  }
+
+  if (0 == fstatat(dir_fd.get(), "index.base", &index_stat, 0))
+    KJ_FAIL_REQUIRE("repository has an unsharded index");
+
+  auto shard_count_file = cas_internal::AnonTemporaryFile(path, 0666);
+  const auto data = std::to_string(shard_count) + "\n";
+  kj::FdOutputStream(shard_count_file.get()).write(data.data(), data.size());
+  KJ_SYSCALL(fsync(shard_count_file.get()));
+  cas_internal::LinkAnonTemporaryFile(dir_fd.get(), shard_count_file.get(),
+                                      kShardCountName);
+}
+
 StorageServer::StorageServer(const char* path, unsigned int flags,
-                             kj::AsyncIoContext& aio_context)
+                             kj::AsyncIoContext& aio_context, size_t shard,
+                             size_t shard_count)
     : aio_context_(aio_context),
-      aio_(cas_internal::AsyncIOServer::Create(aio_context_)),
-      aio_client_(aio_.first->GetMain<AsyncIO>()),
+      aio_(kj::heap<AsyncIOServer>(aio_context_)),
+      read_buffers_(cas_internal::BufferPool::Create(kReadBufferSize,
+                                                     kMaxIdleReadBuffers)),
+      hash_pool_(std::make_unique<HashPool>(*aio_context_.lowLevelProvider,
+                                            kDefaultHashThreads)),
+      cache_(std::make_unique<ObjectCache>(kDefaultCacheSize)),
+      max_cached_object_size_(kDefaultMaxCachedObjectSize),
       dir_fd_(cas_internal::OpenFile(path, O_RDONLY | O_DIRECTORY)),
-      index_fd_(cas_internal::OpenFile(dir_fd_.get(), "index",
+      index_log_name_(IndexLogName(shard, shard_count)),
+      index_base_name_(IndexBaseName(shard, shard_count)),
+      index_fd_(cas_internal::OpenFile(dir_fd_.get(), index_log_name_.c_str(),
                                        O_RDWR | O_CREAT | O_APPEND, 0666)),
       disable_read_(flags & kDisableRead) {
-  for (size_t i = 0; i < 50; ++i) {
-    std::string filename("data");
-    if (i > 0) {
-      filename.push_back('.');
-      if (i < 10) filename.push_back('0');
-      filename += std::to_string(i);
-    }
+  KJ_REQUIRE(shard < shard_count && shard_count <= kDataFileCount, shard,
+             shard_count);
 
+  for (size_t i = 0; i < kDataFileCount; ++i) {
+    // Objects are written at offsets tracked in `data_file_sizes_`, not
+    // appended, so that writes to the same file can be in flight at once.
     data_fds_.emplace_back(cas_internal::OpenFile(
-        dir_fd_.get(), filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0666));
+        dir_fd_.get(), DataFileName(i).c_str(), O_RDWR | O_CREAT, 0666));
+    data_file_allocated_.emplace_back(0);
+    data_file_writes_.emplace_back(0);
+
+    // Data files belonging to other shards are opened too, so that data file
+    // numbers in index entries can be used as indexes into `data_fds_`, but
+    // are never written to.
+    if (i % shard_count != shard) continue;
 
     off_t size;
     KJ_SYSCALL(size = lseek(data_fds_.back().get(), 0, SEEK_END));
 
     data_file_sizes_.emplace_back(size, i);
+    data_file_allocated_.back() = size;
   }
 
   std::make_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
                  HeapComparator);
 
+  std::vector<int> fds;
+  for (const auto& fd : data_fds_) fds.emplace_back(fd.get());
+  aio_->RegisterFiles(kj::arrayPtr(fds.data(), fds.size()));
+
   ReadIndex();
 
   try {
@@ -313,6 +798,8 @@ StorageServer::StorageServer(const char* path, unsigned int flags,
   auto config_file = cas_internal::OpenFile(dir_fd_.get(), "config", O_RDONLY);
 
   config_data_ = cas_internal::ReadFile(config_file);
+
+  ReadPlacement();
 }
 
 StorageServer::~StorageServer() {}
@@ -320,35 +807,116 @@ StorageServer::~StorageServer() {}
 kj::Promise<void> StorageServer::get(CAS::Server::GetContext context) {
   KJ_REQUIRE(!disable_read_);
 
-  CASKey sha1(context.getParams().getKey());
+  const auto sha1 =
+      ObjectKey::FromWire(context.getParams().getKey()).StorageKey();
 
   size_t read_offset = context.getParams().getOffset();
   size_t read_size = context.getParams().getSize();
 
-  auto i = index_.find(sha1);
-  if (i != index_.end()) {
+  if (auto i = index_.Find(sha1)) {
     const auto data_file_idx = (i->offset & kBucketMask) >> 56;
     const auto object_offset = i->offset & kOffsetMask;
     const auto object_size = i->size;
 
-    if (marks_.erase(sha1)) garbage_size_ -= object_size;
+    if (marks_.Unmark(sha1)) garbage_size_ -= object_size;
 
     KJ_REQUIRE(read_offset <= object_size, read_offset, object_size);
 
-    if (read_offset + read_size > object_size)
-      read_size = object_size - read_offset;
+    read_size = std::min<uint64_t>(read_size, object_size - read_offset);
 
     KJ_CONTEXT(object_offset, object_size);
 
-    auto stream = context.getParams().getStream();
+    const auto bulk_channel = context.getParams().getBulkChannel();
+
+    kj::AutoCloseFd bulk_socket;
+    if (bulk_channel && bulk_channels_ && read_size >= bulk_threshold_ &&
+        bulk_transfers_ < kMaxBulkTransfers)
+      bulk_socket = bulk_channels_->Open(bulk_channel);
 
-    auto expect_size_request = stream.expectSizeRequest();
-    expect_size_request.setSize(read_size);
-    expect_size_request.send().detach([](auto e) {});
+    kj::Promise<void> promise = nullptr;
 
-    return WriteStream(std::move(stream), aio_client_,
-                       data_fds_[data_file_idx].get(),
-                       object_offset + read_offset, object_offset + read_size);
+    const bool cacheable = cache_ && object_size > 0 &&
+                           object_size <= max_cached_object_size_ &&
+                           bulk_socket.get() == -1;
+
+    if (cacheable) {
+      if (auto data = cache_->Find(sha1)) {
+        KJ_REQUIRE(read_offset + read_size <= data->size(), read_offset,
+                   read_size, data->size());
+        return WriteData(context.getParams().getStream(),
+                         kj::arrayPtr(data->data() + read_offset, read_size));
+      }
+    }
+
+    if (cacheable && cache_->ShouldAdmit(sha1, object_size)) {
+      auto buffer = kj::heap<std::string>(object_size, '\0');
+      auto read = aio_->Pread(data_fds_[data_file_idx].get(), &(*buffer)[0],
+                              object_offset, object_size);
+
+      promise = read.then([
+        this, sha1, stream = context.getParams().getStream(),
+        buffer = std::move(buffer), read_offset, read_size
+      ]() mutable {
+        KJ_REQUIRE(read_offset + read_size <= buffer->size(), read_offset,
+                   read_size, buffer->size());
+
+        auto result = WriteData(
+            std::move(stream),
+            kj::arrayPtr(buffer->data() + read_offset, read_size));
+
+        // Skip objects removed while being read.
+        if (index_.Find(sha1)) cache_->Insert(sha1, std::move(*buffer));
+
+        return result;
+      });
+    } else if (bulk_socket.get() != -1) {
+      context.getResults().setBulk(true);
+
+      // `sendfile(2)` may block on reading the data file, so it runs on its
+      // own thread.  If the get is canceled, shutting down the socket stops
+      // the thread from waiting for the client to read.
+      ++bulk_transfers_;
+      promise =
+          cas_internal::RunInThread(
+              *aio_context_.lowLevelProvider,
+              [
+                socket = bulk_socket.get(),
+                data_fd = data_fds_[data_file_idx].get(),
+                offset = object_offset + read_offset, read_size
+              ] {
+                cas_internal::SendBulk(socket, data_fd, offset, read_size);
+                if (read_size >= kDropCacheReadSize)
+                  posix_fadvise(data_fd, offset, read_size,
+                                POSIX_FADV_DONTNEED);
+              },
+              [socket = bulk_socket.get()] { shutdown(socket, SHUT_RDWR); })
+              .attach(std::move(bulk_socket),
+                      kj::defer([this] { --bulk_transfers_; }));
+    } else {
+      auto stream = context.getParams().getStream();
+
+      auto expect_size_request = stream.expectSizeRequest();
+      expect_size_request.setSize(read_size);
+      expect_size_request.send().detach([](auto e) {});
+
+      promise = WriteStream(std::move(stream), *aio_, read_buffers_,
+                            read_ahead_, data_fds_[data_file_idx].get(),
+                            object_offset + read_offset,
+                            object_offset + read_offset + read_size);
+    }
+
+    // Keep compaction from truncating the data file while it's being read.
+    if (compaction_ && compaction_->data_file_idx == data_file_idx &&
+        object_offset + object_size > compaction_->keep_prefix) {
+      ++compaction_->readers;
+
+      promise = promise.attach(kj::defer([compaction = compaction_] {
+        if (!--compaction->readers && compaction->readers_done)
+          compaction->readers_done->fulfill();
+      }));
+    }
+
+    return promise;
   }
 
   KJ_FAIL_REQUIRE("Object does not exist", sha1.ToString());
@@ -357,13 +925,7 @@ kj::Promise<void> StorageServer::get(CAS::Server::GetContext context) {
 kj::Promise<void> StorageServer::beginGC(BeginGCContext context) {
   gc_id_ = std::max(gc_id_ + 1, cas_internal::CurrentTimeUSec());
 
-  marks_.clear();
-  garbage_size_ = 0;
-
-  for (const auto& ie : index_) {
-    marks_.emplace(ie.key);
-    garbage_size_ += ie.size;
-  }
+  garbage_size_ = marks_.MarkAll();
 
   context.getResults().setId(gc_id_);
 
@@ -371,31 +933,56 @@ kj::Promise<void> StorageServer::beginGC(BeginGCContext context) {
 }
 
 kj::Promise<void> StorageServer::markGC(MarkGCContext context) {
-  for (auto key_data : context.getParams().getKeys()) {
-    CASKey key(key_data);
+  for (auto key_data : context.getParams().getKeys())
+    MarkGC(ObjectKey::FromWire(key_data).StorageKey());
 
-    if (marks_.erase(key)) {
-      auto i = index_.find(key);
-      KJ_REQUIRE(i != index_.end());
-      garbage_size_ -= i->size;
-    }
-  }
+  return kj::READY_NOW;
+}
 
+kj::Promise<void> StorageServer::markGCStream(MarkGCStreamContext context) {
+  context.getResults().setSink(kj::heap<MarkSinkImpl>(*this));
   return kj::READY_NOW;
 }
 
+kj::Promise<void> StorageServer::markGCFilter(MarkGCFilterContext context) {
+  auto params = context.getParams().getFilter();
+
+  const BloomFilter filter(params.getBits(), params.getHashCount());
+  const auto range = PrefixRange(params.getPrefixBits(), params.getPrefix());
+
+  // Only objects still marked need to be looked up, and those outside the
+  // prefix are skipped without scanning their part of the bitmap.
+  std::vector<CASKey> live;
+  marks_.ForEachInRange(range.first, range.second,
+                        [&filter, &live](const CASKey& key) {
+                          if (filter.Contains(key)) live.emplace_back(key);
+                        });
+
+  for (const auto& key : live) MarkGC(key);
+
+  return kj::READY_NOW;
+}
+
+void StorageServer::MarkGC(const CASKey& key) {
+  if (marks_.Unmark(key)) {
+    auto i = index_.Find(key);
+    KJ_REQUIRE(i != nullptr);
+    garbage_size_ -= i->size;
+  }
+}
+
 kj::Promise<void> StorageServer::endGC(EndGCContext context) {
   const auto gc_id = context.getParams().getId();
   KJ_REQUIRE(gc_id == gc_id_, "Conflicting garbage collection detected", gc_id,
              gc_id_);
 
-  kj::FdOutputStream index_output(index_fd_.get());
+  std::vector<IndexEntry> removals;
 
-  for (auto i = index_.begin(); i != index_.end();) {
-    if (!marks_.count(i->key)) {
-      ++i;
-      continue;
-    }
+  removals.reserve(marks_.size());
+
+  marks_.ForEach([this, &removals](const CASKey& key) {
+    auto i = index_.Find(key);
+    if (!i) return;
 
     const auto data_file_idx = (i->offset & kBucketMask) >> 56;
     data_file_utilization_[data_file_idx] -= i->size;
@@ -405,27 +992,26 @@ kj::Promise<void> StorageServer::endGC(EndGCContext context) {
     ie.size = i->size;
     ie.key = i->key;
 
-    i = index_.erase(i);
+    index_.Erase(key);
+    if (cache_) cache_->Erase(key);
 
-    index_output.write(&ie, sizeof(ie));
-  }
+    removals.emplace_back(ie);
+  });
+
+  LogIndexChanges(kj::arrayPtr(removals.data(), removals.size()));
 
   gc_id_ = 0;
-  marks_ = std::unordered_set<CASKey>();
+  marks_.Clear();
   garbage_size_ = 0;
 
-  index_dirty_ = true;
-
   return kj::READY_NOW;
 }
 
 kj::Promise<void> StorageServer::put(CAS::Server::PutContext context) {
-  auto key_data = context.getParams().getKey();
-  KJ_REQUIRE(key_data.size() == 20, "Key size must be exactly 20 bytes");
-  CASKey key(key_data.begin());
+  const auto object_key = ObjectKey::FromWire(context.getParams().getKey());
+  const auto key = object_key.StorageKey();
 
-  auto i = index_.find(key);
-  if (i != index_.end()) {
+  if (auto i = index_.Find(key)) {
     // If we already have this object, use a null stream to discard the data
     // being written.
     //
@@ -433,40 +1019,36 @@ kj::Promise<void> StorageServer::put(CAS::Server::PutContext context) {
     // written without the `sync flag, but the new object is written with the
     // `sync` flag.
 
-    if (marks_.erase(key)) garbage_size_ -= i->size;
+    if (marks_.Unmark(key)) garbage_size_ -= i->size;
 
     context.getResults().setStream(kj::heap<NullStream>(*this));
     return kj::READY_NOW;
   }
 
-  context.getResults().setStream(kj::heap<PutStream>(
-      *this, context.getParams().getKey(), context.getParams().getSync()));
+  context.getResults().setStream(
+      kj::heap<PutStream>(*this, object_key, context.getParams().getSync()));
   return kj::READY_NOW;
 }
 
 kj::Promise<void> StorageServer::remove(CAS::Server::RemoveContext context) {
-  auto key_data = context.getParams().getKey();
-  KJ_REQUIRE(key_data.size() == 20, "Key size must be exactly 20 bytes");
-  CASKey key(key_data.begin());
+  const auto key =
+      ObjectKey::FromWire(context.getParams().getKey()).StorageKey();
 
-  auto i = index_.find(key);
-  if (i != index_.end()) {
+  if (auto i = index_.Find(key)) {
     const auto data_file_idx = (i->offset & kBucketMask) >> 56;
     data_file_utilization_[data_file_idx] -= i->size;
 
-    if (marks_.erase(key)) garbage_size_ -= i->size;
+    if (marks_.Unmark(key)) garbage_size_ -= i->size;
 
     IndexEntry ie;
     ie.offset = i->offset | kDeletedMask;
     ie.size = i->size;
     ie.key = key;
 
-    index_.erase(i);
+    index_.Erase(key);
+    if (cache_) cache_->Erase(key);
 
-    kj::FdOutputStream index_output(index_fd_.get());
-    index_output.write(&ie, sizeof(ie));
-
-    index_dirty_ = true;
+    LogIndexChanges(kj::arrayPtr(&ie, 1));
   }
 
   return kj::READY_NOW;
@@ -498,12 +1080,12 @@ kj::Promise<void> StorageServer::list(CAS::Server::ListContext context) {
   const auto max_size = context.getParams().getMaxSize();
 
   context.getResults().setList(
-      kj::heap<ObjectListImpl>(this, mode, min_size, max_size));
+      kj::heap<ObjectListImpl>(*this, mode, min_size, max_size));
   return kj::READY_NOW;
 }
 
 kj::Promise<void> StorageServer::compact(CompactContext context) {
-  if (compacting_data_file_ >= 0) return kj::READY_NOW;
+  if (compaction_) return compaction_->done.addBranch();
 
   const auto sync = context.getParams().getSync();
 
@@ -513,21 +1095,29 @@ kj::Promise<void> StorageServer::compact(CompactContext context) {
   size_t data_file_idx = 0;
 
   for (size_t i = 0; i < unreclaimed_space.size(); ++i) {
+    // Objects still being written are not yet in the index, and so would not
+    // be moved.  Such files are left for the next compaction.
+    if (data_file_writes_[i]) continue;
+
     if (unreclaimed_space[i] > max_unreclaimed_space) {
       max_unreclaimed_space = unreclaimed_space[i];
       data_file_idx = i;
     }
   }
 
-  if (!max_unreclaimed_space) return CompactIndexFile(sync);
-
-  compacting_data_file_ = data_file_idx;
+  if (!max_unreclaimed_space) {
+    if (!index_dirty_) return kj::READY_NOW;
+    return CheckpointIndex();
+  }
 
   // After we've selected a data file to compact, remove it from the heap, so
   // that it won't be used by inserts happening while compaction is running.
+  size_t file_size = 0;
+
   for (auto i = data_file_sizes_.begin();; ++i) {
     KJ_REQUIRE(i != data_file_sizes_.end());
     if (i->second == data_file_idx) {
+      file_size = i->first;
       data_file_sizes_.erase(i);
       std::make_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
                      HeapComparator);
@@ -535,59 +1125,130 @@ kj::Promise<void> StorageServer::compact(CompactContext context) {
     }
   }
 
-  data_file_utilization_[data_file_idx] = 0;
+  compaction_ = std::make_shared<Compaction>(
+      data_file_idx, file_size, sync, kj::newPromiseAndFulfiller<void>());
+  auto& compaction = *compaction_;
 
-  // TODO(mortehu): If any of these objects are removed by a separate RPC call
-  // while it's still in this queue, we need to remove it from the queue.
-  std::vector<IndexEntry> moves;
-  size_t keep_prefix = 0;
+  index_.ForEach([&compaction](const IndexEntry& index_entry) {
+    if (compaction.data_file_idx == ((index_entry.offset & kBucketMask) >> 56))
+      compaction.objects.emplace_back(index_entry);
+  });
 
-  for (const auto& index_entry : index_) {
-    if (data_file_idx != ((index_entry.offset & kBucketMask) >> 56)) continue;
+  std::sort(compaction.objects.begin(), compaction.objects.end(),
+            [](const auto& lhs, const auto& rhs) {
+              return (lhs.offset & kOffsetMask) < (rhs.offset & kOffsetMask);
+            });
+
+  // Objects stored back to back from the start of the file stay where they
+  // are.
+  size_t kept = 0;
+  for (const auto& object : compaction.objects) {
+    if ((object.offset & kOffsetMask) != compaction.keep_prefix) break;
+    compaction.keep_prefix += object.size;
+    ++kept;
+  }
 
-    if ((index_entry.offset & kOffsetMask) == keep_prefix) {
-      keep_prefix += index_entry.size;
-      continue;
-    }
+  compaction.objects.erase(compaction.objects.begin(),
+                           compaction.objects.begin() + kept);
+
+  for (const auto& object : compaction.objects)
+    compaction.bytes_to_move += object.size;
+
+  auto result = compaction.done.addBranch();
+
+  compaction_task_ =
+      kj::evalLater([this] { return CompactionStep(); })
+          .then(
+              [this] {
+                compaction_->fulfiller->fulfill();
+                compaction_ = nullptr;
+              },
+              [this](kj::Exception&& e) {
+                // Leave the data file as is.  Objects moved so far become
+                // unreclaimed space in it.
+                data_file_sizes_.emplace_back(compaction_->file_size,
+                                              compaction_->data_file_idx);
+                std::push_heap(data_file_sizes_.begin(),
+                               data_file_sizes_.end(), HeapComparator);
+
+                compaction_->fulfiller->reject(std::move(e));
+                compaction_ = nullptr;
+              })
+          .eagerlyEvaluate(nullptr);
+
+  return result;
+}
 
-    moves.emplace_back(index_entry);
+kj::Promise<void> StorageServer::getCompactionStatus(
+    GetCompactionStatusContext context) {
+  auto status = context.getResults().initStatus();
+
+  status.setBytesReclaimed(compaction_bytes_reclaimed_);
+
+  if (compaction_) {
+    status.setActive(true);
+    status.setDataFile(compaction_->data_file_idx);
+    status.setBytesToMove(compaction_->bytes_to_move);
+    status.setBytesMoved(compaction_->bytes_moved);
   }
 
-  // Reverse `moves` array so that we can use `pop_back` to remove each element
-  // after processing.
-  std::reverse(moves.begin(), moves.end());
-  auto drain_promise = DrainDataFile(std::move(moves));
+  return kj::READY_NOW;
+}
 
-  if (sync) {
-    drain_promise = drain_promise.then([this, data_file_idx] {
-      // Make sure all moves are committed to disk before truncating the file
-      // being drained.
-      auto fsync_promises =
-          kj::heapArrayBuilder<kj::Promise<void>>(data_fds_.size());
-
-      for (size_t i = 0; i < data_fds_.size(); ++i) {
-        if (i == data_file_idx) continue;
-        fsync_promises.add(DataSync(data_fds_[i].get()));
-      }
+kj::Promise<void> StorageServer::getBulkPort(GetBulkPortContext context) {
+  if (bulk_channels_) context.getResults().setPort(bulk_port_);
+  return kj::READY_NOW;
+}
 
-      fsync_promises.add(DataSync(index_fd_.get()));
+kj::Promise<void> StorageServer::getCacheStats(GetCacheStatsContext context) {
+  if (!cache_) return kj::READY_NOW;
 
-      return kj::joinPromises(fsync_promises.finish());
-    });
-  }
+  const auto& cache_stats = cache_->GetStats();
 
-  return drain_promise.then([this, keep_prefix, data_file_idx] {
-    KJ_SYSCALL(ftruncate(data_fds_[data_file_idx].get(), keep_prefix));
+  auto stats = context.getResults().initStats();
+  stats.setHits(cache_stats.hits);
+  stats.setMisses(cache_stats.misses);
+  stats.setRejections(cache_stats.rejections);
+  stats.setObjects(cache_stats.objects);
+  stats.setSize(cache_stats.size);
+  stats.setCapacity(cache_->Capacity());
 
-    const auto dsz = std::make_pair(keep_prefix, data_file_idx);
-    data_file_sizes_.emplace_back(dsz);
-    std::push_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
-                   HeapComparator);
+  return kj::READY_NOW;
+}
 
-    data_file_utilization_[data_file_idx] = keep_prefix;
+kj::Promise<void> StorageServer::getPlacement(GetPlacementContext context) {
+  context.getResults().setRing(placement_);
+  return kj::READY_NOW;
+}
 
-    compacting_data_file_ = -1;
-  });
+kj::Promise<void> StorageServer::setPlacement(SetPlacementContext context) {
+  const auto params = context.getParams();
+  const auto ring = params.getRing();
+
+  context.getResults().setRing(placement_);
+
+  if (ring == placement_) return kj::READY_NOW;
+  if (params.getConditional() && params.getExpected() != placement_)
+    return kj::READY_NOW;
+
+  uint8_t data[sizeof(ring)];
+  for (size_t i = 0; i < sizeof(data); ++i) data[i] = ring >> (i * 8);
+
+  auto placement_file = cas_internal::OpenFile(
+      dir_fd_.get(), "placement.tmp", O_WRONLY | O_CREAT | O_TRUNC);
+  cas_internal::WriteWithOffset(placement_file.get(), data, sizeof(data), 0);
+
+  // Balancing servers clear the placement before writing objects out of
+  // place, so it must be durable before they proceed.
+  KJ_SYSCALL(fsync(placement_file));
+  KJ_SYSCALL(
+      renameat(dir_fd_.get(), "placement.tmp", dir_fd_.get(), "placement"));
+  KJ_SYSCALL(fsync(dir_fd_));
+
+  placement_ = ring;
+  context.getResults().setRing(placement_);
+
+  return kj::READY_NOW;
 }
 
 kj::Promise<void> StorageServer::getConfig(
@@ -599,164 +1260,659 @@ kj::Promise<void> StorageServer::getConfig(
   return kj::READY_NOW;
 }
 
-kj::Promise<void> StorageServer::Put(const CASKey& key, std::string data,
+kj::Promise<void> StorageServer::Put(const ObjectKey& key, std::string data,
                                      bool sync) {
-  if (index_.count(key)) return kj::READY_NOW;
+  if (!data.empty() && data.size() <= pack_threshold_) {
+    return PackObject(key.StorageKey(), key.algorithm, data.data(),
+                      data.size(), sync);
+  }
+
+  auto buffer = kj::heap<std::string>(std::move(data));
+
+  return AddObject(key.StorageKey(), key.algorithm, buffer->size(), sync, [
+    this, buffer = buffer.get()
+  ](int data_fd, size_t offset) {
+    return aio_->Pwrite(data_fd, buffer->data(), offset, buffer->size());
+  }).attach(std::move(buffer));
+}
+
+kj::Promise<void> StorageServer::Put(const ObjectKey& key, int fd,
+                                     size_t size, bool sync) {
+  return AddObject(key.StorageKey(), key.algorithm, size, sync, [
+    this, fd, size
+  ](int data_fd, size_t offset) {
+    return CopyFile(*aio_, fd, data_fd, offset, size,
+                    kj::heapArray<char>(std::min(size, kMaxPutBufferSize)));
+  });
+}
+
+kj::Promise<void> StorageServer::AddObject(
+    const CASKey& key, KeyAlgorithm algorithm, size_t size, bool sync,
+    const std::function<kj::Promise<void>(int, size_t)>& write) {
+  if (index_.Find(key)) return kj::READY_NOW;
+
+  return AppendObject(key, algorithm, size, write)
+      .then([this, sync](const IndexEntry& ie) -> kj::Promise<void> {
+        // Another put of the same object may have completed first.  The
+        // space written is then left for compaction to reclaim.
+        if (index_.Find(ie.key)) return kj::READY_NOW;
+
+        return InsertObject(ie, sync);
+      });
+}
+
+kj::Promise<IndexEntry> StorageServer::AppendObject(
+    const CASKey& key, KeyAlgorithm algorithm, size_t size,
+    const std::function<kj::Promise<void>(int, size_t)>& write) {
+  KJ_REQUIRE(size <= UINT32_MAX, "object too large", size);
 
   // Find the shortest data file.  This ensures all data files have
   // approximately the same length long term.
   std::pop_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
                 HeapComparator);
   const auto data_file_idx = data_file_sizes_.back().second;
+  const size_t data_offset = data_file_sizes_.back().first;
+
+  KJ_REQUIRE(data_offset <= cas_internal::kIndexLogMaxOffset,
+             "data file too large", data_file_idx);
 
   const auto data_fd = data_fds_[data_file_idx].get();
 
-  off_t data_offset;
-  KJ_SYSCALL(data_offset = lseek(data_fd, 0, SEEK_END));
+  // Claim the space before writing, so that the next put can be written
+  // after this one while it's still in flight.
+  data_file_sizes_.back().first += size;
+  std::push_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
+                 HeapComparator);
+
+  Preallocate(data_file_idx, data_offset + size);
+
+  IndexEntry ie;
+  ie.offset =
+      data_offset | AlgorithmBits(algorithm) | (data_file_idx << 56);
+  ie.size = size;
+  ie.key = key;
+
+  if (!size) return ie;
+
+  ++data_file_writes_[data_file_idx];
+
+  return write(data_fd, data_offset)
+      .attach(kj::defer([this, data_file_idx] {
+        --data_file_writes_[data_file_idx];
+      }))
+      .then([ie] { return ie; });
+}
+
+void StorageServer::Preallocate(size_t data_file_idx, size_t end) {
+  auto& allocated = data_file_allocated_[data_file_idx];
+  if (end <= allocated) return;
+
+  const auto new_allocated =
+      (end + kPreallocationStep - 1) / kPreallocationStep * kPreallocationStep;
+
+  // Only a hint, so failures, such as from file systems lacking support, are
+  // ignored.  The file size is left as is, so that the space stays invisible
+  // to readers and to recovery after a restart.
+  fallocate(data_fds_[data_file_idx].get(), FALLOC_FL_KEEP_SIZE, allocated,
+            new_allocated - allocated);
+
+  allocated = new_allocated;
+}
+
+kj::Promise<void> StorageServer::PackObject(const CASKey& key,
+                                            KeyAlgorithm algorithm,
+                                            const void* data, size_t size,
+                                            bool sync) {
+  if (index_.Find(key)) return kj::READY_NOW;
+
+  if (!pack_block_ || !pack_block_->Fits(size)) OpenPackBlock();
 
   IndexEntry ie;
-  ie.offset = data_offset | (data_file_idx << 56);
-  ie.size = data.size();
+  ie.offset = pack_block_->Add(key, data, size) | AlgorithmBits(algorithm) |
+              (pack_file_idx_ << 56);
+  ie.size = size;
   ie.key = key;
 
-  kj::FdOutputStream data_output(data_fd);
-  data_output.write(data.data(), data.size());
+  return InsertObject(ie, sync);
+}
 
-  data_file_sizes_.back().first += data.size();
+kj::Promise<void> StorageServer::InsertObject(const IndexEntry& entry,
+                                              bool sync) {
+  const auto data_file_idx = (entry.offset & kBucketMask) >> 56;
+  data_file_utilization_[data_file_idx] += entry.size;
+
+  index_.Insert(entry);
+
+  LogIndexChanges(kj::arrayPtr(&entry, 1));
+
+  if (!sync) return kj::READY_NOW;
+
+  return GroupSync(data_file_idx);
+}
+
+void StorageServer::OpenPackBlock() {
+  ClosePackBlock();
+
+  // The front of the heap is the shortest data file.
+  const auto data_file = data_file_sizes_.front();
+  const auto block_offset =
+      (data_file.first + kPackBlockSize - 1) / kPackBlockSize * kPackBlockSize;
+  KJ_REQUIRE(block_offset + kPackBlockSize <= cas_internal::kIndexLogMaxOffset,
+             "data file too large", data_file.second);
+
+  auto pack_fd = cas_internal::OpenFile(
+      dir_fd_.get(), DataFileName(data_file.second).c_str(), O_RDWR);
+  pack_block_ =
+      std::make_unique<PackBlockWriter>(pack_fd.get(), block_offset);
+  pack_fd_ = std::move(pack_fd);
+  pack_file_idx_ = data_file.second;
+
+  std::pop_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
+                HeapComparator);
+  data_file_sizes_.pop_back();
+}
+
+void StorageServer::ClosePackBlock() {
+  if (!pack_block_) return;
+
+  // The first object written to a block extends the file to the end of the
+  // block.
+  data_file_sizes_.emplace_back(pack_block_->Offset() + kPackBlockSize,
+                                pack_file_idx_);
   std::push_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
                  HeapComparator);
-  data_file_utilization_[data_file_idx] += data.size();
 
+  pack_block_ = nullptr;
+  pack_fd_ = kj::AutoCloseFd();
+}
+
+kj::Promise<void> StorageServer::DataSync(int fd) { return aio_->Fsync(fd); }
+
+void StorageServer::LogIndexChanges(kj::ArrayPtr<const IndexEntry> entries) {
   // Writes are asynchronous as long as the writeback buffer isn't full, so
   // don't bother using AIO here.
-  kj::FdOutputStream index_output(index_fd_.get());
-  index_output.write(&ie, sizeof(ie));
+  cas_internal::AppendIndexLog(index_fd_.get(), entries);
 
-  index_.emplace(ie);
+  index_dirty_ = true;
 
-  if (!sync) return kj::READY_NOW;
+  index_log_records_ += entries.size();
+  for (const auto& entry : entries) {
+    if (entry.offset & kDeletedMask) ++index_log_deletions_;
+  }
 
-  auto fsync_promises = kj::heapArrayBuilder<kj::Promise<void>>(2);
-  fsync_promises.add(DataSync(data_fd));
-  fsync_promises.add(DataSync(index_fd_.get()));
+  if (index_checkpoint_) {
+    auto& tail = index_checkpoint_->tail;
+    tail.insert(tail.end(), entries.begin(), entries.end());
+    return;
+  }
+
+  if (index_log_records_ >= kMaxStartupLogEntries ||
+      (index_log_deletions_ >= kCheckpointMinDeletions &&
+       index_log_deletions_ > kCheckpointDeletionRatio * index_.size())) {
+    CheckpointIndex();
+  }
+}
+
+kj::Promise<void> StorageServer::GroupSync(size_t data_file_idx) {
+  if (!sync_batch_) {
+    sync_batch_ =
+        std::make_unique<SyncBatch>(kj::newPromiseAndFulfiller<void>());
+  }
 
-  return kj::joinPromises(fsync_promises.finish());
+  sync_batch_->data_files.set(data_file_idx);
+  auto result = sync_batch_->promise.addBranch();
+
+  if (!sync_running_) {
+    sync_running_ = true;
+    sync_task_ = GroupSyncLoop(kGroupSyncDelay).eagerlyEvaluate(nullptr);
+  }
+
+  if (++sync_batch_->size >= kGroupSyncMaxBatch && sync_batch_full_)
+    sync_batch_full_->fulfill();
+
+  return result;
 }
 
-kj::Promise<void> StorageServer::DataSync(int fd) {
-  auto request = aio_client_.fsyncRequest();
-  request.setFd(fd);
-  return request.send().ignoreResult();
+kj::Promise<void> StorageServer::GroupSyncLoop(kj::Duration delay) {
+  auto batch_full = kj::newPromiseAndFulfiller<void>();
+  sync_batch_full_ = std::move(batch_full.fulfiller);
+
+  return aio_context_.provider->getTimer()
+      .afterDelay(delay)
+      .exclusiveJoin(std::move(batch_full.promise))
+      .then([this] {
+        sync_batch_full_ = nullptr;
+
+        std::shared_ptr<SyncBatch> batch(std::move(sync_batch_));
+
+        auto fsync_promises = kj::heapArrayBuilder<kj::Promise<void>>(
+            batch->data_files.count() + 1);
+        for (size_t i = 0; i < data_fds_.size(); ++i) {
+          if (batch->data_files[i])
+            fsync_promises.add(DataSync(data_fds_[i].get()));
+        }
+        fsync_promises.add(DataSync(index_fd_.get()));
+
+        return kj::joinPromises(fsync_promises.finish())
+            .then([batch] { batch->fulfiller->fulfill(); },
+                  [batch](kj::Exception&& e) {
+                    batch->fulfiller->reject(std::move(e));
+                  });
+      })
+      .then([this]() -> kj::Promise<void> {
+        // Puts that arrived while we were syncing have already waited long
+        // enough.
+        if (sync_batch_) return GroupSyncLoop(0 * kj::MICROSECONDS);
+
+        sync_running_ = false;
+
+        return kj::READY_NOW;
+      });
 }
 
-kj::Promise<void> StorageServer::CompactIndexFile(bool sync) {
-  if (!index_dirty_) return kj::READY_NOW;
+void StorageServer::ReadPlacement() {
+  const auto fd = openat(dir_fd_.get(), "placement", O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT) KJ_FAIL_SYSCALL("openat", errno, "placement");
+    return;
+  }
+
+  kj::AutoCloseFd placement_file(fd);
+
+  // A truncated file records no placement.
+  uint8_t data[sizeof(placement_)];
+  if (sizeof(data) !=
+      cas_internal::ReadWithOffset(placement_file, data, 0, sizeof(data), 0))
+    return;
 
+  for (size_t i = 0; i < sizeof(data); ++i)
+    placement_ |= static_cast<uint64_t>(data[i]) << (i * 8);
+}
+
+void StorageServer::WriteIndexCheckpoint(bool sync) {
   // NOTE(mortehu): When using dir_fd_ instead of ".", glibc or Linux seems to
   // clear all the permission bits.
-  auto new_index = cas_internal::AnonTemporaryFile(".", 0666);
-  kj::FdOutputStream new_index_output{new_index.get()};
+  auto new_base = cas_internal::AnonTemporaryFile(".", 0666);
+
+  index_.WriteSegment(new_base.get());
+
+  if (sync) {
+    KJ_SYSCALL(fsync(new_base));
+  }
+
+  IndexSegment segment(new_base.get());
+  segment.Verify();
+
+  cas_internal::LinkAnonTemporaryFile(dir_fd_, new_base,
+                                      index_base_name_.c_str());
 
-  std::vector<IndexEntry> buffer;
+  marks_.Rebase(segment);
+  index_.SetBase(std::move(segment));
 
-  for (const auto& index_entry : index_) {
-    buffer.emplace_back(index_entry);
+  // If we crash before the log is truncated, replaying it on top of the new
+  // base segment is harmless, since it yields the same final state.
+  KJ_SYSCALL(ftruncate(index_fd_.get(), cas_internal::kIndexLogHeaderSize));
 
-    if (buffer.size() == 65536) {
-      new_index_output.write(buffer.data(), sizeof(buffer[0]) * buffer.size());
-      buffer.clear();
+  index_dirty_ = false;
+  index_log_records_ = 0;
+  index_log_deletions_ = 0;
+}
+
+kj::Promise<void> StorageServer::CheckpointIndex() {
+  if (index_checkpoint_) return index_checkpoint_->done.addBranch();
+
+  index_checkpoint_ =
+      std::make_shared<IndexCheckpoint>(kj::newPromiseAndFulfiller<void>());
+
+  auto result = index_checkpoint_->done.addBranch();
+
+  // NOTE(mortehu): When using dir_fd_ instead of ".", glibc or Linux seems to
+  // clear all the permission bits.
+  auto new_base = std::make_shared<kj::AutoCloseFd>(
+      cas_internal::AnonTemporaryFile(".", 0666));
+
+  // The base segment stays in place until the checkpoint completes, so the
+  // thread only needs a copy of the changes made on top of it.
+  index_checkpoint_task_ =
+      cas_internal::RunInThread(
+          *aio_context_.lowLevelProvider,
+          [new_base, &base = index_.Base(),
+           changes = index_.Changes()]() mutable {
+            cas_internal::WriteIndexSegment(new_base->get(), base,
+                                            std::move(changes));
+            KJ_SYSCALL(fsync(new_base->get()));
+
+            // Opening the segment on the event loop only checks its header,
+            // so the entries are checked here, before it is linked.
+            IndexSegment(new_base->get()).Verify();
+          })
+          .then([this, new_base] { FinishIndexCheckpoint(new_base->get()); })
+          .then(
+              [this] {
+                index_checkpoint_->fulfiller->fulfill();
+                index_checkpoint_ = nullptr;
+              },
+              [this](kj::Exception&& e) {
+                syslog(LOG_ERR, "Index checkpoint failed: %s:%d: %s",
+                       e.getFile(), e.getLine(), e.getDescription().cStr());
+
+                // Wait for the log to grow by another full threshold before
+                // trying again.
+                index_log_records_ = 0;
+                index_log_deletions_ = 0;
+
+                index_checkpoint_->fulfiller->reject(std::move(e));
+                index_checkpoint_ = nullptr;
+              })
+          .eagerlyEvaluate(nullptr);
+
+  return result;
+}
+
+void StorageServer::FinishIndexCheckpoint(int new_base) {
+  const auto& tail = index_checkpoint_->tail;
+
+  // Write the records made since the snapshot to a new log before touching
+  // anything, so that a failure leaves the old base segment and log in use.
+  auto new_log = cas_internal::AnonTemporaryFile(".", 0666);
+  cas_internal::InitIndexLog(new_log.get());
+  KJ_SYSCALL(fcntl(new_log.get(), F_SETFL, O_APPEND));
+  cas_internal::AppendIndexLog(new_log.get(),
+                               kj::arrayPtr(tail.data(), tail.size()));
+
+  // The tail may include records that have been reported as synced.
+  if (!tail.empty()) KJ_SYSCALL(fdatasync(new_log.get()));
+
+  // If we crash before the log is replaced, replaying the old log on top of
+  // the new base segment is harmless, since it yields the same final state.
+  cas_internal::LinkAnonTemporaryFile(dir_fd_, new_base,
+                                      index_base_name_.c_str());
+  cas_internal::LinkAnonTemporaryFile(dir_fd_, new_log,
+                                      index_log_name_.c_str());
+
+  retired_index_fd_ = std::move(index_fd_);
+  index_fd_ = std::move(new_log);
+
+  IndexSegment segment(new_base);
+  marks_.Rebase(segment);
+  index_.SetBase(std::move(segment));
+
+  index_log_records_ = tail.size();
+  index_log_deletions_ = 0;
+
+  for (const auto& entry : tail) {
+    if (entry.offset & kDeletedMask) {
+      index_.Erase(entry.key);
+      ++index_log_deletions_;
+    } else {
+      index_.Insert(entry);
     }
   }
 
-  if (!buffer.empty())
-    new_index_output.write(buffer.data(), sizeof(buffer[0]) * buffer.size());
+  index_dirty_ = !tail.empty();
+}
 
-  if (sync) {
-    KJ_SYSCALL(fsync(new_index));
+kj::Promise<void> StorageServer::CompactionStep() {
+  auto& compaction = *compaction_;
+
+  if (compaction.next == compaction.objects.size()) return FinishCompaction();
+
+  // Contiguous range of the data file holding one or more objects to move.
+  struct Extent {
+    size_t begin_offset;
+    size_t end_offset;
+
+    // Range of `compaction.objects` stored in the extent.
+    size_t first;
+    size_t last;
+
+    kj::Array<char> data;
+  };
+
+  std::vector<Extent> extents;
+  size_t batch_size = 0;
+  auto batch_end = compaction.next;
+
+  for (; batch_end < compaction.objects.size(); ++batch_end) {
+    const auto& object = compaction.objects[batch_end];
+
+    if (batch_size && batch_size + object.size > kCompactionStepSize) break;
+    batch_size += object.size;
+
+    const size_t offset = object.offset & kOffsetMask;
+
+    if (extents.empty() ||
+        offset > extents.back().end_offset + kCompactionMaxGap) {
+      extents.emplace_back(Extent{offset, offset, batch_end, batch_end, {}});
+    }
+
+    extents.back().end_offset = offset + object.size;
+    extents.back().last = batch_end + 1;
   }
 
-  cas_internal::LinkAnonTemporaryFile(dir_fd_, new_index, "index");
+  auto reads = kj::heapArrayBuilder<kj::Promise<void>>(extents.size());
+  const auto data_fd = data_fds_[compaction.data_file_idx].get();
 
-  index_fd_ = std::move(new_index);
-  index_dirty_ = false;
+  for (auto& extent : extents) {
+    extent.data = kj::heapArray<char>(extent.end_offset - extent.begin_offset);
+    reads.add(aio_->Pread(data_fd, extent.data.begin(), extent.begin_offset,
+                          extent.data.size()));
+  }
 
-  return kj::READY_NOW;
+  return kj::joinPromises(reads.finish())
+      .then([
+        this, extents = std::move(extents), batch_end, batch_size
+      ]() mutable -> kj::Promise<void> {
+        auto& compaction = *compaction_;
+
+        auto moves = kj::heapArrayBuilder<kj::Promise<void>>(
+            batch_end - compaction.next);
+
+        for (const auto& extent : extents) {
+          for (auto i = extent.first; i != extent.last; ++i) {
+            const auto& object = compaction.objects[i];
+            const auto offset =
+                (object.offset & kOffsetMask) - extent.begin_offset;
+            moves.add(MoveObject(object, extent.data.begin() + offset));
+          }
+        }
+
+        return kj::joinPromises(moves.finish()).attach(std::move(extents));
+      })
+      .then([this, batch_end, batch_size]() -> kj::Promise<void> {
+        auto& compaction = *compaction_;
+
+        compaction.next = batch_end;
+        compaction.bytes_moved += batch_size;
+
+        if (!compaction_rate_) return kj::READY_NOW;
+
+        const auto delay_usec =
+            batch_size * UINT64_C(1000000) / compaction_rate_;
+
+        return aio_context_.provider->getTimer().afterDelay(
+            static_cast<int64_t>(delay_usec) * kj::MICROSECONDS);
+      })
+      .then([this] { return CompactionStep(); });
 }
 
-kj::Promise<void> StorageServer::DrainDataFile(std::vector<IndexEntry> moves) {
-  if (moves.empty()) return kj::READY_NOW;
+kj::Promise<void> StorageServer::FinishCompaction() {
+  auto& compaction = *compaction_;
+
+  kj::Promise<void> promise = kj::READY_NOW;
+
+  if (compaction.sync) {
+    // Make sure all moves are committed to disk before truncating the file
+    // being drained.
+    auto fsync_promises =
+        kj::heapArrayBuilder<kj::Promise<void>>(data_fds_.size());
+
+    for (size_t i = 0; i < data_fds_.size(); ++i) {
+      if (i == compaction.data_file_idx) continue;
+      fsync_promises.add(DataSync(data_fds_[i].get()));
+    }
 
-  const auto move = moves.back();
-  moves.pop_back();
+    fsync_promises.add(DataSync(index_fd_.get()));
+
+    promise = kj::joinPromises(fsync_promises.finish());
+  }
+
+  return promise
+      .then([this]() -> kj::Promise<void> {
+        // Objects that were being streamed to clients when they were moved are
+        // still read from the old location.
+        auto& compaction = *compaction_;
+        if (!compaction.readers) return kj::READY_NOW;
+
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        compaction.readers_done = std::move(paf.fulfiller);
+        return std::move(paf.promise);
+      })
+      .then([this] {
+        auto& compaction = *compaction_;
+
+        KJ_SYSCALL(ftruncate(data_fds_[compaction.data_file_idx].get(),
+                             compaction.keep_prefix));
+
+        // Truncation also releases space preallocated past the end.
+        data_file_allocated_[compaction.data_file_idx] =
+            compaction.keep_prefix;
+
+        data_file_sizes_.emplace_back(compaction.keep_prefix,
+                                      compaction.data_file_idx);
+        std::push_heap(data_file_sizes_.begin(), data_file_sizes_.end(),
+                       HeapComparator);
+
+        compaction_bytes_reclaimed_ +=
+            compaction.file_size - compaction.keep_prefix;
+      });
+}
+
+kj::Promise<void> StorageServer::MoveObject(const IndexEntry& entry,
+                                            const char* data) {
+  // Skip objects that have been removed, or removed and inserted again,
+  // since compaction started.
+  auto index_entry = index_.Find(entry.key);
+  if (!index_entry || index_entry->offset != entry.offset) return kj::READY_NOW;
+
+  if (entry.size && entry.size <= pack_threshold_) {
+    index_.Erase(entry.key);
+    data_file_utilization_[compaction_->data_file_idx] -= entry.size;
+
+    PackObject(entry.key, EntryAlgorithm(entry), data, entry.size, false);
+
+    return kj::READY_NOW;
+  }
 
-  const auto data_file_idx = (move.offset & kBucketMask) >> 56;
+  // The object stays at its old location until the copy has been written.
+  const size_t size = entry.size;
 
-  std::string data;
-  data.resize(move.size);
+  return AppendObject(entry.key, EntryAlgorithm(entry), size, [
+    this, data, size
+  ](int data_fd, size_t offset) {
+    return aio_->Pwrite(data_fd, data, offset, size);
+  }).then([this, entry](const IndexEntry& new_entry) {
+    auto index_entry = index_.Find(entry.key);
+    if (!index_entry || index_entry->offset != entry.offset) return;
 
-  auto pread_request = aio_client_.preadRequest();
-  pread_request.setFd(data_fds_[data_file_idx]);
-  pread_request.setBuffer(reinterpret_cast<uint64_t>(data.data()));
-  pread_request.setStart(move.offset & kOffsetMask);
-  pread_request.setLength(move.size);
+    index_.Erase(entry.key);
+    data_file_utilization_[compaction_->data_file_idx] -= entry.size;
 
-  return pread_request.send().then([
-    this, move, moves = std::move(moves), data = std::move(data)
-  ](auto pread_results) {
-    auto index_entry = index_.find(move);
-    KJ_REQUIRE(index_entry != index_.end());
-    KJ_REQUIRE(index_entry->offset == move.offset);
-    KJ_REQUIRE(index_entry->size == move.size);
-    index_.erase(index_entry);
-    return this->Put(move.key, std::move(data), false).then([
-      this, moves = std::move(moves)
-    ]() mutable { return this->DrainDataFile(std::move(moves)); });
+    InsertObject(new_entry, false);
   });
 }
 
 void StorageServer::ReadIndex() {
-  off_t index_size;
-  KJ_SYSCALL(index_size = lseek(index_fd_.get(), 0, SEEK_END));
-  if (0 != (index_size % sizeof(IndexEntry))) {
-    index_size = index_size / sizeof(IndexEntry) * sizeof(IndexEntry);
-    KJ_SYSCALL(ftruncate(index_fd_.get(), index_size));
+  using Clock = std::chrono::steady_clock;
+
+  const auto seconds = [](Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  };
+
+  auto phase_start = Clock::now();
+
+  const auto base_fd =
+      openat(dir_fd_.get(), index_base_name_.c_str(), O_RDONLY);
+
+  if (base_fd != -1) {
+    kj::AutoCloseFd base_fd_closer(base_fd);
+
+    index_.SetBase(IndexSegment(base_fd));
+
+    for (size_t i = 0; i < data_fds_.size(); ++i)
+      data_file_utilization_[i] = index_.Base().Utilization(i);
+  } else if (errno != ENOENT) {
+    KJ_FAIL_SYSCALL("openat", errno, index_base_name_);
   }
 
-  if (!index_size) return;
+  switch (cas_internal::GetIndexLogFormat(index_fd_.get())) {
+    case cas_internal::IndexLogFormat::kEmpty:
+      cas_internal::InitIndexLog(index_fd_.get());
+      return;
 
-  size_t entry_count = index_size / sizeof(IndexEntry);
-  index_.reserve(entry_count);
+    case cas_internal::IndexLogFormat::kLegacy:
+      index_fd_ = cas_internal::MigrateIndexLog(dir_fd_.get(),
+                                                index_log_name_.c_str(),
+                                                index_fd_.get());
+      break;
 
-  std::array<IndexEntry, 1024> buffer;
+    case cas_internal::IndexLogFormat::kCurrent:
+      break;
+  }
 
-  for (size_t i = 0; i < entry_count; i += buffer.size()) {
-    auto count = std::min(buffer.size(), entry_count - i);
+  const auto base_time = Clock::now() - phase_start;
 
-    cas_internal::ReadWithOffset(index_fd_.get(), &buffer[0],
-                                 count * sizeof(IndexEntry),
-                                 i * sizeof(IndexEntry));
+  const size_t thread_count =
+      std::max(1U, std::thread::hardware_concurrency());
 
-    for (const auto& item :
-         kj::arrayPtr(buffer.begin(), buffer.begin() + count)) {
-      auto index_entry = index_.find(item);
+  // Only the last record for each key matters, so the log is deduplicated in
+  // parallel before being applied on top of the base segment.
+  auto replay = cas_internal::ReplayIndexLog(index_fd_.get(), thread_count);
 
-      if (index_entry != index_.end()) {
-        const auto data_file_idx = (index_entry->offset & kBucketMask) >> 56;
-        data_file_utilization_[data_file_idx] -= index_entry->size;
+  phase_start = Clock::now();
 
-        index_.erase(index_entry);
-      }
+  index_.Reserve(replay.entries.size());
 
-      if (!(item.offset & kDeletedMask)) {
-        const auto data_file_idx = (item.offset & kBucketMask) >> 56;
-        data_file_utilization_[data_file_idx] += item.size;
+  for (const auto& item : replay.entries) {
+    if (auto index_entry = index_.Find(item.key)) {
+      const auto data_file_idx = (index_entry->offset & kBucketMask) >> 56;
+      data_file_utilization_[data_file_idx] -= index_entry->size;
+    }
 
-        index_.emplace(item);
-      } else {
-        index_dirty_ = true;
-      }
+    if (!(item.offset & kDeletedMask)) {
+      const auto data_file_idx = (item.offset & kBucketMask) >> 56;
+      data_file_utilization_[data_file_idx] += item.size;
+
+      index_.Insert(item);
+    } else {
+      index_.Erase(item.key);
     }
   }
+
+  const auto apply_time = Clock::now() - phase_start;
+
+  syslog(LOG_INFO,
+         "Loaded index: %zu base entries in %.3f s; %zu log records, %zu "
+         "keys, using %zu threads: read %.3f s, decode %.3f s, merge %.3f s, "
+         "apply %.3f s",
+         index_.Base().size(), seconds(base_time), replay.record_count,
+         replay.entries.size(), thread_count, seconds(replay.read_time),
+         seconds(replay.decode_time), seconds(replay.merge_time),
+         seconds(apply_time));
+
+  // Discard the remains of any interrupted write.
+  KJ_SYSCALL(ftruncate(index_fd_.get(), replay.valid_size));
+
+  const auto entry_count = replay.record_count;
+
+  if (entry_count) index_dirty_ = true;
+
+  index_log_records_ = entry_count;
+  for (const auto& item : replay.entries) {
+    if (item.offset & kDeletedMask) ++index_log_deletions_;
+  }
+
+  if (entry_count > kMaxStartupLogEntries) WriteIndexCheckpoint(true);
 }
 
 std::vector<size_t> StorageServer::GetUnreclaimedSpace() {
@@ -1,14 +1,23 @@
+#include <bitset>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 #include <capnp/serialize.h>
 #include <kj/array.h>
 #include <kj/async-io.h>
 
+#include "async-io.h"
+#include "bulk-channel.h"
 #include "client.h"
-#include "proto/async-io.capnp.h"
+#include "gc-marks.h"
+#include "hash-pool.h"
+#include "io.h"
+#include "object-cache.h"
+#include "object-index.h"
+#include "pack-block.h"
 #include "proto/ca-cas.capnp.h"
 #include "rpc.h"
 
@@ -23,28 +32,14 @@ class StorageServer : public CAS::Server {
     kDisableRead = 1,
   };
 
-  struct IndexEntry {
-    IndexEntry() = default;
-
-    IndexEntry(const CASKey& key) : key(key) {}
-
-    uint64_t offset = 0;
-    uint32_t size = 0;
-    CASKey key;
-
-    bool operator==(const IndexEntry& rhs) const { return key == rhs.key; }
-  };
-
-  struct IndexEntryHash {
-    typedef std::size_t value_type;
-
-    value_type operator()(const IndexEntry& v) const {
-      return std::hash<CASKey>()(v.key);
-    }
-  };
-
+  // Opens the repository in `path`.  A repository may be split into
+  // `shard_count` shards, each served by its own `StorageServer`, typically in
+  // separate threads.  Every shard has its own index, and appends to its own
+  // subset of the data files.  Requests must be sent to the shard owning the
+  // key, as given by `ShardRouter::ShardForKey()`.
   StorageServer(const char* path, unsigned int flags,
-                kj::AsyncIoContext& aio_context);
+                kj::AsyncIoContext& aio_context, size_t shard = 0,
+                size_t shard_count = 1);
 
   KJ_DISALLOW_COPY(StorageServer);
   ~StorageServer();
@@ -53,6 +48,10 @@ class StorageServer : public CAS::Server {
 
   kj::Promise<void> markGC(MarkGCContext context) override;
 
+  kj::Promise<void> markGCStream(MarkGCStreamContext context) override;
+
+  kj::Promise<void> markGCFilter(MarkGCFilterContext context) override;
+
   kj::Promise<void> endGC(EndGCContext context) override;
 
   kj::Promise<void> get(GetContext context) override;
@@ -67,51 +66,271 @@ class StorageServer : public CAS::Server {
 
   kj::Promise<void> compact(CompactContext context) override;
 
+  kj::Promise<void> getCompactionStatus(
+      GetCompactionStatusContext context) override;
+
   kj::Promise<void> getConfig(GetConfigContext context) override;
 
-  kj::Promise<void> Put(const CASKey& key, std::string data, bool sync);
+  kj::Promise<void> getBulkPort(GetBulkPortContext context) override;
+
+  kj::Promise<void> getCacheStats(GetCacheStatsContext context) override;
+
+  kj::Promise<void> getPlacement(GetPlacementContext context) override;
+
+  kj::Promise<void> setPlacement(SetPlacementContext context) override;
 
-  const std::unordered_set<StorageServer::IndexEntry,
-                           StorageServer::IndexEntryHash>&
-  Index() const {
-    return index_;
+  // Stores `data` under the storage key of `key`, whose digest must already
+  // have been verified.
+  kj::Promise<void> Put(const ObjectKey& key, std::string data, bool sync);
+
+  // Stores the first `size` bytes of the file `fd` as the object `key`.
+  kj::Promise<void> Put(const ObjectKey& key, int fd, size_t size, bool sync);
+
+  // Sets the maximum number of reads kept in flight for each object being
+  // streamed to a client.
+  void SetReadAhead(size_t read_ahead) {
+    KJ_REQUIRE(read_ahead > 0);
+    read_ahead_ = read_ahead;
   }
 
-  const std::unordered_set<CASKey>& Marks() const { return marks_; }
+  // Sets the size of the largest object to pack into a shared block with
+  // other small objects.  Zero disables packing.
+  void SetPackThreshold(size_t pack_threshold) {
+    KJ_REQUIRE(pack_threshold <= kMaxPackedObjectSize, pack_threshold);
+    pack_threshold_ = pack_threshold;
+  }
+
+  // Limits the rate at which compaction reads data, in bytes per second.
+  // Zero means no limit.
+  void SetCompactionRate(size_t compaction_rate) {
+    compaction_rate_ = compaction_rate;
+  }
+
+  // Sets the number of threads verifying the digests of uploaded objects.
+  // Zero means verifying them on the event loop.  Must not be called while
+  // any puts are in progress.
+  void SetHashThreads(size_t hash_threads) {
+    hash_pool_ = std::make_unique<HashPool>(*aio_context_.lowLevelProvider,
+                                            hash_threads);
+  }
+
+  // Allows gets of at least `threshold` bytes to be served on the bulk
+  // transfer channels in `registry`, which clients open by connecting to
+  // `port`.  The registry must outlive the server.
+  void SetBulkChannels(BulkChannelRegistry* registry, uint16_t port,
+                       size_t threshold) {
+    bulk_channels_ = registry;
+    bulk_port_ = port;
+    bulk_threshold_ = threshold;
+  }
+
+  // Keeps up to `size` bytes of objects no larger than `max_object_size` in
+  // memory.  Zero disables the cache.
+  void SetCacheSize(size_t size, size_t max_object_size) {
+    cache_ = size ? std::make_unique<ObjectCache>(size) : nullptr;
+    max_cached_object_size_ = max_object_size;
+  }
+
+  // Starts computing the key of an object being uploaded.
+  kj::Own<HashPool::Stream> HashStream(KeyAlgorithm algorithm) {
+    return hash_pool_->NewStream(algorithm);
+  }
+
+  const ObjectIndex& Index() const { return index_; }
+
+  // Returns the number of shards the repository in `dir_fd` is split into.
+  static size_t ShardCount(int dir_fd);
+
+  // Records that the repository in `path` is split into `shard_count` shards.
+  // Fails if the repository already holds objects in a different number of
+  // shards.
+  static void SetShardCount(const char* path, size_t shard_count);
+
+  // Returns the names of the index log and base segment of a shard.
+  static std::string IndexLogName(size_t shard, size_t shard_count);
+  static std::string IndexBaseName(size_t shard, size_t shard_count);
+
+  // Marks `key` as live in the current garbage collection cycle.
+  void MarkGC(const CASKey& key);
+
+  const GCMarks& Marks() const { return marks_; }
 
  private:
+  // Puts that are waiting for their data and index entries to reach stable
+  // storage.  All of them are completed by the same set of `fdatasync(2)`
+  // calls.
+  struct SyncBatch {
+    SyncBatch(kj::PromiseFulfillerPair<void> paf)
+        : fulfiller(std::move(paf.fulfiller)), promise(paf.promise.fork()) {}
+
+    // Data files written to by the puts in this batch.
+    std::bitset<kMaxDataFiles> data_files;
+
+    size_t size = 0;
+
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    kj::ForkedPromise<void> promise;
+  };
+
+  // Appends an object of `size` bytes to one of the data files, using
+  // `write` to write its contents at the given offset of the given
+  // descriptor, and adds it to the index.  `algorithm` is the hash function
+  // used to compute `key`.
+  kj::Promise<void> AddObject(
+      const CASKey& key, KeyAlgorithm algorithm, size_t size, bool sync,
+      const std::function<kj::Promise<void>(int, size_t)>& write);
+
+  // Like `AddObject()`, but returns the index entry for the written object
+  // instead of adding it to the index.  The space is claimed right away, so
+  // that any number of writes may be in flight.
+  kj::Promise<IndexEntry> AppendObject(
+      const CASKey& key, KeyAlgorithm algorithm, size_t size,
+      const std::function<kj::Promise<void>(int, size_t)>& write);
+
+  // Reserves disk space in the given data file up to at least `end`, in
+  // steps of `kPreallocationStep`.
+  void Preallocate(size_t data_file_idx, size_t end);
+
+  // Adds a small object to the current pack block, starting a new block if
+  // necessary.
+  kj::Promise<void> PackObject(const CASKey& key, KeyAlgorithm algorithm,
+                               const void* data, size_t size, bool sync);
+
+  // Records an object whose data has been written in the index and the index
+  // log.
+  kj::Promise<void> InsertObject(const IndexEntry& entry, bool sync);
+
+  // Starts a new pack block at the end of the shortest data file.
+  void OpenPackBlock();
+
+  // Makes the data file holding the current pack block, if any, available
+  // to `AddObject()` again.
+  void ClosePackBlock();
+
   // Calls `fdatasync(2)` asynchrounously on `fd`.
   kj::Promise<void> DataSync(int fd);
 
-  kj::Promise<void> CompactIndexFile(bool sync);
+  // Returns a promise that is fulfilled once the given data file and the
+  // index log have been synced, sharing the sync with other concurrent puts.
+  kj::Promise<void> GroupSync(size_t data_file_idx);
+
+  // Syncs the pending batch after `delay`, and keeps going as long as new
+  // batches form while syncing.
+  kj::Promise<void> GroupSyncLoop(kj::Duration delay);
+
+  // Appends `entries` to the index log, and starts a background checkpoint if
+  // the log has grown too long.
+  void LogIndexChanges(kj::ArrayPtr<const IndexEntry> entries);
+
+  // Merges all index changes into a new base segment, and truncates the index
+  // log.
+  void WriteIndexCheckpoint(bool sync);
+
+  // State of a background index checkpoint in progress.
+  struct IndexCheckpoint;
+
+  // Like `WriteIndexCheckpoint()`, but writes the new base segment on a
+  // separate thread.  Changes made in the meantime are carried over to the new
+  // index log.  Returns a promise that completes once the new base segment is
+  // in use.
+  kj::Promise<void> CheckpointIndex();
 
-  kj::Promise<void> DrainDataFile(std::vector<IndexEntry> moves);
+  // Switches to the base segment written to `new_base` by `CheckpointIndex()`.
+  void FinishIndexCheckpoint(int new_base);
+
+  // State of a data file compaction in progress.
+  struct Compaction;
+
+  // Moves the next batch of objects out of the data file being compacted, and
+  // schedules the next step.
+  kj::Promise<void> CompactionStep();
+
+  // Syncs the moved objects if requested, and truncates the data file once
+  // no reads of moved objects remain.
+  kj::Promise<void> FinishCompaction();
+
+  // Writes `data` as the new location of `entry`, unless the object has been
+  // removed since compaction started.  `data` must stay valid until the
+  // returned promise completes.
+  kj::Promise<void> MoveObject(const IndexEntry& entry, const char* data);
 
   void ReadIndex();
 
+  // Loads `placement_` from the file "placement", if present.
+  void ReadPlacement();
+
   std::vector<size_t> GetUnreclaimedSpace();
 
   kj::AsyncIoContext& aio_context_;
 
-  std::pair<kj::Own<cas_internal::RPCClient>,
-            kj::Own<cas_internal::RPCServer<AsyncIO>>>
-      aio_;
-  AsyncIO::Client aio_client_;
+  kj::Own<AsyncIOServer> aio_;
+
+  std::shared_ptr<BufferPool> read_buffers_;
+  size_t read_ahead_ = 4;
+
+  std::unique_ptr<HashPool> hash_pool_;
+
+  std::unique_ptr<ObjectCache> cache_;
+  size_t max_cached_object_size_ = 0;
+
+  BulkChannelRegistry* bulk_channels_ = nullptr;
+  uint16_t bulk_port_ = 0;
+  size_t bulk_threshold_ = 0;
+
+  // Number of gets currently being served on bulk transfer channels.
+  size_t bulk_transfers_ = 0;
 
   kj::AutoCloseFd dir_fd_;
 
-  // Descriptor for file holding index entries.
+  std::string index_log_name_;
+  std::string index_base_name_;
+
+  // Descriptor for the log of index changes made since the base segment was
+  // written.
   kj::AutoCloseFd index_fd_;
 
+  // Objects of at most this many bytes are packed into blocks.
+  size_t pack_threshold_ = 0;
+
+  // Block receiving small objects.  While a block is open, its data file is
+  // left out of `data_file_sizes_`, so that nothing else is appended to it.
+  std::unique_ptr<PackBlockWriter> pack_block_;
+  size_t pack_file_idx_ = 0;
+
+  // Descriptor for the data file holding `pack_block_`, opened without
+  // O_APPEND so that the block can be written in place.
+  kj::AutoCloseFd pack_fd_;
+
   // Descriptor for files holding object data.
   std::vector<kj::AutoCloseFd> data_fds_;
+  // Heap of the sizes of the data files appended to, including space
+  // claimed by writes still in flight, and the data file numbers.
   std::vector<std::pair<size_t, size_t>> data_file_sizes_;
+
+  // End of the space preallocated in each data file.
+  std::vector<size_t> data_file_allocated_;
+
+  // Number of writes in flight to each data file.
+  std::vector<size_t> data_file_writes_;
   std::unordered_map<size_t, size_t> data_file_utilization_;
 
-  std::unordered_set<IndexEntry, IndexEntryHash> index_;
+  ObjectIndex index_;
+
+  // Number of records, and number of deletion records, in the index log.
+  size_t index_log_records_ = 0;
+  size_t index_log_deletions_ = 0;
+
+  // Index checkpoint in progress, if any.  Declared after `index_`, since
+  // the checkpoint thread reads its base segment.
+  std::shared_ptr<IndexCheckpoint> index_checkpoint_;
+  kj::Promise<void> index_checkpoint_task_ = nullptr;
+
+  // Index log replaced by the last checkpoint.  Kept open, since group syncs
+  // started before the checkpoint completed may still refer to it.
+  kj::AutoCloseFd retired_index_fd_;
 
   // Marks used in mark and sweep garbage collection.
-  std::unordered_set<CASKey> marks_;
+  GCMarks marks_{index_};
   uint64_t gc_id_ = 0;
 
   // Total size of marked objects.
@@ -119,15 +338,31 @@ class StorageServer : public CAS::Server {
 
   kj::Array<const char> config_data_;
 
+  // Hash ring fingerprint recorded by `setPlacement`, or 0.
+  uint64_t placement_ = 0;
+
   bool disable_read_ = false;
 
-  // Set to true whenever an object is removed, to indicate that the index
-  // could benefit from compaction.
+  // Set to true whenever the index log is non-empty, to indicate that the
+  // index could benefit from compaction.
   bool index_dirty_ = false;
 
-  // Index of data file being compacted, or -1 if no compaction is currently in
-  // progress.
-  int compacting_data_file_ = -1;
+  std::unique_ptr<SyncBatch> sync_batch_;
+
+  // Set while `GroupSyncLoop()` is running.
+  bool sync_running_ = false;
+
+  // Completes the group sync delay early once a batch is full.
+  kj::Own<kj::PromiseFulfiller<void>> sync_batch_full_;
+
+  kj::Promise<void> sync_task_ = nullptr;
+
+  // Compaction in progress, if any.
+  std::shared_ptr<Compaction> compaction_;
+  kj::Promise<void> compaction_task_ = nullptr;
+
+  size_t compaction_rate_ = 0;
+  uint64_t compaction_bytes_reclaimed_ = 0;
 };
 
 }  // namespace cas_internal
@@ -15,9 +15,17 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <algorithm>
+#include <chrono>
 #include <climits>
+#include <map>
 #include <random>
+#include <set>
+#include <unordered_set>
 
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "bulk-channel.h"
 #include "bytestream.h"
 #include "client.h"
 #include "io.h"
@@ -68,9 +76,15 @@ struct StorageServerTest : testing::Test {
   void Connect() {
     auto channel = async_io_.provider->newTwoWayPipe();
 
-    server_ = std::make_unique<RPCServer<CAS>>(
-        kj::heap<StorageServer>(temp_directory_.c_str(), 0, async_io_),
-        std::move(channel.ends[0]));
+    auto storage_server =
+        kj::heap<StorageServer>(temp_directory_.c_str(), 0, async_io_);
+    storage_server->SetPackThreshold(pack_threshold_);
+    storage_server->SetCompactionRate(compaction_rate_);
+    if (bulk_channels_)
+      storage_server->SetBulkChannels(bulk_channels_, kBulkPort, 0);
+
+    server_ = std::make_unique<RPCServer<CAS>>(std::move(storage_server),
+                                               std::move(channel.ends[0]));
 
     client_ = std::make_unique<RPCClient>(std::move(channel.ends[1]));
 
@@ -109,12 +123,52 @@ struct StorageServerTest : testing::Test {
 
   CASKey PutRandomObject() { return PutObject(RandomData()); }
 
+  // Returns the object `key`, starting at `offset`, using the default size.
+  std::string GetObject(const CASKey& key, uint64_t offset = 0) {
+    std::string result;
+
+    auto get_request = cas_->getRequest();
+    get_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+    get_request.setOffset(offset);
+    get_request.setStream(kj::heap<ByteStreamCollector>(result));
+    get_request.send().wait(async_io_.waitScope);
+
+    return result;
+  }
+
+  // Stores `count` objects of random data, and adds their contents to
+  // `objects`.
+  void PutRandomObjects(size_t count, std::map<CASKey, std::string>& objects) {
+    for (size_t i = 0; i < count; ++i) {
+      auto data = RandomData();
+      std::string data_string(data.begin(), data.end());
+      objects.emplace(PutObject(std::move(data)), std::move(data_string));
+    }
+  }
+
+  // Returns the keys of all objects stored on the server.
+  std::set<CASKey> ListObjects() {
+    std::set<CASKey> result;
+    CASClient::ListAsync(*cas_, [&result](const CASKey& key) {
+      result.emplace(key);
+    }).wait(async_io_.waitScope);
+    return result;
+  }
+
   kj::AsyncIoContext async_io_;
 
   std::default_random_engine rng_;
 
   std::string temp_directory_;
 
+  size_t pack_threshold_ = 0;
+  size_t compaction_rate_ = 0;
+
+  // Port reported to clients when `bulk_channels_` is set.  Tests add
+  // channels to the registry directly instead of connecting to it.
+  static const uint16_t kBulkPort = 1;
+  BulkChannelRegistry* bulk_channels_ = nullptr;
+
   std::unique_ptr<RPCServer<CAS>> server_;
   std::unique_ptr<RPCClient> client_;
   std::unique_ptr<CAS::Client> cas_;
@@ -281,6 +335,72 @@ TEST_F(StorageServerTest, PutThenList) {
   }
 }
 
+// Verifies that a list read in small batches returns every object that
+// exists throughout exactly once, while objects are added and removed, and
+// the base segment of the index is replaced.
+TEST_F(StorageServerTest, ListInBatchesWhileModifying) {
+  static const size_t kObjectCount = 300;
+  static const size_t kBatchSize = 50;
+
+  std::set<CASKey> keys;
+  for (size_t i = 0; i < kObjectCount; ++i) keys.emplace(PutRandomObject());
+
+  // Checkpoint, so that some objects are in the base segment, and some on
+  // top of it.
+  CASClient::CompactAsync(*cas_, false).wait(async_io_.waitScope);
+  for (size_t i = 0; i < kObjectCount / 2; ++i)
+    keys.emplace(PutRandomObject());
+
+  auto list = cas_->listRequest().send().getList();
+
+  std::vector<CASKey> listed;
+
+  const auto read_batch = [this, &list, &listed] {
+    auto read_request = list.readRequest();
+    read_request.setCount(kBatchSize);
+    auto response = read_request.send().wait(async_io_.waitScope);
+    auto objects = response.getObjects();
+
+    for (auto object : objects) listed.emplace_back(object.begin());
+
+    return objects.size();
+  };
+
+  ASSERT_EQ(kBatchSize, read_batch());
+
+  std::set<CASKey> removed;
+
+  for (auto i = keys.begin(); i != keys.end();) {
+    if (rng_() % 4 == 0) {
+      CASClient::RemoveAsync(*cas_, *i).wait(async_io_.waitScope);
+      removed.emplace(*i);
+      i = keys.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  // Objects that exist throughout the listing.
+  const auto stable = keys;
+
+  for (size_t i = 0; i < kObjectCount / 2; ++i)
+    keys.emplace(PutRandomObject());
+
+  CASClient::CompactAsync(*cas_, false).wait(async_io_.waitScope);
+
+  while (read_batch()) {
+  }
+
+  std::set<CASKey> unique(listed.begin(), listed.end());
+  EXPECT_EQ(listed.size(), unique.size());
+
+  for (const auto& key : stable) EXPECT_EQ(1U, unique.count(key));
+
+  // Removed objects may only show up if listed before their removal.
+  for (size_t i = kBatchSize; i < listed.size(); ++i)
+    EXPECT_EQ(0U, removed.count(listed[i]));
+}
+
 // Verifies the basic behavior of the garbage collector.
 TEST_F(StorageServerTest, GarbageCollector) {
   auto data0_key = PutObject(RandomData());
@@ -345,6 +465,83 @@ TEST_F(StorageServerTest, GarbageCollector) {
   }
 }
 
+// Server implementing only the original garbage collection calls, like one
+// that predates `markGCStream`.
+class ListMarkServer : public CAS::Server {
+ public:
+  explicit ListMarkServer(CAS::Client backend) : backend_(std::move(backend)) {}
+
+  kj::Promise<void> beginGC(BeginGCContext context) override {
+    return context.tailCall(backend_.beginGCRequest());
+  }
+
+  kj::Promise<void> markGC(MarkGCContext context) override {
+    auto request = backend_.markGCRequest();
+    request.setKeys(context.getParams().getKeys());
+    return context.tailCall(std::move(request));
+  }
+
+  kj::Promise<void> endGC(EndGCContext context) override {
+    auto request = backend_.endGCRequest();
+    request.setId(context.getParams().getId());
+    return context.tailCall(std::move(request));
+  }
+
+ private:
+  CAS::Client backend_;
+};
+
+// Verifies that marks reach servers without `markGCStream`.
+TEST_F(StorageServerTest, GarbageCollectorWithoutMarkStream) {
+  auto data0_key = PutRandomObject();
+  auto data1_key = PutRandomObject();
+
+  CAS::Client legacy = kj::heap<ListMarkServer>(*cas_);
+
+  auto gc_id = CASClient::BeginGC(legacy).wait(async_io_.waitScope);
+
+  std::vector<CASKey> gc_keys;
+  gc_keys.emplace_back(data0_key);
+  CASClient::MarkGC(legacy, gc_keys).wait(async_io_.waitScope);
+
+  CASClient::EndGC(legacy, gc_id).wait(async_io_.waitScope);
+
+  std::vector<CASKey> all_keys;
+  CASClient::ListAsync(*cas_, [&all_keys](const CASKey& key) {
+    all_keys.emplace_back(key);
+  }).wait(async_io_.waitScope);
+  ASSERT_EQ(1U, all_keys.size());
+  EXPECT_EQ(all_keys[0], data0_key);
+  EXPECT_NE(all_keys[0], data1_key);
+}
+
+// Verifies that marking objects with a Bloom filter keeps all of them, and
+// removes most of the garbage.
+TEST_F(StorageServerTest, GarbageCollectorWithFilter) {
+  static const size_t kObjectCount = 200;
+
+  std::vector<CASKey> keys;
+  for (size_t i = 0; i < kObjectCount; ++i)
+    keys.emplace_back(PutRandomObject());
+
+  auto gc_id = CASClient::BeginGC(*cas_).wait(async_io_.waitScope);
+
+  const std::vector<CASKey> live(keys.begin(), keys.begin() + kObjectCount / 2);
+  CASClient::MarkGCFilter(*cas_, live, 0.01).wait(async_io_.waitScope);
+
+  CASClient::EndGC(*cas_, gc_id).wait(async_io_.waitScope);
+
+  std::unordered_set<CASKey> remaining;
+  CASClient::ListAsync(*cas_, [&remaining](const CASKey& key) {
+    remaining.emplace(key);
+  }).wait(async_io_.waitScope);
+
+  for (const auto& key : live) EXPECT_EQ(1U, remaining.count(key));
+
+  // About one false positive is expected.
+  EXPECT_LT(remaining.size(), live.size() + 10);
+}
+
 // Verifies that compaction doesn't corrupt the repository.
 TEST_F(StorageServerTest, Compaction) {
   static const size_t kMaxIterations = 500;
@@ -379,3 +576,296 @@ TEST_F(StorageServerTest, Compaction) {
     }
   }
 }
+
+// Verifies that concurrent synchronous puts all complete, and that their
+// objects persist across server restarts.
+TEST_F(StorageServerTest, ConcurrentSyncPuts) {
+  static const size_t kObjectCount = 500;
+
+  std::vector<CASKey> keys;
+  auto done_promises = kj::heapArrayBuilder<kj::Promise<void>>(kObjectCount);
+
+  for (size_t i = 0; i < kObjectCount; ++i) {
+    auto data = RandomData();
+
+    CASKey key;
+    SHA1::Digest(data.begin(), data.size(), key.begin());
+    keys.emplace_back(key);
+
+    auto put_request = cas_->putRequest();
+    put_request.setKey(kj::arrayPtr<capnp::byte>(key.begin(), 20));
+    put_request.setSync(true);
+    auto stream = put_request.send().getStream();
+
+    auto write_request = stream.writeRequest();
+    write_request.setData(std::move(data));
+
+    done_promises.add(write_request.send().then(
+        [stream](auto) mutable {
+          return stream.doneRequest().send().ignoreResult();
+        }));
+  }
+
+  kj::joinPromises(done_promises.finish()).wait(async_io_.waitScope);
+
+  Connect();
+
+  std::set<CASKey> remote_objects;
+  CASClient::ListAsync(*cas_, [&remote_objects](const CASKey& key) {
+    remote_objects.emplace(key);
+  }).wait(async_io_.waitScope);
+
+  EXPECT_EQ(std::set<CASKey>(keys.begin(), keys.end()), remote_objects);
+}
+
+// Verifies that objects written concurrently, including several to the same
+// data file, end up at distinct locations, also after a restart.
+TEST_F(StorageServerTest, ConcurrentPutsReadBack) {
+  static const size_t kObjectCount = 300;
+
+  std::vector<std::pair<CASKey, std::string>> objects;
+  auto done_promises = kj::heapArrayBuilder<kj::Promise<void>>(kObjectCount);
+
+  for (size_t i = 0; i < kObjectCount; ++i) {
+    auto data = RandomData();
+
+    CASKey key;
+    SHA1::Digest(data.begin(), data.size(), key.begin());
+    objects.emplace_back(
+        key, std::string(reinterpret_cast<const char*>(data.begin()),
+                         data.size()));
+
+    auto put_request = cas_->putRequest();
+    put_request.setKey(kj::arrayPtr<capnp::byte>(key.begin(), 20));
+    auto stream = put_request.send().getStream();
+
+    auto write_request = stream.writeRequest();
+    write_request.setData(std::move(data));
+
+    done_promises.add(write_request.send().then(
+        [stream](auto) mutable {
+          return stream.doneRequest().send().ignoreResult();
+        }));
+  }
+
+  kj::joinPromises(done_promises.finish()).wait(async_io_.waitScope);
+
+  for (const auto& object : objects)
+    EXPECT_EQ(object.second, GetObject(object.first));
+
+  Connect();
+
+  for (const auto& object : objects)
+    EXPECT_EQ(object.second, GetObject(object.first));
+}
+
+// Verifies that objects too large to be buffered in memory are stored
+// correctly.
+TEST_F(StorageServerTest, PutAndGetLargeObject) {
+  static const size_t kChunkSize = 256 * 1024;
+  static const size_t kChunkCount = 13;
+
+  std::uniform_int_distribution<capnp::byte> byte_distribution;
+  std::string data(kChunkSize * kChunkCount, 0);
+  for (auto& b : data) b = byte_distribution(rng_);
+
+  CASKey key;
+  SHA1::Digest(data.data(), data.size(), key.begin());
+
+  auto put_request = cas_->putRequest();
+  put_request.setKey(kj::arrayPtr<capnp::byte>(key.begin(), 20));
+  auto stream = put_request.send().getStream();
+
+  for (size_t i = 0; i < kChunkCount; ++i) {
+    auto write_request = stream.writeRequest();
+    write_request.setData(kj::arrayPtr(
+        reinterpret_cast<const capnp::byte*>(data.data()) + i * kChunkSize,
+        kChunkSize));
+    write_request.send().wait(async_io_.waitScope);
+  }
+
+  stream.doneRequest().send().wait(async_io_.waitScope);
+
+  std::string read_data;
+
+  auto get_request = cas_->getRequest();
+  get_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+  get_request.setStream(kj::heap<ByteStreamCollector>(read_data));
+  get_request.send().wait(async_io_.waitScope);
+
+  EXPECT_EQ(data, read_data);
+}
+
+// Verifies that a get starting past the beginning of an object, without an
+// explicit size, returns the rest of the object, both for objects served
+// from the cache and for objects too large to cache.
+TEST_F(StorageServerTest, GetWithOffset) {
+  std::uniform_int_distribution<capnp::byte> byte_distribution;
+
+  for (const size_t size : {512, 1 << 20}) {
+    auto data = kj::heapArray<capnp::byte>(size);
+    for (auto& b : data) b = byte_distribution(rng_);
+
+    const std::string data_string(data.begin(), data.end());
+    const auto key = PutObject(std::move(data));
+
+    for (const uint64_t offset : {0, 100, 300, 512}) {
+      // The first read of a small object fills the cache, and the second
+      // is served from it.
+      for (size_t i = 0; i < 2; ++i)
+        EXPECT_EQ(data_string.substr(offset), GetObject(key, offset))
+            << size << " " << offset;
+    }
+
+    EXPECT_THROW(GetObject(key, size + 1), kj::Exception);
+  }
+}
+
+// Verifies that a get served on a bulk transfer channel is abandoned promptly
+// when the connection to the client is lost, even if the client has stopped
+// reading from the channel.
+TEST_F(StorageServerTest, CancelBulkGetWhileReceiverIsNotReading) {
+  BulkChannelRegistry registry;
+  bulk_channels_ = &registry;
+  Connect();
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  kj::AutoCloseFd sender(fds[0]), receiver(fds[1]);
+  ASSERT_EQ(0, fcntl(sender.get(), F_SETFL, O_NONBLOCK));
+  const auto channel = registry.Add(sender.get());
+
+  // Much more than the socket buffers hold.
+  auto data = kj::heapArray<capnp::byte>(16 << 20);
+  std::fill(data.begin(), data.end(), 0);
+  const auto key = PutObject(std::move(data));
+
+  std::string result;
+  auto get_request = cas_->getRequest();
+  get_request.setKey(kj::arrayPtr(key.begin(), key.end()));
+  get_request.setBulkChannel(channel);
+  get_request.setStream(kj::heap<ByteStreamCollector>(result));
+  auto get = get_request.send();
+
+  // Let the server fill the socket.
+  async_io_.provider->getTimer()
+      .afterDelay(100 * kj::MILLISECONDS)
+      .wait(async_io_.waitScope);
+
+  // Dropping the connection cancels the get, which must not wait for the
+  // send to time out.
+  const auto start = std::chrono::steady_clock::now();
+  server_.reset();
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(10));
+
+  registry.Remove(channel);
+}
+
+// Verifies that small objects packed into blocks can be read back, also after
+// removals, compaction and server restarts.
+TEST_F(StorageServerTest, PackedObjects) {
+  static const size_t kObjectCount = 300;
+
+  pack_threshold_ = 4096;
+  Connect();
+
+  std::map<CASKey, std::string> objects;
+  PutRandomObjects(kObjectCount, objects);
+
+  for (const auto& object : objects)
+    EXPECT_EQ(object.second, GetObject(object.first));
+
+  for (auto i = objects.begin(); i != objects.end();) {
+    if (rng_() & 1) {
+      CASClient::RemoveAsync(*cas_, i->first).wait(async_io_.waitScope);
+      i = objects.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  CASClient::CompactAsync(*cas_, false).wait(async_io_.waitScope);
+
+  Connect();
+
+  for (const auto& object : objects)
+    EXPECT_EQ(object.second, GetObject(object.first));
+
+  EXPECT_EQ(objects.size(), ListObjects().size());
+}
+
+// Verifies that objects removed while compaction is running stay removed, and
+// that the remaining objects are intact afterwards.
+TEST_F(StorageServerTest, CompactionWithConcurrentRemovals) {
+  static const size_t kObjectCount = 300;
+
+  // Slow enough that compaction is still running when the removals arrive.
+  compaction_rate_ = 10 * 1024 * 1024;
+  Connect();
+
+  std::map<CASKey, std::string> objects;
+  PutRandomObjects(kObjectCount, objects);
+
+  std::vector<CASKey> removals;
+  for (const auto& object : objects) {
+    if (rng_() & 1) removals.emplace_back(object.first);
+  }
+
+  const auto half = removals.begin() + removals.size() / 2;
+
+  for (auto i = removals.begin(); i != half; ++i)
+    CASClient::RemoveAsync(*cas_, *i).wait(async_io_.waitScope);
+
+  auto compact_promise = CASClient::CompactAsync(*cas_, false);
+
+  for (auto i = half; i != removals.end(); ++i)
+    CASClient::RemoveAsync(*cas_, *i).wait(async_io_.waitScope);
+
+  compact_promise.wait(async_io_.waitScope);
+
+  for (const auto& key : removals) objects.erase(key);
+
+  for (const auto& object : objects)
+    EXPECT_EQ(object.second, GetObject(object.first));
+
+  EXPECT_EQ(objects.size(), ListObjects().size());
+
+  auto response =
+      cas_->getCompactionStatusRequest().send().wait(async_io_.waitScope);
+  auto status = response.getStatus();
+  EXPECT_FALSE(status.getActive());
+  EXPECT_LT(0U, status.getBytesReclaimed());
+}
+
+// Verifies that changes made while the index is being checkpointed in the
+// background survive a restart.
+TEST_F(StorageServerTest, IndexCheckpointWithConcurrentChanges) {
+  static const size_t kObjectCount = 300;
+
+  std::map<CASKey, std::string> objects;
+  PutRandomObjects(kObjectCount, objects);
+
+  // Nothing to reclaim from the data files, so this only checkpoints the
+  // index.
+  auto compact_promise = CASClient::CompactAsync(*cas_, false);
+
+  PutRandomObjects(kObjectCount, objects);
+
+  for (auto i = objects.begin(); i != objects.end();) {
+    if (rng_() & 1) {
+      CASClient::RemoveAsync(*cas_, i->first).wait(async_io_.waitScope);
+      i = objects.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  compact_promise.wait(async_io_.waitScope);
+
+  Connect();
+
+  for (const auto& object : objects)
+    EXPECT_EQ(object.second, GetObject(object.first));
+
+  EXPECT_EQ(objects.size(), ListObjects().size());
+}